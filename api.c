@@ -273,6 +273,7 @@ static const char *OSINFO =
 #define _SETCONFIG  "SETCONFIG"
 #define _USBSTATS   "USBSTATS"
 #define _LCD        "LCD"
+#define _NOTIFYLAT  "NOTIFYLATENCY"
 
 static const char ISJSON = '{';
 #define JSON0       "{"
@@ -318,6 +319,7 @@ static const char ISJSON = '{';
 #define JSON_SETCONFIG  JSON1 _SETCONFIG JSON2
 #define JSON_USBSTATS   JSON1 _USBSTATS JSON2
 #define JSON_LCD    JSON1 _LCD JSON2
+#define JSON_NOTIFYLAT  JSON1 _NOTIFYLAT JSON2
 #define JSON_END    JSON4 JSON5
 #define JSON_END_TRUNCATED  JSON4_TRUNCATED JSON5
 #define JSON_BETWEEN_JOIN   ","
@@ -447,6 +449,7 @@ static const char *JSON_PARAMETER = "parameter";
 #define MSG_LOCKOK 123
 #define MSG_LOCKDIS 124
 #define MSG_LCD 125
+#define MSG_NOTIFYLAT 126
 
 enum code_severity
 {
@@ -620,6 +623,7 @@ struct CODES
     { SEVERITY_ERR,   MSG_ASCSETERR, PARAM_BOTH,   "ASC %d set failed: %s" },
 #endif
     { SEVERITY_SUCC,  MSG_LCD, PARAM_NONE, "LCD" },
+    { SEVERITY_SUCC,  MSG_NOTIFYLAT, PARAM_NONE, "Notify latency" },
     { SEVERITY_SUCC,  MSG_LOCKOK,  PARAM_NONE, "Lock stats created" },
     { SEVERITY_WARN,  MSG_LOCKDIS, PARAM_NONE, "Lock stats not enabled" },
     { SEVERITY_FAIL, 0, 0, NULL }
@@ -4479,6 +4483,37 @@ static void lcddata(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __mayb
         io_close(io_data);
 }
 
+static void notifylatency(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
+{
+    struct api_data *root = NULL;
+    struct cg_hist hist[NOTIFY_STAGES];
+    char buf[512];
+    bool io_open;
+    double avg;
+    int i;
+
+    notify_lat_copy(hist);
+
+    message(io_data, MSG_NOTIFYLAT, 0, NULL, isjson);
+    io_open = io_add(io_data, isjson ? COMSTR JSON_NOTIFYLAT : _NOTIFYLAT COMSTR);
+
+    for (i = 0; i < NOTIFY_STAGES; i++)
+    {
+        avg = hist[i].count ? (double)hist[i].total_us / hist[i].count : 0;
+        cg_hist_string(&hist[i], buf, sizeof(buf));
+        root = api_add_int(root, "STAGE", &i, true);
+        root = api_add_const(root, "Name", notify_stage_names[i], false);
+        root = api_add_uint64(root, "Count", &(hist[i].count), true);
+        root = api_add_double(root, "Avg us", &avg, true);
+        root = api_add_uint64(root, "Max us", &(hist[i].max_us), true);
+        root = api_add_string(root, "Histogram", buf, true);
+        root = print_data(io_data, root, isjson, isjson && (i > 0));
+    }
+
+    if (isjson && io_open)
+        io_close(io_data);
+}
+
 static void checkcommand(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, char group);
 
 struct CMDS
@@ -4538,6 +4573,7 @@ struct CMDS
 #endif
     { "asccount",       asccount,   false,  true },
     { "lcd",        lcddisplay, false,  true },
+    { "notifylatency",  notifylatency,  false,  true },
     { "lockstats",      lockstats,  true,   true },
     { NULL,         NULL,       false,  false }
 };
@@ -0,0 +1,578 @@
+/*
+ * Nonce path benchmark on the c5 FPGA simulator (--fpga-bench).
+ *
+ * A local stratum pool gives the driver a job every BENCH_JOB_MS. Once the
+ * simulated chains are hashing, the benchmark steps the rate they push nonces
+ * into the fifo up by BENCH_RATE_STEP, holds each rate for BENCH_STEP_MS and
+ * then lets the driver drain. A rate holds when everything pushed was read,
+ * queued and tested without a fifo or ring overflow, a flush or a stale
+ * nonce, and the driver's diff 1 results match what the simulator knows each
+ * nonce to be. Past the first rate that doesn't hold the search bisects a few
+ * times, then the steps go out as JSON and the miner quits. Nonces known to
+ * pass diff 1 are mixed in, a run where none of them came back valid fails.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <jansson.h>
+
+#include "miner.h"
+#include "util.h"
+#include "sha2.h"
+#include "driver-btm-c5.h"
+#include "sim_c5.h"
+#include "bench_c5.h"
+
+#define BENCH_JOB_MS            1000        // the pool sends a job this often
+#define BENCH_STEP_MS           3000        // time at each rate
+#define BENCH_SETTLE_MS         5000        // from the first nonce to the first step
+#define BENCH_START_TIMEOUT_S   600         // for the driver to bring the chains up
+#define BENCH_QUIET_MS          200         // no counter moved for this long: drained
+#define BENCH_DRAIN_MS          2000        // longest a rate may take to drain
+#define BENCH_RATE_START        1000.0      // nonces/s over all chains
+#define BENCH_RATE_STEP         1.5
+#define BENCH_RATE_MAX          10000000.0
+#define BENCH_BISECT            3           // rates tried between the last that held and the first that didn't
+#define BENCH_ACHIEVED          0.9         // part of a rate the simulator must reach for it to count
+#define BENCH_STALE_JOBS        10          // jobs a share may be behind, cgminer hands non-clean jobs to the driver late
+#define BENCH_MERKLES           12
+#define BENCH_NONCE1            "08000002"
+#define BENCH_NONCE2_LEN        4
+#define BENCH_VERSION           "20000000"
+#define BENCH_NBITS             "17034219"
+#define BENCH_NTIME             "504e86b9"  // fixed, so a nonce2 always makes the same header
+#define BENCH_PREVHASH          "4d16b6f85af6e2198f44ae2a6de67f78487ae5611b77c6c0440b921e00000000"
+#define BENCH_COINB1            "01000000010000000000000000000000000000000000000000000000000000000000000000ffffffff20020862062f503253482f04b8864e5008"
+#define BENCH_COINB2            "072f736c7573682f000000000100f2052a010000001976a914d23fcdf86f7e756a64a7a9688ef9903327048ed988ac00000000"
+
+struct bench_sample
+{
+    double              t;
+    uint64_t            cpu_ns;     // the miner's CPU time, less the simulator, pool and benchmark threads
+    struct sim_c5_stats sim;
+    struct nonce_path_stats path;
+    struct cg_hist      fifo_hist;
+    uint64_t            shares;
+    uint64_t            stale_shares;
+};
+
+/* Nonce2s of the job above with a nonce that passes diff 1, found by hashing
+ * all 2^32 nonces. The simulator swaps them in now and then, so the valid
+ * path gets checked even on the unhashed nonces of bits=0. */
+static const struct sim_c5_known bench_known[] =
+{
+    { 1, 0x490a1d91 },
+    { 1, 0xfcefabb7 },
+    { 3, 0x5e9e54af },
+    { 4, 0x515dbc36 },
+    { 5, 0x0a220333 },
+};
+
+static char *bench_path;
+static pthread_t bench_pth;
+static pthread_t bench_pool_pth;
+static int bench_pool_fd = -1;
+static char bench_merkles[BENCH_MERKLES][65];
+static uint32_t bench_job_id;
+static uint64_t bench_shares;
+static uint64_t bench_stale_shares;     // submitted for a job more than BENCH_STALE_JOBS old
+
+static double bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t bench_thread_cpu_ns(pthread_t pth)
+{
+    struct timespec ts;
+    clockid_t cid;
+
+    if(pthread_getcpuclockid(pth, &cid) || clock_gettime(cid, &ts))
+        return 0;
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/******************** stratum pool ********************/
+
+static void bench_pool_send(int fd, json_t *msg)
+{
+    char *s = json_dumps(msg, JSON_COMPACT);
+
+    if(s)
+    {
+        send(fd, s, strlen(s), MSG_NOSIGNAL);
+        send(fd, "\n", 1, MSG_NOSIGNAL);
+        free(s);
+    }
+    json_decref(msg);
+}
+
+static void bench_pool_notify(int fd)
+{
+    json_t *merkles = json_array();
+    char job_id[16];
+    int i;
+
+    for(i=0; i<BENCH_MERKLES; i++)
+        json_array_append_new(merkles, json_string(bench_merkles[i]));
+    snprintf(job_id, sizeof(job_id), "%x", __atomic_add_fetch(&bench_job_id, 1, __ATOMIC_RELAXED));
+
+    // never clean, a clean job flushes the nonces the driver holds
+    bench_pool_send(fd, json_pack("{s:n,s:s,s:[s,s,s,s,o,s,s,s,b]}", "id", "method", "mining.notify", "params",
+                                  job_id, BENCH_PREVHASH, BENCH_COINB1, BENCH_COINB2, merkles,
+                                  BENCH_VERSION, BENCH_NBITS, BENCH_NTIME, 0));
+}
+
+// returns whether the miner is authorised and wants jobs
+static bool bench_pool_line(int fd, const char *line)
+{
+    json_t *val, *id, *params, *error;
+    json_error_t err;
+    const char *method, *job;
+    bool authorized = false, stale;
+
+    val = json_loads(line, 0, &err);
+    if(!val)
+        return false;
+
+    id = json_object_get(val, "id");
+    if(!id)
+        id = json_null();
+    method = json_string_value(json_object_get(val, "method"));
+    params = json_object_get(val, "params");
+
+    if(!method)
+        ;
+    else if(!strcmp(method, "mining.subscribe"))
+    {
+        bench_pool_send(fd, json_pack("{s:O,s:[[[s,s]],s,i],s:n}", "id", id, "result",
+                                      "mining.notify", "bench", BENCH_NONCE1, BENCH_NONCE2_LEN, "error"));
+    }
+    else if(!strcmp(method, "mining.authorize"))
+    {
+        bench_pool_send(fd, json_pack("{s:O,s:b,s:n}", "id", id, "result", 1, "error"));
+        bench_pool_send(fd, json_pack("{s:n,s:s,s:[i]}", "id", "method", "mining.set_difficulty", "params", 1));
+        bench_pool_notify(fd);
+        authorized = true;
+    }
+    else if(!strcmp(method, "mining.submit"))
+    {
+        job = json_string_value(json_array_get(params, 1));
+        stale = !job || __atomic_load_n(&bench_job_id, __ATOMIC_RELAXED) - strtoul(job, NULL, 16) > BENCH_STALE_JOBS;
+        __atomic_add_fetch(stale ? &bench_stale_shares : &bench_shares, 1, __ATOMIC_RELAXED);
+        error = stale ? json_pack("[i,s,n]", 21, "Job not found") : json_null();
+        bench_pool_send(fd, json_pack("{s:O,s:b,s:o}", "id", id, "result", !stale, "error", error));
+    }
+    // suggest_difficulty, multi_version and the like get no answer, like most pools
+
+    json_decref(val);
+    return authorized;
+}
+
+static void *bench_pool_thread(void *arg)
+{
+    char buf[16384], *nl;
+    size_t len = 0;
+    int fd = -1, n;
+    bool authorized = false;
+    double next_job = 0, wait;
+    struct timeval tv;
+    fd_set fds;
+
+    pthread_detach(pthread_self());
+    RenameThread("BenchPool");
+
+    while(1)
+    {
+        FD_ZERO(&fds);
+        FD_SET(bench_pool_fd, &fds);
+        if(fd >= 0)
+            FD_SET(fd, &fds);
+        wait = authorized ? next_job - bench_now() : 0.1;
+        if(wait < 0)
+            wait = 0;
+        tv.tv_sec = wait;
+        tv.tv_usec = (wait - tv.tv_sec) * 1e6;
+
+        if(select((fd > bench_pool_fd ? fd : bench_pool_fd) + 1, &fds, NULL, NULL, &tv) < 0)
+            continue;
+
+        if(FD_ISSET(bench_pool_fd, &fds))
+        {
+            // the miner reconnected, the old connection is dead to it
+            if(fd >= 0)
+                close(fd);
+            fd = accept(bench_pool_fd, NULL, NULL);
+            len = 0;
+            authorized = false;
+            continue;
+        }
+
+        if(fd >= 0 && FD_ISSET(fd, &fds))
+        {
+            n = recv(fd, buf + len, sizeof(buf) - 1 - len, 0);
+            if(n <= 0)
+            {
+                close(fd);
+                fd = -1;
+                authorized = false;
+                continue;
+            }
+            len += n;
+            buf[len] = '\0';
+            while((nl = strchr(buf, '\n')) != NULL)
+            {
+                *nl = '\0';
+                if(bench_pool_line(fd, buf))
+                {
+                    authorized = true;
+                    next_job = bench_now() + BENCH_JOB_MS / 1000.0;
+                }
+                len -= nl + 1 - buf;
+                memmove(buf, nl + 1, len + 1);
+            }
+            if(len == sizeof(buf) - 1)
+                len = 0;
+        }
+
+        if(authorized && bench_now() >= next_job)
+        {
+            bench_pool_notify(fd);
+            next_job += BENCH_JOB_MS / 1000.0;
+        }
+    }
+    return NULL;
+}
+
+static int bench_pool_init(void)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    unsigned char index[4], hash[32];
+    char *hex;
+    int i;
+
+    // branches that hash like a real block's, the driver folds them into every nonce it checks
+    for(i=0; i<BENCH_MERKLES; i++)
+    {
+        memcpy(index, &i, sizeof(index));
+        sha256(index, sizeof(index), hash);
+        hex = bin2hex(hash, sizeof(hash));
+        strcpy(bench_merkles[i], hex);
+        free(hex);
+    }
+
+    bench_pool_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(bench_pool_fd < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    if(bind(bench_pool_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+       || listen(bench_pool_fd, 1) < 0
+       || getsockname(bench_pool_fd, (struct sockaddr *)&addr, &addrlen) < 0)
+    {
+        close(bench_pool_fd);
+        return -1;
+    }
+
+    if(pthread_create(&bench_pool_pth, NULL, bench_pool_thread, NULL))
+        return -1;
+    return ntohs(addr.sin_port);
+}
+
+/******************** rate search ********************/
+
+static void bench_sample(struct bench_sample *s)
+{
+    struct rusage ru;
+
+    s->t = bench_now();
+    sim_c5_get_stats(&s->sim);
+    get_nonce_path_stats(&s->path);
+    sim_c5_fifo_hist(&s->fifo_hist);
+    s->shares = __atomic_load_n(&bench_shares, __ATOMIC_RELAXED);
+    s->stale_shares = __atomic_load_n(&bench_stale_shares, __ATOMIC_RELAXED);
+
+    getrusage(RUSAGE_SELF, &ru);
+    s->cpu_ns = (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000
+                + (uint64_t)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000;
+    s->cpu_ns -= s->sim.cpu_ns + bench_thread_cpu_ns(bench_pool_pth) + bench_thread_cpu_ns(pthread_self());
+}
+
+// nonces the driver has finished with, one way or another
+static uint64_t bench_done(struct bench_sample *s)
+{
+    return s->path.hw + s->path.valid + s->path.stale + s->path.flushed;
+}
+
+// with the chains held, wait until nothing moves; false if it never settles
+static bool bench_quiet(struct bench_sample *s, double timeout_ms)
+{
+    struct bench_sample last;
+    double start = bench_now(), since;
+
+    bench_sample(&last);
+    since = last.t;
+    while(1)
+    {
+        cgsleep_ms(10);
+        bench_sample(s);
+        if(s->path.read != last.path.read || bench_done(s) != bench_done(&last) || s->sim.nonces != last.sim.nonces)
+        {
+            last = *s;
+            since = s->t;
+        }
+        else if(s->t - since >= BENCH_QUIET_MS / 1000.0)
+            return true;
+        if(s->t - start >= timeout_ms / 1000.0)
+            return false;
+    }
+}
+
+static json_t *bench_latency(struct cg_hist *after, struct cg_hist *before)
+{
+    struct cg_hist d = *after;
+    int i;
+
+    d.count -= before->count;
+    d.total_us -= before->total_us;
+    for(i=0; i<CG_HIST_BUCKETS; i++)
+        d.bucket[i] -= before->bucket[i];
+
+    // percentiles are the upper bounds of log2 buckets
+    return json_pack("{s:I,s:I,s:I,s:f}",
+                     "p50", (json_int_t)cg_hist_percentile(&d, 50),
+                     "p90", (json_int_t)cg_hist_percentile(&d, 90),
+                     "p99", (json_int_t)cg_hist_percentile(&d, 99),
+                     "mean", d.count ? (double)d.total_us / d.count : 0.0);
+}
+
+// one rate; NULL *why if it held
+static json_t *bench_step(double rate, const char **why)
+{
+    struct bench_sample a, b, c;
+    json_t *step;
+    uint64_t pushed, read, hw, valid, expected, stale, lost, misclassified;
+    double secs, achieved, drain_ms;
+    bool drained;
+
+    bench_quiet(&a, BENCH_DRAIN_MS);
+    sim_c5_set_rate(rate);
+    sim_c5_hold(false);
+    cgsleep_ms(BENCH_STEP_MS);
+    sim_c5_hold(true);
+    bench_sample(&b);
+    drained = bench_quiet(&c, BENCH_DRAIN_MS);
+    drain_ms = (c.t - b.t) * 1000 - (drained ? BENCH_QUIET_MS : 0);
+
+    secs = b.t - a.t;
+    achieved = (b.sim.nonces - a.sim.nonces) / secs;
+    pushed = c.sim.nonces - a.sim.nonces;
+    read = c.path.read - a.path.read;
+    hw = c.path.hw - a.path.hw;
+    valid = c.path.valid - a.path.valid;
+    expected = c.sim.valid - a.sim.valid;
+    stale = (c.path.stale - a.path.stale) + (c.stale_shares - a.stale_shares);
+    lost = (c.sim.fifo_overflow - a.sim.fifo_overflow) + (c.path.ring_overflow - a.path.ring_overflow)
+           + (c.path.flushed - a.path.flushed);
+
+    // every nonce the simulator knows to fail diff 1 must be a HW error and the rest valid
+    misclassified = (valid > expected ? valid - expected : expected - valid)
+                    + (hw > pushed - expected ? hw - (pushed - expected) : (pushed - expected) - hw);
+
+    if(achieved < rate * BENCH_ACHIEVED)
+        *why = "simulator";
+    else if(c.sim.fifo_overflow != a.sim.fifo_overflow)
+        *why = "fifo_overflow";
+    else if(c.path.ring_overflow != a.path.ring_overflow)
+        *why = "ring_overflow";
+    else if(c.path.flushed != a.path.flushed)
+        *why = "flushed";
+    else if(!drained || read != pushed || bench_done(&c) - bench_done(&a) != read)
+        *why = "drain";
+    else if(stale)
+        *why = "stale";
+    else if(misclassified)
+        *why = "misclassified";
+    else
+        *why = NULL;
+
+    applog(LOG_NOTICE, "fpga bench: %.0f nonces/s offered, %.0f pushed, %s", rate, achieved, *why ? *why : "held");
+
+    step = json_pack("{s:f,s:f,s:I,s:I,s:I,s:I,s:I,s:I,s:I,s:I,s:I,s:f,s:f,s:f,s:{s:o,s:o,s:o},s:b}",
+                     "offered", rate,
+                     "nonces_s", achieved,
+                     "pushed", (json_int_t)pushed,
+                     "read", (json_int_t)read,
+                     "hw", (json_int_t)hw,
+                     "valid", (json_int_t)valid,
+                     "expected_valid", (json_int_t)expected,
+                     "lost", (json_int_t)lost,
+                     "stale", (json_int_t)stale,
+                     "shares", (json_int_t)(c.shares - a.shares),
+                     "misclassified", (json_int_t)misclassified,
+                     "drain_ms", drain_ms,
+                     "cpu_ns_per_nonce", read ? (double)(c.cpu_ns - a.cpu_ns) / read : 0.0,
+                     "cpu_cores", (double)(c.cpu_ns - a.cpu_ns) / ((c.t - a.t) * 1e9),
+                     "latency_us",
+                     "fifo", bench_latency(&c.fifo_hist, &a.fifo_hist),
+                     "queue", bench_latency(&c.path.drain_hist, &a.path.drain_hist),
+                     "verify", bench_latency(&c.path.verify_hist, &a.path.verify_hist),
+                     "held", !*why);
+    if(*why)
+        json_object_set_new(step, "limit", json_string(*why));
+    return step;
+}
+
+static void bench_report(json_t *report)
+{
+    FILE *fp = strcmp(bench_path, "-") ? fopen(bench_path, "w") : stdout;
+
+    if(!fp)
+    {
+        applog(LOG_ERR, "fpga bench: can't write %s", bench_path);
+        return;
+    }
+    json_dumpf(report, fp, JSON_INDENT(2) | JSON_PRESERVE_ORDER);
+    fputc('\n', fp);
+    if(fp != stdout)
+        fclose(fp);
+}
+
+static void *bench_thread(void *arg)
+{
+    json_t *report, *steps, *step, *best_step = NULL;
+    struct bench_sample s;
+    const char *why, *limit = "max_rate";
+    double rate = BENCH_RATE_START, best = 0, fail = 0, start = bench_now();
+    int bisect = 0;
+    bool valid = false;
+
+    pthread_detach(pthread_self());
+    RenameThread("FpgaBench");
+
+    report = json_object();
+    json_object_set_new(report, "benchmark", json_string("nonce_path"));
+    json_object_set_new(report, "fpga_sim", json_string(opt_fpga_sim ? opt_fpga_sim : ""));
+    json_object_set_new(report, "nonce_verify_threads", json_integer(opt_nonce_verify_threads));
+    json_object_set_new(report, "job_ms", json_integer(BENCH_JOB_MS));
+    json_object_set_new(report, "step_ms", json_integer(BENCH_STEP_MS));
+
+    // the chains start pushing once the driver has them up and a job in the FPGA
+    sim_c5_set_rate(rate);
+    do
+    {
+        cgsleep_ms(100);
+        bench_sample(&s);
+    }
+    while((!s.path.reading || !s.path.read) && bench_now() - start < BENCH_START_TIMEOUT_S);
+    if(!s.path.read)
+    {
+        applog(LOG_ERR, "fpga bench: no nonces from the simulated chains in %ds", BENCH_START_TIMEOUT_S);
+        json_object_set_new(report, "limit", json_string("no_nonces"));
+        bench_report(report);
+        kill_work();
+        return NULL;
+    }
+    cgsleep_ms(BENCH_SETTLE_MS);
+    sim_c5_hold(true);
+
+    steps = json_array();
+    while(1)
+    {
+        step = bench_step(rate, &why);
+        json_array_append_new(steps, step);
+        if(json_integer_value(json_object_get(step, "valid")) > 0)
+            valid = true;
+        if(!why)
+        {
+            best = rate;
+            best_step = step;
+        }
+        else
+        {
+            fail = rate;
+            limit = why;
+            if(!strcmp(why, "simulator"))
+                break;
+        }
+
+        if(!fail)
+        {
+            rate *= BENCH_RATE_STEP;
+            if(rate > BENCH_RATE_MAX)
+                break;
+            continue;
+        }
+        if(!best || bisect++ == BENCH_BISECT)
+            break;
+        rate = sqrt(best * fail);
+    }
+
+    // the known nonces never came back valid, the rates held say nothing about the valid path
+    if(!valid)
+    {
+        applog(LOG_ERR, "fpga bench: no step verified a valid nonce");
+        best = 0;
+        best_step = NULL;
+        limit = "no_valid";
+    }
+
+    json_object_set_new(report, "max_rate", json_real(best));
+    json_object_set_new(report, "limit", json_string(limit));
+    if(best_step)
+    {
+        json_object_set(report, "nonces_s", json_object_get(best_step, "nonces_s"));
+        json_object_set(report, "cpu_ns_per_nonce", json_object_get(best_step, "cpu_ns_per_nonce"));
+        json_object_set(report, "latency_us", json_object_get(best_step, "latency_us"));
+    }
+    json_object_set_new(report, "steps", steps);
+    bench_report(report);
+    json_decref(report);
+
+    applog(LOG_NOTICE, "fpga bench: %.0f nonces/s held, limited by %s", best, limit);
+    kill_work();
+    return NULL;
+}
+
+int bench_c5_init(const char *path, char *url, size_t len)
+{
+    int port = bench_pool_init();
+
+    if(port < 0)
+    {
+        applog(LOG_ERR, "%s: can't start the local pool", __FUNCTION__);
+        return -1;
+    }
+    snprintf(url, len, "stratum+tcp://127.0.0.1:%d", port);
+
+    bench_path = strdup(path);
+    sim_c5_set_known(bench_known, ARRAY_SIZE(bench_known));
+    if(pthread_create(&bench_pth, NULL, bench_thread, NULL))
+        return -1;
+    return 0;
+}
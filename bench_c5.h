@@ -0,0 +1,20 @@
+/*
+ * Nonce path benchmark on the c5 FPGA simulator (--fpga-bench).
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef BENCH_C5_H
+#define BENCH_C5_H
+
+#include <stddef.h>
+
+/* Start the local stratum pool and the benchmark thread, which writes its
+ * JSON report to path ("-" for stdout) and ends the miner. url gets the pool
+ * to mine on. */
+extern int bench_c5_init(const char *path, char *url, size_t len);
+
+#endif /* BENCH_C5_H */
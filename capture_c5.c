@@ -0,0 +1,773 @@
+/*
+ * Capture and replay of what the c5 driver is fed: the stratum lines
+ * recv_line returns, the job images send_job stages and the raw words
+ * get_nonce_and_register reads out of the nonce fifo.
+ *
+ * --fpga-capture writes them to a binary log in host byte order: a
+ * capture_file_header, then capture_records, each with a CLOCK_MONOTONIC
+ * timestamp and its payload. A fifo record is one read of the fifo, the
+ * nonce words each followed by the nonce_record the FPGA wrote for them.
+ *
+ * --fpga-replay runs the miner on the FPGA simulator against a local pool
+ * per captured pool. The log is played in order, at the captured pace or as
+ * fast as the miner keeps up (--fpga-replay-fast): lines go to the miner
+ * through its socket, so recv_line and the stratum parser see them as they
+ * came, and nonces go into the simulated fifo with their records, so the
+ * reader, the verify threads and the submits see them as they came. A
+ * captured reply waits for the miner's request and the records after a job
+ * wait for the driver to send that job, which keeps the order the same
+ * however fast the replay runs. A fast replay also lets the driver test a
+ * fifo read before it pushes the next, so no nonce is lost to its speed.
+ * The driver's own job images are compared with the captured ones.
+ * Register replies are not replayed, the simulated chips answer the
+ * driver's reads themselves, and nonces from before the first job are
+ * dropped, as the capturing driver dropped them.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <jansson.h>
+
+#include "miner.h"
+#include "util.h"
+#include "driver-btm-c5.h"
+#include "sim_c5.h"
+#include "capture_c5.h"
+
+#define CAPTURE_MAGIC           0x43415054      // "CAPT"
+#define CAPTURE_VERSION         1
+#define CAPTURE_BUF_SIZE        (256 * 1024)    // stdio buffer of the log
+#define CAPTURE_FLUSH_MS        1000            // longest a record waits in the buffer
+#define CAPTURE_MAX_RECORD      (1 << 20)       // a replay takes a longer record for a corrupt log
+#define CAPTURE_FIFO_ENTRY      (2 * sizeof(uint32_t) + sizeof(struct nonce_record))
+#define REPLAY_MAX_POOLS        8
+#define REPLAY_JOB_MAX          8192            // the size of the driver's last_job_buffer
+#define REPLAY_JOB_SLOTS        8               // driver job images kept for the comparison
+#define REPLAY_SYNC_MS          3000            // for the miner to reach a sync point
+#define REPLAY_START_TIMEOUT_S  600             // for the driver to bring the chains up and connect
+#define REPLAY_DRAIN_MS         2000            // after the log, for the driver to test the last nonces
+
+enum capture_type
+{
+    CAPTURE_LINE = 1,   // a stratum line without its \n, source is the pool_no
+    CAPTURE_JOB,        // a send_job image, the part_of_job message the driver staged
+    CAPTURE_FIFO,       // the fifo word pairs of one read, a nonce's followed by its nonce_record
+    CAPTURE_CHAINS,     // uint32_t mask of the chains up, uint32_t chips on the biggest
+};
+
+enum capture_mode
+{
+    CAPTURE_OFF,
+    CAPTURE_WRITE,
+    CAPTURE_REPLAY,
+};
+
+struct capture_file_header
+{
+    uint32_t    magic;
+    uint32_t    version;
+    uint64_t    start_ns;       // wall clock at the start, ns since the epoch
+};
+
+struct capture_record
+{
+    uint8_t     type;
+    uint8_t     reserved;
+    uint16_t    source;
+    uint32_t    len;            // payload bytes after this header
+    uint64_t    ns;             // since the start of the capture
+};
+
+struct replay_pool
+{
+    int             source;     // pool_no in the capture
+    int             listen_fd;
+    int             fd;         // the miner's connection, -1 for none
+    pthread_t       pth;
+    pthread_mutex_t lock;       // fd, against a reconnect while a line goes out
+    unsigned int    requests;   // lines with a method from the miner
+    unsigned int    replies;    // captured lines without one sent to it
+};
+
+bool capture_c5_active = false;
+
+static enum capture_mode capture_mode = CAPTURE_OFF;
+static struct capture_c5_stats capture_stats;
+
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *capture_file;
+static uint64_t capture_start_ns;
+static uint64_t capture_flushed_ns;
+static unsigned char capture_fifo_buf[(MAX_NONCE_NUMBER_IN_FIFO + 1) * CAPTURE_FIFO_ENTRY];
+static size_t capture_fifo_len;
+static uint64_t capture_fifo_ns;    // when the read in capture_fifo_buf started
+
+static char *replay_path;
+static bool replay_fast;
+static pthread_t replay_pth;
+static struct replay_pool replay_pools[REPLAY_MAX_POOLS];
+static int replay_pool_num;
+static pthread_mutex_t replay_job_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char replay_job_image[REPLAY_JOB_SLOTS][REPLAY_JOB_MAX];
+static unsigned int replay_job_len[REPLAY_JOB_SLOTS];
+static uint64_t replay_jobs_sent;   // by the driver
+static uint64_t replay_pushed;      // nonces pushed into the simulated fifo
+
+static uint64_t capture_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/******************** capture ********************/
+
+static void capture_write(uint8_t type, uint16_t source, uint64_t ns, const void *payload, uint32_t len)
+{
+    struct capture_record rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.type = type;
+    rec.source = source;
+    rec.len = len;
+    rec.ns = ns - capture_start_ns;
+
+    pthread_mutex_lock(&capture_lock);
+    if(!capture_file)
+    {
+        pthread_mutex_unlock(&capture_lock);
+        return;
+    }
+    if(fwrite(&rec, sizeof(rec), 1, capture_file) != 1 || (len && fwrite(payload, len, 1, capture_file) != 1))
+    {
+        applog(LOG_ERR, "fpga capture: can't write the log, capture stopped");
+        fclose(capture_file);
+        capture_file = NULL;
+        pthread_mutex_unlock(&capture_lock);
+        return;
+    }
+    capture_stats.records++;
+    capture_stats.bytes += sizeof(rec) + len;
+
+    // a miner that gets killed loses at most the last CAPTURE_FLUSH_MS
+    if(ns - capture_flushed_ns >= CAPTURE_FLUSH_MS * 1000000ULL)
+    {
+        fflush(capture_file);
+        capture_flushed_ns = ns;
+    }
+    pthread_mutex_unlock(&capture_lock);
+}
+
+static void replay_job_sent(const unsigned char *buf, unsigned int len);
+
+void capture_c5_line(int pool_no, const char *line, size_t len)
+{
+    if(capture_mode != CAPTURE_WRITE)
+        return;
+    __atomic_add_fetch(&capture_stats.lines, 1, __ATOMIC_RELAXED);
+    capture_write(CAPTURE_LINE, pool_no, capture_now_ns(), line, len);
+}
+
+void capture_c5_job(const unsigned char *buf, unsigned int len)
+{
+    if(capture_mode == CAPTURE_REPLAY)
+    {
+        replay_job_sent(buf, len);
+        return;
+    }
+    if(capture_mode != CAPTURE_WRITE)
+        return;
+    __atomic_add_fetch(&capture_stats.jobs, 1, __ATOMIC_RELAXED);
+    capture_write(CAPTURE_JOB, 0, capture_now_ns(), buf, len);
+}
+
+// only the nonce reader thread calls this and capture_c5_fifo_end
+void capture_c5_fifo(const unsigned int *buf, const struct nonce_record *rec)
+{
+    uint32_t words[2];
+
+    if(capture_mode != CAPTURE_WRITE)
+        return;
+    if(capture_fifo_len + CAPTURE_FIFO_ENTRY > sizeof(capture_fifo_buf))
+        capture_c5_fifo_end();
+    if(!capture_fifo_len)
+        capture_fifo_ns = capture_now_ns();
+
+    words[0] = buf[0];
+    words[1] = buf[1];
+    memcpy(capture_fifo_buf + capture_fifo_len, words, sizeof(words));
+    capture_fifo_len += sizeof(words);
+    if(rec)
+    {
+        memcpy(capture_fifo_buf + capture_fifo_len, rec, sizeof(*rec));
+        capture_fifo_len += sizeof(*rec);
+        __atomic_add_fetch(&capture_stats.nonces, 1, __ATOMIC_RELAXED);
+    }
+    else if(!(buf[0] & WORK_ID_OR_CRC))
+        __atomic_add_fetch(&capture_stats.regs, 1, __ATOMIC_RELAXED);
+}
+
+void capture_c5_fifo_end(void)
+{
+    if(capture_mode != CAPTURE_WRITE || !capture_fifo_len)
+        return;
+    capture_write(CAPTURE_FIFO, 0, capture_fifo_ns, capture_fifo_buf, capture_fifo_len);
+    capture_fifo_len = 0;
+}
+
+void capture_c5_chains(unsigned int mask, int chips)
+{
+    uint32_t layout[2] = {mask, chips};
+
+    if(capture_mode != CAPTURE_WRITE)
+        return;
+    capture_write(CAPTURE_CHAINS, 0, capture_now_ns(), layout, sizeof(layout));
+}
+
+int capture_c5_init(const char *path)
+{
+    struct capture_file_header hdr;
+    struct timespec ts;
+
+    capture_file = fopen(path, "wb");
+    if(!capture_file)
+    {
+        applog(LOG_ERR, "%s: can't create %s", __FUNCTION__, path);
+        return -1;
+    }
+    setvbuf(capture_file, NULL, _IOFBF, CAPTURE_BUF_SIZE);
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = CAPTURE_MAGIC;
+    hdr.version = CAPTURE_VERSION;
+    hdr.start_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    if(fwrite(&hdr, sizeof(hdr), 1, capture_file) != 1)
+    {
+        applog(LOG_ERR, "%s: can't write %s", __FUNCTION__, path);
+        fclose(capture_file);
+        capture_file = NULL;
+        return -1;
+    }
+
+    capture_start_ns = capture_now_ns();
+    capture_flushed_ns = capture_start_ns;
+    capture_mode = CAPTURE_WRITE;
+    capture_c5_active = true;
+    applog(LOG_NOTICE, "fpga capture: writing stratum lines, jobs and nonce fifo reads to %s", path);
+    return 0;
+}
+
+void capture_c5_close(void)
+{
+    pthread_mutex_lock(&capture_lock);
+    if(capture_file)
+    {
+        fclose(capture_file);
+        capture_file = NULL;
+        applog(LOG_NOTICE, "fpga capture: %llu records, %llu bytes", (unsigned long long)capture_stats.records, (unsigned long long)capture_stats.bytes);
+    }
+    pthread_mutex_unlock(&capture_lock);
+}
+
+/******************** replay ********************/
+
+static bool replay_has_method(const char *line)
+{
+    json_error_t err;
+    json_t *val = json_loads(line, 0, &err);
+    bool method;
+
+    if(!val)
+        return false;
+    method = json_string_value(json_object_get(val, "method")) != NULL;
+    json_decref(val);
+    return method;
+}
+
+static void replay_job_sent(const unsigned char *buf, unsigned int len)
+{
+    unsigned int slot;
+
+    if(len > REPLAY_JOB_MAX)
+        len = REPLAY_JOB_MAX;
+    pthread_mutex_lock(&replay_job_lock);
+    slot = replay_jobs_sent % REPLAY_JOB_SLOTS;
+    memcpy(replay_job_image[slot], buf, len);
+    replay_job_len[slot] = len;
+    replay_jobs_sent++;
+    pthread_mutex_unlock(&replay_job_lock);
+}
+
+static void *replay_pool_thread(void *arg)
+{
+    struct replay_pool *p = arg;
+    char buf[16384], *nl;
+    size_t len = 0;
+    int fd, n;
+    fd_set fds;
+
+    pthread_detach(pthread_self());
+    RenameThread("ReplayPool");
+
+    while(1)
+    {
+        fd = __atomic_load_n(&p->fd, __ATOMIC_RELAXED);
+        FD_ZERO(&fds);
+        FD_SET(p->listen_fd, &fds);
+        if(fd >= 0)
+            FD_SET(fd, &fds);
+        if(select((fd > p->listen_fd ? fd : p->listen_fd) + 1, &fds, NULL, NULL, NULL) < 0)
+            continue;
+
+        if(FD_ISSET(p->listen_fd, &fds))
+        {
+            n = accept(p->listen_fd, NULL, NULL);
+            // the miner reconnected, what it asked on the old connection is not owed any more
+            pthread_mutex_lock(&p->lock);
+            if(p->fd >= 0)
+                close(p->fd);
+            p->fd = n;
+            p->requests = p->replies;
+            pthread_mutex_unlock(&p->lock);
+            len = 0;
+            continue;
+        }
+
+        if(fd < 0 || !FD_ISSET(fd, &fds))
+            continue;
+        n = recv(fd, buf + len, sizeof(buf) - 1 - len, 0);
+        if(n <= 0)
+        {
+            pthread_mutex_lock(&p->lock);
+            if(p->fd == fd)
+            {
+                close(fd);
+                p->fd = -1;
+            }
+            pthread_mutex_unlock(&p->lock);
+            len = 0;
+            continue;
+        }
+        len += n;
+        buf[len] = '\0';
+        while((nl = strchr(buf, '\n')) != NULL)
+        {
+            *nl = '\0';
+            if(replay_has_method(buf))
+                __atomic_add_fetch(&p->requests, 1, __ATOMIC_RELAXED);
+            len -= nl + 1 - buf;
+            memmove(buf, nl + 1, len + 1);
+        }
+        if(len == sizeof(buf) - 1)
+            len = 0;
+    }
+    return NULL;
+}
+
+static int replay_pool_init(struct replay_pool *p, int source)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+
+    p->source = source;
+    p->fd = -1;
+    pthread_mutex_init(&p->lock, NULL);
+    p->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(p->listen_fd < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    if(bind(p->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+       || listen(p->listen_fd, 1) < 0
+       || getsockname(p->listen_fd, (struct sockaddr *)&addr, &addrlen) < 0)
+    {
+        close(p->listen_fd);
+        return -1;
+    }
+
+    if(pthread_create(&p->pth, NULL, replay_pool_thread, p))
+        return -1;
+    return ntohs(addr.sin_port);
+}
+
+static struct replay_pool *replay_pool_of(int source)
+{
+    int i;
+
+    for(i=0; i<replay_pool_num; i++)
+    {
+        if(replay_pools[i].source == source)
+            return &replay_pools[i];
+    }
+    return NULL;
+}
+
+// the next record and its payload, false at the end of the log or on a bad record
+static bool replay_read(FILE *fp, struct capture_record *rec, unsigned char **payload, size_t *size)
+{
+    if(fread(rec, sizeof(*rec), 1, fp) != 1)
+        return false;
+    if(rec->len > CAPTURE_MAX_RECORD)
+    {
+        applog(LOG_ERR, "fpga replay: record of %u bytes, the log is corrupt", rec->len);
+        return false;
+    }
+    if(rec->len + 1 > *size)
+    {
+        *size = rec->len + 1;
+        *payload = realloc(*payload, *size);
+        if(!*payload)
+            quit(1, "fpga replay: can't allocate a record of %u bytes", rec->len);
+    }
+    if(rec->len && fread(*payload, rec->len, 1, fp) != 1)
+        return false;
+    (*payload)[rec->len] = '\0';    // lines are used as strings
+    return true;
+}
+
+static FILE *replay_open(const char *path)
+{
+    struct capture_file_header hdr;
+    FILE *fp = fopen(path, "rb");
+
+    if(!fp)
+    {
+        applog(LOG_ERR, "fpga replay: can't open %s", path);
+        return NULL;
+    }
+    if(fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != CAPTURE_MAGIC || hdr.version != CAPTURE_VERSION)
+    {
+        applog(LOG_ERR, "fpga replay: %s is not a version %d capture", path, CAPTURE_VERSION);
+        fclose(fp);
+        return NULL;
+    }
+    return fp;
+}
+
+struct replay_wait
+{
+    struct replay_pool  *pool;
+    uint64_t            job;
+    const unsigned int  *buf;
+    const struct nonce_record *rec;
+};
+
+static bool replay_connected(struct replay_wait *w)
+{
+    return __atomic_load_n(&w->pool->fd, __ATOMIC_RELAXED) >= 0;
+}
+
+static bool replay_requested(struct replay_wait *w)
+{
+    return __atomic_load_n(&w->pool->requests, __ATOMIC_RELAXED) > w->pool->replies;
+}
+
+static bool replay_job_reached(struct replay_wait *w)
+{
+    return __atomic_load_n(&replay_jobs_sent, __ATOMIC_RELAXED) > w->job;
+}
+
+static bool replay_nonce_pushed(struct replay_wait *w)
+{
+    return sim_c5_push_nonce(w->buf, w->rec);
+}
+
+static bool replay_drained(struct replay_wait *w)
+{
+    struct nonce_path_stats nps;
+
+    get_nonce_path_stats(&nps);
+    return nps.read + nps.ring_overflow >= replay_pushed && !nps.queued;
+}
+
+// poll until the miner gets to where the log is, false when it doesn't in timeout_ms
+static bool replay_sync(bool (*reached)(struct replay_wait *), struct replay_wait *w, unsigned int timeout_ms)
+{
+    uint64_t deadline = capture_now_ns() + timeout_ms * 1000000ULL;
+
+    while(!reached(w))
+    {
+        if(capture_now_ns() >= deadline)
+        {
+            __atomic_add_fetch(&capture_stats.sync_timeouts, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+        cgsleep_ms(1);
+    }
+    return true;
+}
+
+static void replay_line(uint16_t source, const char *line, uint32_t len)
+{
+    struct replay_wait w = {0};
+    bool reply = !replay_has_method(line);
+
+    w.pool = replay_pool_of(source);
+    if(!w.pool)
+        return;
+    if(!replay_sync(replay_connected, &w, replay_jobs_sent || w.pool->replies ? REPLAY_SYNC_MS : REPLAY_START_TIMEOUT_S * 1000))
+        return;
+    if(reply)
+        replay_sync(replay_requested, &w, REPLAY_SYNC_MS);
+
+    pthread_mutex_lock(&w.pool->lock);
+    if(w.pool->fd >= 0)
+    {
+        send(w.pool->fd, line, len, MSG_NOSIGNAL);
+        send(w.pool->fd, "\n", 1, MSG_NOSIGNAL);
+        if(reply)
+            w.pool->replies++;
+        __atomic_add_fetch(&capture_stats.lines, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&w.pool->lock);
+}
+
+static void replay_job(uint64_t index, const unsigned char *image, uint32_t len)
+{
+    struct replay_wait w = {0};
+    unsigned int slot, i;
+    bool same = false;
+
+    w.job = index;
+    if(!replay_sync(replay_job_reached, &w, index ? REPLAY_SYNC_MS : REPLAY_START_TIMEOUT_S * 1000))
+        return;
+
+    pthread_mutex_lock(&replay_job_lock);
+    if(replay_jobs_sent - index <= REPLAY_JOB_SLOTS)
+    {
+        slot = index % REPLAY_JOB_SLOTS;
+        same = replay_job_len[slot] == len && !memcmp(replay_job_image[slot], image, len);
+        if(!same)
+        {
+            for(i=0; i<len && i<replay_job_len[slot] && replay_job_image[slot][i] == image[i]; i++)
+                ;
+            applog(LOG_INFO, "fpga replay: job %llu differs from the capture at byte %u", (unsigned long long)index, i);
+        }
+    }
+    pthread_mutex_unlock(&replay_job_lock);
+
+    __atomic_add_fetch(&capture_stats.jobs, 1, __ATOMIC_RELAXED);
+    if(!same)
+        __atomic_add_fetch(&capture_stats.job_diffs, 1, __ATOMIC_RELAXED);
+}
+
+static void replay_fifo(const unsigned char *payload, uint32_t len, bool reading)
+{
+    struct replay_wait w = {0};
+    struct nonce_record rec;
+    unsigned int buf[2];
+    uint32_t pos = 0;
+
+    if(replay_fast && reading)
+        replay_sync(replay_drained, &w, REPLAY_SYNC_MS);
+
+    while(pos + 2 * sizeof(uint32_t) <= len)
+    {
+        memcpy(buf, payload + pos, 2 * sizeof(uint32_t));
+        pos += 2 * sizeof(uint32_t);
+        if(!(buf[0] & WORK_ID_OR_CRC))
+        {
+            __atomic_add_fetch(&capture_stats.regs, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        if(!(buf[0] & NONCE_INDICATOR) || pos + sizeof(rec) > len)
+            continue;
+        memcpy(&rec, payload + pos, sizeof(rec));
+        pos += sizeof(rec);
+        if(!reading)
+            continue;
+
+        w.buf = buf;
+        w.rec = &rec;
+        if(replay_sync(replay_nonce_pushed, &w, REPLAY_SYNC_MS))
+        {
+            replay_pushed++;
+            __atomic_add_fetch(&capture_stats.nonces, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void *replay_thread(void *arg)
+{
+    struct capture_record rec;
+    struct nonce_path_stats nps;
+    unsigned char *payload = NULL;
+    size_t size = 0;
+    uint64_t jobs = 0, now, due;
+    int64_t shift = 0;  // replay clock less the capture's, it only grows when the miner is slower
+    bool first = true;
+    FILE *fp;
+
+    pthread_detach(pthread_self());
+    RenameThread("FpgaReplay");
+
+    fp = replay_open(replay_path);
+    if(!fp)
+    {
+        kill_work();
+        return NULL;
+    }
+
+    while(replay_read(fp, &rec, &payload, &size))
+    {
+        __atomic_add_fetch(&capture_stats.records, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&capture_stats.bytes, sizeof(rec) + rec.len, __ATOMIC_RELAXED);
+
+        now = capture_now_ns();
+        if(first)
+        {
+            shift = now - rec.ns;
+            first = false;
+        }
+        due = rec.ns + shift;
+        if(!replay_fast && due > now)
+            cgsleep_us((due - now) / 1000);
+
+        switch(rec.type)
+        {
+        case CAPTURE_LINE:
+            replay_line(rec.source, (char *)payload, rec.len);
+            break;
+        case CAPTURE_JOB:
+            replay_job(jobs++, payload, rec.len);
+            break;
+        case CAPTURE_FIFO:
+            replay_fifo(payload, rec.len, jobs > 0);
+            break;
+        default:
+            break;
+        }
+
+        // what came after a wait for the miner keeps its captured spacing from there
+        now = capture_now_ns();
+        if(now > rec.ns + shift)
+            shift = now - rec.ns;
+    }
+    fclose(fp);
+    free(payload);
+
+    cgsleep_ms(REPLAY_DRAIN_MS);
+    get_nonce_path_stats(&nps);
+    applog(LOG_NOTICE, "fpga replay: %llu lines, %llu jobs (%llu differ), %llu nonces, %llu register replies skipped, %llu sync timeouts",
+           (unsigned long long)capture_stats.lines, (unsigned long long)capture_stats.jobs, (unsigned long long)capture_stats.job_diffs,
+           (unsigned long long)capture_stats.nonces, (unsigned long long)capture_stats.regs, (unsigned long long)capture_stats.sync_timeouts);
+    applog(LOG_NOTICE, "fpga replay: driver read %llu nonces, lost %llu to full rings, flushed %llu, tested %llu valid, %llu hw, %llu stale, pool accepted %lld rejected %lld",
+           (unsigned long long)nps.read, (unsigned long long)nps.ring_overflow, (unsigned long long)nps.flushed,
+           (unsigned long long)nps.valid, (unsigned long long)nps.hw, (unsigned long long)nps.stale,
+           (long long)total_accepted, (long long)total_rejected);
+    kill_work();
+    return NULL;
+}
+
+int replay_c5_init(const char *path, bool fast, char urls[][64], int max, char **sim_spec)
+{
+    struct capture_record rec;
+    unsigned char *payload = NULL;
+    size_t size = 0;
+    uint32_t layout[2] = {0, 0};
+    int sources[REPLAY_MAX_POOLS], num = 0, i, j, port;
+    char spec[128];
+    FILE *fp;
+
+    fp = replay_open(path);
+    if(!fp)
+        return -1;
+
+    // a first pass for the pools to serve and the chains to simulate
+    while(replay_read(fp, &rec, &payload, &size))
+    {
+        if(rec.type == CAPTURE_LINE)
+        {
+            for(i=0; i<num && sources[i] != rec.source; i++)
+                ;
+            if(i == num && num < REPLAY_MAX_POOLS && num < max)
+                sources[num++] = rec.source;
+        }
+        else if(rec.type == CAPTURE_CHAINS && !layout[0] && rec.len >= sizeof(layout))
+            memcpy(layout, payload, sizeof(layout));
+    }
+    fclose(fp);
+    free(payload);
+
+    if(!num)
+    {
+        applog(LOG_ERR, "fpga replay: no stratum lines in %s", path);
+        return -1;
+    }
+
+    // in pool_no order, so the miner's pool priorities are the captured ones
+    for(i=1; i<num; i++)
+    {
+        for(j=i; j>0 && sources[j-1] > sources[j]; j--)
+        {
+            port = sources[j];
+            sources[j] = sources[j-1];
+            sources[j-1] = port;
+        }
+    }
+    for(i=0; i<num; i++)
+    {
+        port = replay_pool_init(&replay_pools[i], sources[i]);
+        if(port < 0)
+        {
+            applog(LOG_ERR, "fpga replay: can't start the local pool for pool %d", sources[i]);
+            return -1;
+        }
+        replay_pool_num++;
+        snprintf(urls[i], 64, "stratum+tcp://127.0.0.1:%d", port);
+    }
+
+    if(!*sim_spec && layout[0])
+    {
+        snprintf(spec, sizeof(spec), "chips=%u,chains=", layout[1]);
+        for(i=0; i<BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            if(layout[0] & (1 << i))
+                snprintf(spec + strlen(spec), sizeof(spec) - strlen(spec), "%s%d", spec[strlen(spec) - 1] == '=' ? "" : ":", i);
+        }
+        *sim_spec = strdup(spec);
+    }
+    // the captured nonces are all the chains return
+    sim_c5_hold(true);
+
+    replay_path = strdup(path);
+    replay_fast = fast;
+    capture_mode = CAPTURE_REPLAY;
+    capture_c5_active = true;
+    if(pthread_create(&replay_pth, NULL, replay_thread, NULL))
+        return -1;
+    applog(LOG_NOTICE, "fpga replay: %s %s on %d local pools", path, fast ? "as fast as the miner takes it" : "at the captured pace", num);
+    return num;
+}
+
+void capture_c5_get_stats(struct capture_c5_stats *stats)
+{
+    stats->records = __atomic_load_n(&capture_stats.records, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&capture_stats.bytes, __ATOMIC_RELAXED);
+    stats->lines = __atomic_load_n(&capture_stats.lines, __ATOMIC_RELAXED);
+    stats->jobs = __atomic_load_n(&capture_stats.jobs, __ATOMIC_RELAXED);
+    stats->job_diffs = __atomic_load_n(&capture_stats.job_diffs, __ATOMIC_RELAXED);
+    stats->nonces = __atomic_load_n(&capture_stats.nonces, __ATOMIC_RELAXED);
+    stats->regs = __atomic_load_n(&capture_stats.regs, __ATOMIC_RELAXED);
+    stats->sync_timeouts = __atomic_load_n(&capture_stats.sync_timeouts, __ATOMIC_RELAXED);
+}
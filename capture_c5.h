@@ -0,0 +1,54 @@
+/*
+ * Capture of the c5 driver's inputs to a binary log (--fpga-capture) and
+ * their replay on the FPGA simulator (--fpga-replay).
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef CAPTURE_C5_H
+#define CAPTURE_C5_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct capture_c5_stats
+{
+    uint64_t    records;        // written to or read from the log
+    uint64_t    bytes;
+    uint64_t    lines;          // stratum lines captured or sent to the miner
+    uint64_t    jobs;           // send_job images captured or matched against the driver's
+    uint64_t    job_diffs;      // replayed jobs the driver built differently from the capture
+    uint64_t    nonces;         // nonce words captured or pushed into the simulated fifo
+    uint64_t    regs;           // register replies captured; a replay skips them, the simulator answers its own
+    uint64_t    sync_timeouts;  // replay points the miner did not reach in time
+};
+
+struct nonce_record;
+
+/* Set while capturing or replaying, the hooks below are no-ops otherwise */
+extern bool capture_c5_active;
+
+extern int capture_c5_init(const char *path);
+extern void capture_c5_close(void);
+
+/* Hooks: a line recv_line returned, a job image send_job staged, the fifo
+ * words of one read of get_nonce_and_register with the record of each nonce,
+ * and the chains the driver brought up. */
+extern void capture_c5_line(int pool_no, const char *line, size_t len);
+extern void capture_c5_job(const unsigned char *buf, unsigned int len);
+extern void capture_c5_fifo(const unsigned int *buf, const struct nonce_record *rec);
+extern void capture_c5_fifo_end(void);
+extern void capture_c5_chains(unsigned int mask, int chips);
+
+/* Start a local pool for each pool in the log, fill urls with them and return
+ * how many there are. *sim_spec gets the captured chains unless already set.
+ * The replay quits the miner at the end of the log. */
+extern int replay_c5_init(const char *path, bool fast, char urls[][64], int max, char **sim_spec);
+
+extern void capture_c5_get_stats(struct capture_c5_stats *stats);
+
+#endif /* CAPTURE_C5_H */
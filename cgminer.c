@@ -68,6 +68,9 @@ char *curly = ":D";
 
 #ifdef USE_BITMAIN_C5
 #include "driver-btm-c5.h"
+#include "sha256d_c5.h"
+#include "bench_c5.h"
+#include "capture_c5.h"
 #endif
 
 #ifdef USE_USBUTILS
@@ -923,6 +926,14 @@ static char __maybe_unused *set_int_0_to_4(const char *arg, int *i)
     return set_int_range(arg, i, 0, 4);
 }
 
+#ifdef USE_BITMAIN_C5
+static char *opt_bench_sha256d(void *arg)
+{
+    sha256d_c5_bench();
+    exit(0);
+}
+#endif
+
 
 void get_intrange(char *arg, int *val1, int *val2)
 {
@@ -1571,6 +1582,82 @@ static struct opt_table opt_config_table[] =
     opt_set_invbool, &opt_pre_heat,
     "Set bitmain miner doesn't pre heat"),
 
+    OPT_WITHOUT_ARG("--calibration-cache",
+    opt_set_bool, &opt_calibration_cache,
+    "Reuse the temp sensor calibration of hash boards that did not change since the last start"),
+
+    OPT_WITHOUT_ARG("--warm-restart",
+    opt_set_bool, &opt_warm_restart,
+    "On restart, take over the running hashboards instead of resetting them"),
+
+    OPT_WITHOUT_ARG("--chain-reinit",
+    opt_set_bool, &opt_chain_reinit,
+    "Reset and bring back up a single hash board that stopped hashing, the others keep mining"),
+
+    OPT_WITHOUT_ARG("--chip-autotune",
+    opt_set_bool, &opt_chip_autotune,
+    "Tune the frequency of each chip to its nonce yield, HW errors and temp, saved per hash board in " AUTOTUNE_FILE),
+
+    OPT_WITHOUT_ARG("--chip-autotune-dry-run",
+    opt_set_bool, &opt_chip_autotune_dry_run,
+    "Only log and report the frequency changes --chip-autotune would make"),
+
+    OPT_WITH_ARG("--vf-optimise",
+    opt_set_charp, NULL, &opt_vf_optimise,
+    "Search each hash board's voltage and frequency for the lowest J/TH, toward jth=<J/TH> or ghs=<GH/s> over all boards"),
+
+    OPT_WITH_ARG("--vf-floor",
+    set_int_1_to_65535, opt_show_intval, &opt_vf_floor,
+    "GH/s over all boards --vf-optimise never goes below (default: 90% of the hash boards' nominal hashrate)"),
+
+    OPT_WITH_ARG("--power-model",
+    opt_set_charp, NULL, &opt_power_model,
+    "Hash board power for --vf-optimise: idle watts plus k*V^2*chip MHz, over the PSU efficiency (default: " VF_POWER_MODEL_DEFAULT ")"),
+
+    OPT_WITHOUT_ARG("--bench-sha256d",
+    opt_bench_sha256d, NULL,
+    "Benchmark the nonce verify hashing and exit"),
+
+    OPT_WITHOUT_ARG("--job-staging",
+    opt_set_bool, &opt_job_staging,
+    "Switch FPGA jobs with staged registers and no settle delays"),
+
+    OPT_WITHOUT_ARG("--job-verify",
+    opt_set_bool, &opt_job_verify,
+    "Read each job back from the FPGA job buffer and log any difference"),
+
+    OPT_WITH_ARG("--job-template-depth",
+    set_int_1_to_255, opt_show_intval, &opt_job_template_depth,
+    "Number of recent stratum jobs kept to verify late nonces against (default: 16)"),
+
+    OPT_WITH_ARG("--nonce-verify-threads",
+    set_int_1_to_10, opt_show_intval, &opt_nonce_verify_threads,
+    "Number of threads verifying nonces, chains are shared out between them (default: 1)"),
+
+    OPT_WITH_ARG("--fpga-backend",
+    opt_set_charp, NULL, &opt_fpga_backend,
+    "FPGA register backend: mmap (default) or sim, a software model of the FPGA and hash boards"),
+
+    OPT_WITH_ARG("--fpga-sim",
+    opt_set_charp, NULL, &opt_fpga_sim,
+    "Simulated hash boards for --fpga-backend sim, e.g. chains=5:6:7,chips=63,rate=0,bits=32,fans=2"),
+
+    OPT_WITH_ARG("--fpga-bench",
+    opt_set_charp, NULL, &opt_fpga_bench,
+    "Find the highest nonce rate the driver keeps up with on simulated hash boards and a local pool, write it as JSON to this file (- for stdout) and quit"),
+
+    OPT_WITH_ARG("--fpga-capture",
+    opt_set_charp, NULL, &opt_fpga_capture,
+    "Log every stratum line, job sent to the FPGA and nonce fifo read to this file, for --fpga-replay"),
+
+    OPT_WITH_ARG("--fpga-replay",
+    opt_set_charp, NULL, &opt_fpga_replay,
+    "Replay a --fpga-capture log on simulated hash boards and local pools, then quit"),
+
+    OPT_WITHOUT_ARG("--fpga-replay-fast",
+    opt_set_bool, &opt_fpga_replay_fast,
+    "Replay as fast as the miner takes it instead of at the captured pace"),
+
 
 #endif
 
@@ -3451,7 +3538,10 @@ static void share_result(
         mutex_lock(&stats_lock);
 
 	if (work->chain_id < BITMAIN_MAX_CHAIN_NUM)
+	{
 		g_accepted[work->chain_id]++;
+		g_accepted_diff[work->chain_id] += work->work_difficulty;
+	}
         cgpu->accepted++;
         total_accepted++;
         pool->accepted++;
@@ -5532,6 +5622,77 @@ static bool block_exists(const char *hexstr, const unsigned char *bedata, const
     return ret;
 }
 
+const char *notify_stage_names[NOTIFY_STAGES] =
+{
+    "total", "parse_notify", "test_work_current", "driver_update", "job_encode", "job_commit"
+};
+
+/* Per stage time since the previous stage reached, the total in NOTIFY_RECV */
+static struct cg_hist notify_lat_hist[NOTIFY_STAGES];
+static pthread_mutex_t notify_lat_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline bool notify_ts_set(cgtimer_t *ts)
+{
+    return ts->tv_sec || ts->tv_nsec;
+}
+
+/* Called by parse_notify under the pool data_lock, the notify was read at
+ * pool->ts_recv */
+void notify_lat_start(struct pool *pool)
+{
+    memset(pool->notify_ts, 0, sizeof(pool->notify_ts));
+    pool->notify_ts[NOTIFY_RECV] = pool->ts_recv;
+    cgtimer_time(&pool->notify_ts[NOTIFY_PARSED]);
+    pool->notify_recorded = false;
+}
+
+static void notify_lat_record(struct pool *pool)
+{
+    int stage, prev = NOTIFY_RECV;
+
+    mutex_lock(&notify_lat_lock);
+    for (stage = NOTIFY_PARSED; stage < NOTIFY_STAGES; stage++)
+    {
+        if (!notify_ts_set(&pool->notify_ts[stage]))
+            continue;
+        cg_hist_add(&notify_lat_hist[stage], cgtimer_us_diff(&pool->notify_ts[stage], &pool->notify_ts[prev]));
+        prev = stage;
+    }
+    cg_hist_add(&notify_lat_hist[NOTIFY_RECV],
+                cgtimer_us_diff(&pool->notify_ts[NOTIFY_COMMIT], &pool->notify_ts[NOTIFY_RECV]));
+    mutex_unlock(&notify_lat_lock);
+}
+
+/* Only the first time each stage is reached for the current notify counts, and
+ * only in order: a stage reached again after a later one, e.g. test_work_current
+ * from get_work inside a driver update, is not this notify's latency. Reaching
+ * NOTIFY_COMMIT adds the notify to the histograms. */
+void notify_lat_stamp(struct pool *pool, enum notify_stage stage)
+{
+    int later;
+
+    if (pool->notify_recorded || !notify_ts_set(&pool->notify_ts[NOTIFY_RECV]))
+        return;
+    for (later = stage; later < NOTIFY_STAGES; later++)
+    {
+        if (notify_ts_set(&pool->notify_ts[later]))
+            return;
+    }
+    cgtimer_time(&pool->notify_ts[stage]);
+    if (stage == NOTIFY_COMMIT)
+    {
+        notify_lat_record(pool);
+        pool->notify_recorded = true;
+    }
+}
+
+void notify_lat_copy(struct cg_hist *hist)
+{
+    mutex_lock(&notify_lat_lock);
+    memcpy(hist, notify_lat_hist, sizeof(notify_lat_hist));
+    mutex_unlock(&notify_lat_lock);
+}
+
 static bool test_work_current(struct work *work)
 {
     struct pool *pool = work->pool;
@@ -5565,6 +5726,8 @@ static bool test_work_current(struct work *work)
         pool->swork.clean = false;
         work->longpoll = true;
     }
+    if (work->stratum)
+        notify_lat_stamp(pool, NOTIFY_CURRENT);
 
     cg_wunlock(&pool->data_lock);
 
@@ -8202,6 +8365,96 @@ void set_target(unsigned char *dest_target, double diff)
 }
 
 
+/* Everything in the coinbase ahead of nonce2 (coinb1 and nonce1) is fixed for
+ * a job, so hash its whole blocks once. Must be called with the pool data
+ * lock held for writing whenever coinbase or nonce2_offset change */
+void set_pool_cb_midstate(struct pool *pool)
+{
+    sha256_ctx ctx;
+    int i;
+
+    pool->cb_midstate_len = pool->nonce2_offset & ~(SHA256_BLOCK_SIZE - 1);
+    sha256_init(&ctx);
+    sha256_update(&ctx, pool->coinbase, pool->cb_midstate_len);
+    for (i = 0; i < 8; i++)
+        pool->cb_midstate[i] = ctx.h[i];
+}
+
+/* Rebuild the work a returned nonce belongs to. Unlike gen_stratum_work this
+ * leaves the pool untouched (nonce2 and the version are patched in local
+ * copies) so several verify threads may do it for the same pool at once, and
+ * only the coinbase tail after cb_midstate is hashed */
+static void gen_stratum_work_by_nonce2(struct pool *pool, struct work *work, uint64_t nonce2, uint32_t version)
+{
+    unsigned char merkle_root[32], merkle_sha[64];
+    unsigned char hash1[32];
+    unsigned char *cb_tail;
+    unsigned int cb_tail_len;
+    uint32_t *data32, *swap32;
+    uint64_t nonce2le;
+    sha256_ctx ctx;
+    int i;
+
+    cg_rlock(&pool->data_lock);
+
+    cb_tail_len = pool->coinbase_len - pool->cb_midstate_len;
+    cb_tail = alloca(cb_tail_len);
+    cg_memcpy(cb_tail, pool->coinbase + pool->cb_midstate_len, cb_tail_len);
+    nonce2le = htole64(nonce2);
+    cg_memcpy(cb_tail + pool->nonce2_offset - pool->cb_midstate_len, &nonce2le, (unsigned int)pool->n2size);
+
+    work->nonce2     = nonce2;
+    work->nonce2_len = pool->n2size;
+
+    /* Generate merkle root, resuming the coinbase hash from cb_midstate */
+    for (i = 0; i < 8; i++)
+        ctx.h[i] = pool->cb_midstate[i];
+    ctx.tot_len = pool->cb_midstate_len;
+    ctx.len = 0;
+    sha256_update(&ctx, cb_tail, cb_tail_len);
+    sha256_final(&ctx, hash1);
+    sha256(hash1, 32, merkle_root);
+    cg_memcpy(merkle_sha, merkle_root, 32);
+
+    for (i = 0; i < pool->merkles; i++)
+    {
+        cg_memcpy(merkle_sha + 32, pool->swork.merkle_bin[i], 32);
+        gen_hash(merkle_sha, merkle_root, 64);
+        cg_memcpy(merkle_sha, merkle_root, 32);
+    }
+
+    data32 = (uint32_t *)merkle_sha;
+    swap32 = (uint32_t *)merkle_root;
+
+    flip32(swap32, data32);
+
+    cg_memcpy(work->data, pool->header_bin, 112);
+    cg_memcpy(work->data, &version, 4);
+    cg_memcpy(work->data + 36, merkle_root, 32);
+
+    work->sdiff  = pool->sdiff;
+    work->job_id = strdup(pool->swork.job_id);
+    work->nonce1 = strdup(pool->nonce1);
+    work->ntime  = strdup(pool->ntime);
+
+    cg_runlock(&pool->data_lock);
+
+    calc_midstate(work);
+    set_target(work->target, work->sdiff);
+
+    work->pool          = pool;
+    work->stratum       = true;
+    work->nonce         = 0;
+    work->longpoll      = false;
+    work->getwork_mode  = GETWORK_MODE_STRATUM;
+    work->work_block    = work_block;
+    work->drv_rolllimit = 60;
+
+    calc_diff(work, work->sdiff);
+
+    cgtime(&work->tv_staged);
+}
+
 //#ifdef USE_BITMAIN_C5
 void get_work_by_nonce2(struct thr_info *thr,
                         struct work **work,
@@ -8213,16 +8466,10 @@ void get_work_by_nonce2(struct thr_info *thr,
 {
     *work = make_work();
     const int thr_id = thr->id;
-    struct cgpu_info *cgpu = thr->cgpu;
-    struct device_drv *drv = cgpu->drv;
-    cg_wlock(&pool->data_lock);
-    pool->nonce2 = nonce2;
+
     //if(pool->support_vil) // comment as default
     version = Swap32(version);
-    cg_memcpy(pool->header_bin, &version, 4);
-    cg_wunlock(&pool->data_lock);
-
-    gen_stratum_work(pool, *work);
+    gen_stratum_work_by_nonce2(pool, *work, nonce2, version);
 
     (*work)->pool = real_pool;
 
@@ -11538,6 +11785,83 @@ int main(int argc, char *argv[])
         load_default_config();
     }
 
+#ifdef USE_BITMAIN_C5
+    if (opt_fpga_bench)
+    {
+        char url[64];
+
+        if (total_pools)
+        {
+            early_quit(1, "--fpga-bench mines on its own local pool, remove the other pools");
+        }
+        if (opt_fpga_backend && strcmp(opt_fpga_backend, "sim"))
+        {
+            early_quit(1, "--fpga-bench runs on --fpga-backend sim");
+        }
+        opt_fpga_backend = "sim";
+        if (!opt_fpga_sim)
+        {
+            opt_fpga_sim = "bits=0";
+        }
+        opt_fixed_freq = true;  // the simulator answers no test patterns
+
+        if (bench_c5_init(opt_fpga_bench, url, sizeof(url)) < 0)
+        {
+            early_quit(1, "--fpga-bench can't start its local pool");
+        }
+        set_url(strdup(url));
+        set_user("bench");
+        set_pass("x");
+    }
+    if (opt_fpga_replay)
+    {
+        char urls[8][64];
+        int i, num;
+
+        if (total_pools)
+        {
+            early_quit(1, "--fpga-replay mines on the captured pools, remove the other pools");
+        }
+        if (opt_fpga_bench || opt_fpga_capture)
+        {
+            early_quit(1, "--fpga-replay can't run with --fpga-bench or --fpga-capture");
+        }
+        if (opt_fpga_backend && strcmp(opt_fpga_backend, "sim"))
+        {
+            early_quit(1, "--fpga-replay runs on --fpga-backend sim");
+        }
+        opt_fpga_backend = "sim";
+        opt_fixed_freq = true;  // the simulator answers no test patterns
+
+        num = replay_c5_init(opt_fpga_replay, opt_fpga_replay_fast, urls, 8, &opt_fpga_sim);
+        if (num < 0)
+        {
+            early_quit(1, "--fpga-replay can't replay %s", opt_fpga_replay);
+        }
+        for (i = 0; i < num; i++)
+        {
+            set_url(strdup(urls[i]));
+            set_user("replay");
+            set_pass("x");
+        }
+    }
+    if (opt_fpga_capture && capture_c5_init(opt_fpga_capture) < 0)
+    {
+        early_quit(1, "--fpga-capture can't write %s", opt_fpga_capture);
+    }
+    if (opt_vf_optimise)
+    {
+        if (opt_chip_autotune || opt_chip_autotune_dry_run)
+        {
+            early_quit(1, "--vf-optimise moves the frequency of whole hash boards, it can't run with --chip-autotune");
+        }
+        if (!vf_optimise_parse(opt_vf_optimise, opt_power_model))
+        {
+            early_quit(1, "Invalid --vf-optimise %s or --power-model, want jth=<J/TH> or ghs=<GH/s> and idle=<W>,k=<W/V^2/MHz>,psu=<0-1>", opt_vf_optimise);
+        }
+    }
+#endif
+
     if (opt_benchmark || opt_benchfile)
     {
         struct pool *pool;
@@ -45,6 +45,9 @@
 #include <errno.h>
 #include <string.h>
 #include <sys/sysinfo.h>
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
 
 #include "elist.h"
 #include "miner.h"
@@ -140,6 +143,9 @@ static void hexdump(const uint8_t *p, unsigned int len)
 #include "util.h"
 #include "driver-btm-c5.h"
 #include "sha2_c5.h"
+#include "sha256d_c5.h"
+#include "sim_c5.h"
+#include "capture_c5.h"
 
 #ifdef R4
 int MIN_PWM_PERCENT;
@@ -181,17 +187,54 @@ bool gBegin_get_nonce = false;
 struct timeval tv_send_job = {0, 0};
 struct timeval tv_send = {0, 0};
 
-pthread_mutex_t reg_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t nonce_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t iic_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t fpga_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 pthread_mutex_t opencore_readtemp_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-uint64_t h = 0;
-
-
-uint32_t given_id = 2;
+uint64_t scanhash_thread_saved = 0;             // scanhash calls served without creating a thread
+uint64_t nonce_read_count = 0;                  // nonces taken out of the fifo by get_nonce_and_register
+uint64_t nonce_read_ns = 0;                     // time spent reading them, fifo and nonce2/job_id record
+char *opt_fpga_backend = NULL;                 // NULL or "mmap" for /dev/mem, "sim" for sim_c5
+char *opt_fpga_sim = NULL;
+char *opt_fpga_bench = NULL;                   // JSON report of the nonce path benchmark, see bench_c5.c
+char *opt_fpga_capture = NULL;                 // binary log of the driver's inputs, see capture_c5.c
+char *opt_fpga_replay = NULL;
+bool opt_fpga_replay_fast = false;
+unsigned int nonce_poll_us = NONCE_POLL_DEFAULT_US; // adaptive fifo poll interval
+unsigned int nonce_fifo_hwm = 0;                // most entries seen in the nonce fifo at once
+uint64_t nonce_fifo_full = 0;                   // reads that found the fifo full, nonces may have been lost
+uint64_t nonce_fifo_wakeups = 0;
+bool opt_job_verify = false;
+struct cg_hist job_send_hist;                   // bitmain_c5_update to RUN_BIT set by send_job
+bool opt_job_staging = false;
+struct cg_hist job_switch_idle_hist;            // RUN_BIT clear while switching jobs
+struct chain_init chain_init_state[BITMAIN_MAX_CHAIN_NUM];
+bool opt_calibration_cache = false;
+struct calibration_cache calibration_cache;     // loaded at init, refreshed by calibration_sensor_offset
+unsigned char chip_freq_index[BITMAIN_MAX_CHAIN_NUM][BITMAIN_DEFAULT_ASIC_NUM]; // PLL index last set into each chip
+bool opt_warm_restart = false;
+bool c5_init_done = false;                      // hashboards are up, their state is worth handing over
+bool warm_restarted = false;                    // this process adopted the hashboards of the previous one
+bool opt_chain_reinit = false;
+unsigned int chain_reinit_num[BITMAIN_MAX_CHAIN_NUM];       // recoveries run on each chain
+unsigned int chain_reinit_failed[BITMAIN_MAX_CHAIN_NUM];    // ... that did not get all asics back
+struct timeval chain_reinit_time[BITMAIN_MAX_CHAIN_NUM];    // when each chain was last recovered
+double chain_reinit_saved = 0;                  // GH the other chains hashed while one was being recovered
+bool opt_chip_autotune = false;
+bool opt_chip_autotune_dry_run = false;         // only log and report what the autotuner would change
+unsigned char chip_base_freq_index[BITMAIN_MAX_CHAIN_NUM][BITMAIN_DEFAULT_ASIC_NUM]; // where the autotuner took each chip over, 0 before
+struct autotune_file autotune_file;
+unsigned int autotune_raised = 0;               // PLL steps the autotuner made, or recommended in a dry run
+unsigned int autotune_lowered = 0;
+char *opt_vf_optimise = NULL;                   // jth=<J/TH> or ghs=<GH/s>, see vf_optimise_step
+int opt_vf_floor = 0;                           // GH/s, 0 for VF_OPT_FLOOR of the nominal hashrate
+char *opt_power_model = NULL;
+uint8_t chain_base_voltage_pic[BITMAIN_MAX_CHAIN_NUM]; // where the optimiser took each chain over, 0 before
+
+
+uint32_t given_id = 2;                          // id of the last job sent, published after its template
+uint64_t job_template_stale = 0;                // nonces for jobs already gone from the template ring
 uint32_t c_coinbase_padding = 0;
 uint32_t c_merkles_num = 0;
 uint32_t l_coinbase_padding = 0;
@@ -215,6 +258,8 @@ int FatalErrorValue=0;
 bool opt_bitmain_new_cmd_type_vil = false;
 bool opt_fixed_freq = false;
 bool opt_pre_heat = true;
+int opt_nonce_verify_threads = 1;
+int opt_job_template_depth = 16;
 
 bool status_error = false;
 bool once_error = false;
@@ -227,6 +272,7 @@ double chain_asic_RT[BITMAIN_MAX_CHAIN_NUM][CHAIN_ASIC_NUM]= {0};
 
 uint32_t g_accepted[BITMAIN_MAX_CHAIN_NUM] = {0};
 uint32_t g_rejected[BITMAIN_MAX_CHAIN_NUM] = {0};
+double g_accepted_diff[BITMAIN_MAX_CHAIN_NUM] = {0};
 uint64_t rate[BITMAIN_MAX_CHAIN_NUM] = {0};
 uint64_t nonce_num[BITMAIN_MAX_CHAIN_NUM][BITMAIN_DEFAULT_ASIC_NUM][TIMESLICE] = {0};
 int nonce_times = 0;
@@ -236,7 +282,7 @@ char displayed_rate[BITMAIN_MAX_CHAIN_NUM][32];
 uint8_t chain_voltage_pic[BITMAIN_MAX_CHAIN_NUM] = {0xff};
 int chain_voltage_value[BITMAIN_MAX_CHAIN_NUM] = {0};
 
-unsigned char hash_board_id[BITMAIN_MAX_CHAIN_NUM][12];
+unsigned char hash_board_id[BITMAIN_MAX_CHAIN_NUM][HASH_BOARD_ID_LEN];
 
 int lowest_testOK_temp[BITMAIN_MAX_CHAIN_NUM]= {0}; // board test patten OK, we record temp in PIC, then we need keep board temp >= this lowest temp
 int chain_temp_toolow[BITMAIN_MAX_CHAIN_NUM]= {0};
@@ -269,8 +315,11 @@ static int test_core = 8;
 
 struct nonce_content temp_nonce_buf[MAX_RETURNED_NONCE_NUM];
 struct reg_content temp_reg_buf[MAX_RETURNED_NONCE_NUM];
-volatile struct nonce_buf nonce_read_out;
-volatile struct reg_buf reg_value_buf;
+struct nonce_worker nonce_workers[MAX_NONCE_VERIFY_THREADS];
+unsigned char nonce_chain_worker[BITMAIN_MAX_CHAIN_NUM];   // which nonce_workers[] verifies a chain
+static uint32_t chain_hw_carried[BITMAIN_MAX_CHAIN_NUM];   // dev->chain_hw adopted from a warm restart
+struct reg_queue reg_queue[BITMAIN_MAX_CHAIN_NUM];
+struct temp_snapshot temp_snapshot;             // written by read_temp_func only
 
 
 #define USE_IIC 1
@@ -294,6 +343,13 @@ pthread_mutex_t reinit_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static int reinit_counter=0;
 void bitmain_core_reInit();
+bool bitmain_chain_reInit(int chainIndex);
+static void check_chain_reinit();
+static void autotune_start();
+static void autotune_step();
+static void save_autotune_file();
+static void vf_optimise_start();
+static void vf_optimise_step();
 
 signed char getMeddleOffsetForTestPatten(int chainIndex)
 {
@@ -314,6 +370,9 @@ bool isC5_Board()
 
 void software_set_address();
 void set_asic_ticket_mask(unsigned int ticket_mask);
+void set_baud_with_addr(unsigned char bauddiv,int mode,unsigned char chip_addr,int chain,int iic,int open_core,int bottom_or_mid);
+void temp_snapshot_get(struct temp_snapshot *ts);
+static bool temp_snapshot_stale(struct temp_snapshot *ts);
 void init_uart_baud();
 void open_core_one_chain(int chainIndex, bool nullwork_enable);
 void getAsicNum_preOpenCore(int chainIndex);
@@ -322,10 +381,15 @@ void writeInitLogFile(char *logstr);
 void clearInitLogFile();
 void re_send_last_job();
 void saveSearchFailedFlagInfo(char *search_failed_info);
+void *nonce_verify_func(void *arg);
+void set_nonce_chain_worker();
+void merge_nonce_worker_asic_nonce();
+static void merge_nonce_worker_chain_hw();
+static void carry_nonce_worker_chain_hw(const uint32_t *chain_hw);
 
 extern void jump_to_app_CheckAndRestorePIC(int chainIndex); // defined in Clement-bitmain.c
 
-static unsigned char last_job_buffer[8192]= {23};
+static unsigned char last_job_buffer[8192] __attribute__((aligned(8))) = {23};
 
 ///////////// below they must be changed at same time!!!! ///////////////////////
 typedef enum
@@ -2373,6 +2437,15 @@ void set_pic_iic_flash_addr_pointer(unsigned char chain, unsigned char addr_H, u
         unsigned int data;
         int ret=0;
 
+        if(opt_fpga_backend && !strcmp(opt_fpga_backend, "sim"))
+        {
+            if(sim_c5_init(opt_fpga_sim, &axi_fpga_addr, &fpga_mem_addr) < 0)
+                quit(1, "%s: can't start the FPGA simulator", __FUNCTION__);
+            goto set_addresses;
+        }
+        if(opt_fpga_backend && strcmp(opt_fpga_backend, "mmap"))
+            quit(1, "%s: unknown --fpga-backend %s, want mmap or sim", __FUNCTION__, opt_fpga_backend);
+
         fd_mem = open("/dev/mem", O_RDWR);
         if(fd_mem < 0)
         {
@@ -2406,6 +2479,7 @@ void set_pic_iic_flash_addr_pointer(unsigned char chain, unsigned char addr_H, u
         }
         applog(LOG_DEBUG,"mmap fpga_mem_addr = 0x%x\n", fpga_mem_addr);
 
+set_addresses:
         nonce2_jobid_address = fpga_mem_addr;
         job_start_address_1  = fpga_mem_addr + NONCE2_AND_JOBID_STORE_SPACE/sizeof(int);
         job_start_address_2  = fpga_mem_addr + (NONCE2_AND_JOBID_STORE_SPACE + JOB_STORE_SPACE)/sizeof(int);
@@ -2459,6 +2533,12 @@ void set_pic_iic_flash_addr_pointer(unsigned char chain, unsigned char addr_H, u
     {
         int ret = 0;
 
+        if(sim_c5_active)
+        {
+            sim_c5_close();
+            return ret;
+        }
+
         ret = munmap((void *)axi_fpga_addr, TOTAL_LEN);
         if(ret<0)
         {
@@ -2526,7 +2606,8 @@ void set_Hardware_version(unsigned int value)
     int get_fan_speed(unsigned char *fan_id, unsigned int *fan_speed)
     {
         int ret = -1;
-        ret = *((unsigned int *)(axi_fpga_addr + FAN_SPEED));
+        // the FPGA moves to the next fan on every read
+        ret = sim_c5_active ? sim_c5_fan_speed() : *((unsigned int *)(axi_fpga_addr + FAN_SPEED));
         *fan_speed = 0x000000ff & ret;
         *fan_id = (unsigned char)(0x00000007 & (ret >> 8));
         if(*fan_speed > 0)
@@ -2617,6 +2698,11 @@ void set_Hardware_version(unsigned int value)
     int get_return_nonce(unsigned int *buf)
     {
         int ret = -1;
+        if(sim_c5_active)
+        {
+            sim_c5_return_nonce(buf);
+            return buf[1];
+        }
         ret = *((unsigned int *)(axi_fpga_addr + RETURN_NONCE));
         *(buf + 0) = ret;
         ret = *((unsigned int *)(axi_fpga_addr + RETURN_NONCE + 1));
@@ -2636,18 +2722,19 @@ void set_Hardware_version(unsigned int value)
     void set_BC_write_command(unsigned int value)
     {
         char logstr[256];
-        int wait_count=0;
+        cgtimer_t start, now;
         *((unsigned int *)(axi_fpga_addr + BC_WRITE_COMMAND)) = value;
         //applog(LOG_DEBUG,"%s: set BC_WRITE_COMMAND is 0x%x\n", __FUNCTION__, value);
 
         if(value & BC_COMMAND_BUFFER_READY)
         {
+            cgtimer_time(&start);
             while(get_BC_write_command() & BC_COMMAND_BUFFER_READY)
             {
-                cgsleep_ms(1);
-                wait_count++;
+                cgsleep_us(BC_READY_POLL_US);
 
-                if(wait_count>3000)
+                cgtimer_time(&now);
+                if(cgtimer_us_diff(&now, &start) > BC_READY_TIMEOUT_US)
                 {
                     sprintf(logstr,"Error: set_BC_write_command wait buffer ready timeout!\n");
                     writeInitLogFile(logstr);
@@ -2662,6 +2749,141 @@ void set_Hardware_version(unsigned int value)
         }
     }
 
+    /* Batched BC commands. Every command goes through the one FPGA command
+     * buffer, so they can't overlap, but bc_queue_run writes each as soon as the
+     * buffer is free, polling it every BC_READY_POLL_US without the read back and
+     * log of set_BC_command_buffer. Commands to one chain keep their order and
+     * their gap_us spacing, and while a chain waits out its gap the other chains'
+     * commands go in between, so a per chip loop costs the same on 1 chain or 16.
+     */
+    void bc_queue_add(struct bc_queue *q, unsigned char chain, unsigned int *cmd_buf, unsigned int gap_us)
+    {
+        if(q->num == q->size)
+        {
+            q->size = q->size ? q->size * 2 : 64;
+            q->cmds = realloc(q->cmds, q->size * sizeof(struct bc_cmd));
+            if(unlikely(!q->cmds))
+                quit(1, "Failed to realloc bc_queue");
+        }
+        memcpy(q->cmds[q->num].cmd, cmd_buf, sizeof(q->cmds[q->num].cmd));
+        q->cmds[q->num].chain = chain;
+        q->cmds[q->num].gap_us = gap_us;
+        q->num++;
+    }
+
+    void bc_queue_free(struct bc_queue *q)
+    {
+        free(q->cmds);
+        q->cmds = NULL;
+        q->num = q->size = 0;
+    }
+
+    static unsigned int bc_wait_ready(void)
+    {
+        unsigned int ret;
+        cgtimer_t start, now;
+        char logstr[256];
+
+        cgtimer_time(&start);
+        while((ret = *(axi_fpga_addr + BC_WRITE_COMMAND)) & BC_COMMAND_BUFFER_READY)
+        {
+            cgtimer_time(&now);
+            if(cgtimer_us_diff(&now, &start) >= BC_READY_TIMEOUT_US)
+            {
+                sprintf(logstr,"Error: %s wait buffer ready timeout!\n", __FUNCTION__);
+                writeInitLogFile(logstr);
+                break;
+            }
+            cgsleep_us(BC_READY_POLL_US);
+        }
+        return ret;
+    }
+
+    static void bc_issue(struct bc_cmd *cmd)
+    {
+        unsigned int ret;
+
+        ret = bc_wait_ready();
+        *(axi_fpga_addr + BC_COMMAND_BUFFER) = cmd->cmd[0];
+        *(axi_fpga_addr + BC_COMMAND_BUFFER + 1) = cmd->cmd[1];
+        *(axi_fpga_addr + BC_COMMAND_BUFFER + 2) = cmd->cmd[2];
+        *(axi_fpga_addr + BC_WRITE_COMMAND) = BC_COMMAND_BUFFER_READY | BC_COMMAND_EN_CHAIN_ID | (cmd->chain << 16) | (ret & 0xfff0ffff);
+    }
+
+    // a single command, returns once the FPGA has taken it
+    void bc_send(unsigned char chain, unsigned int *cmd_buf)
+    {
+        struct bc_cmd cmd;
+
+        memcpy(cmd.cmd, cmd_buf, sizeof(cmd.cmd));
+        cmd.chain = chain;
+        bc_issue(&cmd);
+        bc_wait_ready();
+    }
+
+    // issue and empty the queue, returns once the FPGA has taken the last command
+    void bc_queue_run(struct bc_queue *q)
+    {
+        int next[BITMAIN_MAX_CHAIN_NUM];            // index of each chain's next command
+        cgtimer_t not_before[BITMAIN_MAX_CHAIN_NUM], now, wake;
+        int i, chain, remaining = q->num;
+        bool issued, waiting;
+        int64_t us;
+
+        for(chain=0; chain<BITMAIN_MAX_CHAIN_NUM; chain++)
+        {
+            next[chain] = q->num;
+            not_before[chain].tv_sec = 0;
+            not_before[chain].tv_nsec = 0;
+        }
+        for(i=q->num-1; i>=0; i--)
+            next[q->cmds[i].chain & 0xf] = i;
+
+        while(remaining)
+        {
+            issued = waiting = false;
+            cgtimer_time(&now);
+            for(chain=0; chain<BITMAIN_MAX_CHAIN_NUM; chain++)
+            {
+                if(next[chain] >= q->num)
+                    continue;
+                if(cgtimer_us_diff(&not_before[chain], &now) > 0)
+                {
+                    if(!waiting || cgtimer_us_diff(&not_before[chain], &wake) < 0)
+                        wake = not_before[chain];
+                    waiting = true;
+                    continue;
+                }
+
+                i = next[chain];
+                bc_issue(&q->cmds[i]);
+                remaining--;
+                issued = true;
+
+                cgtimer_time(&not_before[chain]);
+                not_before[chain].tv_sec += q->cmds[i].gap_us / 1000000;
+                not_before[chain].tv_nsec += (q->cmds[i].gap_us % 1000000) * 1000;
+                if(not_before[chain].tv_nsec >= 1000000000)
+                {
+                    not_before[chain].tv_sec++;
+                    not_before[chain].tv_nsec -= 1000000000;
+                }
+                for(i++; i<q->num && (q->cmds[i].chain & 0xf) != chain; i++)
+                    ;
+                next[chain] = i;
+            }
+            if(!issued && waiting)
+            {
+                cgtimer_time(&now);
+                us = cgtimer_us_diff(&wake, &now);
+                if(us > 0)
+                    cgsleep_us(us);
+            }
+        }
+        bc_wait_ready();
+        q->num = 0;
+    }
+
     int get_ticket_mask(void)
     {
         int ret = -1;
@@ -3105,7 +3327,10 @@ void set_Hardware_version(unsigned int value)
     void set_PWM_according_to_temperature()
     {
         int  pwm_percent = 0, temp_change = 0;
-        temp_highest = dev->temp_top1[PWM_T];
+        struct temp_snapshot ts;
+
+        temp_snapshot_get(&ts);
+        temp_highest = temp_snapshot_stale(&ts) ? 0 : ts.temp_top[PWM_T];
 
 #ifdef DEBUG_218_FAN_FULLSPEED
         if(is218_Temp)
@@ -3146,7 +3371,7 @@ void set_Hardware_version(unsigned int value)
             else
                 pwm_percent = MIN_PWM_PERCENT + (temp_highest -MIN_FAN_TEMP) * PWM_ADJUST_FACTOR;
 
-            if(dev->temp_top1[PWM_T] > MAX_FAN_TEMP)
+            if(ts.temp_top[PWM_T] > MAX_FAN_TEMP)
                 pwm_percent = MAX_PWM_PERCENT;
 
             if(pwm_percent < 0)
@@ -3169,15 +3394,19 @@ void set_Hardware_version(unsigned int value)
     {
         static int fix_fan_steps=0;
         int  pwm_percent = dev->fan_pwm, temp_change = 0;
+        struct temp_snapshot ts;
         char logstr[256];
 
+        temp_snapshot_get(&ts);
 #ifdef TWO_CHIP_TEMP_S9
-        temp_highest = dev->temp_low1[PWM_T];
+        temp_highest = ts.temp_low[PWM_T];
 #else
         if(is218_Temp)
-            temp_highest=dev->temp_top1[TEMP_POS_LOCAL];
-        else temp_highest = dev->temp_top1[PWM_T];
+            temp_highest=ts.temp_top[TEMP_POS_LOCAL];
+        else temp_highest = ts.temp_top[PWM_T];
 #endif
+        if(temp_snapshot_stale(&ts))
+            temp_highest = 0;   // no recent temps, run the fans full speed
 
         temp_change = temp_highest - last_temperature;
 
@@ -3190,7 +3419,7 @@ void set_Hardware_version(unsigned int value)
         }
 #endif
 
-        sprintf(logstr,"set FAN speed according to: temp_highest=%d temp_top1[PWM_T]=%d temp_top1[TEMP_POS_LOCAL]=%d temp_change=%d fix_fan_steps=%d\n",temp_highest,dev->temp_top1[PWM_T],dev->temp_top1[TEMP_POS_LOCAL],temp_change,fix_fan_steps);
+        sprintf(logstr,"set FAN speed according to: temp_highest=%d temp_top1[PWM_T]=%d temp_top1[TEMP_POS_LOCAL]=%d temp_change=%d fix_fan_steps=%d\n",temp_highest,ts.temp_top[PWM_T],ts.temp_top[TEMP_POS_LOCAL],temp_change,fix_fan_steps);
         writeLogFile(logstr);
 
 #ifndef TWO_CHIP_TEMP_S9
@@ -3229,7 +3458,7 @@ void set_Hardware_version(unsigned int value)
         else
 #endif
         {
-            if(temp_highest >= MAX_FAN_TEMP || temp_highest == 0 || dev->temp_top1[PWM_T]>=MAX_FAN_TEMP || dev->temp_top1[TEMP_POS_LOCAL]>=MAX_FAN_PCB_TEMP)//some board temp is very high than others!!!
+            if(temp_highest >= MAX_FAN_TEMP || temp_highest == 0 || ts.temp_top[PWM_T]>=MAX_FAN_TEMP || ts.temp_top[TEMP_POS_LOCAL]>=MAX_FAN_PCB_TEMP)//some board temp is very high than others!!!
             {
                 set_PWM(MAX_PWM_PERCENT);
                 dev->fan_pwm = MAX_PWM_PERCENT;
@@ -3256,7 +3485,7 @@ void set_Hardware_version(unsigned int value)
                     pwm_percent=MAX_PWM_PERCENT;
 
 #ifdef TWO_CHIP_TEMP_S9
-                if(dev->temp_top1[PWM_T] > 110 && pwm_percent<MAX_PWM_PERCENT)
+                if(ts.temp_top[PWM_T] > 110 && pwm_percent<MAX_PWM_PERCENT)
 #else
                 if(temp_highest>=MAX_TEMP_NEED_UP_FANSTEP && pwm_percent<MAX_PWM_PERCENT)
 #endif
@@ -3305,7 +3534,7 @@ void set_Hardware_version(unsigned int value)
                     set_PWM(pwm_percent);
                 }
 #ifdef TWO_CHIP_TEMP_S9
-                else if(dev->temp_top1[PWM_T] > 110 && pwm_percent<MAX_PWM_PERCENT)
+                else if(ts.temp_top[PWM_T] > 110 && pwm_percent<MAX_PWM_PERCENT)
 #else
                 else if(temp_highest>=MAX_TEMP_NEED_UP_FANSTEP && pwm_percent<MAX_PWM_PERCENT)
 #endif
@@ -3352,20 +3581,22 @@ void set_Hardware_version(unsigned int value)
     }
 
 
-    void set_frequency_with_addr_plldatai(int pllindex,unsigned char mode,unsigned char addr, unsigned char chain)
+    // queue the PLL commands of one chip, or of every chip on the chain with mode set
+    void bc_queue_frequency(struct bc_queue *q, int pllindex,unsigned char mode,unsigned char addr, unsigned char chain)
     {
         unsigned char buf[9] = {0,0,0,0,0,0,0,0,0};
         unsigned int cmd_buf[3] = {0,0,0};
-        int i;
-        unsigned int ret, value;
         uint32_t reg_data_pll = 0;
         uint16_t reg_data_pll2 = 0;
         uint32_t reg_data_vil = 0;
-        i = chain;
+
+        if(mode)
+            memset(chip_freq_index[chain], pllindex, BITMAIN_DEFAULT_ASIC_NUM);
+        else if(dev->addrInterval && addr / dev->addrInterval < BITMAIN_DEFAULT_ASIC_NUM)
+            chip_freq_index[chain][addr / dev->addrInterval] = pllindex;
 
         reg_data_vil = freq_pll_1385[pllindex].vilpll;;
 
-        //applog(LOG_DEBUG,"%s: i = %d\n", __FUNCTION__, i);
         if(!opt_multi_version)  // fil mode
         {
             memset(buf,0,sizeof(buf));
@@ -3377,13 +3608,7 @@ void set_Hardware_version(unsigned int value)
             buf[3] = (reg_data_pll >> 0) & 0xff;
             buf[3] |= CRC5(buf, 4*8 - 5);
             cmd_buf[0] = buf[0]<<24 | buf[1]<<16 | buf[2]<<8 | buf[3];
-
-            set_BC_command_buffer(cmd_buf);
-            ret = get_BC_write_command();
-            value = BC_COMMAND_BUFFER_READY | BC_COMMAND_EN_CHAIN_ID| (i << 16) | (ret & 0xfff0ffff);
-            set_BC_write_command(value);
-
-            cgsleep_us(3000);
+            bc_queue_add(q, chain, cmd_buf, 3000);
 
             memset(buf,0,sizeof(buf));
             memset(cmd_buf,0,sizeof(cmd_buf));
@@ -3394,13 +3619,7 @@ void set_Hardware_version(unsigned int value)
             buf[3] = reg_data_pll2& 0x0ff;
             buf[3] |= CRC5(buf, 4*8 - 5);
             cmd_buf[0] = buf[0]<<24 | buf[1]<<16 | buf[2]<<8 | buf[3];
-
-            set_BC_command_buffer(cmd_buf);
-            ret = get_BC_write_command();
-            value = BC_COMMAND_BUFFER_READY | BC_COMMAND_EN_CHAIN_ID| (i << 16) | (ret & 0xfff0ffff);
-            set_BC_write_command(value);
-
-            cgsleep_us(5000);
+            bc_queue_add(q, chain, cmd_buf, 5000);
         }
         else    // vil
         {
@@ -3427,20 +3646,18 @@ void set_Hardware_version(unsigned int value)
             cmd_buf[0] = buf[0]<<24 | buf[1]<<16 | buf[2]<<8 | buf[3];
             cmd_buf[1] = buf[4]<<24 | buf[5]<<16 | buf[6]<<8 | buf[7];;
             cmd_buf[2] = buf[8]<<24;
+            bc_queue_add(q, chain, cmd_buf, 10000);
+        }
+    }
 
-            while (1)
-            {
-                ret = get_BC_write_command();
-                if ((ret & 0x80000000) == 0)
-                    break;
-                cgsleep_us(500);
-            }
-            set_BC_command_buffer(cmd_buf);
-            value = BC_COMMAND_BUFFER_READY | BC_COMMAND_EN_CHAIN_ID| (i << 16) | (ret & 0xfff0ffff);
-            set_BC_write_command(value);
+    void set_frequency_with_addr_plldatai(int pllindex,unsigned char mode,unsigned char addr, unsigned char chain)
+    {
+        struct bc_queue q = {0};
 
-            cgsleep_us(10000);
-        }
+        bc_queue_frequency(&q, pllindex, mode, addr, chain);
+        bc_queue_run(&q);
+        bc_queue_free(&q);
+        cgsleep_us(opt_multi_version ? 10000 : 5000);     // the gap after the last command
     }
 
     /* always return _some_ valid index */
@@ -3976,6 +4193,7 @@ void set_Hardware_version(unsigned int value)
 	unsigned short int orig_frequency = frequency;
         int default_freq_index=get_pll_index(orig_frequency);
         char logstr[256];
+        struct bc_queue q = {0};
 
         applog(LOG_DEBUG,"\n--- %s\n", __FUNCTION__);
 
@@ -4478,9 +4696,9 @@ void set_Hardware_version(unsigned int value)
 
                         if(isFixedFreqMode())   // when use fixed freq, we add more 1 step on freq index
                             //set_frequency_with_addr_plldatai(chain_pic_buf[new_T9_PLUS_chainIndex][7+new_T9_PLUS_chainOffset*31+4+j]+1, 0, j * dev->addrInterval, i);
-                            set_frequency_with_addr_plldatai(chain_pic_buf[new_T9_PLUS_chainIndex][7+new_T9_PLUS_chainOffset*31+4+j], 0, j * dev->addrInterval, i);
+                            bc_queue_frequency(&q, chain_pic_buf[new_T9_PLUS_chainIndex][7+new_T9_PLUS_chainOffset*31+4+j], 0, j * dev->addrInterval, i);
                         else
-                            set_frequency_with_addr_plldatai(chain_pic_buf[new_T9_PLUS_chainIndex][7+new_T9_PLUS_chainOffset*31+4+j], 0, j * dev->addrInterval, i);
+                            bc_queue_frequency(&q, chain_pic_buf[new_T9_PLUS_chainIndex][7+new_T9_PLUS_chainOffset*31+4+j], 0, j * dev->addrInterval, i);
 
                         sprintf(logstr,"Asic[%2d]:%s ",j,freq_pll_1385[chain_pic_buf[new_T9_PLUS_chainIndex][7+new_T9_PLUS_chainOffset*31+4+j]].freq);
                         writeInitLogFile(logstr);
@@ -4524,9 +4742,9 @@ void set_Hardware_version(unsigned int value)
 
                         if(isFixedFreqMode())   // when use fixed freq, we add more 1 step on freq index
                             //set_frequency_with_addr_plldatai(chain_pic_buf[((i/3)*3)][7+(i%3)*31+4+j]+1, 0, j * dev->addrInterval, i);
-                            set_frequency_with_addr_plldatai(chain_pic_buf[((i/3)*3)][7+(i%3)*31+4+j], 0, j * dev->addrInterval, i);
+                            bc_queue_frequency(&q, chain_pic_buf[((i/3)*3)][7+(i%3)*31+4+j], 0, j * dev->addrInterval, i);
                         else
-                            set_frequency_with_addr_plldatai(chain_pic_buf[((i/3)*3)][7+(i%3)*31+4+j], 0, j * dev->addrInterval, i);
+                            bc_queue_frequency(&q, chain_pic_buf[((i/3)*3)][7+(i%3)*31+4+j], 0, j * dev->addrInterval, i);
 
                         sprintf(logstr,"Asic[%2d]:%s ",j,freq_pll_1385[chain_pic_buf[((i/3)*3)][7+(i%3)*31+4+j]].freq);
                         writeInitLogFile(logstr);
@@ -4581,9 +4799,9 @@ void set_Hardware_version(unsigned int value)
 
                     if(isFixedFreqMode())   // when use fixed freq, we add more 1 step on freq index
                         //set_frequency_with_addr_plldatai(last_freq[i][j*2+3]+1,0, j * dev->addrInterval,i);
-                        set_frequency_with_addr_plldatai(last_freq[i][j*2+3],0, j * dev->addrInterval,i);
+                        bc_queue_frequency(&q, last_freq[i][j*2+3],0, j * dev->addrInterval,i);
                     else
-                        set_frequency_with_addr_plldatai(last_freq[i][j*2+3],0, j * dev->addrInterval,i);
+                        bc_queue_frequency(&q, last_freq[i][j*2+3],0, j * dev->addrInterval,i);
 
                     sprintf(logstr,"Asic[%2d]:%s ",j,freq_pll_1385[last_freq[i][j*2+3]].freq);
                     writeInitLogFile(logstr);
@@ -4605,6 +4823,10 @@ void set_Hardware_version(unsigned int value)
                 writeInitLogFile(logstr);
             }
         }
+        // the chips of all chains, each chain's PLL gaps overlap with the others
+        bc_queue_run(&q);
+        bc_queue_free(&q);
+        cgsleep_us(opt_multi_version ? 10000 : 5000);
 
         value = atoi(freq_pll_1385[max_freq_index].freq);
         dev->frequency = value;
@@ -4722,25 +4944,143 @@ void set_Hardware_version(unsigned int value)
     }
 
 
+    // producer side: returns the slot to fill, or NULL (and counts an overflow) if the ring is full
+    static inline struct nonce_content *nonce_ring_reserve(struct nonce_ring *ring)
+    {
+        unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+        if(ring->head - tail >= NONCE_RING_SIZE)
+        {
+            ring->overflow++;
+            return NULL;
+        }
+        return &ring->nonce_buffer[ring->head & NONCE_RING_MASK];
+    }
+
+    // producer side: publish the slot returned by nonce_ring_reserve
+    static inline void nonce_ring_commit(struct nonce_ring *ring)
+    {
+        __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    }
+
+    // consumer side: returns the oldest nonce, or NULL if the ring is empty
+    static inline struct nonce_content *nonce_ring_peek(struct nonce_ring *ring)
+    {
+        unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+        if(__atomic_exchange_n(&ring->flush, 0, __ATOMIC_ACQ_REL))
+        {
+            __atomic_add_fetch(&ring->flushed, head - ring->tail, __ATOMIC_RELAXED);
+            __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+        }
+
+        if(ring->tail == head)
+            return NULL;
+        return &ring->nonce_buffer[ring->tail & NONCE_RING_MASK];
+    }
+
+    // consumer side: hand the slot returned by nonce_ring_peek back to the producer
+    static inline void nonce_ring_release(struct nonce_ring *ring)
+    {
+        __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+    }
+
     void clear_nonce_fifo()
     {
-        unsigned int buf[2] = {0};
+        int i;
+
+        // the tail belongs to the consumer, so only ask it to drop what is queued
+        for(i=0; i<opt_nonce_verify_threads; i++)
+            __atomic_store_n(&nonce_workers[i].ring.flush, 1, __ATOMIC_RELEASE);
+    }
+
+    void get_nonce_path_stats(struct nonce_path_stats *stats)
+    {
+        struct nonce_worker *worker;
+        int i, j;
+
+        memset(stats, 0, sizeof(*stats));
+        stats->reading = gBegin_get_nonce;
+        stats->read = __atomic_load_n(&nonce_read_count, __ATOMIC_RELAXED);
+        stats->stale = __atomic_load_n(&job_template_stale, __ATOMIC_RELAXED);
+        for(i=0; i<opt_nonce_verify_threads; i++)
+        {
+            worker = &nonce_workers[i];
+            stats->ring_overflow += __atomic_load_n(&worker->ring.overflow, __ATOMIC_RELAXED);
+            stats->flushed += __atomic_load_n(&worker->ring.flushed, __ATOMIC_RELAXED);
+            stats->queued += __atomic_load_n(&worker->ring.head, __ATOMIC_RELAXED) - __atomic_load_n(&worker->ring.tail, __ATOMIC_RELAXED);
+            stats->valid += __atomic_load_n(&worker->valid, __ATOMIC_RELAXED);
+            for(j=0; j<BITMAIN_MAX_CHAIN_NUM; j++)
+                stats->hw += __atomic_load_n(&worker->chain_hw[j], __ATOMIC_RELAXED);
+            cg_hist_merge(&stats->drain_hist, &worker->drain_hist);
+            cg_hist_merge(&stats->verify_hist, &worker->verify_hist);
+        }
+    }
+
+    void reg_queue_init()
+    {
+        pthread_condattr_t attr;
+        int i;
+
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        for(i=0; i<BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            pthread_mutex_init(&reg_queue[i].lock, NULL);
+            pthread_cond_init(&reg_queue[i].cond, &attr);
+            reg_queue[i].p_wr = 0;
+            reg_queue[i].p_rd = 0;
+            reg_queue[i].received = 0;
+        }
+        pthread_condattr_destroy(&attr);
+    }
+
+    // drop the replies a chain has sent so far
+    void reg_queue_flush(int chain)
+    {
+        struct reg_queue *q = &reg_queue[chain];
 
-        pthread_mutex_lock(&nonce_mutex);
-        nonce_read_out.p_wr = 0;
-        nonce_read_out.p_rd = 0;
-        nonce_read_out.nonce_num = 0;
-        pthread_mutex_unlock(&nonce_mutex);
+        pthread_mutex_lock(&q->lock);
+        q->p_rd = q->p_wr;
+        q->received = 0;
+        pthread_mutex_unlock(&q->lock);
     }
 
     void clear_register_value_buf()
     {
-        pthread_mutex_lock(&reg_mutex);
-        reg_value_buf.p_wr = 0;
-        reg_value_buf.p_rd = 0;
-        reg_value_buf.reg_value_num = 0;
-        //memset(reg_value_buf.reg_buffer, 0, sizeof(struct reg_content)*MAX_NONCE_NUMBER_IN_FIFO);
-        pthread_mutex_unlock(&reg_mutex);
+        int i;
+
+        for(i=0; i<BITMAIN_MAX_CHAIN_NUM; i++)
+            reg_queue_flush(i);
+    }
+
+    // take the next reply of a chain, waiting up to timeout_ms for it. false if none came
+    static bool reg_queue_get(int chain, struct reg_content *reply, int timeout_ms)
+    {
+        struct reg_queue *q = &reg_queue[chain];
+        struct timespec deadline;
+        bool got;
+
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+        if(deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        pthread_mutex_lock(&q->lock);
+        while(q->p_wr == q->p_rd)
+        {
+            if(pthread_cond_timedwait(&q->cond, &q->lock, &deadline) == ETIMEDOUT)
+                break;
+        }
+        got = q->p_wr != q->p_rd;
+        if(got)
+            *reply = q->reg_buffer[q->p_rd++ % REG_QUEUE_SIZE];
+        pthread_mutex_unlock(&q->lock);
+        return got;
     }
 
     void read_asic_register(unsigned char chain, unsigned char mode, unsigned char chip_addr, unsigned char reg_addr)
@@ -4946,246 +5286,173 @@ void set_Hardware_version(unsigned int value)
         }
     }
 
-    bool check_asic_reg(unsigned int reg)
+    // replies that came to a chain's queue since its last flush
+    static unsigned int reg_queue_received(int chain)
     {
-        int i, j, not_reg_data_time=0;
-        int nonce_number = 0;
-        unsigned int buf[2] = {0};
-        unsigned int reg_value_num=0;
-        unsigned int temp_nonce = 0;
+        return __atomic_load_n(&reg_queue[chain].received, __ATOMIC_RELAXED);
+    }
+
+    /* Read reg from every asic of the chains in chain_mask. All chains are
+     * asked at once, and each chain is done as soon as all its asics answered,
+     * or when none did for REG_REPLY_TIMEOUT_MS. False if a chain sent more than
+     * REG_RUNAWAY_REPLIES replies to the read, it is looping.
+     */
+    static bool check_asic_reg_chains(unsigned int reg, unsigned int chain_mask)
+    {
+        struct reg_content reply;
         unsigned char reg_buf[5] = {0,0,0,0,0};
-        int read_num = 0;
-        uint64_t tmp_rate = 0;
-        int reg_processed_counter=0;
+        int i, expected, read_num;
+        bool ok = true;
+        uint64_t tmp_rate;
         char logstr[256];
 
-    rerun_all:
-        clear_register_value_buf();
-        tmp_rate = 0;
         for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
         {
-            reg_processed_counter=0;
-            read_num = 0;
-            if(dev->chain_exist[i] == 1
-#ifdef DEBUG_XILINX_NONCE_NOTENOUGH
-               && i!=DISABLE_REG_CHAIN_INDEX
-#endif
-              )
+            if(chain_mask & (1 << i))
             {
-                tmp_rate = 0;
+                reg_queue_flush(i);
+                if (reg ==CHIP_ADDRESS)
+                    dev->chain_asic_num[i] = 0;
+                read_asic_register(i, 1, 0, reg);
+            }
+        }
 
-                //  sprintf(logstr,"do read_asic_register on Chain[%d]...\n",i);
-                //  writeLogFile(logstr);
+        for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            if(!(chain_mask & (1 << i)))
+                continue;
 
-                read_asic_register(i, 1, 0, reg);
+            tmp_rate = 0;
+            read_num = 0;
+            expected = reg == CHIP_ADDRESS ? CHAIN_ASIC_NUM : dev->chain_asic_num[i];
 
-                //  sprintf(logstr,"Done read_asic_register on Chain[%d]\n",i);
-                //  writeLogFile(logstr);
+            if(reg == 0x08)
+            {
+                sprintf(logstr,"\nget RT hashrate from Chain[%d]: (asic index start from 1-%d)\n",i,CHAIN_ASIC_NUM);
+                writeLogFile(logstr);
+            }
 
-                if (reg ==CHIP_ADDRESS)
-                    dev->chain_asic_num[i] = 0;
+            while(read_num < expected && reg_queue_received(i) <= REG_RUNAWAY_REPLIES && reg_queue_get(i, &reply, REG_REPLY_TIMEOUT_MS))
+            {
+                reg_buf[3] = (unsigned char)(reply.reg_value & 0xff);
+                reg_buf[2] = (unsigned char)((reply.reg_value >> 8) & 0xff);
+                reg_buf[1] = (unsigned char)((reply.reg_value >> 16)& 0xff);
+                reg_buf[0] = (unsigned char)((reply.reg_value >> 24)& 0xff);
 
-                if(reg == 0x08)
+#ifdef ENABLE_REGISTER_CRC_CHECK
+                if(CRC5(reg_buf, (REGISTER_DATA_LENGTH+3)*8-5) != reply.crc)
                 {
-                    sprintf(logstr,"\nget RT hashrate from Chain[%d]: (asic index start from 1-%d)\n",i,CHAIN_ASIC_NUM);
-                    writeLogFile(logstr);
+                    sprintf(logstr,"%s: crc is 0x%x, but it should be 0x%x\n", __FUNCTION__, CRC5(reg_buf, (REGISTER_DATA_LENGTH+1)*8-5), reply.crc);
+                    writeInitLogFile(logstr);
+                    continue;
+                }
+#endif
+                read_num++;
+
+                if(reg == CHIP_ADDRESS)
+                {
+                    dev->chain_asic_num[i]++;
+                }
+
+                if(reg == PLL_PARAMETER)
+                {
+                    sprintf(logstr,"chain[%d]: the asic freq is 0x%x\n", i, reply.reg_value);
+                    writeInitLogFile(logstr);
                 }
 
-                while(not_reg_data_time < 3)    //if there is no register value for 3 times, we can think all asic return their address
+                if(reg == TICKET_MASK)
                 {
-                    cgsleep_ms(300);
+                    sprintf(logstr,"chain[%d]: the asic TICKET_MASK is 0x%x\n", i, reply.reg_value);
+                    writeInitLogFile(logstr);
+                }
 
-                    pthread_mutex_lock(&reg_mutex);
-                    reg_value_num = reg_value_buf.reg_value_num;
+                if(reg == 0x08 && read_num<=CHAIN_ASIC_NUM)
+                {
+                    int ii;
+                    char displayed_rate_asic[32];
+                    uint64_t temp_hash_rate = 0;
+                    uint8_t rate_buf[10];
 
-                    if((reg_value_num >= MAX_NONCE_NUMBER_IN_FIFO || reg_value_buf.p_rd >= MAX_NONCE_NUMBER_IN_FIFO) && not_reg_data_time <3)
-                    {
-                        not_reg_data_time ++;
-                        pthread_mutex_unlock(&reg_mutex);
-                        goto rerun_all;
-                    }
-                    if(not_reg_data_time == 3)
+                    for(ii = 0; ii < 4; ii++)
                     {
-                        pthread_mutex_unlock(&reg_mutex);
-                        return true;
+                        sprintf(rate_buf + 2*ii,"%02x",reg_buf[ii]);
                     }
 
-                    if(reg_value_num > 0)
-                    {
-                        reg_processed_counter+=reg_value_num;
+                    temp_hash_rate = strtol(rate_buf,NULL,16);
+                    temp_hash_rate = (temp_hash_rate << 24);
+                    tmp_rate += temp_hash_rate;
 
-                        if(reg_processed_counter>600)
-                        {
-                            //  sprintf(logstr,"read asic reg Error on Chain[%d]\n",i);
-                            //  writeInitLogFile(logstr);
+                    suffix_string_c5(temp_hash_rate, displayed_rate_asic, sizeof(displayed_rate_asic), 6,false);
+                    sprintf(logstr,"Asic[%02d]=%s ",read_num,displayed_rate_asic);
+                    writeLogFile(logstr);
 
-                            pthread_mutex_unlock(&reg_mutex);
-                            return false;
-                        }
+                    chain_asic_RT[i][read_num-1]=atof(displayed_rate_asic);
 
-                        //  sprintf(logstr,"process reg_value_num=%d on Chain[%d]\n",reg_value_num,i);
-                        //  writeLogFile(logstr);
+                    if(read_num%8 == 0 || read_num==CHAIN_ASIC_NUM)
+                    {
+                        sprintf(logstr,"\n");
+                        writeLogFile(logstr);
+                    }
+                }
+            }
 
-                        not_reg_data_time = 0;
+            if(reg == CHIP_ADDRESS)
+            {
+                if(dev->chain_asic_num[i] > dev->max_asic_num_in_one_chain)
+                {
+                    dev->max_asic_num_in_one_chain = dev->chain_asic_num[i];
+                }
+            }
 
-                        for(j = 0; j < reg_value_num; j++)
-                        {
-                            if(reg_value_buf.reg_buffer[reg_value_buf.p_rd].chain_number != i)
-                            {
-                                //  sprintf(logstr,"read asic reg Error: wrong chain number=%d on Chain[%d]\n",i);
-                                //  writeInitLogFile(logstr);
+            if(reg == 0x08)
+            {
+                if(read_num == dev->chain_asic_num[i])
+                {
+                    rate[i] = tmp_rate;
+                    suffix_string_c5(rate[i], (char * )displayed_rate[i], sizeof(displayed_rate[i]), 6,false);
+                    rate_error[i] = 0;
+                }
 
-                                reg_value_buf.p_rd++;
-                                reg_value_buf.reg_value_num--;
-                                if(reg_value_buf.p_rd >= MAX_NONCE_NUMBER_IN_FIFO)
-                                {
-                                    reg_value_buf.p_rd = 0;
-                                }
+                if(read_num == 0 || status_error )
+                {
+                    rate_error[i]++;
+                    if(rate_error[i] > 3 || status_error)
+                    {
+                        rate[i] = 0;
+                        suffix_string_c5(rate[i], (char * )displayed_rate[i], sizeof(displayed_rate[i]), 6,false);
+                    }
+                }
+            }
+        }
 
-                                continue;
-                            }
+        // by now every chain has had the whole read to flood its queue
+        for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            if((chain_mask & (1 << i)) && reg_queue_received(i) > REG_RUNAWAY_REPLIES)
+            {
+                sprintf(logstr,"read asic reg Error on Chain[%d]: %u replies\n", i, reg_queue_received(i));
+                writeInitLogFile(logstr);
+                ok = false;
+            }
+        }
+        return ok;
+    }
 
-                            reg_buf[3] = (unsigned char)(reg_value_buf.reg_buffer[reg_value_buf.p_rd].reg_value & 0xff);
-                            reg_buf[2] = (unsigned char)((reg_value_buf.reg_buffer[reg_value_buf.p_rd].reg_value >> 8) & 0xff);
-                            reg_buf[1] = (unsigned char)((reg_value_buf.reg_buffer[reg_value_buf.p_rd].reg_value >> 16)& 0xff);
-                            reg_buf[0] = (unsigned char)((reg_value_buf.reg_buffer[reg_value_buf.p_rd].reg_value >> 24)& 0xff);
+    bool check_asic_reg(unsigned int reg)
+    {
+        unsigned int chain_mask = 0;
+        int i;
 
-#ifdef ENABLE_REGISTER_CRC_CHECK
-                            if(CRC5(reg_buf, (REGISTER_DATA_LENGTH+3)*8-5) != reg_value_buf.reg_buffer[reg_value_buf.p_rd].crc)
-                            {
-                                sprintf(logstr,"%s: crc is 0x%x, but it should be 0x%x\n", __FUNCTION__, CRC5(reg_buf, (REGISTER_DATA_LENGTH+1)*8-5), reg_value_buf.reg_buffer[reg_value_buf.p_rd].crc);
-                                writeInitLogFile(logstr);
-
-                                reg_value_buf.p_rd++;
-                                reg_value_buf.reg_value_num--;
-                                if(reg_value_buf.p_rd >= MAX_NONCE_NUMBER_IN_FIFO)
-                                {
-                                    reg_value_buf.p_rd = 0;
-                                }
-
-                                continue;
-                            }
+        for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            if(dev->chain_exist[i] == 1
+#ifdef DEBUG_XILINX_NONCE_NOTENOUGH
+               && i!=DISABLE_REG_CHAIN_INDEX
 #endif
-                            reg_value_buf.p_rd++;
-                            reg_value_buf.reg_value_num--;
-                            if(reg_value_buf.p_rd >= MAX_NONCE_NUMBER_IN_FIFO)
-                            {
-                                reg_value_buf.p_rd = 0;
-                            }
-
-                            if(reg == CHIP_ADDRESS)
-                            {
-                                dev->chain_asic_num[i]++;
-                            }
-
-                            if(reg == PLL_PARAMETER)
-                            {
-                                sprintf(logstr,"chain[%d]: the asic freq is 0x%x\n", i, reg_value_buf.reg_buffer[reg_value_buf.p_rd].reg_value);
-                                writeInitLogFile(logstr);
-                            }
-
-                            if(reg == TICKET_MASK)
-                            {
-                                sprintf(logstr,"chain[%d]: the asic TICKET_MASK is 0x%x\n", i, reg_value_buf.reg_buffer[reg_value_buf.p_rd].reg_value);
-                                writeInitLogFile(logstr);
-                            }
-
-                            if(reg == 0x08)
-                            {
-                                int ii;
-                                char displayed_rate_asic[32];
-                                uint64_t temp_hash_rate = 0;
-                                uint8_t rate_buf[10];
-                                uint8_t displayed_rate[16];
-
-                                read_num ++;
-                                if(read_num<=CHAIN_ASIC_NUM)
-                                {
-                                    for(ii = 0; ii < 4; ii++)
-                                    {
-                                        sprintf(rate_buf + 2*ii,"%02x",reg_buf[ii]);
-                                    }
-
-                                    //    sprintf(logstr,"%s: hashrate is %s\n", __FUNCTION__, rate_buf);
-                                    //  writeInitLogFile(logstr);
-
-                                    temp_hash_rate = strtol(rate_buf,NULL,16);
-                                    temp_hash_rate = (temp_hash_rate << 24);
-                                    tmp_rate += temp_hash_rate;
-
-                                    suffix_string_c5(temp_hash_rate, displayed_rate_asic, sizeof(displayed_rate_asic), 6,false);
-                                    sprintf(logstr,"Asic[%02d]=%s ",read_num,displayed_rate_asic);
-                                    writeLogFile(logstr);
-
-                                    chain_asic_RT[i][read_num-1]=atof(displayed_rate_asic);
-
-                                    if(read_num%8 == 0 || read_num==CHAIN_ASIC_NUM)
-                                    {
-                                        sprintf(logstr,"\n");
-                                        writeLogFile(logstr);
-                                    }
-                                }
-                            }
-                        }
-
-                        if(reg == CHIP_ADDRESS)
-                        {
-                            if (dev->chain_asic_num[i] == CHAIN_ASIC_NUM)
-                            {
-                                pthread_mutex_unlock(&reg_mutex);
-                                break;
-                            }
-                        }
-
-                        //  sprintf(logstr,"Done reg_value_num=%d on Chain[%d]\n",reg_value_num,i);
-                        //  writeLogFile(logstr);
-                    }
-                    else
-                    {
-                        cgsleep_ms(100);
-                        not_reg_data_time++;
-
-                        //  sprintf(logstr,"not_reg_data_time=%d on Chain[%d]\n",not_reg_data_time,i);
-                        //  writeLogFile(logstr);
-                    }
-
-                    pthread_mutex_unlock(&reg_mutex);
-                }
-
-                not_reg_data_time = 0;
-
-                if(reg == CHIP_ADDRESS)
-                {
-                    if(dev->chain_asic_num[i] > dev->max_asic_num_in_one_chain)
-                    {
-                        dev->max_asic_num_in_one_chain = dev->chain_asic_num[i];
-                    }
-                }
-                if(read_num == dev->chain_asic_num[i])
-                {
-                    rate[i] = tmp_rate;
-                    suffix_string_c5(rate[i], (char * )displayed_rate[i], sizeof(displayed_rate[i]), 6,false);
-                    rate_error[i] = 0;
-
-                    //    sprintf(logstr,"%s: chain %d hashrate is %s\n", __FUNCTION__, i, displayed_rate[i]);
-                    //  writeInitLogFile(logstr);
-                }
-
-                if(read_num == 0 || status_error )
-                {
-                    rate_error[i]++;
-                    if(rate_error[i] > 3 || status_error)
-                    {
-                        rate[i] = 0;
-                        suffix_string_c5(rate[i], (char * )displayed_rate[i], sizeof(displayed_rate[i]), 6,false);
-                    }
-                }
-                //set_nonce_fifo_interrupt(get_nonce_fifo_interrupt() & ~(FLUSH_NONCE3_FIFO));
-                clear_register_value_buf();
-            }
+              )
+                chain_mask |= 1 << i;
         }
-
-        return true;
+        return check_asic_reg_chains(reg, chain_mask);
     }
 
     void reset_one_hashboard(int chainIndex)
@@ -5200,267 +5467,30 @@ void set_Hardware_version(unsigned int value)
 
     bool check_asic_reg_oneChain(int chainIndex, unsigned int reg)
     {
-
-        int i, j, not_reg_data_time=0;
-        int nonce_number = 0;
-        unsigned int buf[2] = {0};
-        unsigned int reg_value_num=0;
-        unsigned int temp_nonce = 0;
-        unsigned char reg_buf[5] = {0,0,0,0,0};
-        int read_num = 0;
-        uint64_t tmp_rate = 0;
-        int reg_processed_counter=0;
-        char logstr[256];
-
-    rerun_all:
-        clear_register_value_buf();
-        tmp_rate = 0;
-        //for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
-        i=chainIndex;
-        {
-            reg_processed_counter=0;
-            read_num = 0;
-            if(dev->chain_exist[i] == 1)
-            {
-                tmp_rate = 0;
-
-                //  sprintf(logstr,"do read_asic_register on Chain[%d]...\n",i);
-                //  writeLogFile(logstr);
-
-                read_asic_register(i, 1, 0, reg);
-
-                //  sprintf(logstr,"Done read_asic_register on Chain[%d]\n",i);
-                //  writeLogFile(logstr);
-
-                if (reg ==CHIP_ADDRESS)
-                    dev->chain_asic_num[i] = 0;
-
-                while(not_reg_data_time < 3)    //if there is no register value for 3 times, we can think all asic return their address
-                {
-                    cgsleep_ms(300);
-
-                    pthread_mutex_lock(&reg_mutex);
-                    reg_value_num = reg_value_buf.reg_value_num;
-
-                    if((reg_value_num >= MAX_NONCE_NUMBER_IN_FIFO || reg_value_buf.p_rd >= MAX_NONCE_NUMBER_IN_FIFO) && not_reg_data_time <3)
-                    {
-                        not_reg_data_time ++;
-                        pthread_mutex_unlock(&reg_mutex);
-                        goto rerun_all;
-                    }
-                    if(not_reg_data_time == 3)
-                    {
-                        pthread_mutex_unlock(&reg_mutex);
-                        return true;
-                    }
-
-                    if(reg_value_num > 0)
-                    {
-                        reg_processed_counter+=reg_value_num;
-
-                        if(reg_processed_counter>600)
-                        {
-                            //  sprintf(logstr,"read asic reg Error on Chain[%d]\n",i);
-                            //  writeInitLogFile(logstr);
-                            pthread_mutex_unlock(&reg_mutex);
-                            return false;
-                        }
-
-                        //  sprintf(logstr,"process reg_value_num=%d on Chain[%d]\n",reg_value_num,i);
-                        //  writeLogFile(logstr);
-
-                        not_reg_data_time = 0;
-
-                        for(j = 0; j < reg_value_num; j++)
-                        {
-                            if(reg_value_buf.reg_buffer[reg_value_buf.p_rd].chain_number != i)
-                            {
-                                reg_value_buf.p_rd++;
-                                reg_value_buf.reg_value_num--;
-                                if(reg_value_buf.p_rd >= MAX_NONCE_NUMBER_IN_FIFO)
-                                {
-                                    reg_value_buf.p_rd = 0;
-                                }
-
-                                continue;
-                            }
-
-                            reg_buf[3] = (unsigned char)(reg_value_buf.reg_buffer[reg_value_buf.p_rd].reg_value & 0xff);
-                            reg_buf[2] = (unsigned char)((reg_value_buf.reg_buffer[reg_value_buf.p_rd].reg_value >> 8) & 0xff);
-                            reg_buf[1] = (unsigned char)((reg_value_buf.reg_buffer[reg_value_buf.p_rd].reg_value >> 16)& 0xff);
-                            reg_buf[0] = (unsigned char)((reg_value_buf.reg_buffer[reg_value_buf.p_rd].reg_value >> 24)& 0xff);
-
-#ifdef ENABLE_REGISTER_CRC_CHECK
-                            if(CRC5(reg_buf, (REGISTER_DATA_LENGTH+3)*8-5) != reg_value_buf.reg_buffer[reg_value_buf.p_rd].crc)
-                            {
-                                sprintf(logstr,"%s: crc is 0x%x, but it should be 0x%x\n", __FUNCTION__, CRC5(reg_buf, (REGISTER_DATA_LENGTH+1)*8-5), reg_value_buf.reg_buffer[reg_value_buf.p_rd].crc);
-                                writeInitLogFile(logstr);
-
-                                reg_value_buf.p_rd++;
-                                reg_value_buf.reg_value_num--;
-                                if(reg_value_buf.p_rd >= MAX_NONCE_NUMBER_IN_FIFO)
-                                {
-                                    reg_value_buf.p_rd = 0;
-                                }
-
-                                continue;
-                            }
-#endif
-                            reg_value_buf.p_rd++;
-                            reg_value_buf.reg_value_num--;
-                            if(reg_value_buf.p_rd >= MAX_NONCE_NUMBER_IN_FIFO)
-                            {
-                                reg_value_buf.p_rd = 0;
-                            }
-
-                            if(reg == CHIP_ADDRESS)
-                            {
-                                dev->chain_asic_num[i]++;
-                            }
-
-                            if(reg == PLL_PARAMETER)
-                            {
-                                applog(LOG_DEBUG,"%s: the asic freq is 0x%x\n", __FUNCTION__, reg_value_buf.reg_buffer[reg_value_buf.p_rd].reg_value);
-                            }
-
-                            if(reg == 0x08)
-                            {
-                                int i;
-                                uint64_t temp_hash_rate = 0;
-                                uint8_t rate_buf[10];
-                                uint8_t displayed_rate[16];
-                                for(i = 0; i < 4; i++)
-                                {
-                                    sprintf(rate_buf + 2*i,"%02x",reg_buf[i]);
-                                }
-                                applog(LOG_DEBUG,"%s: hashrate is %s\n", __FUNCTION__, rate_buf);
-                                temp_hash_rate = strtol(rate_buf,NULL,16);
-                                temp_hash_rate = (temp_hash_rate << 24);
-                                tmp_rate += temp_hash_rate;
-                                read_num ++;
-                            }
-                        }
-
-                        if(reg == CHIP_ADDRESS)
-                        {
-                            if (dev->chain_asic_num[i] == CHAIN_ASIC_NUM)
-                            {
-                                pthread_mutex_unlock(&reg_mutex);
-                                break;
-                            }
-                        }
-
-                        //  sprintf(logstr,"Done reg_value_num=%d on Chain[%d]\n",reg_value_num,i);
-                        //  writeLogFile(logstr);
-                    }
-                    else
-                    {
-                        cgsleep_ms(100);
-                        not_reg_data_time++;
-
-                        //  sprintf(logstr,"not_reg_data_time=%d on Chain[%d]\n",not_reg_data_time,i);
-                        //  writeLogFile(logstr);
-                    }
-
-                    pthread_mutex_unlock(&reg_mutex);
-                }
-
-                not_reg_data_time = 0;
-
-                if(reg == CHIP_ADDRESS)
-                {
-                    if(dev->chain_asic_num[i] > dev->max_asic_num_in_one_chain)
-                    {
-                        dev->max_asic_num_in_one_chain = dev->chain_asic_num[i];
-                    }
-                }
-                if(read_num == dev->chain_asic_num[i])
-                {
-                    rate[i] = tmp_rate;
-                    suffix_string_c5(rate[i], (char * )displayed_rate[i], sizeof(displayed_rate[i]), 6,false);
-                    rate_error[i] = 0;
-                    applog(LOG_DEBUG,"%s: chain %d hashrate is %s\n", __FUNCTION__, i, displayed_rate[i]);
-                }
-                if(read_num == 0 || status_error )
-                {
-                    rate_error[i]++;
-                    if(rate_error[i] > 3 || status_error)
-                    {
-                        rate[i] = 0;
-                        suffix_string_c5(rate[i], (char * )displayed_rate[i], sizeof(displayed_rate[i]), 6,false);
-                    }
-                }
-                //set_nonce_fifo_interrupt(get_nonce_fifo_interrupt() & ~(FLUSH_NONCE3_FIFO));
-                clear_register_value_buf();
-            }
-        }
-
-        return true;
+        if(dev->chain_exist[chainIndex] != 1)
+            return true;
+        return check_asic_reg_chains(reg, 1 << chainIndex);
     }
 
 
 #define RETRY_NUM 5
     unsigned int check_asic_reg_with_addr(unsigned int reg,unsigned int chip_addr,unsigned int chain, int check_num)
     {
-        int i, j, not_reg_data_time=0;
-        int nonce_number = 0;
-        unsigned int reg_value_num=0;
-        unsigned int reg_buf = 0;
-        i = chain;
-    rerun:
-        clear_register_value_buf();
-        read_asic_register(i, 0, chip_addr, reg);
-        cgsleep_ms(80);
+        struct reg_content reply;
+        int retry;
 
-        while(not_reg_data_time < RETRY_NUM)    //if there is no register value for 3 times, we can think all asic return their address
+        for(retry = 0; retry < RETRY_NUM; retry++)
         {
-            pthread_mutex_lock(&reg_mutex);
-            reg_value_num = reg_value_buf.reg_value_num;
-            //applog(LOG_NOTICE,"%s: p_wr = %d reg_value_num = %d\n", __FUNCTION__,reg_value_buf.p_wr,reg_value_buf.reg_value_num);
-            pthread_mutex_unlock(&reg_mutex);
-
-            applog(LOG_DEBUG,"%s: reg_value_num %d", __FUNCTION__, reg_value_num);
-            if((reg_value_num >= MAX_NONCE_NUMBER_IN_FIFO || reg_value_buf.p_rd >= MAX_NONCE_NUMBER_IN_FIFO ||reg_value_num ==0 ) && not_reg_data_time <RETRY_NUM)
-            {
-                not_reg_data_time ++;
-                goto rerun;
-            }
-            if(not_reg_data_time >= RETRY_NUM)
-            {
-                return 0;
-            }
+            reg_queue_flush(chain);
+            read_asic_register(chain, 0, chip_addr, reg);
+            if(!reg_queue_get(chain, &reply, REG_CHIP_REPLY_TIMEOUT_MS))
+                continue;
 
-            pthread_mutex_lock(&reg_mutex);
-            for(i = 0; i < reg_value_num; i++)
-            {
-                reg_buf = reg_value_buf.reg_buffer[reg_value_buf.p_rd].reg_value;
-                applog(LOG_DEBUG,"%s: chip %x reg %x reg_buff %x", __FUNCTION__, chip_addr,reg,reg_buf);
-                reg_value_buf.p_rd++;
-                reg_value_buf.reg_value_num--;
-                if(reg_value_buf.p_rd < MAX_NONCE_NUMBER_IN_FIFO)
-                {
-                    reg_value_buf.p_rd = 0;
-                }
-                if(reg == GENERAL_I2C_COMMAND)
-                {
-                    if((reg_buf & 0xc0000000) == 0x0)
-                    {
-                        pthread_mutex_unlock(&reg_mutex);
-                        clear_register_value_buf();
-                        return reg_buf;
-                    }
-                    else
-                    {
-                        pthread_mutex_unlock(&reg_mutex);
-                        clear_register_value_buf();
-                        return 0;
-                    }
-                }
-            }
-            pthread_mutex_unlock(&reg_mutex);
+            applog(LOG_DEBUG,"%s: chip %x reg %x reg_buff %x", __FUNCTION__, chip_addr,reg,reply.reg_value);
+            if(reg == GENERAL_I2C_COMMAND && (reply.reg_value & 0xc0000000) == 0x0)
+                return reply.reg_value;
+            return 0;
         }
-        //set_nonce_fifo_interrupt(get_nonce_fifo_interrupt() & ~(FLUSH_NONCE3_FIFO));
-        clear_register_value_buf();
         return 0;
     }
 
@@ -5524,62 +5554,189 @@ void set_Hardware_version(unsigned int value)
             return ret;
     }
 
-#ifdef USE_N_OFFSET_FIX_TEMP
-    int8_t calc_offset(int remote, int local)
+    // the last published temp snapshot, without taking any lock
+    void temp_snapshot_get(struct temp_snapshot *ts)
     {
-        float t_noise;
-        t_noise = remote - ((1.11-1.008)/1.008)*(273.15 + local) - local;
-        return (int8_t)(0 - t_noise);
-    }
+        uint32_t seq;
 
-    int16_t get_remote(int16_t remote)
-    {
-        float t_re_re;
-#ifdef EXTEND_TEMP_MODE
-        remote = remote - 64;
-#endif
-        t_re_re = (1.008 * (remote) - (1.11 - 1.008) * 273.15) / 1.11;
-        applog(LOG_DEBUG,"remote : %"PRId16" temp : %f",remote,t_re_re);
-        return (int16_t)(t_re_re);
+        do
+        {
+            seq = __atomic_load_n(&temp_snapshot.seq, __ATOMIC_ACQUIRE);
+            memcpy(ts, &temp_snapshot, sizeof(*ts));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        }
+        while((seq & 1) || seq != __atomic_load_n(&temp_snapshot.seq, __ATOMIC_RELAXED));
     }
 
-    int16_t get_local(int16_t local)
+    static bool temp_snapshot_stale(struct temp_snapshot *ts)
     {
+        struct timeval now;
 
-#ifdef EXTEND_TEMP_MODE
-        local = local - 64;
-#endif
-        return local;
+        cgtime(&now);
+        return ts->taken.tv_sec == 0 || now.tv_sec - ts->taken.tv_sec > TEMP_SNAPSHOT_STALE;
     }
 
-    int8_t do_calibration_sensor_offset(unsigned char device,unsigned char chip_addr,int chain, int temp_chip_index)
+    static void temp_snapshot_publish(int sweep_ms)
     {
-        int8_t offset = 0;
-        int8_t middle,local = 0;
-        int16_t ret = 0;
-        int8_t error_Limit = 0;
-        int8_t retry_Time_Count = 0;
-        int get_value_once=0;
-        int check_ok_counter=0;
-        char logstr[256];
+        uint32_t seq = temp_snapshot.seq;
 
-        ret = check_reg_temp(device, 0xfe, 0x0, 0, chip_addr, chain); // Read Local Temp, Without Any Exception?
-        dev->TempChipType[chain][temp_chip_index]= ret & 0xff;
+        __atomic_store_n(&temp_snapshot.seq, seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
 
-        if(dev->TempChipType[chain][temp_chip_index]==0x1a) //debug for 218
-            is218_Temp=true;
+        cgtime(&temp_snapshot.taken);
+        temp_snapshot.sweep_ms = sweep_ms;
+        memcpy(temp_snapshot.chain_maxtemp, dev->chain_asic_maxtemp, sizeof(temp_snapshot.chain_maxtemp));
+        memcpy(temp_snapshot.chain_mintemp, dev->chain_asic_mintemp, sizeof(temp_snapshot.chain_mintemp));
+        memcpy(temp_snapshot.temp_top, dev->temp_top1, sizeof(temp_snapshot.temp_top));
+        memcpy(temp_snapshot.temp_low, dev->temp_low1, sizeof(temp_snapshot.temp_low));
 
-#ifdef EXTEND_TEMP_MODE
-        check_reg_temp(device, 0x9, 0x04, 1, chip_addr, chain);
-#endif
-        check_reg_temp(device, 0x11, offset, 1, chip_addr, chain); // Set offset
-        ret = check_reg_temp(device, 0x0, 0x0, 0, chip_addr, chain); // Read Local Temp, Without Any Exception?
-        local = get_local(ret & 0xff);
+        __atomic_store_n(&temp_snapshot.seq, seq + 2, __ATOMIC_RELEASE);
+    }
 
-        ret = check_reg_temp(device, 0x1, 0x0, 0, chip_addr, chain); // Read Remote Temp
+    /* The read of check_reg_temp, from temp chip j of every chain in chain_mask
+     * at once: the I2C commands go out to all chains, then every chain's result
+     * is polled through its register queue. ret[chain] is 0 if the read failed.
+     */
+    static void check_reg_temp_chains(unsigned char device, unsigned char reg, int j, unsigned int chain_mask, unsigned int *ret)
+    {
+        struct reg_content reply;
+        unsigned int pending = chain_mask, busy;
+        int i, fail_time, poll;
 
-#ifdef EXTEND_TEMP_MODE
-        middle = ret & 0xff - 64;
+        for(fail_time = 0; fail_time < 2 && pending; fail_time++)
+        {
+            for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+            {
+                if(pending & (1 << i))
+                {
+                    ret[i] = 0;
+                    wait_iic_ok(dev->TempChipAddr[i][j], i, 0);
+                }
+            }
+            for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+            {
+                if(pending & (1 << i))
+                    read_temp(device, reg, 0, 0, dev->TempChipAddr[i][j], i);
+            }
+            cgsleep_ms(1);
+
+            busy = pending;
+            for(poll = 0; poll < TEMP_IIC_POLL_NUM && busy; poll++)
+            {
+                for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+                {
+                    if(busy & (1 << i))
+                    {
+                        reg_queue_flush(i);
+                        read_asic_register(i, 0, dev->TempChipAddr[i][j], GENERAL_I2C_COMMAND);
+                    }
+                }
+                for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+                {
+                    if((busy & (1 << i)) && reg_queue_get(i, &reply, REG_CHIP_REPLY_TIMEOUT_MS) && (reply.reg_value & 0xc0000000) == 0x0)
+                    {
+                        ret[i] = reply.reg_value;
+                        busy &= ~(1 << i);
+                    }
+                }
+            }
+
+            for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+            {
+                if((pending & (1 << i)) && (ret[i] & 0xff00) >> 8 == reg && (ret[i] & 0xff) != 0xff && (ret[i] & 0xff) != 0x7f)
+                    pending &= ~(1 << i);
+            }
+        }
+
+        for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            if(pending & (1 << i))
+                ret[i] = 0;
+        }
+    }
+
+    // point the sensor of temp chip j of every chain in chain_mask at its middle or bottom diode
+    static void select_temp_chains(int j, unsigned int chain_mask, int bottom_or_mid)
+    {
+        struct reg_content reply;
+        int i;
+
+        for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            if(chain_mask & (1 << i))
+                set_baud_with_addr(dev->baud, 0, dev->TempChipAddr[i][j], i, 1, 0, bottom_or_mid);
+        }
+        for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            if(chain_mask & (1 << i))
+            {
+                reg_queue_flush(i);
+                read_asic_register(i, 0, dev->TempChipAddr[i][j], MISC_CONTROL);
+            }
+        }
+        for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            if(chain_mask & (1 << i))
+                reg_queue_get(i, &reply, REG_CHIP_REPLY_TIMEOUT_MS);
+        }
+    }
+
+#ifdef USE_N_OFFSET_FIX_TEMP
+    int8_t calc_offset(int remote, int local)
+    {
+        float t_noise;
+        t_noise = remote - ((1.11-1.008)/1.008)*(273.15 + local) - local;
+        return (int8_t)(0 - t_noise);
+    }
+
+    int16_t get_remote(int16_t remote)
+    {
+        float t_re_re;
+#ifdef EXTEND_TEMP_MODE
+        remote = remote - 64;
+#endif
+        t_re_re = (1.008 * (remote) - (1.11 - 1.008) * 273.15) / 1.11;
+        applog(LOG_DEBUG,"remote : %"PRId16" temp : %f",remote,t_re_re);
+        return (int16_t)(t_re_re);
+    }
+
+    int16_t get_local(int16_t local)
+    {
+
+#ifdef EXTEND_TEMP_MODE
+        local = local - 64;
+#endif
+        return local;
+    }
+
+    int8_t do_calibration_sensor_offset(unsigned char device,unsigned char chip_addr,int chain, int temp_chip_index)
+    {
+        int8_t offset = 0;
+        int8_t middle,local = 0;
+        int16_t ret = 0;
+        int8_t error_Limit = 0;
+        int8_t retry_Time_Count = 0;
+        int get_value_once=0;
+        int check_ok_counter=0;
+        char logstr[256];
+
+        ret = check_reg_temp(device, 0xfe, 0x0, 0, chip_addr, chain); // Read Local Temp, Without Any Exception?
+        dev->TempChipType[chain][temp_chip_index]= ret & 0xff;
+
+        if(dev->TempChipType[chain][temp_chip_index]==0x1a) //debug for 218
+            is218_Temp=true;
+
+#ifdef EXTEND_TEMP_MODE
+        check_reg_temp(device, 0x9, 0x04, 1, chip_addr, chain);
+#endif
+        check_reg_temp(device, 0x11, offset, 1, chip_addr, chain); // Set offset
+        ret = check_reg_temp(device, 0x0, 0x0, 0, chip_addr, chain); // Read Local Temp, Without Any Exception?
+        local = get_local(ret & 0xff);
+
+        ret = check_reg_temp(device, 0x1, 0x0, 0, chip_addr, chain); // Read Remote Temp
+
+#ifdef EXTEND_TEMP_MODE
+        middle = ret & 0xff - 64;
 #else
         middle = ret & 0xff;
 #endif
@@ -5741,6 +5898,212 @@ void set_Hardware_version(unsigned int value)
         }
     }
 
+    // false unless the whole of a size byte state file could be read into data
+    static bool read_state_file(const char *path, void *data, size_t size)
+    {
+        FILE *fd;
+        bool ok = false;
+
+        fd=fopen(path,"rb");
+        if(fd)
+        {
+            ok = fread(data,1,size,fd) == size;
+            fclose(fd);
+        }
+        return ok;
+    }
+
+    /* Replace a state file through path.new and a rename, so a reader never
+     * sees half of it. A file on flash is synced first, and not written at all
+     * when it already holds the same bytes.
+     */
+    static void write_state_file(const char *path, const void *data, size_t size, bool on_flash)
+    {
+        char new_path[256];
+        void *old;
+        bool same;
+        FILE *fd;
+
+        if(on_flash && (old = malloc(size)))
+        {
+            same = read_state_file(path, old, size) && memcmp(old, data, size) == 0;
+            free(old);
+            if(same)
+                return;
+        }
+
+        snprintf(new_path, sizeof(new_path), "%s.new", path);
+        fd=fopen(new_path,"wb");
+        if(fd)
+        {
+            if(fwrite(data,1,size,fd) == size && fflush(fd) == 0)
+            {
+                if(on_flash)
+                    fsync(fileno(fd));
+                if(fclose(fd) == 0)
+                {
+                    rename(new_path, path);
+                    return;
+                }
+            }
+            else
+                fclose(fd);
+            unlink(new_path);
+        }
+    }
+
+    void load_calibration_cache()
+    {
+        bool ok;
+        char logstr[256];
+
+        ok = read_state_file(CALIBRATION_CACHE_FILE, &calibration_cache, sizeof(calibration_cache))
+             && calibration_cache.magic == CALIBRATION_CACHE_MAGIC
+             && calibration_cache.version == CALIBRATION_CACHE_VERSION
+             && calibration_cache.crc == CRC16((uint8_t *)&calibration_cache, offsetof(struct calibration_cache, crc));
+
+        if(!ok)
+        {
+            memset(&calibration_cache, 0, sizeof(calibration_cache));
+            calibration_cache.magic = CALIBRATION_CACHE_MAGIC;
+            calibration_cache.version = CALIBRATION_CACHE_VERSION;
+        }
+        sprintf(logstr,"Calibration cache %s\n", ok ? "loaded" : "not found or invalid");
+        writeInitLogFile(logstr);
+    }
+
+    // only written when it changed, the file lives on flash
+    void save_calibration_cache()
+    {
+        calibration_cache.crc = CRC16((uint8_t *)&calibration_cache, offsetof(struct calibration_cache, crc));
+        write_state_file(CALIBRATION_CACHE_FILE, &calibration_cache, sizeof(calibration_cache), true);
+    }
+
+    static bool hash_board_id_valid(unsigned char *id)
+    {
+        int i;
+
+        for(i=1; i<HASH_BOARD_ID_LEN; i++)
+        {
+            if(id[i] != id[0])
+                return true;
+        }
+        return id[0] != 0 && id[0] != 0xff;
+    }
+
+    static struct calibration_chain *find_calibration_chain(int chain)
+    {
+        int i;
+
+        if(!hash_board_id_valid(hash_board_id[chain]))
+            return NULL;
+        for(i=0; i<BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            if(calibration_cache.chain[i].valid && memcmp(calibration_cache.chain[i].board_id, hash_board_id[chain], HASH_BOARD_ID_LEN) == 0)
+                return &calibration_cache.chain[i];
+        }
+        return NULL;
+    }
+
+    // the chips' PLL indexes before the autotuner moved them, what a restart brings them up at
+    static unsigned char *calibration_freq_index(int chain)
+    {
+        return chip_base_freq_index[chain][0] ? chip_base_freq_index[chain] : chip_freq_index[chain];
+    }
+
+    /* Take the temp sensor setup of chain from the calibration cache, if the board
+     * still has the asic count, voltage and chip PLL indexes it was calibrated with
+     * and each sensor still reads back the chip type it had. Otherwise the caller
+     * calibrates from scratch.
+     */
+    static bool restore_calibration(unsigned char device, int chain)
+    {
+        struct calibration_chain *cc;
+        unsigned int ret;
+        char logstr[256];
+        int i;
+
+#ifdef SHOW_BOTTOM_TEMP
+        return false;   // bottom offsets are not cached
+#endif
+        if(!opt_calibration_cache)
+            return false;
+
+        cc = find_calibration_chain(chain);
+        if(!cc)
+            return false;
+
+        if(cc->asic_num != dev->chain_asic_num[chain] || cc->voltage_pic != chain_voltage_pic[chain]
+           || memcmp(cc->freq_index, calibration_freq_index(chain), dev->chain_asic_num[chain]) != 0
+           || cc->temp_num <= 0 || cc->temp_num > MAX_TEMPCHIP_NUM)
+        {
+            sprintf(logstr,"Chain[J%d] changed since it was calibrated, calibrate again\n",chain+1);
+            writeInitLogFile(logstr);
+            return false;
+        }
+
+        for(i=0; i<cc->temp_num; i++)
+        {
+            set_baud_with_addr(dev->baud, 0, cc->temp_chip_addr[i], chain, 1, 0, (int) TEMP_MIDDLE);
+            check_asic_reg_with_addr(MISC_CONTROL,cc->temp_chip_addr[i],chain,1);
+
+            ret = check_reg_temp(device, 0xfe, 0x0, 0, cc->temp_chip_addr[i], chain);
+            if((ret & 0xff) != cc->temp_chip_type[i])
+            {
+                sprintf(logstr,"Chain[J%d] chip[%d] typeID=%02x, cached %02x, calibrate again\n",chain+1,cc->temp_chip_addr[i],ret & 0xff,cc->temp_chip_type[i]);
+                writeInitLogFile(logstr);
+                return false;
+            }
+#ifdef EXTEND_TEMP_MODE
+            check_reg_temp(device, 0x9, 0x04, 1, cc->temp_chip_addr[i], chain);
+#endif
+            check_reg_temp(device, 0x11, cc->middle_offset[i], 1, cc->temp_chip_addr[i], chain);    // set offset
+
+            dev->TempChipAddr[chain][i] = cc->temp_chip_addr[i];
+            dev->TempChipType[chain][i] = cc->temp_chip_type[i];
+            middle_Offset[chain][i] = cc->middle_offset[i];
+            if(dev->TempChipType[chain][i]==0x1a) //debug for 218
+                is218_Temp=true;
+
+            sprintf(logstr,"Chain[J%d] chip[%d] use cached middle temp offset=%d typeID=%02x\n",chain+1,dev->TempChipAddr[chain][i],middle_Offset[chain][i],dev->TempChipType[chain][i]);
+            writeInitLogFile(logstr);
+        }
+        dev->chain_asic_temp_num[chain] = cc->temp_num;
+        return true;
+    }
+
+    static void store_calibration(int chain)
+    {
+        struct calibration_chain *cc;
+        int i;
+
+        if(!opt_calibration_cache || !hash_board_id_valid(hash_board_id[chain]))
+            return;
+
+        cc = find_calibration_chain(chain);
+        for(i=0; !cc && i<BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            if(!calibration_cache.chain[i].valid)
+                cc = &calibration_cache.chain[i];
+        }
+        if(!cc)
+            cc = &calibration_cache.chain[chain];   // full of other boards, reuse this slot's
+
+        memset(cc, 0, sizeof(*cc));
+        memcpy(cc->board_id, hash_board_id[chain], HASH_BOARD_ID_LEN);
+        cc->asic_num = dev->chain_asic_num[chain];
+        cc->voltage_pic = chain_voltage_pic[chain];
+        cc->temp_num = dev->chain_asic_temp_num[chain];
+        for(i=0; i<cc->temp_num && i<MAX_TEMPCHIP_NUM; i++)
+        {
+            cc->temp_chip_addr[i] = dev->TempChipAddr[chain][i];
+            cc->temp_chip_type[i] = dev->TempChipType[chain][i];
+            cc->middle_offset[i] = middle_Offset[chain][i];
+        }
+        memcpy(cc->freq_index, calibration_freq_index(chain), BITMAIN_DEFAULT_ASIC_NUM);
+        cc->valid = cc->temp_num > 0;
+    }
+
     int8_t calibration_sensor_offset(unsigned char device, int chain)
     {
         int i;
@@ -5763,6 +6126,9 @@ void set_Hardware_version(unsigned int value)
 #endif
 
 #ifndef TWO_CHIP_TEMP_S9
+        if(restore_calibration(device, chain))
+            return 0;
+
         get_temperature_offset_value(chain,temp_offset);
         sprintf(logstr,"Chain[J%d] PIC temp offset=%d,%d,%d,%d,%d,%d,%d,%d\n",chain+1,temp_offset[0],temp_offset[1],temp_offset[2],temp_offset[3],temp_offset[4],temp_offset[5],temp_offset[6],temp_offset[7]);
         writeInitLogFile(logstr);
@@ -5900,6 +6266,10 @@ void set_Hardware_version(unsigned int value)
             writeInitLogFile(logstr);
         }
 #endif
+
+#ifndef TWO_CHIP_TEMP_S9
+        store_calibration(chain);
+#endif
         return 0;
     }
 
@@ -6744,6 +7114,24 @@ void set_Hardware_version(unsigned int value)
 
 #define OFFSIDE_TOP 125
 #define OFFSIDE_LOW 75
+    // chains read_temp_func reads the sensors of, the T9+ copies the others' temps from them
+    static bool is_temp_sensor_chain(int i)
+    {
+        if(dev->chain_exist[i] != 1)
+            return false;
+#ifdef DEBUG_XILINX_NONCE_NOTENOUGH
+        if(i == DISABLE_REG_CHAIN_INDEX)
+            return false;
+#endif
+#ifdef T9_18
+        if(fpga_version>=0xE)
+            return i==8 || i==10 || i==12;  // only 8,10,12... has temp sensor!!!
+        return i%3 == 1;    // only 1,4,7... has temp sensor!!!
+#else
+        return true;
+#endif
+    }
+
     void * read_temp_func()
     {
         char logstr[256];
@@ -6767,6 +7155,11 @@ void set_Hardware_version(unsigned int value)
         int mintemp[TEMP_POS_NUM];
         int cur_fan_num=0;
         int fatal_error_counter=0;
+        unsigned int temp_local[MAX_TEMPCHIP_NUM][BITMAIN_MAX_CHAIN_NUM];
+        unsigned int temp_middle[MAX_TEMPCHIP_NUM][BITMAIN_MAX_CHAIN_NUM];
+        unsigned int chain_mask;
+        struct timeval tv_sweep, tv_swept;
+        struct temp_snapshot ts;
 
         clearTempLogFile();
 
@@ -6819,27 +7212,51 @@ void set_Hardware_version(unsigned int value)
             memset(temp_top,0x00,sizeof(temp_top));
             memset(temp_low,0x00,sizeof(temp_low));
 
-            for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+            // read the sensors of all chains side by side, one temp chip index at a time
+            cgtime(&tv_sweep);
+            for(j=0; j < MAX_TEMPCHIP_NUM; j++)
             {
-                if(dev->chain_exist[i] == 1
-#ifdef DEBUG_XILINX_NONCE_NOTENOUGH
-                   && i!=DISABLE_REG_CHAIN_INDEX
-#endif
-                  )   //clement for debug
+                chain_mask = 0;
+                for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
                 {
-#ifdef T9_18
-                    if(fpga_version>=0xE)
+                    if(is_temp_sensor_chain(i) && j < dev->chain_asic_temp_num[i])
+                        chain_mask |= 1 << i;
+                }
+                if(!chain_mask)
+                    continue;
+
+                check_reg_temp_chains(0x98, 0x00, j, chain_mask, temp_local[j]);
+
+                // 0. Switch To Middle
+                select_temp_chains(j, chain_mask, (int) TEMP_MIDDLE);
+
+#if ((!defined USE_N_OFFSET_FIX_TEMP) && (!defined EXTEND_TEMP_MODE))
+                for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+                {
+                    if(!(chain_mask & (1 << i)))
+                        continue;
+
+                    if(dev->chain_asic_temp[i][j][TEMP_POS_MIDDLE]<125)
                     {
-                        if(i!=8 && i!=10 && i!=12)  // only 8,10,12... has temp sensor!!! we just copy temp value to other chains!
-                            continue;
+                        middle_Offset_sw[i][j]=0;
                     }
-                    else
+                    // set middle offset
+                    if(middle_Offset_sw[i][j]!=0)
                     {
-                        if(i%3 != 1)    // only 1,4,7... has temp sensor!!! we just copy temp value to other chains!
-                            continue;
+                        ret = check_reg_temp(0x98, 0x11, middle_Offset_sw[i][j], 1, dev->TempChipAddr[i][j], i); // Set offset
                     }
+                    else
+                        ret = check_reg_temp(0x98, 0x11, middle_Offset[i][j], 1, dev->TempChipAddr[i][j], i); // Set offset
+                }
 #endif
+                check_reg_temp_chains(0x98, 0x01, j, chain_mask, temp_middle[j]);
+            }
+            cgtime(&tv_swept);
 
+            for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+            {
+                if(is_temp_sensor_chain(i))
+                {
                     sprintf(logstr,"do read temp on Chain[%d]\n",i);
                     writeLogFile(logstr);
 
@@ -6859,7 +7276,7 @@ void set_Hardware_version(unsigned int value)
                         sprintf(logstr,"Chain[%d] Chip[%d] TempTypeID=%02x middle offset=%d\n",i, (dev->TempChipAddr[i][j]/4)+1, dev->TempChipType[i][j],middle_Offset[i][j]);
                         writeLogFile(logstr);
 
-                        ret = check_reg_temp(0x98, 0x00, 0x0, 0x0, dev->TempChipAddr[i][j], i);
+                        ret = temp_local[j][i];
                         if (ret != 0)
                         {
                             dev->chain_asic_temp[i][j][TEMP_POS_LOCAL] = get_local(ret & 0xff);
@@ -6873,24 +7290,7 @@ void set_Hardware_version(unsigned int value)
                             writeLogFile(logstr);
                         }
 
-                        // 0. Switch To Middle
-                        set_baud_with_addr(dev->baud, 0, dev->TempChipAddr[i][j], i, 1, 0, (int) TEMP_MIDDLE);
-                        check_asic_reg_with_addr(MISC_CONTROL,dev->TempChipAddr[i][j],i,1);
-
-#if ((!defined USE_N_OFFSET_FIX_TEMP) && (!defined EXTEND_TEMP_MODE))
-                        if(dev->chain_asic_temp[i][j][TEMP_POS_MIDDLE]<125)
-                        {
-                            middle_Offset_sw[i][j]=0;
-                        }
-                        // set middle offset
-                        if(middle_Offset_sw[i][j]!=0)
-                        {
-                            ret = check_reg_temp(0x98, 0x11, middle_Offset_sw[i][j], 1, dev->TempChipAddr[i][j], i); // Set offset
-                        }
-                        else
-                            ret = check_reg_temp(0x98, 0x11, middle_Offset[i][j], 1, dev->TempChipAddr[i][j], i); // Set offset
-#endif
-                        ret = check_reg_temp(0x98, 0x01, 0x0, 0x0, dev->TempChipAddr[i][j], i);
+                        ret = temp_middle[j][i];
                         if (ret != 0)
                         {
                             dev->chain_asic_temp[i][j][TEMP_POS_MIDDLE] = get_remote(ret & 0xff);
@@ -7184,6 +7584,12 @@ void set_Hardware_version(unsigned int value)
                 }
             }
 #endif
+            temp_snapshot_publish(ms_tdiff(&tv_swept, &tv_sweep));
+
+            // fan control and the checks below only use the snapshot, the asics are free again
+            pthread_mutex_unlock(&opencore_readtemp_mutex);
+            temp_snapshot_get(&ts);
+
             // only change fan speed after read temp value!!!
             check_fan();
 
@@ -7219,7 +7625,7 @@ void set_Hardware_version(unsigned int value)
 #endif
 
 #ifndef DISABLE_TEMP_PROTECT
-            if(diff.tv_sec > 120 || dev->temp_top1[TEMP_POS_LOCAL] > MAX_PCB_TEMP // we use pcb temp to check protect or not
+            if(diff.tv_sec > 120 || ts.temp_top[TEMP_POS_LOCAL] > MAX_PCB_TEMP // we use pcb temp to check protect or not
                || cur_fan_num < MIN_FAN_NUM /*|| dev->fan_speed_top1 < (MAX_FAN_SPEED * dev->fan_pwm / 150) */ )
             {
                 fatal_error_counter++;
@@ -7228,7 +7634,7 @@ void set_Hardware_version(unsigned int value)
                 {
                     global_stop = true; // still counter the chip's x times
 
-                    if(dev->temp_top1[TEMP_POS_LOCAL] > MAX_PCB_TEMP)
+                    if(ts.temp_top[TEMP_POS_LOCAL] > MAX_PCB_TEMP)
                         FatalErrorValue=ERROR_OVER_MAXTEMP;
                     else if(cur_fan_num < MIN_FAN_NUM)
                         FatalErrorValue=ERROR_FAN_LOST;
@@ -7237,7 +7643,7 @@ void set_Hardware_version(unsigned int value)
                     else
                         FatalErrorValue=ERROR_UNKOWN_STATUS;
 
-                    if(dev->temp_top1[TEMP_POS_LOCAL] > MAX_PCB_TEMP
+                    if(ts.temp_top[TEMP_POS_LOCAL] > MAX_PCB_TEMP
                        || cur_fan_num < MIN_FAN_NUM /* || dev->fan_speed_top1 < (MAX_FAN_SPEED * dev->fan_pwm / 150) */)
                     {
                         status_error = true;    // will stop counter the chip's x times
@@ -7319,13 +7725,13 @@ void set_Hardware_version(unsigned int value)
                 writeInitLogFile(logstr);
             }
 
+            pthread_mutex_lock(&opencore_readtemp_mutex);
             processTEST();
+            pthread_mutex_unlock(&opencore_readtemp_mutex);
 
             sprintf(logstr,"FAN PWM: %d\n",dev->fan_pwm);
             writeLogFile(logstr);
 
-            pthread_mutex_unlock(&opencore_readtemp_mutex);
-
             sprintf(logstr,"read_temp_func Done!\n");
             writeLogFile(logstr);
 
@@ -7340,26 +7746,18 @@ void set_Hardware_version(unsigned int value)
         }
     }
 
-    void chain_inactive(unsigned char chain)
+    static void chain_inactive_cmd(unsigned int *cmd_buf)
     {
         unsigned char buf[5] = {0,0,0,0,5};
-        unsigned int cmd_buf[3] = {0,0,0};
-        unsigned int ret, value;
 
+        memset(cmd_buf, 0, 3*sizeof(unsigned int));
         if(!opt_multi_version)  // fil mode
         {
             buf[0] = CHAIN_INACTIVE | COMMAND_FOR_ALL;
             buf[1] = 0;
             buf[2] = 0;
             buf[3] = CRC5(buf, 4*8 - 5);
-            applog(LOG_DEBUG,"%s: buf[0]=0x%x, buf[1]=0x%x, buf[2]=0x%x, buf[3]=0x%x\n", __FUNCTION__, buf[0], buf[1], buf[2], buf[3]);
-
             cmd_buf[0] = buf[0]<<24 | buf[1]<<16 | buf[2]<<8 | buf[3];
-            set_BC_command_buffer(cmd_buf);
-
-            ret = get_BC_write_command();
-            value = BC_COMMAND_BUFFER_READY | BC_COMMAND_EN_CHAIN_ID | (chain << 16) | (ret & 0xfff0ffff);
-            set_BC_write_command(value);
         }
         else    // vil mode
         {
@@ -7368,29 +7766,16 @@ void set_Hardware_version(unsigned int value)
             buf[2] = 0;
             buf[3] = 0;
             buf[4] = CRC5(buf, 4*8);
-            applog(LOG_DEBUG,"%s: buf[0]=0x%x, buf[1]=0x%x, buf[2]=0x%x, buf[3]=0x%x, buf[4]=0x%x\n", __FUNCTION__, buf[0], buf[1], buf[2], buf[3], buf[4]);
-
             cmd_buf[0] = buf[0]<<24 | buf[1]<<16 | buf[2]<<8 | buf[3];
             cmd_buf[1] = buf[4]<<24;
-            while (1)
-            {
-                ret = get_BC_write_command();
-                if ((ret & 0x80000000) == 0)
-                    break;
-                cgsleep_ms(1);
-            }
-            set_BC_command_buffer(cmd_buf);
-            value = BC_COMMAND_BUFFER_READY | BC_COMMAND_EN_CHAIN_ID | (chain << 16) | (ret & 0xfff0ffff);
-            set_BC_write_command(value);
         }
     }
 
-    void set_address(unsigned char chain, unsigned char mode, unsigned char address)
+    static void set_address_cmd(unsigned int *cmd_buf, unsigned char mode, unsigned char address)
     {
         unsigned char buf[9] = {0};
-        unsigned int cmd_buf[3] = {0,0,0};
-        unsigned int ret, value;
 
+        memset(cmd_buf, 0, 3*sizeof(unsigned int));
         if(!opt_multi_version)  // fil mode
         {
             buf[0] = SET_ADDRESS;
@@ -7399,14 +7784,7 @@ void set_Hardware_version(unsigned int value)
             if (mode)   //all
                 buf[0] |= COMMAND_FOR_ALL;
             buf[3] = CRC5(buf, 4*8 - 5);
-            applog(LOG_DEBUG,"%s: buf[0]=0x%x, buf[1]=0x%x, buf[2]=0x%x, buf[3]=0x%x\n", __FUNCTION__, buf[0], buf[1], buf[2], buf[3]);
-
             cmd_buf[0] = buf[0]<<24 | buf[1]<<16 | buf[2]<<8 | buf[3];
-            set_BC_command_buffer(cmd_buf);
-
-            ret = get_BC_write_command();
-            value = BC_COMMAND_BUFFER_READY | BC_COMMAND_EN_CHAIN_ID | (chain << 16) | (ret & 0xfff0ffff);
-            set_BC_write_command(value);
         }
         else    // vil mode
         {
@@ -7415,23 +7793,27 @@ void set_Hardware_version(unsigned int value)
             buf[2] = address;
             buf[3] = 0;
             buf[4] = CRC5(buf, 4*8);
-            //applog(LOG_DEBUG,"%s: buf[0]=0x%x, buf[1]=0x%x, buf[2]=0x%x, buf[3]=0x%x, buf[4]=0x%x\n", __FUNCTION__, buf[0], buf[1], buf[2], buf[3], buf[4]);
-
             cmd_buf[0] = buf[0]<<24 | buf[1]<<16 | buf[2]<<8 | buf[3];
             cmd_buf[1] = buf[4]<<24;
-            while (1)
-            {
-                ret = get_BC_write_command();
-                if ((ret & 0x80000000) == 0)
-                    break;
-                cgsleep_ms(1);
-            }
-            set_BC_command_buffer(cmd_buf);
-            value = BC_COMMAND_BUFFER_READY | BC_COMMAND_EN_CHAIN_ID | (chain << 16) | (ret & 0xfff0ffff);
-            set_BC_write_command(value);
         }
     }
 
+    void chain_inactive(unsigned char chain)
+    {
+        unsigned int cmd_buf[3];
+
+        chain_inactive_cmd(cmd_buf);
+        bc_send(chain, cmd_buf);
+    }
+
+    void set_address(unsigned char chain, unsigned char mode, unsigned char address)
+    {
+        unsigned int cmd_buf[3];
+
+        set_address_cmd(cmd_buf, mode, address);
+        bc_send(chain, cmd_buf);
+    }
+
     int calculate_asic_number(unsigned int actual_asic_number)
     {
         int i = 0;
@@ -7563,6 +7945,8 @@ void set_Hardware_version(unsigned int value)
         unsigned int i, j;
         unsigned char chip_addr = 0;
         unsigned char check_bit = 0;
+        unsigned int cmd_buf[3];
+        struct bc_queue q = {0};
 
         dev->check_bit=0;
 
@@ -7576,34 +7960,37 @@ void set_Hardware_version(unsigned int value)
             dev->check_bit++;
         }
 
+        // every chain gets the same 30ms spaced sequence, the queue runs them side by side
         for(i=0; i<BITMAIN_MAX_CHAIN_NUM; i++)
         {
             if(dev->chain_exist[i] == 1 && dev->chain_asic_num[i] > 0)
             {
                 chip_addr = 0;
-                chain_inactive(i);
-                cgsleep_ms(30);
-                chain_inactive(i);
-                cgsleep_ms(30);
-                chain_inactive(i);
-                cgsleep_ms(30);
+                chain_inactive_cmd(cmd_buf);
+                bc_queue_add(&q, i, cmd_buf, 30000);
+                bc_queue_add(&q, i, cmd_buf, 30000);
+                bc_queue_add(&q, i, cmd_buf, 30000);
 
                 for(j = 0; j < 0x100/dev->addrInterval; j++)
                 {
-                    set_address(i, 0, chip_addr);
+                    set_address_cmd(cmd_buf, 0, chip_addr);
+                    bc_queue_add(&q, i, cmd_buf, 30000);
                     chip_addr += dev->addrInterval;
-                    cgsleep_ms(30);
                 }
             }
         }
+        bc_queue_run(&q);
+        bc_queue_free(&q);
+        cgsleep_ms(30);
     }
 
     void set_asic_ticket_mask(unsigned int ticket_mask)
     {
         unsigned char buf[9] = {0};
         unsigned int cmd_buf[3] = {0,0,0};
-        unsigned int ret, value,i;
+        unsigned int i;
         unsigned int tm;
+        struct bc_queue q = {0};
 
         tm = Swap32(ticket_mask);
 
@@ -7622,11 +8009,7 @@ void set_Hardware_version(unsigned int value)
                     applog(LOG_DEBUG,"%s: buf[0]=0x%x, buf[1]=0x%x, buf[2]=0x%x, buf[3]=0x%x\n", __FUNCTION__, buf[0], buf[1], buf[2], buf[3]);
 
                     cmd_buf[0] = buf[0]<<24 | buf[1]<<16 | buf[2]<<8 | buf[3];
-                    set_BC_command_buffer(cmd_buf);
-
-                    ret = get_BC_write_command();
-                    value = BC_COMMAND_BUFFER_READY | BC_COMMAND_EN_CHAIN_ID | (i << 16) | (ret & 0xfff0ffff);
-                    set_BC_write_command(value);
+                    bc_queue_add(&q, i, cmd_buf, 0);
                 }
                 else    // vil mode
                 {
@@ -7644,20 +8027,20 @@ void set_Hardware_version(unsigned int value)
                     cmd_buf[1] = buf[4]<<24 | buf[5]<<16 | buf[6]<<8 | buf[7];
                     cmd_buf[2] = buf[8]<<24;
 
-                    set_BC_command_buffer(cmd_buf);
-                    ret = get_BC_write_command();
-                    value = BC_COMMAND_BUFFER_READY | BC_COMMAND_EN_CHAIN_ID| (i << 16) | (ret & 0xfff0ffff);
-                    set_BC_write_command(value);
+                    bc_queue_add(&q, i, cmd_buf, 0);
                 }
             }
         }
+        bc_queue_run(&q);
+        bc_queue_free(&q);
     }
 
     void set_hcnt(unsigned int hcnt)
     {
         unsigned char buf[9] = {0};
         unsigned int cmd_buf[3] = {0,0,0};
-        unsigned int ret, value,i;
+        unsigned int i;
+        struct bc_queue q = {0};
 
         for(i=0; i<BITMAIN_MAX_CHAIN_NUM; i++)
         {
@@ -7695,22 +8078,66 @@ void set_Hardware_version(unsigned int value)
                     cmd_buf[1] = buf[4]<<24 | buf[5]<<16 | buf[6]<<8 | buf[7];
                     cmd_buf[2] = buf[8]<<24;
 
-                    set_BC_command_buffer(cmd_buf);
-                    ret = get_BC_write_command();
-                    value = BC_COMMAND_BUFFER_READY | BC_COMMAND_EN_CHAIN_ID| (i << 16) | (ret & 0xFFF0FFFF);
-                    set_BC_write_command(value);
+                    bc_queue_add(&q, i, cmd_buf, 0);
                 }
             }
         }
+        bc_queue_run(&q);
+        bc_queue_free(&q);
     }
 
 
 #if 1
-    void set_baud(unsigned char bauddiv,int no_use)
+    static void set_baud_cmd(unsigned int *cmd_buf, unsigned char bauddiv)
     {
         unsigned char buf[9] = {0};
+
+        memset(cmd_buf, 0, 3*sizeof(unsigned int));
+        if(!opt_multi_version)  // fil mode
+        {
+            buf[0] = SET_BAUD_OPS;
+            buf[1] = 0x10;
+            buf[2] = bauddiv & 0x1f;
+            buf[0] |= COMMAND_FOR_ALL;
+            buf[3] = CRC5(buf, 4*8 - 5);
+            applog(LOG_DEBUG,"%s: buf[0]=0x%x, buf[1]=0x%x, buf[2]=0x%x, buf[3]=0x%x\n", __FUNCTION__, buf[0], buf[1], buf[2], buf[3]);
+
+            cmd_buf[0] = buf[0]<<24 | buf[1]<<16 | buf[2]<<8 | buf[3];
+        }
+        else    // vil mode
+        {
+            buf[0] = VIL_COMMAND_TYPE | VIL_ALL | SET_CONFIG;
+            buf[1] = 0x09;
+            buf[2] = 0;
+            buf[3] = MISC_CONTROL;
+            buf[4] = 0;
+            buf[5] = INV_CLKO;
+            buf[6] = bauddiv & 0x1f;
+            buf[7] = 0;
+            buf[8] = CRC5(buf, 8*8);
+
+            cmd_buf[0] = buf[0]<<24 | buf[1]<<16 | buf[2]<<8 | buf[3];
+            cmd_buf[1] = buf[4]<<24 | buf[5]<<16 | buf[6]<<8 | buf[7];
+            cmd_buf[2] = buf[8]<<24;
+            applog(LOG_DEBUG,"%s: cmd_buf[0]=0x%x, cmd_buf[1]=0x%x, cmd_buf[2]=0x%x\n", __FUNCTION__, cmd_buf[0], cmd_buf[1], cmd_buf[2]);
+        }
+    }
+
+    // change the FPGA's bauddiv, the asics must already have been told
+    static void set_fpga_baud(unsigned char bauddiv)
+    {
+        unsigned int ret, value;
+
+        ret = get_BC_write_command();
+        value = (ret & 0xffffffe0) | (bauddiv & 0x1f);
+        set_BC_write_command(value);
+        dev->baud = bauddiv;
+    }
+
+    void set_baud(unsigned char bauddiv,int no_use)
+    {
         unsigned int cmd_buf[3] = {0,0,0};
-        unsigned int ret, value,i;
+        unsigned int i;
 
         if(dev->baud == bauddiv)
         {
@@ -7718,58 +8145,19 @@ void set_Hardware_version(unsigned int value)
             return;
         }
 
+        set_baud_cmd(cmd_buf, bauddiv);
         for(i=0; i<BITMAIN_MAX_CHAIN_NUM; i++)
         {
             if(dev->chain_exist[i] == 1)
             {
                 //first step: send new bauddiv to ASIC, but FPGA doesn't change its bauddiv, it uses old bauddiv to send BC command to ASIC
-                if(!opt_multi_version)  // fil mode
-                {
-                    buf[0] = SET_BAUD_OPS;
-                    buf[1] = 0x10;
-                    buf[2] = bauddiv & 0x1f;
-                    buf[0] |= COMMAND_FOR_ALL;
-                    buf[3] = CRC5(buf, 4*8 - 5);
-                    applog(LOG_DEBUG,"%s: buf[0]=0x%x, buf[1]=0x%x, buf[2]=0x%x, buf[3]=0x%x\n", __FUNCTION__, buf[0], buf[1], buf[2], buf[3]);
-
-                    cmd_buf[0] = buf[0]<<24 | buf[1]<<16 | buf[2]<<8 | buf[3];
-                    set_BC_command_buffer(cmd_buf);
-
-                    ret = get_BC_write_command();
-                    value = BC_COMMAND_BUFFER_READY | BC_COMMAND_EN_CHAIN_ID | (i << 16) | (ret & 0xfff0ffff);
-                    set_BC_write_command(value);
-                }
-                else    // vil mode
-                {
-                    buf[0] = VIL_COMMAND_TYPE | VIL_ALL | SET_CONFIG;
-                    buf[1] = 0x09;
-                    buf[2] = 0;
-                    buf[3] = MISC_CONTROL;
-                    buf[4] = 0;
-                    buf[5] = INV_CLKO;
-                    buf[6] = bauddiv & 0x1f;
-                    buf[7] = 0;
-                    buf[8] = CRC5(buf, 8*8);
-
-                    cmd_buf[0] = buf[0]<<24 | buf[1]<<16 | buf[2]<<8 | buf[3];
-                    cmd_buf[1] = buf[4]<<24 | buf[5]<<16 | buf[6]<<8 | buf[7];
-                    cmd_buf[2] = buf[8]<<24;
-                    applog(LOG_DEBUG,"%s: cmd_buf[0]=0x%x, cmd_buf[1]=0x%x, cmd_buf[2]=0x%x\n", __FUNCTION__, cmd_buf[0], cmd_buf[1], cmd_buf[2]);
-
-                    set_BC_command_buffer(cmd_buf);
-                    ret = get_BC_write_command();
-                    value = BC_COMMAND_BUFFER_READY | BC_COMMAND_EN_CHAIN_ID| (i << 16) | (ret & 0xfff0ffff);
-                    set_BC_write_command(value);
-                }
+                bc_send(i, cmd_buf);
             }
         }
 
         // second step: change FPGA's bauddiv
         cgsleep_us(50000);
-        ret = get_BC_write_command();
-        value = (ret & 0xffffffe0) | (bauddiv & 0x1f);
-        set_BC_write_command(value);
-        dev->baud = bauddiv;
+        set_fpga_baud(bauddiv);
     }
 #endif
 
@@ -8190,7 +8578,8 @@ void set_Hardware_version(unsigned int value)
                                 sprintf(logstr,"Chain[%d] RT=%f ideal=%f need re-init\n",i,rt_board_rate,ideal_board_rate);
                                 writeInitLogFile(logstr);
 
-                                bitmain_core_reInit();
+                                if(!bitmain_chain_reInit(i))
+                                    bitmain_core_reInit();
 
                                 sprintf(logstr,"Re-init Done\n");
                                 writeInitLogFile(logstr);
@@ -8291,6 +8680,15 @@ void set_Hardware_version(unsigned int value)
             if (diff.tv_sec > 60 || (global_stop == true && diff.tv_sec > 30))
             {
                 run_counter++;  // for check asic o or x
+                merge_nonce_worker_asic_nonce();
+                merge_nonce_worker_chain_hw();
+
+                if(opt_chain_reinit && !global_stop)
+                    check_chain_reinit();
+                if(opt_chip_autotune && !global_stop)
+                    autotune_step();
+                if(opt_vf_optimise && !global_stop)
+                    vf_optimise_step();
 
 #ifdef ENABLE_REINIT_MINING
                 if(restartNum>0 && (!global_stop) && reinit_counter>600)
@@ -8311,7 +8709,8 @@ void set_Hardware_version(unsigned int value)
                                 sprintf(logstr,"Chain[%d] get 0 nonce in 1 min\n",i);
                                 writeInitLogFile(logstr);
 
-                                bitmain_core_reInit();
+                                if(!bitmain_chain_reInit(i))
+                                    bitmain_core_reInit();
 
                                 sprintf(logstr,"Re-init Done\n");
                                 writeInitLogFile(logstr);
@@ -8416,7 +8815,7 @@ void set_Hardware_version(unsigned int value)
 #endif
     void open_core(bool nullwork_enable)
     {
-        unsigned int i = 0, j = 0, k, m, work_id = 0, ret = 0, value = 0, work_fifo_ready = 0, loop=0;
+        unsigned int i = 0, j = 0, k, m, work_id = 0, ret = 0, work_fifo_ready = 0, loop=0;
         unsigned char gateblk[4] = {0,0,0,0};
         unsigned int cmd_buf[3] = {0,0,0}, buf[TW_WRITE_COMMAND_LEN/sizeof(unsigned int)]= {0};
         unsigned int buf_vil_tw[TW_WRITE_COMMAND_LEN_VIL/sizeof(unsigned int)]= {0};
@@ -8455,10 +8854,7 @@ void set_Hardware_version(unsigned int value)
             {
                 if(dev->chain_exist[i] == 1)
                 {
-                    set_BC_command_buffer(cmd_buf);
-                    ret = get_BC_write_command();
-                    value = BC_COMMAND_BUFFER_READY | BC_COMMAND_EN_CHAIN_ID | (i << 16) | (ret & 0xfff0ffff);
-                    set_BC_write_command(value);
+                    bc_send(i, cmd_buf);
                     cgsleep_us(10000);
 
                     for(m=0; m<loop; m++)
@@ -8562,12 +8958,7 @@ void set_Hardware_version(unsigned int value)
                     work_vil_1387.work_count = 0;
                     work_vil_1387.data[0] = 0xff;
                     work_vil_1387.data[11] = 0xff;
-                    set_BC_command_buffer(cmd_buf);
-
-                    ret = get_BC_write_command();
-                    value = BC_COMMAND_BUFFER_READY | BC_COMMAND_EN_CHAIN_ID | (i << 16) | (ret & 0xfff0ffff);
-                    //ret &= ~BC_COMMAND_EN_NULL_WORK;
-                    set_BC_write_command(value);
+                    bc_send(i, cmd_buf);
                     cgsleep_us(10000);
 
                     for(m=0; m<loop; m++)
@@ -8643,7 +9034,7 @@ void set_Hardware_version(unsigned int value)
 
     void open_core_one_chain(int chainIndex, bool nullwork_enable)
     {
-        unsigned int i = 0, j = 0, k, m, work_id = 0, ret = 0, value = 0, work_fifo_ready = 0, loop=0;
+        unsigned int i = 0, j = 0, k, m, work_id = 0, ret = 0, work_fifo_ready = 0, loop=0;
         unsigned char gateblk[4] = {0,0,0,0};
         unsigned int cmd_buf[3] = {0,0,0}, buf[TW_WRITE_COMMAND_LEN/sizeof(unsigned int)]= {0};
         unsigned int buf_vil_tw[TW_WRITE_COMMAND_LEN_VIL/sizeof(unsigned int)]= {0};
@@ -8684,10 +9075,7 @@ void set_Hardware_version(unsigned int value)
             {
                 if(dev->chain_exist[i] == 1)
                 {
-                    set_BC_command_buffer(cmd_buf);
-                    ret = get_BC_write_command();
-                    value = BC_COMMAND_BUFFER_READY | BC_COMMAND_EN_CHAIN_ID | (i << 16) | (ret & 0xfff0ffff);
-                    set_BC_write_command(value);
+                    bc_send(i, cmd_buf);
                     cgsleep_us(10000);
 
                     for(m=0; m<loop; m++)
@@ -8792,12 +9180,7 @@ void set_Hardware_version(unsigned int value)
                     work_vil_1387.work_count = 0;
                     work_vil_1387.data[0] = 0xff;
                     work_vil_1387.data[11] = 0xff;
-                    set_BC_command_buffer(cmd_buf);
-
-                    ret = get_BC_write_command();
-                    value = BC_COMMAND_BUFFER_READY | BC_COMMAND_EN_CHAIN_ID | (i << 16) | (ret & 0xfff0ffff);
-                    //ret &= ~BC_COMMAND_EN_NULL_WORK;
-                    set_BC_write_command(value);
+                    bc_send(i, cmd_buf);
                     cgsleep_us(10000);
 
                     for(m=0; m<loop; m++)
@@ -8873,7 +9256,7 @@ void set_Hardware_version(unsigned int value)
 
     void open_core_onChain(int chainIndex, int coreNum, int opencore_num, bool nullwork_enable)
     {
-        unsigned int i = 0, j = 0, k, m, work_id = 0, ret = 0, value = 0, work_fifo_ready = 0, loop=0;
+        unsigned int i = 0, j = 0, k, m, work_id = 0, ret = 0, work_fifo_ready = 0, loop=0;
         unsigned char gateblk[4] = {0,0,0,0};
         unsigned int cmd_buf[3] = {0,0,0}, buf[TW_WRITE_COMMAND_LEN/sizeof(unsigned int)]= {0};
         unsigned int buf_vil_tw[TW_WRITE_COMMAND_LEN_VIL/sizeof(unsigned int)]= {0};
@@ -8909,10 +9292,7 @@ void set_Hardware_version(unsigned int value)
             {
                 if(dev->chain_exist[i] == 1)
                 {
-                    set_BC_command_buffer(cmd_buf);
-                    ret = get_BC_write_command();
-                    value = BC_COMMAND_BUFFER_READY | BC_COMMAND_EN_CHAIN_ID | (i << 16) | (ret & 0xfff0ffff);
-                    set_BC_write_command(value);
+                    bc_send(i, cmd_buf);
                     cgsleep_us(10000);
 
                     for(m=0; m<loop; m++)
@@ -9017,12 +9397,7 @@ void set_Hardware_version(unsigned int value)
                     work_vil_1387.work_count = 0;
                     work_vil_1387.data[0] = 0xff;
                     work_vil_1387.data[11] = 0xff;
-                    set_BC_command_buffer(cmd_buf);
-
-                    ret = get_BC_write_command();
-                    value = BC_COMMAND_BUFFER_READY | BC_COMMAND_EN_CHAIN_ID | (i << 16) | (ret & 0xfff0ffff);
-                    //ret &= ~BC_COMMAND_EN_NULL_WORK;
-                    set_BC_write_command(value);
+                    bc_send(i, cmd_buf);
                     cgsleep_us(10000);
 
                     for(m=0; m<loop; m++)
@@ -9126,6 +9501,7 @@ void set_Hardware_version(unsigned int value)
         int each_asic_freq;
         int freq_test=PRE_OPENCORE_FREQ;    //300M
         int freq_value=atoi(freq_pll_1385[freq_test].freq);
+        struct bc_queue q = {0};
 
         for(j=0; j<2; j++)
         {
@@ -9135,8 +9511,11 @@ void set_Hardware_version(unsigned int value)
 
                 for(each_asic_freq = 0; each_asic_freq < CHAIN_ASIC_NUM; each_asic_freq ++)
                 {
-                    set_frequency_with_addr_plldatai(freq_test, 0, each_asic_freq * dev->addrInterval, chainIndex);
+                    bc_queue_frequency(&q, freq_test, 0, each_asic_freq * dev->addrInterval, chainIndex);
                 }
+                bc_queue_run(&q);
+                bc_queue_free(&q);
+                cgsleep_us(opt_multi_version ? 10000 : 5000);
 
                 dev->timeout = 0x1000000/calculate_core_number(BM1387_CORE_NUM)*dev->addrInterval/freq_value*10/100;    // 10% timeout
                 set_time_out_control(((dev->timeout) & MAX_TIMEOUT_VALUE) | TIME_OUT_VALID);
@@ -9169,21 +9548,13 @@ void set_Hardware_version(unsigned int value)
     }
 #endif
 
+    // route a register reply from the fifo to the queue of its chain
     void insert_reg_data(unsigned int *buf)
     {
+        struct reg_queue *q = &reg_queue[CHAIN_NUMBER(buf[0])];
+        struct reg_content *reply;
         char logstr[256];
 
-        if(reg_value_buf.reg_value_num >= MAX_NONCE_NUMBER_IN_FIFO || reg_value_buf.p_wr >= MAX_NONCE_NUMBER_IN_FIFO)
-        {
-            clear_register_value_buf();
-            return;
-        }
-        pthread_mutex_lock(&reg_mutex);
-
-        reg_value_buf.reg_buffer[reg_value_buf.p_wr].reg_value    = buf[1];
-        reg_value_buf.reg_buffer[reg_value_buf.p_wr].crc          = (buf[0] >> 24) & 0x1f;
-        reg_value_buf.reg_buffer[reg_value_buf.p_wr].chain_number = CHAIN_NUMBER(buf[0]);
-
 #ifdef DEBUG_XILINX_NONCE_NOTENOUGH
         if(doTestPatten)
         {
@@ -9195,43 +9566,110 @@ void set_Hardware_version(unsigned int value)
         }
 #endif
 
-        if(reg_value_buf.p_wr < MAX_NONCE_NUMBER_IN_FIFO )
+        pthread_mutex_lock(&q->lock);
+        q->received++;
+        if(q->p_wr - q->p_rd >= REG_QUEUE_SIZE)
         {
-            reg_value_buf.p_wr++;
+            q->overflow++;
         }
         else
         {
-            reg_value_buf.p_wr = 0;
+            reply = &q->reg_buffer[q->p_wr % REG_QUEUE_SIZE];
+            reply->reg_value    = buf[1];
+            reply->crc          = (buf[0] >> 24) & 0x1f;
+            reply->chain_number = CHAIN_NUMBER(buf[0]);
+            q->p_wr++;
+            pthread_cond_signal(&q->cond);
         }
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    /* Copy one nonce2/job_id record out of the uncached table in 16 byte bursts,
+     * instead of a bus read per field and per midstate byte.
+     */
+    static inline void read_nonce_record(struct nonce_record *rec, unsigned int work_id)
+    {
+        const uint32_t *src = (const uint32_t *)((unsigned char *)nonce2_jobid_address + work_id*NONCE2_AND_JOBID_ALIGN);
+        uint32_t *dst = (uint32_t *)rec;
+
+        // the FPGA rewrites the table behind our back, never let gcc reuse an earlier read
+        __asm__ __volatile__("" ::: "memory");
+#ifdef __ARM_NEON__
+        vst1q_u32(dst, vld1q_u32(src));
+        vst1q_u32(dst + 4, vld1q_u32(src + 4));
+        vst1q_u32(dst + 8, vld1q_u32(src + 8));
+        vst1q_u32(dst + 12, vld1q_u32(src + 12));
+#else
+        int i;
+
+        for(i=0; i<NONCE2_AND_JOBID_ALIGN/4; i++)
+            dst[i] = src[i];
+#endif
+    }
+
+    // --fpga-capture: a fifo word as read and, for a nonce, the record it points at
+    static void capture_fifo_word(unsigned int *buf)
+    {
+        struct nonce_record rec;
 
-        if(reg_value_buf.reg_value_num < MAX_NONCE_NUMBER_IN_FIFO)
+        if((buf[0] & WORK_ID_OR_CRC) && (buf[0] & NONCE_INDICATOR))
         {
-            reg_value_buf.reg_value_num++;
+            read_nonce_record(&rec, WORK_ID_OR_CRC_VALUE(buf[0]));
+            capture_c5_fifo(buf, &rec);
         }
         else
+            capture_c5_fifo(buf, NULL);
+    }
+
+    /* Wait until the nonce fifo is worth reading again, given how many entries the
+     * last read found. The poll interval follows the fill level: it backs off while
+     * the fifo is found empty and halves when a read finds it more than
+     * NONCE_FIFO_TARGET full.
+     */
+    static void nonce_fifo_wait(unsigned int nonce_number)
+    {
+        nonce_fifo_wakeups++;
+        if(nonce_number > nonce_fifo_hwm)
+            nonce_fifo_hwm = nonce_number;
+        if(nonce_number >= MAX_NONCE_NUMBER_IN_FIFO)
+            nonce_fifo_full++;
+
+        if(nonce_number == 0)
+        {
+            nonce_poll_us += nonce_poll_us / 4;
+            if(nonce_poll_us > NONCE_POLL_MAX_US)
+                nonce_poll_us = NONCE_POLL_MAX_US;
+        }
+        else if(nonce_number > NONCE_FIFO_TARGET)
         {
-            reg_value_buf.reg_value_num = MAX_NONCE_NUMBER_IN_FIFO;
+            nonce_poll_us /= 2;
+            if(nonce_poll_us < NONCE_POLL_MIN_US)
+                nonce_poll_us = NONCE_POLL_MIN_US;
         }
-        //applog(LOG_NOTICE,"%s: p_wr = %d reg_value_num = %d\n", __FUNCTION__,reg_value_buf.p_wr,reg_value_buf.reg_value_num);
-        pthread_mutex_unlock(&reg_mutex);
+        cgsleep_us(nonce_poll_us);
     }
 
     void * get_nonce_and_register()
     {
-        unsigned int work_id=0, *data_addr=NULL;
-        unsigned int i=0, j=0, m=0, nonce_number = 0, read_loop=0;
+        unsigned int work_id=0;
+        unsigned int i=0, j=0, nonce_number = 0, read_loop=0;
         unsigned int buf[2] = {0,0};
-        uint64_t n2h = 0, n2l = 0;
         char ret = 0;
-        unsigned int nonce_p_wr=0, nonce_p_rd=0, nonce_nonce_num=0, nonce_loop_back=0;
+        struct nonce_content *nonce = NULL;
+        struct nonce_worker *worker;
+        struct nonce_record rec;
+        unsigned int got_nonce = 0;     // bit per nonce_workers[] that got something in this batch
+        unsigned int nonce_got = 0;
+        cgtimer_t ts_read, ts_done, ts_diff;
         unsigned int reg_p_wr=0, reg_p_rd=0, reg_reg_value_num=0, reg_loop_back=0;
         char *buf_hex = NULL;
 
         while(1)
         {
-            cgsleep_ms(1);
+            nonce_fifo_wait(nonce_number);
             if(doTestPatten)
             {
+                nonce_number = 0;
                 cgsleep_ms(100);
                 continue;
             }
@@ -9243,105 +9681,79 @@ void set_Hardware_version(unsigned int value)
             if(nonce_number)
             {
                 read_loop = nonce_number;
+                got_nonce = 0;
+                nonce_got = 0;
+                cgtimer_time(&ts_read);
                 applog(LOG_DEBUG,"%s: read_loop = %d\n", __FUNCTION__, read_loop);
 
                 for(j=0; j<read_loop; j++)
                 {
                     get_return_nonce(buf);
+                    if(capture_c5_active)
+                        capture_fifo_word(buf);
                     if(buf[0] & WORK_ID_OR_CRC) //nonce
                     {
                         if(gBegin_get_nonce)
                         {
                             if(buf[0] & NONCE_INDICATOR)
                             {
-                                pthread_mutex_lock(&nonce_mutex);
+                                worker = &nonce_workers[__atomic_load_n(&nonce_chain_worker[buf[0] & 0x0000000f], __ATOMIC_RELAXED)];
+                                nonce = nonce_ring_reserve(&worker->ring);
+                                if(!nonce)
+                                    continue;
+
                                 work_id = WORK_ID_OR_CRC_VALUE(buf[0]);
-                                data_addr = (unsigned int *)((unsigned char *)nonce2_jobid_address + work_id*64);
-                                nonce_read_out.nonce_buffer[nonce_read_out.p_wr].work_id          = work_id;
-                                nonce_read_out.nonce_buffer[nonce_read_out.p_wr].nonce3           = buf[1];
-                                nonce_read_out.nonce_buffer[nonce_read_out.p_wr].chain_num        = buf[0] & 0x0000000f;
-                                nonce_read_out.nonce_buffer[nonce_read_out.p_wr].job_id           = *(data_addr + JOB_ID_OFFSET);
-                                nonce_read_out.nonce_buffer[nonce_read_out.p_wr].header_version   = *(data_addr + HEADER_VERSION_OFFSET);
-                                n2h = *(data_addr + NONCE2_H_OFFSET);
-                                n2l = *(data_addr + NONCE2_L_OFFSET);
-                                nonce_read_out.nonce_buffer[nonce_read_out.p_wr].nonce2           = (n2h << 32) | (n2l);
-
-                                for(m=0; m<MIDSTATE_LEN; m++)
-                                {
-                                    nonce_read_out.nonce_buffer[nonce_read_out.p_wr].midstate[m]  = *((unsigned char *)data_addr + MIDSTATE_OFFSET + m);
-                                }
+                                read_nonce_record(&rec, work_id);
+                                nonce->work_id          = work_id;
+                                nonce->nonce3           = buf[1];
+                                nonce->chain_num        = buf[0] & 0x0000000f;
+                                nonce->job_id           = rec.job_id;
+                                nonce->header_version   = rec.header_version;
+                                nonce->nonce2           = ((uint64_t)rec.nonce2_h << 32) | rec.nonce2_l;
+                                memcpy(nonce->midstate, rec.midstate, MIDSTATE_LEN);
 #ifdef DEBUG_LOG
                                 applog(LOG_DEBUG,"%s: buf[0] = 0x%x\n", __FUNCTION__, buf[0]);
                                 applog(LOG_DEBUG,"%s: work_id = 0x%x\n", __FUNCTION__, work_id);
                                 applog(LOG_DEBUG,"%s: nonce2_jobid_address = 0x%x\n", __FUNCTION__, nonce2_jobid_address);
-                                applog(LOG_DEBUG,"%s: data_addr = 0x%x\n", __FUNCTION__, data_addr);
-                                applog(LOG_DEBUG,"%s: nonce3 = 0x%x\n", __FUNCTION__, nonce_read_out.nonce_buffer[nonce_read_out.p_wr].nonce3);
-                                applog(LOG_DEBUG,"%s: job_id = 0x%x\n", __FUNCTION__, nonce_read_out.nonce_buffer[nonce_read_out.p_wr].job_id);
-                                applog(LOG_DEBUG,"%s: header_version = 0x%x\n", __FUNCTION__, nonce_read_out.nonce_buffer[nonce_read_out.p_wr].header_version);
-                                applog(LOG_DEBUG,"%s: nonce2 = 0x%x\n", __FUNCTION__, nonce_read_out.nonce_buffer[nonce_read_out.p_wr].nonce2);
+                                applog(LOG_DEBUG,"%s: nonce3 = 0x%x\n", __FUNCTION__, nonce->nonce3);
+                                applog(LOG_DEBUG,"%s: job_id = 0x%x\n", __FUNCTION__, nonce->job_id);
+                                applog(LOG_DEBUG,"%s: header_version = 0x%x\n", __FUNCTION__, nonce->header_version);
+                                applog(LOG_DEBUG,"%s: nonce2 = 0x%x\n", __FUNCTION__, nonce->nonce2);
 
-                                buf_hex = bin2hex(nonce_read_out.nonce_buffer[nonce_read_out.p_wr].midstate,32);
+                                buf_hex = bin2hex(nonce->midstate,32);
 
                                 applog(LOG_DEBUG,"%s: midstate: %s\n", __FUNCTION__, buf_hex);
 
                                 free(buf_hex);
 #endif
-
-                                if(nonce_read_out.p_wr < MAX_NONCE_NUMBER_IN_FIFO)
-                                {
-                                    nonce_read_out.p_wr++;
-                                }
-                                else
-                                {
-                                    nonce_read_out.p_wr = 0;
-                                }
-
-                                if(nonce_read_out.nonce_num < MAX_NONCE_NUMBER_IN_FIFO)
-                                {
-                                    nonce_read_out.nonce_num++;
-                                }
-                                else
-                                {
-                                    nonce_read_out.nonce_num = MAX_NONCE_NUMBER_IN_FIFO;
-                                }
-
-                                pthread_mutex_unlock(&nonce_mutex);
+                                nonce->tv_read = ts_read;
+                                nonce_ring_commit(&worker->ring);
+                                got_nonce |= 1 << (worker - nonce_workers);
+                                nonce_got++;
                             }
                         }
                     }
                     else    //reg value
                     {
-                        if(reg_value_buf.reg_value_num >= MAX_NONCE_NUMBER_IN_FIFO || reg_value_buf.p_wr >= MAX_NONCE_NUMBER_IN_FIFO)
-                        {
-                            clear_register_value_buf();
-                            continue;
-                        }
-                        pthread_mutex_lock(&reg_mutex);
+                        insert_reg_data(buf);
+                    }
+                }
 
-                        reg_value_buf.reg_buffer[reg_value_buf.p_wr].reg_value    = buf[1];
-                        reg_value_buf.reg_buffer[reg_value_buf.p_wr].crc          = (buf[0] >> 24) & 0x1f;
-                        reg_value_buf.reg_buffer[reg_value_buf.p_wr].chain_number = CHAIN_NUMBER(buf[0]);
+                if(capture_c5_active)
+                    capture_c5_fifo_end();
 
-                        if(reg_value_buf.p_wr < MAX_NONCE_NUMBER_IN_FIFO )
-                        {
-                            reg_value_buf.p_wr++;
-                        }
-                        else
-                        {
-                            reg_value_buf.p_wr = 0;
-                        }
+                if(nonce_got)
+                {
+                    cgtimer_time(&ts_done);
+                    cgtimer_sub(&ts_done, &ts_read, &ts_diff);
+                    nonce_read_ns += (uint64_t)ts_diff.tv_sec * 1000000000 + ts_diff.tv_nsec;
+                    nonce_read_count += nonce_got;
+                }
 
-                        if(reg_value_buf.reg_value_num < MAX_NONCE_NUMBER_IN_FIFO)
-                        {
-                            reg_value_buf.reg_value_num++;
-                        }
-                        else
-                        {
-                            reg_value_buf.reg_value_num = MAX_NONCE_NUMBER_IN_FIFO;
-                        }
-                        //applog(LOG_NOTICE,"%s: p_wr = %d reg_value_num = %d\n", __FUNCTION__,reg_value_buf.p_wr,reg_value_buf.reg_value_num);
-                        pthread_mutex_unlock(&reg_mutex);
-                    }
+                for(i=0; got_nonce; i++, got_nonce >>= 1)
+                {
+                    if(got_nonce & 1)
+                        cgsem_post(&nonce_workers[i].ready);
                 }
             }
         }
@@ -9929,328 +10341,495 @@ void set_Hardware_version(unsigned int value)
         system("cp /tmp/lasttemp /tmp/err3.log -f");
     }
 
-    int bitmain_c5_init(struct init_config config)
+    static const char *chain_init_phase_name[CHAIN_INIT_PHASES] =
     {
-        char ret=0,j;
-        uint16_t crc = 0;
-        bool test_result;
-        int i=0,x = 0,y = 0;
-        int hardware_version;
-        unsigned int data = 0;
-        bool testRet;
-        int testCounter=0;
-        struct sysinfo si;
+        "PIC", "voltage", "reset", "asic check", "address", "freq", "baud", "open core"
+    };
+
+    /* Close the chain's current bring-up phase, logging how long it took, and
+     * start phase. CHAIN_INIT_DONE only closes it. A chain already in phase
+     * stays in it, timed from when it started.
+     */
+    void chain_init_phase(int chain, int phase)
+    {
+        struct chain_init *ci = &chain_init_state[chain];
+        cgtimer_t now;
+        int ms, i;
         char logstr[256];
 
-#ifdef DISABLE_FINAL_TEST   // if disable test mode, we need set two value and save into files on flash
-        saveRestartNum(2);
-        saveRebootTestNum(0);
-#endif
+        if(ci->phase == phase)
+            return;
 
-        clearInitLogFile();
+        cgtimer_time(&now);
+        if(ci->phase != CHAIN_INIT_DONE)
+        {
+            ms = cgtimer_us_diff(&now, &ci->phase_start) / 1000;
+            ci->phase_ms[ci->phase] += ms;
+            sprintf(logstr,"Chain[J%d] %s took %d ms\n", chain+1, chain_init_phase_name[ci->phase], ms);
+            writeInitLogFile(logstr);
+        }
+        if(phase == CHAIN_INIT_DONE && ci->phase != CHAIN_INIT_DONE)
+        {
+            for(ms=0, i=0; i < CHAIN_INIT_PHASES; i++)
+                ms += ci->phase_ms[i];
+            sprintf(logstr,"Chain[J%d] bring-up took %d ms\n", chain+1, ms);
+            writeInitLogFile(logstr);
+        }
+        ci->phase = phase;
+        ci->phase_start = now;
+    }
 
-        isC5_CtrlBoard=isC5_Board();
+    void chain_init_phase_all(int phase)
+    {
+        int i;
 
-        if(isC5_CtrlBoard)
+        for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
         {
-#ifdef R4
-            MIN_PWM_PERCENT=MIN_PWM_PERCENT_C5;
-            MID_PWM_PERCENT=MID_PWM_PERCENT_C5;
-            MAX_PWM_PERCENT=MAX_PWM_PERCENT_C5;
-            MAX_TEMP=MAX_TEMP_C5;
-            MAX_FAN_TEMP=MAX_FAN_TEMP_C5;
-            MID_FAN_TEMP=MID_FAN_TEMP_C5;
-            MIN_FAN_TEMP=MIN_FAN_TEMP_C5;
-            MAX_PCB_TEMP=MAX_PCB_TEMP_C5;
-            MAX_FAN_PCB_TEMP=MAX_FAN_PCB_TEMP_C5;
-#endif
-
-            PHY_MEM_NONCE2_JOBID_ADDRESS=PHY_MEM_NONCE2_JOBID_ADDRESS_C5;
-            sprintf(logstr,"This is C5 board.\n");
+            if(dev->chain_exist[i] == 1)
+                chain_init_phase(i, phase);
         }
-        else
-        {
-#ifdef R4
-            MIN_PWM_PERCENT=MIN_PWM_PERCENT_XILINX;
-            MID_PWM_PERCENT=MID_PWM_PERCENT_XILINX;
-            MAX_PWM_PERCENT=MAX_PWM_PERCENT_XILINX;
-            MAX_TEMP=MAX_TEMP_XILINX;
-            MAX_FAN_TEMP=MAX_FAN_TEMP_XILINX;
-            MID_FAN_TEMP=MID_FAN_TEMP_XILINX;
-            MIN_FAN_TEMP=MIN_FAN_TEMP_XILINX;
-            MAX_PCB_TEMP=MAX_PCB_TEMP_XILINX;
-            MAX_FAN_PCB_TEMP=MAX_FAN_PCB_TEMP_XILINX;
-#endif
+    }
 
-            sysinfo(&si);
+    /* Run phase on every chain, as a state machine per chain: step does one
+     * step of the chain and says how long the chain then has to settle. The
+     * steps themselves run one at a time, the FPGA command buffer and the PIC
+     * bus being shared, but one chain's settle time is spent on the others.
+     */
+    void chain_init_run(int phase, int (*step)(int chain, struct chain_init *ci))
+    {
+        struct chain_init *ci;
+        cgtimer_t now, wake;
+        bool running, stepped, waiting;
+        int chain, ms;
+        int64_t us;
 
-            if(si.totalram > 1000000000)
+        for(chain=0; chain < BITMAIN_MAX_CHAIN_NUM; chain++)
+        {
+            ci = &chain_init_state[chain];
+            ci->step = -1;
+            if(dev->chain_exist[chain] == 1)
             {
-                PHY_MEM_NONCE2_JOBID_ADDRESS=PHY_MEM_NONCE2_JOBID_ADDRESS_XILINX_1GB;
-
-                sprintf(logstr, "Detect 1GB control board of XILINX\n");
+                chain_init_phase(chain, phase);
+                ci->step = 0;
+                ci->retries = 0;
+                ci->not_before = ci->phase_start;
             }
-            else if(si.totalram > 500000000)
+        }
+
+        do
+        {
+            running = stepped = waiting = false;
+            for(chain=0; chain < BITMAIN_MAX_CHAIN_NUM; chain++)
             {
-                PHY_MEM_NONCE2_JOBID_ADDRESS=PHY_MEM_NONCE2_JOBID_ADDRESS_XILINX_512MB;
+                ci = &chain_init_state[chain];
+                if(ci->step < 0)
+                    continue;
+                running = true;
 
-                sprintf(logstr, "Detect 512MB control board of XILINX\n");
+                cgtimer_time(&now);
+                if(cgtimer_us_diff(&ci->not_before, &now) > 0)
+                {
+                    if(!waiting || cgtimer_us_diff(&ci->not_before, &wake) < 0)
+                        wake = ci->not_before;
+                    waiting = true;
+                    continue;
+                }
+
+                ms = step(chain, ci);
+                stepped = true;
+                if(ms < 0 || dev->chain_exist[chain] != 1)
+                {
+                    ci->step = -1;
+                    continue;
+                }
+                cgtimer_time(&ci->not_before);
+                ci->not_before.tv_sec += ms / 1000;
+                ci->not_before.tv_nsec += (ms % 1000) * 1000000;
+                if(ci->not_before.tv_nsec >= 1000000000)
+                {
+                    ci->not_before.tv_sec++;
+                    ci->not_before.tv_nsec -= 1000000000;
+                }
             }
-            else
+            if(!stepped && waiting)
             {
-                PHY_MEM_NONCE2_JOBID_ADDRESS=PHY_MEM_NONCE2_JOBID_ADDRESS_XILINX_256MB;
-
-                sprintf(logstr, "Detect 256MB control board of XILINX\n");
+                cgtimer_time(&now);
+                us = cgtimer_us_diff(&wake, &now);
+                if(us > 0)
+                    cgsleep_us(us);
             }
         }
-        writeInitLogFile(logstr);
-
-#ifdef R4       // if defined , for R4  63 chips
-        sprintf(logstr,"Miner Type = R4\n");
-        writeInitLogFile(logstr);
-#endif
-
-#ifdef S9_PLUS  // if defined , for T9  57 chips
-        sprintf(logstr,"Miner Type = T9\n");
-        writeInitLogFile(logstr);
-#endif
-
-#ifdef S9_63    // if defined , for S9  63 chips
-        sprintf(logstr,"Miner Type = S9\n");
-        writeInitLogFile(logstr);
-#endif
+        while(running);
+    }
 
-#ifdef T9_18    // if defined , for T9+  18 chips
-        sprintf(logstr,"Miner Type = T9+\n");
-        writeInitLogFile(logstr);
-#endif
+    // sleep until ms after since
+    static void chain_init_wait(cgtimer_t *since, int ms)
+    {
+        cgtimer_t now;
+        int64_t us;
 
-        memcpy(&config_parameter, &config, sizeof(struct init_config));
+        cgtimer_time(&now);
+        us = (int64_t)ms * 1000 - cgtimer_us_diff(&now, since);
+        if(us > 0)
+            cgsleep_us(us);
+    }
 
-        if(config_parameter.token_type != INIT_CONFIG_TYPE)
-        {
-            applog(LOG_DEBUG,"%s: config_parameter.token_type != 0x%x, it is 0x%x\n", __FUNCTION__, INIT_CONFIG_TYPE, config_parameter.token_type);
-            return -1;
-        }
+#ifndef T9_18
+    static int pic_init_step(int chain, struct chain_init *ci)
+    {
+        char logstr[256];
+        int i = chain;
 
-        crc = CRC16((uint8_t*)(&config_parameter), sizeof(struct init_config) - sizeof(uint16_t));
-        if(crc != config_parameter.crc)
+        pthread_mutex_lock(&iic_mutex);
+        if(ci->step++ == 0)
         {
-            applog(LOG_DEBUG,"%s: config_parameter.crc = 0x%x, but we calculate it as 0x%x\n", __FUNCTION__, config_parameter.crc, crc);
-            return -2;
+            reset_iic_pic(i);
+            pthread_mutex_unlock(&iic_mutex);
+            return PIC_RESET_WAIT_MS;
         }
 
-        read_nonce_reg_id = calloc(1,sizeof(struct thr_info));
-        if(thr_info_create(read_nonce_reg_id, NULL, get_nonce_and_register, read_nonce_reg_id))
+        if(!isFixedFreqMode())
         {
-            applog(LOG_DEBUG,"%s: create thread for get nonce and register from FPGA failed\n", __FUNCTION__);
-            return -5;
-        }
+            set_pic_iic_flash_addr_pointer(i, PIC_FLASH_POINTER_FREQ_START_ADDRESS_H, PIC_FLASH_POINTER_FREQ_START_ADDRESS_L);
+            get_data_from_pic_flash(i, last_freq[i]);
+            get_data_from_pic_flash(i, last_freq[i]+16);
+            get_data_from_pic_flash(i, last_freq[i]+32);
+            get_data_from_pic_flash(i, last_freq[i]+48);
+            get_data_from_pic_flash(i, last_freq[i]+64);
+            get_data_from_pic_flash(i, last_freq[i]+80);
+            get_data_from_pic_flash(i, last_freq[i]+96);
+            get_data_from_pic_flash(i, last_freq[i]+112);
 
-        pthread_detach(read_nonce_reg_id->pth);
+            set_pic_iic_flash_addr_pointer(i, PIC_FLASH_POINTER_BADCORE_START_ADDRESS_H, PIC_FLASH_POINTER_BADCORE_START_ADDRESS_L);
+            get_data_from_pic_flash(i, badcore_num_buf[i]);
+            get_data_from_pic_flash(i, badcore_num_buf[i]+16);
+            get_data_from_pic_flash(i, badcore_num_buf[i]+32);
+            get_data_from_pic_flash(i, badcore_num_buf[i]+48);
 
-        //init axi
-        bitmain_axi_init();
+            if(last_freq[i][1] == FREQ_MAGIC && last_freq[i][40] == 0x23)   //0x23 is backup voltage magic number
+            {
+                chain_voltage_value[i]=(((last_freq[i][36]&0x0f)<<4)+(last_freq[i][38]&0x0f))*10;
 
-#ifdef USE_NEW_RESET_FPGA
-        set_reset_allhashboard(1);
-        sleep(RESET_KEEP_TIME);
-        set_reset_allhashboard(0);
-        sleep(1);
-        set_reset_allhashboard(1);
-#endif
+                sprintf(logstr,"Chain[J%d] has backup chain_voltage=%d\n",i+1,chain_voltage_value[i]);
+                writeInitLogFile(logstr);
+            }
 
-        //reset FPGA & HASH board
-        if(config_parameter.reset)
-        {
-            set_QN_write_data_command(RESET_HASH_BOARD | RESET_ALL | RESET_FPGA | RESET_TIME(RESET_HASHBOARD_TIME));
-#ifdef USE_NEW_RESET_FPGA
-            sleep(2);
-#else
-            while(get_QN_write_data_command() & RESET_HASH_BOARD)
+            if(last_freq[i][1] == FREQ_MAGIC && last_freq[i][46] == 0x23)   //0x23 is board temp magic number
             {
-                cgsleep_ms(30);
-            }
-            cgsleep_ms(500);
+                lowest_testOK_temp[i]=(signed char)(((last_freq[i][42]&0x0f)<<4)+(last_freq[i][44]&0x0f));
+
+                sprintf(logstr,"Chain[J%d] test patten OK temp=%d\n",i+1,lowest_testOK_temp[i]);
+                writeInitLogFile(logstr);
+
+#ifdef DISABLE_TEMP_PROTECT // for debug
+                if(lowest_testOK_temp[i]<MIN_TEMP_CONTINUE_DOWN_FAN)
+                    lowest_testOK_temp[i]=MIN_TEMP_CONTINUE_DOWN_FAN;   // if too low, we just set MIN_TEMP_CONTINUE_DOWN_FAN
 #endif
-            set_PWM(MAX_PWM_PERCENT);
+            }
         }
 
-#ifdef T9_18
-	// config fpga into T9+ mode
-	set_Hardware_version(0x80000000);
-#endif
+        jump_to_app_CheckAndRestorePIC(i);
+        if(opt_calibration_cache || opt_chip_autotune || opt_chip_autotune_dry_run)
+            get_hash_board_id_number(i, hash_board_id[i]);
 
-#ifdef DEBUG_PRINT_T9_PLUS_PIC_HEART_INFO
-        set_red_led(false); // close red led
-#endif
+        pthread_mutex_unlock(&iic_mutex);
+        return -1;
+    }
 
-        // need read FPGA version at first, used in T9+
-        hardware_version = get_hardware_version();
-        pcb_version = (hardware_version >> 16) & 0x00007fff;    // for T9+ the highest bit is used as config for S9 or T9+ mode, so use 7fff
-        fpga_version = hardware_version & 0x000000ff;
-        sprintf(g_miner_version, "%d.%d.%d.%d", fpga_version, pcb_version, C5_VERSION, BMMINER_VERSION);
+    // power cycle and reset a chain that did not answer with all its asics, and count again
+    static int asic_check_step(int chain, struct chain_init *ci)
+    {
+        char logstr[256];
+
+        switch(ci->step)
+        {
+            case 0:
+                if(dev->chain_asic_num[chain] == CHAIN_ASIC_NUM || ci->retries >= ASIC_RETRY_NUM)
+                    return -1;
+                dev->chain_asic_num[chain]=0;
 
 #ifdef USE_NEW_RESET_FPGA
-        set_reset_allhashboard(1);
+                set_reset_hashboard(chain,1);
 #endif
+                pthread_mutex_lock(&iic_mutex);
+                disable_pic_dac(chain);
+                pthread_mutex_unlock(&iic_mutex);
+                ci->step = 1;
+                return 1000;
 
-        dev->baud=DEFAULT_BAUD_VALUE;   // need set default value as init value
-
-        set_nonce2_and_job_id_store_address(PHY_MEM_NONCE2_JOBID_ADDRESS);
-        set_job_start_address(PHY_MEM_JOB_START_ADDRESS_1);
+            case 1:
+                pthread_mutex_lock(&iic_mutex);
+                enable_pic_dac(chain);
+                pthread_mutex_unlock(&iic_mutex);
+                ci->step = 2;
+                return 2000;
 
-        //check chain
-        check_chain();
+            case 2:
+                ci->step = 3;
+#ifdef USE_NEW_RESET_FPGA
+                set_reset_hashboard(chain,0);
+                return 1000;
+#else
+                reset_one_hashboard(chain);
+                return 0;
+#endif
 
-#ifdef T9_18
-        for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
-        {
-            if(dev->chain_exist[i] == 1)
-            {
-                if(fpga_version>=0xE)
-                {
-                    int new_T9_PLUS_chainIndex,new_T9_PLUS_chainOffset;
-                    getPICChainIndexOffset(i,&new_T9_PLUS_chainIndex,&new_T9_PLUS_chainOffset);
+            default:
+                check_asic_reg_oneChain(chain,CHIP_ADDRESS);
 
-                    pthread_mutex_lock(&iic_mutex);
-                    if(i>=1 && i<=3)
-                    {
-                        reset_iic_pic(i);
-                        jump_to_app_CheckAndRestorePIC_T9_18(i);
+                sprintf(logstr,"retry Chain[J%d] has %d asic\n",chain+1,dev->chain_asic_num[chain]);
+                writeInitLogFile(logstr);
 
-                        if(!isFixedFreqMode())
-                        {
-                            read_freq_badcores(i,chain_pic_buf[i]);
+                ci->retries++;
+                ci->step = 0;
+                return 0;
+        }
+    }
 
-                            sprintf(logstr,"Chain[%d] read_freq_badcores : ",i);
-                            writeInitLogFile(logstr);
-                            for(j=0; j<128; j++)
-                            {
-                                sprintf(logstr,"0x%02x ",chain_pic_buf[i][j]);
-                                writeInitLogFile(logstr);
-                            }
-                            sprintf(logstr,"\n");
-                            writeInitLogFile(logstr);
-                        }
-                    }
+#ifdef ENABLE_HIGH_VOLTAGE_OPENCORE
+    // open the cores at the open core voltage, and give the chain its working voltage once they settled
+    static int opencore_step(int chain, struct chain_init *ci)
+    {
+        char logstr[256];
+#ifdef DEBUG_DOWN_VOLTAGE_TEST
+        int vol_value;
+        unsigned char vol_pic;
+#endif
 
-                    if(!isFixedFreqMode())
-                    {
-                        if(chain_pic_buf[new_T9_PLUS_chainIndex][0] == FREQ_MAGIC)
-                        {
-                            chain_voltage_value[i]=chain_pic_buf[new_T9_PLUS_chainIndex][7+new_T9_PLUS_chainOffset*31+1]*10;
+        if(ci->step++ == 0)
+        {
+#ifdef USE_OPENCORE_ONEBYONE
+            opencore_onebyone_onChain(chain);
+#else
+            open_core_one_chain(chain,true);
+#endif
+            return OPENCORE_SETTLE_MS;
+        }
 
-                            sprintf(logstr,"Chain[J%d] has backup chain_voltage=%d\n",i+1,chain_voltage_value[i]);
-                            writeInitLogFile(logstr);
-                        }
+#ifdef DEBUG_DOWN_VOLTAGE_TEST
+        vol_value=getVolValueFromPICvoltage(chain_voltage_pic[chain])-DEBUG_DOWN_VOLTAGE_VALUE;
+        vol_pic=getPICvoltageFromValue(vol_value);
 
-                        lowest_testOK_temp[i]=(signed char)chain_pic_buf[new_T9_PLUS_chainIndex][7+new_T9_PLUS_chainOffset*31+3];
+        pthread_mutex_lock(&iic_mutex);
+        // restore the normal voltage
+        set_pic_voltage(chain, vol_pic);
+        pthread_mutex_unlock(&iic_mutex);
 
-                        sprintf(logstr,"Chain[J%d] test patten OK temp=%d\n",i+1,lowest_testOK_temp[i]);
-                        writeInitLogFile(logstr);
+        sprintf(logstr,"DEBUG MODE Chain[J%d] set working voltage=%d [%d] orignal voltage=%d [%d]\n",chain+1,vol_value,vol_pic,getVolValueFromPICvoltage(chain_voltage_pic[chain]),chain_voltage_pic[chain]);
+        writeInitLogFile(logstr);
+#else
+        pthread_mutex_lock(&iic_mutex);
+        // restore the normal voltage
+        set_pic_voltage(chain, chain_voltage_pic[chain]);
+        pthread_mutex_unlock(&iic_mutex);
 
-#ifdef DISABLE_TEMP_PROTECT // for debug
-                        if(lowest_testOK_temp[i]<MIN_TEMP_CONTINUE_DOWN_FAN)
-                            lowest_testOK_temp[i]=MIN_TEMP_CONTINUE_DOWN_FAN;   // if too low, we just set MIN_TEMP_CONTINUE_DOWN_FAN
+        sprintf(logstr,"Chain[J%d] set working voltage=%d [%d]\n",chain+1,getVolValueFromPICvoltage(chain_voltage_pic[chain]),chain_voltage_pic[chain]);
+        writeInitLogFile(logstr);
+#endif
+        return -1;
+    }
+#endif
 #endif
-                    }
-                    pthread_mutex_unlock(&iic_mutex);
-                }
-                else
-                {
-                    pthread_mutex_lock(&iic_mutex);
-                    // if(i%3==0) read into chain_pic_buf
 
-                    if(i%3==0)
-                    {
-                        reset_iic_pic(i);
-                        sleep(1);
-                        jump_to_app_CheckAndRestorePIC_T9_18(i);
+    /* Called on shutdown with RUN_BIT already clear. The hashboards keep their
+     * power, addresses, PLLs and open cores, so the next bmminer can take them
+     * over as they are instead of resetting them.
+     */
+    void save_warm_restart()
+    {
+        struct warm_restart_state *ws;
 
-                        if(!isFixedFreqMode())
-                            read_freq_badcores(i,chain_pic_buf[((i/3)*3)]);
-                    }
+        if(!opt_warm_restart || !c5_init_done || status_error)
+            return;
 
-                    if(!isFixedFreqMode())
-                    {
-                        if(chain_pic_buf[((i/3)*3)][0] == FREQ_MAGIC)
-                        {
-                            chain_voltage_value[i]=chain_pic_buf[((i/3)*3)][7+(i%3)*31+1]*10;
+        ws = calloc(1, sizeof(*ws));
+        if(!ws)
+            return;
 
-                            sprintf(logstr,"Chain[J%d] has backup chain_voltage=%d\n",i+1,chain_voltage_value[i]);
-                            writeInitLogFile(logstr);
-                        }
+        ws->magic = WARM_RESTART_MAGIC;
+        ws->version = WARM_RESTART_VERSION;
+        ws->size = sizeof(*ws);
+        cgtimer_time(&ws->saved);
+        ws->hardware_version = get_hardware_version();
+        ws->phy_mem_nonce2_jobid_address = PHY_MEM_NONCE2_JOBID_ADDRESS;
+        ws->multi_version = opt_multi_version;
+        ws->freq = opt_bitmain_c5_freq;
+        ws->voltage = opt_bitmain_c5_voltage;
+        ws->fixed_freq = opt_fixed_freq;
+        ws->is218_temp = is218_Temp;
+        memcpy(&ws->dev, dev, sizeof(ws->dev));
+        memcpy(ws->chain_voltage_pic, chain_voltage_pic, sizeof(ws->chain_voltage_pic));
+        memcpy(ws->chain_voltage_value, chain_voltage_value, sizeof(ws->chain_voltage_value));
+        memcpy(ws->lowest_testOK_temp, lowest_testOK_temp, sizeof(ws->lowest_testOK_temp));
+#ifdef T9_18
+        memcpy(ws->chain_pic_buf, chain_pic_buf, sizeof(ws->chain_pic_buf));
+#else
+        memcpy(ws->last_freq, last_freq, sizeof(ws->last_freq));
+        memcpy(ws->badcore_num_buf, badcore_num_buf, sizeof(ws->badcore_num_buf));
+#endif
+        memcpy(ws->chain_badcore_num, chain_badcore_num, sizeof(ws->chain_badcore_num));
+        memcpy(ws->show_last_freq, show_last_freq, sizeof(ws->show_last_freq));
+        memcpy(ws->chip_last_freq, chip_last_freq, sizeof(ws->chip_last_freq));
+        memcpy(ws->pic_temp_offset, pic_temp_offset, sizeof(ws->pic_temp_offset));
+        memcpy(ws->base_freq_index, base_freq_index, sizeof(ws->base_freq_index));
+        memcpy(ws->middle_offset, middle_Offset, sizeof(ws->middle_offset));
+        memcpy(ws->chip_freq_index, chip_freq_index, sizeof(ws->chip_freq_index));
+        memcpy(ws->chip_base_freq_index, chip_base_freq_index, sizeof(ws->chip_base_freq_index));
+        memcpy(ws->chain_base_voltage_pic, chain_base_voltage_pic, sizeof(ws->chain_base_voltage_pic));
+        memcpy(ws->hash_board_id, hash_board_id, sizeof(ws->hash_board_id));
+
+        write_state_file(WARM_RESTART_FILE, ws, sizeof(*ws), false);
+        applog(LOG_NOTICE,"%s: hashboard state saved for a warm restart", __FUNCTION__);
+        free(ws);
+    }
+
+    /* Take over the hashboards a previous bmminer left running, after checking
+     * they are the same boards, set up with the same options, and still answer
+     * with all their asics. Returns false, having changed nothing the cold init
+     * does not set again, when they can't be adopted.
+     */
+    static bool adopt_warm_restart(unsigned int hardware_version)
+    {
+        struct warm_restart_state *ws;
+        unsigned int chain_exist[BITMAIN_MAX_CHAIN_NUM];
+        cgtimer_t now;
+        bool ok;
+        char logstr[256];
+        int i;
 
-                        lowest_testOK_temp[i]=(signed char)chain_pic_buf[((i/3)*3)][7+(i%3)*31+3];
+        ws = calloc(1, sizeof(*ws));
+        if(!ws)
+            return false;
 
-                        sprintf(logstr,"Chain[J%d] test patten OK temp=%d\n",i+1,lowest_testOK_temp[i]);
-                        writeInitLogFile(logstr);
+        ok = read_state_file(WARM_RESTART_FILE, ws, sizeof(*ws));
+        unlink(WARM_RESTART_FILE);  // one chance only, a failed adoption falls back to a full reset
 
-#ifdef DISABLE_TEMP_PROTECT // for debug
-                        if(lowest_testOK_temp[i]<MIN_TEMP_CONTINUE_DOWN_FAN)
-                            lowest_testOK_temp[i]=MIN_TEMP_CONTINUE_DOWN_FAN;   // if too low, we just set MIN_TEMP_CONTINUE_DOWN_FAN
-#endif
-                    }
-                    pthread_mutex_unlock(&iic_mutex);
-                }
-            }
+        cgtimer_time(&now);
+        if(ok && (ws->magic != WARM_RESTART_MAGIC || ws->version != WARM_RESTART_VERSION || ws->size != sizeof(*ws)
+                  || cgtimer_us_diff(&now, &ws->saved) > WARM_RESTART_MAX_AGE * 1000000LL))
+        {
+            sprintf(logstr,"Warm restart: saved state is stale or of another version\n");
+            writeInitLogFile(logstr);
+            ok = false;
         }
-#else
-        for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+        if(ok && (ws->hardware_version != hardware_version || ws->multi_version != opt_multi_version
+                  || ws->freq != opt_bitmain_c5_freq || ws->voltage != opt_bitmain_c5_voltage || ws->fixed_freq != opt_fixed_freq))
         {
-            if(dev->chain_exist[i] == 1)
-            {
-                pthread_mutex_lock(&iic_mutex);
-                reset_iic_pic(i);
-                cgsleep_ms(500);
+            sprintf(logstr,"Warm restart: FPGA or hashboard options changed\n");
+            writeInitLogFile(logstr);
+            ok = false;
+        }
 
-                if(!isFixedFreqMode())
+        if(ok)
+        {
+            check_chain();
+            for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+            {
+                chain_exist[i] = dev->chain_exist[i];
+                if(chain_exist[i] != ws->dev.chain_exist[i])
                 {
-                    set_pic_iic_flash_addr_pointer(i, PIC_FLASH_POINTER_FREQ_START_ADDRESS_H, PIC_FLASH_POINTER_FREQ_START_ADDRESS_L);
-                    get_data_from_pic_flash(i, last_freq[i]);
-                    get_data_from_pic_flash(i, last_freq[i]+16);
-                    get_data_from_pic_flash(i, last_freq[i]+32);
-                    get_data_from_pic_flash(i, last_freq[i]+48);
-                    get_data_from_pic_flash(i, last_freq[i]+64);
-                    get_data_from_pic_flash(i, last_freq[i]+80);
-                    get_data_from_pic_flash(i, last_freq[i]+96);
-                    get_data_from_pic_flash(i, last_freq[i]+112);
-
-                    set_pic_iic_flash_addr_pointer(i, PIC_FLASH_POINTER_BADCORE_START_ADDRESS_H, PIC_FLASH_POINTER_BADCORE_START_ADDRESS_L);
-                    get_data_from_pic_flash(i, badcore_num_buf[i]);
-                    get_data_from_pic_flash(i, badcore_num_buf[i]+16);
-                    get_data_from_pic_flash(i, badcore_num_buf[i]+32);
-                    get_data_from_pic_flash(i, badcore_num_buf[i]+48);
+                    sprintf(logstr,"Warm restart: Chain[J%d] was %s\n",i+1,chain_exist[i] ? "plugged in" : "removed");
+                    writeInitLogFile(logstr);
+                    ok = false;
+                }
+            }
+        }
 
-                    if(last_freq[i][1] == FREQ_MAGIC && last_freq[i][40] == 0x23)   //0x23 is backup voltage magic number
-                    {
-                        chain_voltage_value[i]=(((last_freq[i][36]&0x0f)<<4)+(last_freq[i][38]&0x0f))*10;
+        if(ok)
+        {
+            // the chips still have their addresses and the FPGA its baud, so counting them is the sanity check
+            dev->addrInterval = ws->dev.addrInterval;
+            dev->baud = ws->dev.baud;
+            check_asic_reg(CHIP_ADDRESS);
+            for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+            {
+                if(chain_exist[i] == 1 && dev->chain_asic_num[i] != ws->dev.chain_asic_num[i])
+                {
+                    sprintf(logstr,"Warm restart: Chain[J%d] answers with %d asic, had %d\n",i+1,dev->chain_asic_num[i],ws->dev.chain_asic_num[i]);
+                    writeInitLogFile(logstr);
+                    ok = false;
+                }
+            }
+        }
 
-                        sprintf(logstr,"Chain[J%d] has backup chain_voltage=%d\n",i+1,chain_voltage_value[i]);
-                        writeInitLogFile(logstr);
-                    }
+        if(!ok)
+        {
+            free(ws);
+            return false;
+        }
 
-                    if(last_freq[i][1] == FREQ_MAGIC && last_freq[i][46] == 0x23)   //0x23 is board temp magic number
-                    {
-                        lowest_testOK_temp[i]=(signed char)(((last_freq[i][42]&0x0f)<<4)+(last_freq[i][44]&0x0f));
+        memcpy(dev, &ws->dev, sizeof(ws->dev));
+        dev->current_job_start_address = job_start_address_1;   // as bitmain_axi_init set the FPGA
+        for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            memset(dev->chain_asic_nonce[i], 0, sizeof(dev->chain_asic_nonce[i]));
+        }
+        carry_nonce_worker_chain_hw(ws->dev.chain_hw);
+        PHY_MEM_NONCE2_JOBID_ADDRESS = ws->phy_mem_nonce2_jobid_address;
+        is218_Temp = ws->is218_temp;
+        memcpy(chain_voltage_pic, ws->chain_voltage_pic, sizeof(ws->chain_voltage_pic));
+        memcpy(chain_voltage_value, ws->chain_voltage_value, sizeof(ws->chain_voltage_value));
+        memcpy(lowest_testOK_temp, ws->lowest_testOK_temp, sizeof(ws->lowest_testOK_temp));
+#ifdef T9_18
+        memcpy(chain_pic_buf, ws->chain_pic_buf, sizeof(ws->chain_pic_buf));
+#else
+        memcpy(last_freq, ws->last_freq, sizeof(ws->last_freq));
+        memcpy(badcore_num_buf, ws->badcore_num_buf, sizeof(ws->badcore_num_buf));
+#endif
+        memcpy(chain_badcore_num, ws->chain_badcore_num, sizeof(ws->chain_badcore_num));
+        memcpy(show_last_freq, ws->show_last_freq, sizeof(ws->show_last_freq));
+        memcpy(chip_last_freq, ws->chip_last_freq, sizeof(ws->chip_last_freq));
+        memcpy(pic_temp_offset, ws->pic_temp_offset, sizeof(ws->pic_temp_offset));
+        memcpy(base_freq_index, ws->base_freq_index, sizeof(ws->base_freq_index));
+        memcpy(middle_Offset, ws->middle_offset, sizeof(ws->middle_offset));
+        memcpy(chip_freq_index, ws->chip_freq_index, sizeof(ws->chip_freq_index));
+        memcpy(chip_base_freq_index, ws->chip_base_freq_index, sizeof(ws->chip_base_freq_index));
+        memcpy(chain_base_voltage_pic, ws->chain_base_voltage_pic, sizeof(ws->chain_base_voltage_pic));
+        memcpy(hash_board_id, ws->hash_board_id, sizeof(ws->hash_board_id));
+        free(ws);
 
-                        sprintf(logstr,"Chain[J%d] test patten OK temp=%d\n",i+1,lowest_testOK_temp[i]);
-                        writeInitLogFile(logstr);
+        set_nonce2_and_job_id_store_address(PHY_MEM_NONCE2_JOBID_ADDRESS);
+        set_job_start_address(PHY_MEM_JOB_START_ADDRESS_1);
+        set_nonce_fifo_interrupt(get_nonce_fifo_interrupt() | FLUSH_NONCE3_FIFO);
+        set_BC_write_command(get_BC_write_command() | BC_COMMAND_EN_NULL_WORK);   // the shutdown turned it off
+        if(opt_multi_version)
+            set_time_out_control(((dev->timeout * opt_multi_version) & MAX_TIMEOUT_VALUE) | TIME_OUT_VALID);
+        else
+            set_time_out_control(((dev->timeout) & MAX_TIMEOUT_VALUE) | TIME_OUT_VALID);
 
-#ifdef DISABLE_TEMP_PROTECT // for debug
-                        if(lowest_testOK_temp[i]<MIN_TEMP_CONTINUE_DOWN_FAN)
-                            lowest_testOK_temp[i]=MIN_TEMP_CONTINUE_DOWN_FAN;   // if too low, we just set MIN_TEMP_CONTINUE_DOWN_FAN
-#endif
-                    }
-                }
+        sprintf(logstr,"Warm restart: adopted the running hashboards\n");
+        writeInitLogFile(logstr);
+        return true;
+    }
 
-                jump_to_app_CheckAndRestorePIC(i);
+    // --fpga-capture: the chains a replay has to simulate
+    static void capture_chain_layout()
+    {
+        unsigned int mask = 0;
+        int i, chips = 0;
 
-                pthread_mutex_unlock(&iic_mutex);
-            }
+        if(!capture_c5_active)
+            return;
+        for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            if(dev->chain_exist[i] != 1 || dev->chain_asic_num[i] == 0)
+                continue;
+            mask |= 1 << i;
+            if(dev->chain_asic_num[i] > chips)
+                chips = dev->chain_asic_num[i];
         }
-#endif
+        capture_c5_chains(mask, chips);
+    }
+
+    // the part of bitmain_c5_init that adopted hashboards still need
+    static int bitmain_c5_resume()
+    {
+        int hardware_version;
+
+        hardware_version = get_hardware_version();
+        pcb_version = (hardware_version >> 16) & 0x00007fff;
+        fpga_version = hardware_version & 0x000000ff;
+        sprintf(g_miner_version, "%d.%d.%d.%d", fpga_version, pcb_version, C5_VERSION, BMMINER_VERSION);
 
         pic_heart_beat = calloc(1,sizeof(struct thr_info));
         if(thr_info_create(pic_heart_beat, NULL, pic_heart_beat_func, pic_heart_beat))
@@ -10260,261 +10839,598 @@ void set_Hardware_version(unsigned int value)
         }
         pthread_detach(pic_heart_beat->pth);
 
-        for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+        //check who control fan
+        dev->fan_eft = config_parameter.fan_eft;
+        dev->fan_pwm= config_parameter.fan_pwm_percent;
+        if(config_parameter.fan_eft)
         {
-            if(dev->chain_exist[i] == 1)
+            if((config_parameter.fan_pwm_percent >= 0) && (config_parameter.fan_pwm_percent <= 100))
             {
-                unsigned char vol_pic;
-                pthread_mutex_lock(&iic_mutex);
-
-#ifdef ENABLE_HIGH_VOLTAGE_OPENCORE
-                chain_voltage_pic[i] = get_pic_voltage(i);  // read orignal voltage at first!
-
-                vol_pic=getPICvoltageFromValue(HIGHEST_VOLTAGE_LIMITED_HW);
-
-#ifdef T9_18
-                sprintf(logstr,"Chain[J%d] will use voltage=%d [%d] to open core\n",i+1,HIGHEST_VOLTAGE_LIMITED_HW,vol_pic);
-                writeInitLogFile(logstr);
-
-                if(fpga_version>=0xE)
-                {
-                    if(i>=1 && i<=3)
-                        set_voltage_T9_18_into_PIC(i, vol_pic);
-                }
-                else
-                {
-                    if(i%3==0)
-                        set_voltage_T9_18_into_PIC(i, vol_pic);
-                }
-#else
-                set_pic_voltage(i, vol_pic);
-#endif
-#endif
-
-#ifndef T9_18
-                enable_pic_dac(i);
-#endif
-                pthread_mutex_unlock(&iic_mutex);
+                set_PWM(config_parameter.fan_pwm_percent);
+            }
+            else
+            {
+                set_PWM_according_to_temperature();
             }
         }
-
-        if(isFixedFreqMode())
+        else
         {
-            // we must set voltage value according to the freq of config file!
-            for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
-            {
-                if(dev->chain_exist[i] == 1)
-                {
-                    chain_voltage_value[i] = getFixedFreqVoltageValue(config_parameter.frequency);
-                    chain_voltage_pic[i] = getPICvoltageFromValue(chain_voltage_value[i]);
+            set_PWM_according_to_temperature();
+        }
 
-                    sprintf(logstr,"Fix freq=%d Chain[%d] voltage_pic=%d value=%d\n",config_parameter.frequency,i,chain_voltage_pic[i],chain_voltage_value[i]);
-                    writeInitLogFile(logstr);
-                }
-            }
+        read_temp_id = calloc(1,sizeof(struct thr_info));
+        if(thr_info_create(read_temp_id, NULL, read_temp_func, read_temp_id))
+        {
+            applog(LOG_DEBUG,"%s: create thread for read temp\n", __FUNCTION__);
+            return -7;
         }
+        pthread_detach(read_temp_id->pth);
 
-        if(!isFixedFreqMode())
+        check_system_work_id = calloc(1,sizeof(struct thr_info));
+        if(thr_info_create(check_system_work_id, NULL, check_system_work, check_system_work_id))
         {
-            cgsleep_ms(100);
-            for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
-            {
-                if(dev->chain_exist[i] == 1)
-                {
-                    int vol_value;
-                    unsigned char vol_pic;
-                    pthread_mutex_lock(&iic_mutex);
-#ifndef ENABLE_HIGH_VOLTAGE_OPENCORE
-                    chain_voltage_pic[i] = get_pic_voltage(i);
-#endif
-                    vol_value = getVolValueFromPICvoltage(chain_voltage_pic[i]);
+            applog(LOG_DEBUG,"%s: create thread for check system\n", __FUNCTION__);
+            return -6;
+        }
+        pthread_detach(check_system_work_id->pth);
 
-                    sprintf(logstr,"Chain[J%d] orignal chain_voltage_pic=%d value=%d\n",i+1,chain_voltage_pic[i],vol_value);
-                    writeInitLogFile(logstr);
+        warm_restarted = true;
+        autotune_start();
+        vf_optimise_start();
+        capture_chain_layout();
+        c5_init_done = true;
+        cgtime(&tv_send_job);
+        cgtime(&tv_send);
+        startCheckNetworkJob=true;
 
-#ifdef T9_18
-                    if(getChainPICMagicNumber(i)== FREQ_MAGIC)
-#else
-                    if(last_freq[i][1] == FREQ_MAGIC && last_freq[i][40] == 0x23)   //0x23 is backup voltage magic number
+        setStartTimePoint();
+        return 0;
+    }
+
+    int bitmain_c5_init(struct init_config config)
+    {
+        char ret=0,j;
+        uint16_t crc = 0;
+        bool test_result;
+        int i=0,x = 0,y = 0;
+        int hardware_version;
+        unsigned int data = 0;
+        bool testRet;
+        int testCounter=0;
+        struct sysinfo si;
+        char logstr[256];
+        cgtimer_t tv_reset, tv_voltage;
+        int voltage_settle_ms = 0;
+
+#ifdef DISABLE_FINAL_TEST   // if disable test mode, we need set two value and save into files on flash
+        saveRestartNum(2);
+        saveRebootTestNum(0);
 #endif
-                    {
-#ifndef DEBUG_KEEP_USE_PIC_VOLTAGE_WITHOUT_CHECKING_VOLTAGE_OF_SEARCHFREQ
-                        if(vol_value != chain_voltage_value[i]) // if not equal, we need force to set backup voltage to hashbaord!!!
-                        {
-                            vol_pic=getPICvoltageFromValue(chain_voltage_value[i]);
 
-                            sprintf(logstr,"Chain[J%d] will use backup chain_voltage_pic=%d [%d]\n",i+1,chain_voltage_value[i],vol_pic);
-                            writeInitLogFile(logstr);
+        clearInitLogFile();
 
-                            chain_voltage_pic[i] = vol_pic;
+        isC5_CtrlBoard=isC5_Board();
 
-#ifndef ENABLE_HIGH_VOLTAGE_OPENCORE
-#ifndef T9_18   // T9_18 only can call enable_pic_dac once after jump to app!!!
-                            set_pic_voltage(i, vol_pic);
-                            enable_pic_dac(i);
-#endif
+        if(isC5_CtrlBoard)
+        {
+#ifdef R4
+            MIN_PWM_PERCENT=MIN_PWM_PERCENT_C5;
+            MID_PWM_PERCENT=MID_PWM_PERCENT_C5;
+            MAX_PWM_PERCENT=MAX_PWM_PERCENT_C5;
+            MAX_TEMP=MAX_TEMP_C5;
+            MAX_FAN_TEMP=MAX_FAN_TEMP_C5;
+            MID_FAN_TEMP=MID_FAN_TEMP_C5;
+            MIN_FAN_TEMP=MIN_FAN_TEMP_C5;
+            MAX_PCB_TEMP=MAX_PCB_TEMP_C5;
+            MAX_FAN_PCB_TEMP=MAX_FAN_PCB_TEMP_C5;
 #endif
-                            sprintf(logstr,"Chain[J%d] get working chain_voltage_pic=%d\n",i+1,chain_voltage_pic[i]);
-                            writeInitLogFile(logstr);
-                        }
+
+            PHY_MEM_NONCE2_JOBID_ADDRESS=PHY_MEM_NONCE2_JOBID_ADDRESS_C5;
+            sprintf(logstr,"This is C5 board.\n");
+        }
+        else
+        {
+#ifdef R4
+            MIN_PWM_PERCENT=MIN_PWM_PERCENT_XILINX;
+            MID_PWM_PERCENT=MID_PWM_PERCENT_XILINX;
+            MAX_PWM_PERCENT=MAX_PWM_PERCENT_XILINX;
+            MAX_TEMP=MAX_TEMP_XILINX;
+            MAX_FAN_TEMP=MAX_FAN_TEMP_XILINX;
+            MID_FAN_TEMP=MID_FAN_TEMP_XILINX;
+            MIN_FAN_TEMP=MIN_FAN_TEMP_XILINX;
+            MAX_PCB_TEMP=MAX_PCB_TEMP_XILINX;
+            MAX_FAN_PCB_TEMP=MAX_FAN_PCB_TEMP_XILINX;
 #endif
-                    }
 
-                    pthread_mutex_unlock(&iic_mutex);
-                }
+            sysinfo(&si);
+
+            if(si.totalram > 1000000000)
+            {
+                PHY_MEM_NONCE2_JOBID_ADDRESS=PHY_MEM_NONCE2_JOBID_ADDRESS_XILINX_1GB;
+
+                sprintf(logstr, "Detect 1GB control board of XILINX\n");
             }
-            cgsleep_ms(1000);
-        }
+            else if(si.totalram > 500000000)
+            {
+                PHY_MEM_NONCE2_JOBID_ADDRESS=PHY_MEM_NONCE2_JOBID_ADDRESS_XILINX_512MB;
 
-#ifdef T9_18
-        // set voltage and enable it for only once!!!
-        for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
-        {
-            if(dev->chain_exist[i] == 1)
+                sprintf(logstr, "Detect 512MB control board of XILINX\n");
+            }
+            else
             {
-                pthread_mutex_lock(&iic_mutex);
-#ifndef ENABLE_HIGH_VOLTAGE_OPENCORE
-                set_pic_voltage(i, 0);  // the second parameter is not used, we set 0 for T9_18
-#endif
-                enable_pic_dac(i);
-                pthread_mutex_unlock(&iic_mutex);
+                PHY_MEM_NONCE2_JOBID_ADDRESS=PHY_MEM_NONCE2_JOBID_ADDRESS_XILINX_256MB;
+
+                sprintf(logstr, "Detect 256MB control board of XILINX\n");
             }
         }
-        sleep(5);   // wait for sometime , voltage need time to prepare!!!
+        writeInitLogFile(logstr);
+
+#ifdef R4       // if defined , for R4  63 chips
+        sprintf(logstr,"Miner Type = R4\n");
+        writeInitLogFile(logstr);
 #endif
 
+#ifdef S9_PLUS  // if defined , for T9  57 chips
+        sprintf(logstr,"Miner Type = T9\n");
+        writeInitLogFile(logstr);
+#endif
+
+#ifdef S9_63    // if defined , for S9  63 chips
+        sprintf(logstr,"Miner Type = S9\n");
+        writeInitLogFile(logstr);
+#endif
+
+#ifdef T9_18    // if defined , for T9+  18 chips
+        sprintf(logstr,"Miner Type = T9+\n");
+        writeInitLogFile(logstr);
+#endif
+
+        memcpy(&config_parameter, &config, sizeof(struct init_config));
+
+        if(config_parameter.token_type != INIT_CONFIG_TYPE)
+        {
+            applog(LOG_DEBUG,"%s: config_parameter.token_type != 0x%x, it is 0x%x\n", __FUNCTION__, INIT_CONFIG_TYPE, config_parameter.token_type);
+            return -1;
+        }
+
+        crc = CRC16((uint8_t*)(&config_parameter), sizeof(struct init_config) - sizeof(uint16_t));
+        if(crc != config_parameter.crc)
+        {
+            applog(LOG_DEBUG,"%s: config_parameter.crc = 0x%x, but we calculate it as 0x%x\n", __FUNCTION__, config_parameter.crc, crc);
+            return -2;
+        }
+
+        for(i=0; i<opt_nonce_verify_threads; i++)
+            cgsem_init(&nonce_workers[i].ready);
+        reg_queue_init();
+
+        //init axi, before the reader below polls the fifo
+        bitmain_axi_init();
+
+        read_nonce_reg_id = calloc(1,sizeof(struct thr_info));
+        if(thr_info_create(read_nonce_reg_id, NULL, get_nonce_and_register, read_nonce_reg_id))
+        {
+            applog(LOG_DEBUG,"%s: create thread for get nonce and register from FPGA failed\n", __FUNCTION__);
+            return -5;
+        }
+
+        pthread_detach(read_nonce_reg_id->pth);
+
+        if(opt_warm_restart && adopt_warm_restart(get_hardware_version()))
+            return bitmain_c5_resume();
+
 #ifdef USE_NEW_RESET_FPGA
         set_reset_allhashboard(1);
         sleep(RESET_KEEP_TIME);
         set_reset_allhashboard(0);
         sleep(1);
-#else
-        set_QN_write_data_command(RESET_HASH_BOARD | RESET_ALL | RESET_TIME(RESET_HASHBOARD_TIME));
-        while(get_QN_write_data_command() & RESET_HASH_BOARD)
+        set_reset_allhashboard(1);
+#endif
+
+        //reset FPGA & HASH board
+        if(config_parameter.reset)
         {
-            cgsleep_ms(30);
+            set_QN_write_data_command(RESET_HASH_BOARD | RESET_ALL | RESET_FPGA | RESET_TIME(RESET_HASHBOARD_TIME));
+#ifdef USE_NEW_RESET_FPGA
+            sleep(2);
+#else
+            while(get_QN_write_data_command() & RESET_HASH_BOARD)
+            {
+                cgsleep_ms(30);
+            }
+            cgsleep_ms(500);
+#endif
+            set_PWM(MAX_PWM_PERCENT);
         }
-        cgsleep_ms(1000);
+
+#ifdef T9_18
+	// config fpga into T9+ mode
+	set_Hardware_version(0x80000000);
 #endif
 
-        if(opt_multi_version)
-            set_dhash_acc_control(get_dhash_acc_control() & (~OPERATION_MODE) & (~ VIL_MIDSTATE_NUMBER(0xf)) | VIL_MIDSTATE_NUMBER(1) | VIL_MODE  & (~NEW_BLOCK) & (~RUN_BIT));
-        cgsleep_ms(10);
+#ifdef DEBUG_PRINT_T9_PLUS_PIC_HEART_INFO
+        set_red_led(false); // close red led
+#endif
 
-        //set core number
-        dev->corenum = BM1387_CORE_NUM;
+        // need read FPGA version at first, used in T9+
+        hardware_version = get_hardware_version();
+        pcb_version = (hardware_version >> 16) & 0x00007fff;    // for T9+ the highest bit is used as config for S9 or T9+ mode, so use 7fff
+        fpga_version = hardware_version & 0x000000ff;
+        sprintf(g_miner_version, "%d.%d.%d.%d", fpga_version, pcb_version, C5_VERSION, BMMINER_VERSION);
 
-#ifdef USE_PREINIT_OPENCORE
-        // must set default baud here !!! because maybe some chip can not receive signal, we must keep default baud, and let those chip has chance to get command on next time!!!
-        // but if set default baud, it is too slow ,will cause chips work timeout, voltage will be changing always!!!
-        //set_baud(DEFAULT_BAUD_VALUE,1);   // so we do not set it, and only try pre-open core in S9+
+#ifdef USE_NEW_RESET_FPGA
+        set_reset_allhashboard(1);
+        cgtimer_time(&tv_reset);
+#endif
 
-        for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
-        {
-            if(dev->chain_exist[i] == 1)
-            {
-                getAsicNum_preOpenCore(i);  // need set default baud 26 at first!!!
+        dev->baud=DEFAULT_BAUD_VALUE;   // need set default value as init value
 
-                sprintf(logstr,"Chain[J%d] has %d asic\n",i+1,dev->chain_asic_num[i]);
-                writeInitLogFile(logstr);
+        set_nonce2_and_job_id_store_address(PHY_MEM_NONCE2_JOBID_ADDRESS);
+        set_job_start_address(PHY_MEM_JOB_START_ADDRESS_1);
 
-                if(dev->chain_asic_num[i] != CHAIN_ASIC_NUM && readRebootTestNum()>0)
-                {
-                    char error_info[256];
-                    sprintf(error_info,"J%d:3",i+1);
-                    saveSearchFailedFlagInfo(error_info);
+        //check chain
+        check_chain();
 
-                    system("sync");
-                    system("reboot");
-                }
+        memset(chain_init_state, 0, sizeof(chain_init_state));
+        for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+            chain_init_state[i].phase = CHAIN_INIT_DONE;
 
-                if(dev->chain_asic_num[i]<=0)
-                {
-                    dev->chain_exist[i]=0;
-                }
-            }
-        }
-#else
-        //check ASIC number for every chain
-        check_asic_reg(CHIP_ADDRESS);
-        cgsleep_ms(10);
+        if(opt_calibration_cache)
+            load_calibration_cache();
 
+#ifdef T9_18
+        chain_init_phase_all(CHAIN_INIT_PIC);
         for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
         {
             if(dev->chain_exist[i] == 1)
             {
-                int retry_count=0;
-                sprintf(logstr,"Chain[J%d] has %d asic\n",i+1,dev->chain_asic_num[i]);
-                writeInitLogFile(logstr);
-
-#ifndef T9_18
-                while(dev->chain_asic_num[i] != CHAIN_ASIC_NUM && retry_count<6)
+                if(fpga_version>=0xE)
                 {
-                    dev->chain_asic_num[i]=0;
+                    int new_T9_PLUS_chainIndex,new_T9_PLUS_chainOffset;
+                    getPICChainIndexOffset(i,&new_T9_PLUS_chainIndex,&new_T9_PLUS_chainOffset);
 
-#ifdef USE_NEW_RESET_FPGA
-                    set_reset_hashboard(i,1);
-#endif
                     pthread_mutex_lock(&iic_mutex);
-                    disable_pic_dac(i);
-                    pthread_mutex_unlock(&iic_mutex);
-                    sleep(1);
+                    if(i>=1 && i<=3)
+                    {
+                        reset_iic_pic(i);
+                        jump_to_app_CheckAndRestorePIC_T9_18(i);
 
-                    pthread_mutex_lock(&iic_mutex);
-                    enable_pic_dac(i);
-                    pthread_mutex_unlock(&iic_mutex);
-                    sleep(2);
+                        if(!isFixedFreqMode())
+                        {
+                            read_freq_badcores(i,chain_pic_buf[i]);
 
-#ifdef USE_NEW_RESET_FPGA
-                    set_reset_hashboard(i,0);
-                    sleep(1);
-#else
-                    reset_one_hashboard(i);
-#endif
+                            sprintf(logstr,"Chain[%d] read_freq_badcores : ",i);
+                            writeInitLogFile(logstr);
+                            for(j=0; j<128; j++)
+                            {
+                                sprintf(logstr,"0x%02x ",chain_pic_buf[i][j]);
+                                writeInitLogFile(logstr);
+                            }
+                            sprintf(logstr,"\n");
+                            writeInitLogFile(logstr);
+                        }
+                    }
 
-                    check_asic_reg_oneChain(i,CHIP_ADDRESS);
+                    if(!isFixedFreqMode())
+                    {
+                        if(chain_pic_buf[new_T9_PLUS_chainIndex][0] == FREQ_MAGIC)
+                        {
+                            chain_voltage_value[i]=chain_pic_buf[new_T9_PLUS_chainIndex][7+new_T9_PLUS_chainOffset*31+1]*10;
 
-                    sprintf(logstr,"retry Chain[J%d] has %d asic\n",i+1,dev->chain_asic_num[i]);
-                    writeInitLogFile(logstr);
+                            sprintf(logstr,"Chain[J%d] has backup chain_voltage=%d\n",i+1,chain_voltage_value[i]);
+                            writeInitLogFile(logstr);
+                        }
 
-                    retry_count++;
-                }
+                        lowest_testOK_temp[i]=(signed char)chain_pic_buf[new_T9_PLUS_chainIndex][7+new_T9_PLUS_chainOffset*31+3];
+
+                        sprintf(logstr,"Chain[J%d] test patten OK temp=%d\n",i+1,lowest_testOK_temp[i]);
+                        writeInitLogFile(logstr);
+
+#ifdef DISABLE_TEMP_PROTECT // for debug
+                        if(lowest_testOK_temp[i]<MIN_TEMP_CONTINUE_DOWN_FAN)
+                            lowest_testOK_temp[i]=MIN_TEMP_CONTINUE_DOWN_FAN;   // if too low, we just set MIN_TEMP_CONTINUE_DOWN_FAN
 #endif
-                if(dev->chain_asic_num[i] != CHAIN_ASIC_NUM && readRebootTestNum()>0)
+                    }
+                    if(opt_calibration_cache || opt_chip_autotune || opt_chip_autotune_dry_run)
+                        get_hash_board_id_number(i, hash_board_id[i]);
+                    pthread_mutex_unlock(&iic_mutex);
+                }
+                else
                 {
-                    char error_info[256];
-                    sprintf(error_info,"J%d:3",i+1);
-                    saveSearchFailedFlagInfo(error_info);
+                    pthread_mutex_lock(&iic_mutex);
+                    // if(i%3==0) read into chain_pic_buf
 
-                    system("sync");
-                    system("reboot");
-                }
+                    if(i%3==0)
+                    {
+                        reset_iic_pic(i);
+                        sleep(1);
+                        jump_to_app_CheckAndRestorePIC_T9_18(i);
 
-                if(dev->chain_asic_num[i]<=0)
-                {
-                    dev->chain_exist[i]=0;
+                        if(!isFixedFreqMode())
+                            read_freq_badcores(i,chain_pic_buf[((i/3)*3)]);
+                    }
+
+                    if(!isFixedFreqMode())
+                    {
+                        if(chain_pic_buf[((i/3)*3)][0] == FREQ_MAGIC)
+                        {
+                            chain_voltage_value[i]=chain_pic_buf[((i/3)*3)][7+(i%3)*31+1]*10;
+
+                            sprintf(logstr,"Chain[J%d] has backup chain_voltage=%d\n",i+1,chain_voltage_value[i]);
+                            writeInitLogFile(logstr);
+                        }
+
+                        lowest_testOK_temp[i]=(signed char)chain_pic_buf[((i/3)*3)][7+(i%3)*31+3];
+
+                        sprintf(logstr,"Chain[J%d] test patten OK temp=%d\n",i+1,lowest_testOK_temp[i]);
+                        writeInitLogFile(logstr);
+
+#ifdef DISABLE_TEMP_PROTECT // for debug
+                        if(lowest_testOK_temp[i]<MIN_TEMP_CONTINUE_DOWN_FAN)
+                            lowest_testOK_temp[i]=MIN_TEMP_CONTINUE_DOWN_FAN;   // if too low, we just set MIN_TEMP_CONTINUE_DOWN_FAN
+#endif
+                    }
+                    if(opt_calibration_cache || opt_chip_autotune || opt_chip_autotune_dry_run)
+                        get_hash_board_id_number(i, hash_board_id[i]);
+                    pthread_mutex_unlock(&iic_mutex);
                 }
             }
         }
+#else
+        chain_init_run(CHAIN_INIT_PIC, pic_init_step);
 #endif
 
-        // clement for debug
-//  check_asic_reg(TICKET_MASK);
-
-        software_set_address();
-        cgsleep_ms(10);
-
-//    check_asic_reg(CHIP_ADDRESS);
-//    cgsleep_ms(10);
-
-        if(config_parameter.frequency_eft)
+        pic_heart_beat = calloc(1,sizeof(struct thr_info));
+        if(thr_info_create(pic_heart_beat, NULL, pic_heart_beat_func, pic_heart_beat))
         {
-            dev->frequency = config_parameter.frequency;
-            set_frequency(dev->frequency);
-            sprintf(dev->frequency_t,"%u",dev->frequency);
+            applog(LOG_DEBUG,"%s: create thread error for pic_heart_beat_func\n", __FUNCTION__);
+            return -6;
         }
+        pthread_detach(pic_heart_beat->pth);
 
-        cgsleep_ms(10);
+        chain_init_phase_all(CHAIN_INIT_VOLTAGE);
+        for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            if(dev->chain_exist[i] == 1)
+            {
+                unsigned char vol_pic;
+                pthread_mutex_lock(&iic_mutex);
+
+#ifdef ENABLE_HIGH_VOLTAGE_OPENCORE
+                chain_voltage_pic[i] = get_pic_voltage(i);  // read orignal voltage at first!
+
+                vol_pic=getPICvoltageFromValue(HIGHEST_VOLTAGE_LIMITED_HW);
+
+#ifdef T9_18
+                sprintf(logstr,"Chain[J%d] will use voltage=%d [%d] to open core\n",i+1,HIGHEST_VOLTAGE_LIMITED_HW,vol_pic);
+                writeInitLogFile(logstr);
+
+                if(fpga_version>=0xE)
+                {
+                    if(i>=1 && i<=3)
+                        set_voltage_T9_18_into_PIC(i, vol_pic);
+                }
+                else
+                {
+                    if(i%3==0)
+                        set_voltage_T9_18_into_PIC(i, vol_pic);
+                }
+#else
+                set_pic_voltage(i, vol_pic);
+#endif
+#endif
+
+#ifndef T9_18
+                enable_pic_dac(i);
+#endif
+                pthread_mutex_unlock(&iic_mutex);
+            }
+        }
+        cgtimer_time(&tv_voltage);
+
+        if(isFixedFreqMode())
+        {
+            // we must set voltage value according to the freq of config file!
+            for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+            {
+                if(dev->chain_exist[i] == 1)
+                {
+                    chain_voltage_value[i] = getFixedFreqVoltageValue(config_parameter.frequency);
+                    chain_voltage_pic[i] = getPICvoltageFromValue(chain_voltage_value[i]);
+
+                    sprintf(logstr,"Fix freq=%d Chain[%d] voltage_pic=%d value=%d\n",config_parameter.frequency,i,chain_voltage_pic[i],chain_voltage_value[i]);
+                    writeInitLogFile(logstr);
+                }
+            }
+        }
+
+        if(!isFixedFreqMode())
+        {
+            cgsleep_ms(100);
+            for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+            {
+                if(dev->chain_exist[i] == 1)
+                {
+                    int vol_value;
+                    unsigned char vol_pic;
+                    pthread_mutex_lock(&iic_mutex);
+#ifndef ENABLE_HIGH_VOLTAGE_OPENCORE
+                    chain_voltage_pic[i] = get_pic_voltage(i);
+#endif
+                    vol_value = getVolValueFromPICvoltage(chain_voltage_pic[i]);
+
+                    sprintf(logstr,"Chain[J%d] orignal chain_voltage_pic=%d value=%d\n",i+1,chain_voltage_pic[i],vol_value);
+                    writeInitLogFile(logstr);
+
+#ifdef T9_18
+                    if(getChainPICMagicNumber(i)== FREQ_MAGIC)
+#else
+                    if(last_freq[i][1] == FREQ_MAGIC && last_freq[i][40] == 0x23)   //0x23 is backup voltage magic number
+#endif
+                    {
+#ifndef DEBUG_KEEP_USE_PIC_VOLTAGE_WITHOUT_CHECKING_VOLTAGE_OF_SEARCHFREQ
+                        if(vol_value != chain_voltage_value[i]) // if not equal, we need force to set backup voltage to hashbaord!!!
+                        {
+                            vol_pic=getPICvoltageFromValue(chain_voltage_value[i]);
+
+                            sprintf(logstr,"Chain[J%d] will use backup chain_voltage_pic=%d [%d]\n",i+1,chain_voltage_value[i],vol_pic);
+                            writeInitLogFile(logstr);
+
+                            chain_voltage_pic[i] = vol_pic;
+
+#ifndef ENABLE_HIGH_VOLTAGE_OPENCORE
+#ifndef T9_18   // T9_18 only can call enable_pic_dac once after jump to app!!!
+                            set_pic_voltage(i, vol_pic);
+                            enable_pic_dac(i);
+                            cgtimer_time(&tv_voltage);
+#endif
+#endif
+                            sprintf(logstr,"Chain[J%d] get working chain_voltage_pic=%d\n",i+1,chain_voltage_pic[i]);
+                            writeInitLogFile(logstr);
+                        }
+#endif
+                    }
+
+                    pthread_mutex_unlock(&iic_mutex);
+                }
+            }
+            voltage_settle_ms = VOLTAGE_SETTLE_MS;
+        }
+
+#ifdef T9_18
+        // set voltage and enable it for only once!!!
+        for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            if(dev->chain_exist[i] == 1)
+            {
+                pthread_mutex_lock(&iic_mutex);
+#ifndef ENABLE_HIGH_VOLTAGE_OPENCORE
+                set_pic_voltage(i, 0);  // the second parameter is not used, we set 0 for T9_18
+#endif
+                enable_pic_dac(i);
+                pthread_mutex_unlock(&iic_mutex);
+            }
+        }
+        cgtimer_time(&tv_voltage);
+        voltage_settle_ms = 5000;   // wait for sometime , voltage need time to prepare!!!
+#endif
+
+        // the voltage settles while the boards are still held in reset
+        chain_init_phase_all(CHAIN_INIT_RESET);
+#ifdef USE_NEW_RESET_FPGA
+        set_reset_allhashboard(1);
+        chain_init_wait(&tv_reset, RESET_KEEP_TIME * 1000);
+        chain_init_wait(&tv_voltage, voltage_settle_ms);
+        set_reset_allhashboard(0);
+        sleep(1);
+#else
+        chain_init_wait(&tv_voltage, voltage_settle_ms);
+        set_QN_write_data_command(RESET_HASH_BOARD | RESET_ALL | RESET_TIME(RESET_HASHBOARD_TIME));
+        while(get_QN_write_data_command() & RESET_HASH_BOARD)
+        {
+            cgsleep_ms(30);
+        }
+        cgsleep_ms(1000);
+#endif
+
+        if(opt_multi_version)
+            set_dhash_acc_control(get_dhash_acc_control() & (~OPERATION_MODE) & (~ VIL_MIDSTATE_NUMBER(0xf)) | VIL_MIDSTATE_NUMBER(1) | VIL_MODE  & (~NEW_BLOCK) & (~RUN_BIT));
+        cgsleep_ms(10);
+
+        //set core number
+        dev->corenum = BM1387_CORE_NUM;
+
+#ifdef USE_PREINIT_OPENCORE
+        // must set default baud here !!! because maybe some chip can not receive signal, we must keep default baud, and let those chip has chance to get command on next time!!!
+        // but if set default baud, it is too slow ,will cause chips work timeout, voltage will be changing always!!!
+        //set_baud(DEFAULT_BAUD_VALUE,1);   // so we do not set it, and only try pre-open core in S9+
+
+        for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            if(dev->chain_exist[i] == 1)
+            {
+                getAsicNum_preOpenCore(i);  // need set default baud 26 at first!!!
+
+                sprintf(logstr,"Chain[J%d] has %d asic\n",i+1,dev->chain_asic_num[i]);
+                writeInitLogFile(logstr);
+
+                if(dev->chain_asic_num[i] != CHAIN_ASIC_NUM && readRebootTestNum()>0)
+                {
+                    char error_info[256];
+                    sprintf(error_info,"J%d:3",i+1);
+                    saveSearchFailedFlagInfo(error_info);
+
+                    system("sync");
+                    system("reboot");
+                }
+
+                if(dev->chain_asic_num[i]<=0)
+                {
+                    dev->chain_exist[i]=0;
+                }
+            }
+        }
+#else
+        //check ASIC number for every chain
+        chain_init_phase_all(CHAIN_INIT_ASIC);
+        check_asic_reg(CHIP_ADDRESS);
+        cgsleep_ms(10);
+
+        for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            if(dev->chain_exist[i] == 1)
+            {
+                sprintf(logstr,"Chain[J%d] has %d asic\n",i+1,dev->chain_asic_num[i]);
+                writeInitLogFile(logstr);
+            }
+        }
+
+#ifndef T9_18
+        // chains short of asics are power cycled and counted again, side by side
+        chain_init_run(CHAIN_INIT_ASIC, asic_check_step);
+#endif
+
+        for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            if(dev->chain_exist[i] == 1)
+            {
+                if(dev->chain_asic_num[i] != CHAIN_ASIC_NUM && readRebootTestNum()>0)
+                {
+                    char error_info[256];
+                    sprintf(error_info,"J%d:3",i+1);
+                    saveSearchFailedFlagInfo(error_info);
+
+                    system("sync");
+                    system("reboot");
+                }
+
+                if(dev->chain_asic_num[i]<=0)
+                {
+                    dev->chain_exist[i]=0;
+                }
+            }
+        }
+#endif
+
+        // clement for debug
+//  check_asic_reg(TICKET_MASK);
+
+        chain_init_phase_all(CHAIN_INIT_ADDRESS);
+        software_set_address();
+        cgsleep_ms(10);
+
+//    check_asic_reg(CHIP_ADDRESS);
+//    cgsleep_ms(10);
+
+        chain_init_phase_all(CHAIN_INIT_FREQ);
+        if(config_parameter.frequency_eft)
+        {
+            dev->frequency = config_parameter.frequency;
+            set_frequency(dev->frequency);
+            sprintf(dev->frequency_t,"%u",dev->frequency);
+        }
+
+        cgsleep_ms(10);
 
         //check who control fan
         dev->fan_eft = config_parameter.fan_eft;
@@ -10563,6 +11479,7 @@ void set_Hardware_version(unsigned int value)
         }
 
         //set baud
+        chain_init_phase_all(CHAIN_INIT_BAUD);
         init_uart_baud();
         cgsleep_ms(10);
 
@@ -10679,7 +11596,10 @@ void set_Hardware_version(unsigned int value)
 #endif
         }
 
-#ifdef ENABLE_HIGH_VOLTAGE_OPENCORE
+#if defined(ENABLE_HIGH_VOLTAGE_OPENCORE) && !defined(T9_18)
+        chain_init_run(CHAIN_INIT_OPENCORE, opencore_step);
+#elif defined(ENABLE_HIGH_VOLTAGE_OPENCORE)
+        chain_init_phase_all(CHAIN_INIT_OPENCORE);
         for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
         {
             int vol_value;
@@ -10706,8 +11626,6 @@ void set_Hardware_version(unsigned int value)
                 sprintf(logstr,"DEBUG MODE Chain[J%d] set working voltage=%d [%d] orignal voltage=%d [%d]\n",i+1,vol_value,vol_pic,getVolValueFromPICvoltage(chain_voltage_pic[i]),chain_voltage_pic[i]);
                 writeInitLogFile(logstr);
 #else
-
-#ifdef T9_18
                 if(fpga_version>=0xE)
                 {
                     if(i==1)
@@ -10782,21 +11700,14 @@ void set_Hardware_version(unsigned int value)
                     sprintf(logstr,"Chain[J%d] set working voltage=%d [%d]\n",i+1,getVolValueFromPICvoltage(chain_voltage_pic[i]),chain_voltage_pic[i]);
                     writeInitLogFile(logstr);
                 }
-#else
-                pthread_mutex_lock(&iic_mutex);
-                // restore the normal voltage
-                set_pic_voltage(i, chain_voltage_pic[i]);
-                pthread_mutex_unlock(&iic_mutex);
-
-                sprintf(logstr,"Chain[J%d] set working voltage=%d [%d]\n",i+1,getVolValueFromPICvoltage(chain_voltage_pic[i]),chain_voltage_pic[i]);
-                writeInitLogFile(logstr);
-#endif
 #endif
             }
         }
 #else
+        chain_init_phase_all(CHAIN_INIT_OPENCORE);
         open_core(true);
 #endif
+        chain_init_phase_all(CHAIN_INIT_DONE);
 
 #ifdef USE_OPENCORE_TWICE
         sleep(5);
@@ -10831,257 +11742,1133 @@ void set_Hardware_version(unsigned int value)
             set_time_out_control(((dev->timeout) & MAX_TIMEOUT_VALUE) | TIME_OUT_VALID);
 #endif
 
-        read_temp_id = calloc(1,sizeof(struct thr_info));
-        if(thr_info_create(read_temp_id, NULL, read_temp_func, read_temp_id))
-        {
-            applog(LOG_DEBUG,"%s: create thread for read temp\n", __FUNCTION__);
-            return -7;
-        }
-        pthread_detach(read_temp_id->pth);
+        read_temp_id = calloc(1,sizeof(struct thr_info));
+        if(thr_info_create(read_temp_id, NULL, read_temp_func, read_temp_id))
+        {
+            applog(LOG_DEBUG,"%s: create thread for read temp\n", __FUNCTION__);
+            return -7;
+        }
+        pthread_detach(read_temp_id->pth);
+
+#ifndef CAPTURE_PATTEN
+        if(!isFixedFreqMode())
+        {
+//#ifdef ENABLE_PREHEAT
+            if(opt_pre_heat)
+            {
+#ifdef DEBUG_XILINX_NONCE_NOTENOUGH
+                set_bmc_counter(0);
+                sprintf(logstr,"reset bmc counter=0x%08x\n",read_bmc_counter());
+                writeInitLogFile(logstr);
+#endif
+                //if(readRebootTestNum()<=0)        // we will do preheat every time, even in reboot test mode.
+                {
+                    doTestPatten=true;
+                    sleep(3);
+
+                    for(i = 0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+                    {
+                        if(dev->chain_exist[i] == 1)
+                        {
+#ifdef T9_18
+                            memcpy(chain_pic_buf[i],chip_last_freq[i],128); // restore the real freq for chips
+#else
+                            memcpy(last_freq[i],chip_last_freq[i],256); // restore the real freq for chips
+#endif
+                        }
+                    }
+
+                    someBoardUpVoltage=false;
+                    test_result=clement_doTestBoard(true);
+
+#ifdef ENABLE_REINIT_WHEN_TESTFAILED
+                    //if(!test_result)
+                    {
+                        pthread_mutex_lock(&opencore_readtemp_mutex);
+                        doTestPatten=false;
+                        bitmain_reinit();
+
+                        // clement debug to show ticket mask!!!
+                        check_asic_reg(TICKET_MASK);
+
+#ifdef FASTER_TESTPATTEN
+                        if(opt_multi_version)
+                            set_time_out_control((((dev->timeout/10) * 1 /*opt_multi_version*/) & MAX_TIMEOUT_VALUE) | TIME_OUT_VALID);
+                        else
+                            set_time_out_control(((dev->timeout/10) & MAX_TIMEOUT_VALUE) | TIME_OUT_VALID);
+#endif
+
+                        doTestPatten=true;
+                        pthread_mutex_unlock(&opencore_readtemp_mutex);
+                        clement_doTestBoard(true);
+                    }
+#endif
+
+                    for(i = 0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+                    {
+                        if(dev->chain_exist[i] == 1)
+                        {
+#ifdef T9_18
+                            memcpy(chain_pic_buf[i],show_last_freq[i],128); // restore the user freq for showed on web for users
+#else
+                            memcpy(last_freq[i],show_last_freq[i],256); // restore the user freq for showed on web for users
+#endif
+                        }
+                    }
+
+                    // must re-set these two address to FPGA
+                    set_nonce2_and_job_id_store_address(PHY_MEM_NONCE2_JOBID_ADDRESS);
+                    set_job_start_address(PHY_MEM_JOB_START_ADDRESS_1);
+
+                    doTestPatten=false;
+                }
+
+#ifdef DEBUG_XILINX_NONCE_NOTENOUGH
+                sprintf(logstr,"After TEST bmc counter=0x%08x\n",read_bmc_counter());
+                writeInitLogFile(logstr);
+#endif
+            }
+//#endif
+        }
+#endif
+
+        //clear_nonce_fifo();
+#ifndef CAPTURE_PATTEN
+        set_asic_ticket_mask(63);   // clement
+        set_hcnt(0);
+        cgsleep_ms(10);
+#endif
+
+#ifdef FASTER_TESTPATTEN
+        //set real timeout back
+        if(opt_multi_version)
+            set_time_out_control(((dev->timeout * opt_multi_version) & MAX_TIMEOUT_VALUE) | TIME_OUT_VALID);
+        else
+            set_time_out_control(((dev->timeout) & MAX_TIMEOUT_VALUE) | TIME_OUT_VALID);
+#endif
+
+        check_system_work_id = calloc(1,sizeof(struct thr_info));
+        if(thr_info_create(check_system_work_id, NULL, check_system_work, check_system_work_id))
+        {
+            applog(LOG_DEBUG,"%s: create thread for check system\n", __FUNCTION__);
+            return -6;
+        }
+        pthread_detach(check_system_work_id->pth);
+
+        for(x=0; x<BITMAIN_MAX_CHAIN_NUM; x++)
+        {
+            if(dev->chain_exist[x])
+            {
+                int offset = 0;
+                for(y=0; y<dev->chain_asic_num[x]; y++)
+                {
+                    if(y%8 == 0)
+                    {
+                        dev->chain_asic_status_string[x][y+offset] = ' ';
+                        offset++;
+                    }
+                    dev->chain_asic_status_string[x][y+offset] = 'o';
+                    dev->chain_asic_nonce[x][y] = 0;
+                }
+                dev->chain_asic_status_string[x][y+offset] = '\0';
+            }
+        }
+
+        if(opt_calibration_cache)
+        {
+            // only a run that brought every chain up complete is worth remembering
+            for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+            {
+                if(dev->chain_exist[i] == 1 && dev->chain_asic_num[i] != CHAIN_ASIC_NUM)
+                    break;
+            }
+            if(i == BITMAIN_MAX_CHAIN_NUM)
+                save_calibration_cache();
+        }
+
+        autotune_start();
+        vf_optimise_start();
+        capture_chain_layout();
+        c5_init_done = true;
+        cgtime(&tv_send_job);
+        cgtime(&tv_send);
+        startCheckNetworkJob=true;
+
+        setStartTimePoint();
+        return 0;
+    }
+
+    void bitmain_core_reInit()
+    {
+        int i,j;
+        int vol_value,vol_pic,cur_vol_value,cur_vol_pic;
+        char logstr[256];
+
+        doTestPatten=true;
+        pthread_mutex_lock(&reinit_mutex);
+        startCheckNetworkJob=false;
+
+        set_dhash_acc_control((unsigned int)get_dhash_acc_control() & ~RUN_BIT);
+        sleep(3);
+        set_dhash_acc_control((unsigned int)get_dhash_acc_control() & ~RUN_BIT);
+        sleep(2);
+
+        open_core(true);
+        sprintf(logstr,"bitmain_core_reInit open_core over\n");
+        writeInitLogFile(logstr);
+
+        // must re-set these two address to FPGA
+        set_nonce2_and_job_id_store_address(PHY_MEM_NONCE2_JOBID_ADDRESS);
+        set_job_start_address(PHY_MEM_JOB_START_ADDRESS_1);
+
+        //clear_nonce_fifo();
+#ifndef CAPTURE_PATTEN
+        set_asic_ticket_mask(63);   // clement
+        set_hcnt(0);
+        cgsleep_ms(10);
+#endif
+        set_nonce_fifo_interrupt(get_nonce_fifo_interrupt() | FLUSH_NONCE3_FIFO);
+
+#if 0
+        //set real timeout back
+        if(opt_multi_version)
+            set_time_out_control(((dev->timeout * opt_multi_version) & MAX_TIMEOUT_VALUE) | TIME_OUT_VALID);
+        else
+            set_time_out_control(((dev->timeout) & MAX_TIMEOUT_VALUE) | TIME_OUT_VALID);
+#endif
+
+        doTestPatten=false;
+        pthread_mutex_unlock(&reinit_mutex);
+        re_send_last_job();
+        cgtime(&tv_send_job);
+        cgtime(&tv_send);
+        startCheckNetworkJob=true;
+    }
+
+    /* Stop the FPGA sending work, for the part of a chain recovery that needs
+     * the BC line to itself. Returns with reinit_mutex held.
+     */
+    static void chain_reinit_pause()
+    {
+        doTestPatten=true;
+        pthread_mutex_lock(&reinit_mutex);
+        startCheckNetworkJob=false;
+
+        set_dhash_acc_control((unsigned int)get_dhash_acc_control() & ~RUN_BIT);
+        while((unsigned int)get_dhash_acc_control() & RUN_BIT)
+        {
+            cgsleep_ms(1);
+        }
+    }
+
+    static void chain_reinit_resume()
+    {
+        doTestPatten=false;
+        pthread_mutex_unlock(&reinit_mutex);
+        re_send_last_job();
+        cgtime(&tv_send_job);
+        cgtime(&tv_send);
+        startCheckNetworkJob=true;
+    }
+
+    /* Reset one chain and bring it back: power cycle, count and address the
+     * asics, give them back their own frequencies and the working baud, and
+     * open the cores. The other chains keep hashing through the power cycle
+     * and the calibration, and only stop for the commands that have to go out
+     * at the reset asics' default baud, which the FPGA uses for every chain.
+     * Returns false if the chain did not come back with all its asics.
+     */
+    bool bitmain_chain_reInit(int chainIndex)
+    {
+        struct timeval tv_start, tv_pause, tv_resume, tv_end;
+        unsigned char baud = dev->baud;
+        double other_rate = 0, hashing_ms;
+        bool ok;
+        int i;
+        char logstr[256];
+
+        if(dev->chain_exist[chainIndex] != 1)
+            return false;
+
+        cgtime(&tv_start);
+        for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            if(i != chainIndex && dev->chain_exist[i] == 1)
+                other_rate += rate[i];
+        }
+
+        sprintf(logstr,"Chain[J%d] re-init start, the other chains keep hashing\n",chainIndex+1);
+        writeInitLogFile(logstr);
+
+        // no hashrate or temp reads while the chain is down
+        pthread_mutex_lock(&opencore_readtemp_mutex);
+        chain_reinit_num[chainIndex]++;
+
+#ifdef USE_NEW_RESET_FPGA
+        set_reset_hashboard(chainIndex,1);
+#endif
+        pthread_mutex_lock(&iic_mutex);
+        disable_pic_dac(chainIndex);
+        pthread_mutex_unlock(&iic_mutex);
+        sleep(1);
+
+        pthread_mutex_lock(&iic_mutex);
+        enable_pic_dac(chainIndex);
+        pthread_mutex_unlock(&iic_mutex);
+        sleep(2);
+
+#ifdef USE_NEW_RESET_FPGA
+        set_reset_hashboard(chainIndex,0);
+        sleep(1);
+#else
+        reset_one_hashboard(chainIndex);
+#endif
+
+        cgtime(&tv_pause);
+        chain_reinit_pause();
+        set_fpga_baud(DEFAULT_BAUD_VALUE);
+
+        dev->chain_asic_num[chainIndex]=0;
+        check_asic_reg_oneChain(chainIndex,CHIP_ADDRESS);
+        ok = dev->chain_asic_num[chainIndex] == CHAIN_ASIC_NUM;
+        if(ok)
+        {
+            unsigned int cmd_buf[3];
+
+            struct bc_queue q = {0};
+
+            software_set_address_onChain(chainIndex);
+            for(i=0; i < dev->chain_asic_num[chainIndex]; i++)
+                bc_queue_frequency(&q, chip_freq_index[chainIndex][i], 0, i * dev->addrInterval, chainIndex);
+            bc_queue_run(&q);
+            bc_queue_free(&q);
+            cgsleep_us(opt_multi_version ? 10000 : 5000);
+
+            set_baud_cmd(cmd_buf, baud);
+            bc_send(chainIndex, cmd_buf);
+            cgsleep_us(50000);
+        }
+        set_fpga_baud(baud);
+
+        if(ok)
+        {
+#ifndef CAPTURE_PATTEN
+            set_asic_ticket_mask(63);
+            set_hcnt(0);
+#endif
+            open_core_one_chain(chainIndex,true);
+
+            // as in bitmain_core_reInit, and the open core work is not in the job buffer, drop its nonces
+            set_nonce2_and_job_id_store_address(PHY_MEM_NONCE2_JOBID_ADDRESS);
+            set_nonce_fifo_interrupt(get_nonce_fifo_interrupt() | FLUSH_NONCE3_FIFO);
+        }
+        chain_reinit_resume();
+        cgtime(&tv_resume);
+
+        if(ok)
+            calibration_sensor_offset(0x98,chainIndex);
+        else
+            chain_reinit_failed[chainIndex]++;
+
+        rate_error[chainIndex] = 0;
+        memset(dev->chain_asic_nonce[chainIndex], 0, sizeof(dev->chain_asic_nonce[chainIndex]));
+        pthread_mutex_unlock(&opencore_readtemp_mutex);
+
+        cgtime(&tv_end);
+        copy_time(&chain_reinit_time[chainIndex], &tv_end);
+
+        hashing_ms = ms_tdiff(&tv_end, &tv_start) - ms_tdiff(&tv_resume, &tv_pause);
+        chain_reinit_saved += other_rate * hashing_ms / 1000 / 1e9;
+
+        sprintf(logstr,"Chain[J%d] re-init %s with %d asic in %d ms, hashing paused %d ms\n",chainIndex+1,ok ? "done" : "failed",
+                dev->chain_asic_num[chainIndex],ms_tdiff(&tv_end, &tv_start),ms_tdiff(&tv_resume, &tv_pause));
+        writeInitLogFile(logstr);
+        return ok;
+    }
+
+    /* Called from check_system_work once a minute, with the asic nonce counts
+     * of the minute merged. A chain none of whose asics found a nonce, or that
+     * stopped answering the hashrate reads, is recovered on its own.
+     */
+    static void check_chain_reinit()
+    {
+        struct timeval now;
+        int i, j;
+        char logstr[256];
+
+        if(!c5_init_done || doTestPatten)
+            return;
+
+        cgtime(&now);
+        for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            if(dev->chain_exist[i] != 1 || dev->chain_asic_num[i] == 0)
+                continue;
+            if(chain_reinit_time[i].tv_sec && tdiff(&now, &chain_reinit_time[i]) < CHAIN_REINIT_HOLDOFF)
+                continue;
+
+            for(j=0; j < dev->chain_asic_num[i]; j++)
+            {
+                if(dev->chain_asic_nonce[i][j] > 0)
+                    break;
+            }
+
+            if(j < dev->chain_asic_num[i] && rate_error[i] <= CHAIN_REINIT_RATE_ERRORS)
+                continue;
+
+            sprintf(logstr,"Chain[J%d] %s, re-init this chain\n",i+1,
+                    j >= dev->chain_asic_num[i] ? "got 0 nonce in 1 min" : "does not answer hashrate reads");
+            writeInitLogFile(logstr);
+
+            bitmain_chain_reInit(i);
+            cgtime(&now);
+        }
+    }
+
+    static struct autotune_chain autotune_chains[BITMAIN_MAX_CHAIN_NUM];   // offsets the chips run at, limits learned
+    static uint32_t autotune_nonces[BITMAIN_MAX_CHAIN_NUM][BITMAIN_DEFAULT_ASIC_NUM];   // of the current window
+    static uint32_t autotune_hw[BITMAIN_MAX_CHAIN_NUM][BITMAIN_DEFAULT_ASIC_NUM];
+    static char autotune_advice[BITMAIN_MAX_CHAIN_NUM][BITMAIN_DEFAULT_ASIC_NUM + BITMAIN_DEFAULT_ASIC_NUM/8 + 1]; // last window, like chain_acs
+    static int autotune_periods = 0;
+    static bool autotune_started = false;
+    static bool autotune_changed = false;          // offsets or limits not in AUTOTUNE_FILE yet
+    static struct timeval autotune_window_start;
+    static struct timeval autotune_saved;
+
+    static void load_autotune_file()
+    {
+        bool ok;
+        char logstr[256];
+
+        ok = read_state_file(AUTOTUNE_FILE, &autotune_file, sizeof(autotune_file))
+             && autotune_file.magic == AUTOTUNE_MAGIC
+             && autotune_file.version == AUTOTUNE_VERSION
+             && autotune_file.crc == CRC16((uint8_t *)&autotune_file, offsetof(struct autotune_file, crc));
+
+        if(!ok)
+        {
+            memset(&autotune_file, 0, sizeof(autotune_file));
+            autotune_file.magic = AUTOTUNE_MAGIC;
+            autotune_file.version = AUTOTUNE_VERSION;
+        }
+        sprintf(logstr,"Chip autotune settings %s\n", ok ? "loaded" : "not found or invalid");
+        writeInitLogFile(logstr);
+    }
+
+    static struct autotune_chain *find_autotune_chain(int chain)
+    {
+        int i;
+
+        if(!hash_board_id_valid(hash_board_id[chain]))
+            return NULL;
+        for(i=0; i<BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            if(autotune_file.chain[i].valid && memcmp(autotune_file.chain[i].board_id, hash_board_id[chain], HASH_BOARD_ID_LEN) == 0)
+                return &autotune_file.chain[i];
+        }
+        return NULL;
+    }
+
+    static void save_autotune_file()
+    {
+        struct autotune_chain *ac;
+        int i, j;
+
+        if(!autotune_started || opt_chip_autotune_dry_run || !autotune_changed)
+            return;
+
+        for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            if(!autotune_chains[i].valid)
+                continue;
+            ac = find_autotune_chain(i);
+            for(j=0; !ac && j<BITMAIN_MAX_CHAIN_NUM; j++)
+            {
+                if(!autotune_file.chain[j].valid)
+                    ac = &autotune_file.chain[j];
+            }
+            if(!ac)
+                ac = &autotune_file.chain[i];   // full of other boards, reuse this slot's
+            memcpy(ac, &autotune_chains[i], sizeof(*ac));
+        }
+        autotune_file.crc = CRC16((uint8_t *)&autotune_file, offsetof(struct autotune_file, crc));
+        autotune_changed = false;
+        cgtime(&autotune_saved);
+        write_state_file(AUTOTUNE_FILE, &autotune_file, sizeof(autotune_file), true);
+    }
+
+    // a PLL index into one chip of a hashing chain
+    static void set_chip_pll_index(int chain, int chip, int pllindex)
+    {
+        // no temp reads between the PLL commands of a chip
+        pthread_mutex_lock(&opencore_readtemp_mutex);
+        set_frequency_with_addr_plldatai(pllindex, 0, chip * dev->addrInterval, chain);
+        pthread_mutex_unlock(&opencore_readtemp_mutex);
+    }
+
+    static int clamp_pll_index(int pllindex)
+    {
+        if(pllindex < MIN_FREQ)
+            return MIN_FREQ;
+        if(pllindex > MAX_FREQ)
+            return MAX_FREQ;
+        return pllindex;
+    }
+
+    /* Called once the hashboards are up, cold or adopted. Takes the PLL index
+     * each chip was brought up at as its base and, on a cold start, moves the
+     * chips of boards tuned before to the offsets saved for their board id.
+     */
+    static void autotune_start()
+    {
+        struct autotune_chain *ac, *saved;
+        char logstr[256];
+        int i, j, idx, moved;
+
+        if(opt_chip_autotune_dry_run)
+            opt_chip_autotune = true;
+        if(!opt_chip_autotune || doTestPatten)
+            return;
+
+        load_autotune_file();
+        for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            ac = &autotune_chains[i];
+            memset(ac, 0, sizeof(*ac));
+            if(dev->chain_exist[i] != 1 || dev->chain_asic_num[i] == 0)
+                continue;
+
+            // an adopted board keeps the base of the process that tuned it
+            if(!warm_restarted || !chip_base_freq_index[i][0])
+                memcpy(chip_base_freq_index[i], chip_freq_index[i], BITMAIN_DEFAULT_ASIC_NUM);
+
+            memcpy(ac->board_id, hash_board_id[i], HASH_BOARD_ID_LEN);
+            ac->valid = hash_board_id_valid(hash_board_id[i]);
+            ac->asic_num = dev->chain_asic_num[i];
+            for(j=0; j < BITMAIN_DEFAULT_ASIC_NUM; j++)
+            {
+                ac->offset[j] = chip_freq_index[i][j] - chip_base_freq_index[i][j];
+                ac->limit[j] = AUTOTUNE_MAX_STEPS;
+            }
+            memset(autotune_advice[i], 0, sizeof(autotune_advice[i]));
+
+            saved = find_autotune_chain(i);
+            if(!saved || saved->asic_num != ac->asic_num)
+                continue;
+            memcpy(ac->limit, saved->limit, sizeof(ac->limit));
+            if(warm_restarted || opt_chip_autotune_dry_run)
+                continue;   // the chips already run where they are, a dry run leaves them there
+
+            moved = 0;
+            for(j=0; j < dev->chain_asic_num[i]; j++)
+            {
+                idx = clamp_pll_index(chip_base_freq_index[i][j] + saved->offset[j]);
+                if(idx != chip_freq_index[i][j])
+                {
+                    set_chip_pll_index(i, j, idx);
+                    moved++;
+                }
+                ac->offset[j] = idx - chip_base_freq_index[i][j];
+            }
+            sprintf(logstr,"Chain[J%d] %d chips set to their autotuned frequency\n",i+1,moved);
+            writeInitLogFile(logstr);
+        }
+
+        memset(autotune_nonces, 0, sizeof(autotune_nonces));
+        memset(autotune_hw, 0, sizeof(autotune_hw));
+        autotune_periods = 0;
+        cgtime(&autotune_window_start);
+        cgtime(&autotune_saved);
+        autotune_started = true;
+    }
+
+    static int autotune_cmp_double(const void *a, const void *b)
+    {
+        double x = *(const double *)a, y = *(const double *)b;
+
+        return x < y ? -1 : x > y;
+    }
+
+    /* One decision on the chips of chain from the window just ended. Yield is
+     * judged per MHz against the chain's median: one PLL step is a few percent,
+     * less than the noise of a chip's nonce count over a window, but a chip
+     * that fails its timing falls well behind chips that do not. A chip steps
+     * down on HW errors, or when its yield dropped after raises, and learns
+     * that as its limit; healthy chips step up, a few per window, while the
+     * board is not hot. Temp is -1 when the sensors are stale.
+     */
+    static void autotune_chain(int chain, int temp)
+    {
+        struct autotune_chain *ac = &autotune_chains[chain];
+        double yield[BITMAIN_DEFAULT_ASIC_NUM], sorted[BITMAIN_DEFAULT_ASIC_NUM];
+        double median, hw_ratio;
+        int step[BITMAIN_DEFAULT_ASIC_NUM];
+        int asic_num = dev->chain_asic_num[chain];
+        int i, j, n = 0, idx, raises = 0, up = 0, down = 0, hottest = -1;
+        bool may_raise = temp >= 0 && temp < MAX_FAN_TEMP - AUTOTUNE_TEMP_MARGIN;
+        char logstr[256];
+
+        for(j=0; j < asic_num; j++)
+        {
+            yield[j] = (double)autotune_nonces[chain][j] / get_freqvalue_by_index(chip_freq_index[chain][j]);
+            if(autotune_nonces[chain][j] >= AUTOTUNE_MIN_NONCES)
+                sorted[n++] = yield[j];
+        }
+        if(n < asic_num / 2)
+        {
+            applog(LOG_DEBUG,"%s: chain %d, %d chips with enough nonces, no decision this window", __FUNCTION__, chain, n);
+            return;
+        }
+        qsort(sorted, n, sizeof(sorted[0]), autotune_cmp_double);
+        median = n % 2 ? sorted[n/2] : (sorted[n/2 - 1] + sorted[n/2]) / 2;
+
+        for(j=0; j < asic_num; j++)
+        {
+            hw_ratio = (double)autotune_hw[chain][j] / (autotune_nonces[chain][j] + autotune_hw[chain][j] + 1);
+            idx = chip_freq_index[chain][j];
+            step[j] = 0;
+
+            if(autotune_hw[chain][j] >= 2 && hw_ratio > AUTOTUNE_HW_LOWER && idx > MIN_FREQ)
+                step[j] = -1;
+            else if(ac->offset[j] > 0 && autotune_nonces[chain][j] >= AUTOTUNE_MIN_NONCES && yield[j] < median * AUTOTUNE_YIELD_LOWER)
+                step[j] = -1;
+            else if(may_raise && raises < AUTOTUNE_MAX_RAISES && hw_ratio <= AUTOTUNE_HW_RAISE
+                    && autotune_nonces[chain][j] >= AUTOTUNE_MIN_NONCES && yield[j] >= median * AUTOTUNE_YIELD_RAISE
+                    && ac->offset[j] < ac->limit[j] && idx < MAX_FREQ)
+            {
+                step[j] = 1;
+                raises++;
+            }
+
+            if(step[j] < 0 && !opt_chip_autotune_dry_run)
+                ac->limit[j] = ac->offset[j] - 1;
+            if(step[j] == 0 && ac->offset[j] > 0 && (hottest < 0 || idx > chip_freq_index[chain][hottest]))
+                hottest = j;
+        }
+
+        // over the fan's limit, give back the fastest raised chip's step each window
+        if(temp >= MAX_FAN_TEMP && hottest >= 0)
+            step[hottest] = -1;
+
+        for(j=0, i=0; j < asic_num; j++)
+        {
+            if(j % 8 == 0)
+                autotune_advice[chain][i++] = ' ';
+            autotune_advice[chain][i++] = step[j] > 0 ? '+' : step[j] < 0 ? '-' : 'o';
+            if(step[j] == 0)
+                continue;
+
+            if(step[j] > 0)
+                up++;
+            else
+                down++;
+            if(!opt_chip_autotune_dry_run)
+            {
+                set_chip_pll_index(chain, j, chip_freq_index[chain][j] + step[j]);
+                ac->offset[j] += step[j];
+            }
+        }
+        autotune_advice[chain][i] = '\0';
+
+        autotune_raised += up;
+        autotune_lowered += down;
+        if(up || down)
+        {
+            autotune_changed = true;
+            sprintf(logstr,"Chain[J%d] autotune%s: %d chips up, %d down, median %.3f nonces/MHz, temp %d\n",chain+1,
+                    opt_chip_autotune_dry_run ? " dry run" : "",up,down,median,temp);
+            writeInitLogFile(logstr);
+        }
+    }
+
+    /* Called from check_system_work once a minute, with the asic nonce counts
+     * of the minute merged. Every AUTOTUNE_WINDOW minutes each chain gets a
+     * decision on its chips, AUTOTUNE_FILE is written at most once an
+     * AUTOTUNE_SAVE_INTERVAL.
+     */
+    static void autotune_step()
+    {
+        struct temp_snapshot ts;
+        struct timeval now;
+        int i, j, k;
+
+        if(!autotune_started)
+            return;
+
+        for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            if(dev->chain_exist[i] != 1)
+                continue;
+            for(j=0; j < BITMAIN_DEFAULT_ASIC_NUM; j++)
+            {
+                autotune_nonces[i][j] += dev->chain_asic_nonce[i][j];
+                for(k=0; k < opt_nonce_verify_threads; k++)
+                    autotune_hw[i][j] += __atomic_exchange_n(&nonce_workers[k].chip_hw[i][j], 0, __ATOMIC_RELAXED);
+            }
+        }
+        if(++autotune_periods < AUTOTUNE_WINDOW)
+            return;
+
+        temp_snapshot_get(&ts);
+        for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            if(dev->chain_exist[i] != 1 || dev->chain_asic_num[i] == 0 || !autotune_chains[i].asic_num)
+                continue;
+            // a chain recovered during the window lost some of its counts
+            if(tdiff(&chain_reinit_time[i], &autotune_window_start) > 0)
+                continue;
+            autotune_chain(i, temp_snapshot_stale(&ts) ? -1 : ts.chain_maxtemp[i][PWM_T]);
+        }
+
+        memset(autotune_nonces, 0, sizeof(autotune_nonces));
+        memset(autotune_hw, 0, sizeof(autotune_hw));
+        autotune_periods = 0;
+        cgtime(&now);
+        copy_time(&autotune_window_start, &now);
+        if(tdiff(&now, &autotune_saved) >= AUTOTUNE_SAVE_INTERVAL)
+            save_autotune_file();
+    }
+
+    // --vf-optimise, see vf_optimise_step
+    struct vf_chain
+    {
+        int base_voltage;                           // where init left the chain, the highest tried
+        int voltage;                                // being measured
+        int freq_step;
+        int best_voltage;                           // the point moves are tried from
+        int best_freq_step;
+        double best_ghs;
+        double best_jth;
+        double floor_ghs;
+        double target_ghs;                          // ghs= share of the chain, 0 for a jth= target
+        int move;                                   // of vf_moves being measured, -1 for the best point
+        int tried;                                  // moves from the best point that did not win
+        int settle;                                 // periods left before measuring
+        int hold;                                   // periods left converged
+        int periods;
+        struct timeval window_start;
+        uint64_t hashes;
+        uint32_t hw_seen, hw;
+        uint32_t nonces;
+        double pool_diff_seen, pool_diff;
+    };
+
+    static const struct
+    {
+        int voltage;
+        int freq_step;
+    } vf_moves[] =
+    {
+        { -VF_OPT_VOLT_STEP, 0 },
+        { 0, -1 },
+        { 0, 1 },
+        { VF_OPT_VOLT_STEP, 0 },
+    };
+
+    static struct vf_chain vf_chains[BITMAIN_MAX_CHAIN_NUM];
+    static struct vf_history vf_history[VF_OPT_HISTORY];
+    static unsigned int vf_history_num = 0;
+    static double vf_target_jth = 0, vf_target_ghs = 0;
+    static double vf_idle_w = 0, vf_k = 0, vf_psu = 0;
+    static bool vf_started = false;
+
+    /* --vf-optimise and --power-model, checked before the driver starts. The
+     * power model is per hash board: idle watts plus k watts per V^2 and chip
+     * MHz, the dynamic power of CMOS, over the PSU efficiency at the wall.
+     */
+    bool vf_optimise_parse(const char *target, const char *power_model)
+    {
+        char *buf, *tok, *val, *end, *save;
+        bool ok = true;
+
+        if(sscanf(target, "jth=%lf", &vf_target_jth) == 1 && vf_target_jth > 0)
+            vf_target_ghs = 0;
+        else if(sscanf(target, "ghs=%lf", &vf_target_ghs) == 1 && vf_target_ghs > 0)
+            vf_target_jth = 0;
+        else
+            return false;
+
+        // given keys come after the defaults, and win
+        if(!power_model)
+            power_model = "";
+        buf = malloc(strlen(VF_POWER_MODEL_DEFAULT) + strlen(power_model) + 2);
+        if(!buf)
+            return false;
+        sprintf(buf, "%s,%s", VF_POWER_MODEL_DEFAULT, power_model);
 
-#ifndef CAPTURE_PATTEN
-        if(!isFixedFreqMode())
+        for(tok = strtok_r(buf, ",", &save); tok && ok; tok = strtok_r(NULL, ",", &save))
         {
-//#ifdef ENABLE_PREHEAT
-            if(opt_pre_heat)
+            val = strchr(tok, '=');
+            if(!val)
             {
-#ifdef DEBUG_XILINX_NONCE_NOTENOUGH
-                set_bmc_counter(0);
-                sprintf(logstr,"reset bmc counter=0x%08x\n",read_bmc_counter());
-                writeInitLogFile(logstr);
-#endif
-                //if(readRebootTestNum()<=0)        // we will do preheat every time, even in reboot test mode.
-                {
-                    doTestPatten=true;
-                    sleep(3);
+                ok = false;
+                break;
+            }
+            *val++ = '\0';
 
-                    for(i = 0; i < BITMAIN_MAX_CHAIN_NUM; i++)
-                    {
-                        if(dev->chain_exist[i] == 1)
-                        {
-#ifdef T9_18
-                            memcpy(chain_pic_buf[i],chip_last_freq[i],128); // restore the real freq for chips
-#else
-                            memcpy(last_freq[i],chip_last_freq[i],256); // restore the real freq for chips
-#endif
-                        }
-                    }
+            if(!strcmp(tok, "idle"))
+                vf_idle_w = strtod(val, &end);
+            else if(!strcmp(tok, "k"))
+                vf_k = strtod(val, &end);
+            else if(!strcmp(tok, "psu"))
+                vf_psu = strtod(val, &end);
+            else
+                ok = false;
+            ok = ok && end != val && !*end;
+        }
+        free(buf);
+        return ok && vf_idle_w >= 0 && vf_k > 0 && vf_psu > 0 && vf_psu <= 1;
+    }
 
-                    someBoardUpVoltage=false;
-                    test_result=clement_doTestBoard(true);
+    // power model of chain at the wall, with its chips at their PLL indexes now
+    static double vf_chain_watts(int chain, int voltage)
+    {
+        double v = voltage / 100.0, mhz = 0;
+        int j;
 
-#ifdef ENABLE_REINIT_WHEN_TESTFAILED
-                    //if(!test_result)
-                    {
-                        pthread_mutex_lock(&opencore_readtemp_mutex);
-                        doTestPatten=false;
-                        bitmain_reinit();
+        for(j=0; j < dev->chain_asic_num[chain]; j++)
+            mhz += get_freqvalue_by_index(chip_freq_index[chain][j]);
+        return (vf_idle_w + vf_k * v * v * mhz) / vf_psu;
+    }
 
-                        // clement debug to show ticket mask!!!
-                        check_asic_reg(TICKET_MASK);
+    // what the chips of chain hash at the PLL indexes they were brought up at, less their bad cores
+    static double vf_nominal_ghs(int chain)
+    {
+        double ghs = 0;
+        int j;
 
-#ifdef FASTER_TESTPATTEN
-                        if(opt_multi_version)
-                            set_time_out_control((((dev->timeout/10) * 1 /*opt_multi_version*/) & MAX_TIMEOUT_VALUE) | TIME_OUT_VALID);
-                        else
-                            set_time_out_control(((dev->timeout/10) & MAX_TIMEOUT_VALUE) | TIME_OUT_VALID);
-#endif
+        for(j=0; j < dev->chain_asic_num[chain]; j++)
+            ghs += get_freqvalue_by_index(chip_base_freq_index[chain][j]) * (BM1387_CORE_NUM - chain_badcore_num[chain][j]) / 1000.0;
+        return ghs;
+    }
 
-                        doTestPatten=true;
-                        pthread_mutex_unlock(&opencore_readtemp_mutex);
-                        clement_doTestBoard(true);
-                    }
-#endif
+    static void vf_set_voltage(int chain, int voltage)
+    {
+        chain_voltage_pic[chain] = getPICvoltageFromValue(voltage);
+        pthread_mutex_lock(&iic_mutex);
+        set_pic_voltage(chain, chain_voltage_pic[chain]);
+        pthread_mutex_unlock(&iic_mutex);
+    }
 
-                    for(i = 0; i < BITMAIN_MAX_CHAIN_NUM; i++)
-                    {
-                        if(dev->chain_exist[i] == 1)
-                        {
-#ifdef T9_18
-                            memcpy(chain_pic_buf[i],show_last_freq[i],128); // restore the user freq for showed on web for users
-#else
-                            memcpy(last_freq[i],show_last_freq[i],256); // restore the user freq for showed on web for users
-#endif
-                        }
-                    }
+    static void vf_set_freq_step(int chain, int freq_step)
+    {
+        int j;
 
-                    // must re-set these two address to FPGA
-                    set_nonce2_and_job_id_store_address(PHY_MEM_NONCE2_JOBID_ADDRESS);
-                    set_job_start_address(PHY_MEM_JOB_START_ADDRESS_1);
+        for(j=0; j < dev->chain_asic_num[chain]; j++)
+            set_chip_pll_index(chain, j, clamp_pll_index(chip_base_freq_index[chain][j] + freq_step));
+    }
 
-                    doTestPatten=false;
-                }
+    // frequency first on the way down, voltage first on the way up
+    static void vf_apply(int chain, int voltage, int freq_step)
+    {
+        struct vf_chain *c = &vf_chains[chain];
 
-#ifdef DEBUG_XILINX_NONCE_NOTENOUGH
-                sprintf(logstr,"After TEST bmc counter=0x%08x\n",read_bmc_counter());
-                writeInitLogFile(logstr);
-#endif
-            }
-//#endif
-        }
-#endif
+        if(voltage > c->voltage)
+            vf_set_voltage(chain, voltage);
+        if(freq_step != c->freq_step)
+            vf_set_freq_step(chain, freq_step);
+        if(voltage < c->voltage)
+            vf_set_voltage(chain, voltage);
+        c->voltage = voltage;
+        c->freq_step = freq_step;
+        c->settle = VF_OPT_SETTLE;
+    }
 
-        //clear_nonce_fifo();
-#ifndef CAPTURE_PATTEN
-        set_asic_ticket_mask(63);   // clement
-        set_hcnt(0);
-        cgsleep_ms(10);
-#endif
+    static void vf_record(int chain, char result, double ghs, double pool_ghs, double watts, double jth)
+    {
+        struct vf_chain *c = &vf_chains[chain];
+        struct vf_history *h = &vf_history[vf_history_num % VF_OPT_HISTORY];
+        char logstr[256];
 
-#ifdef FASTER_TESTPATTEN
-        //set real timeout back
-        if(opt_multi_version)
-            set_time_out_control(((dev->timeout * opt_multi_version) & MAX_TIMEOUT_VALUE) | TIME_OUT_VALID);
-        else
-            set_time_out_control(((dev->timeout) & MAX_TIMEOUT_VALUE) | TIME_OUT_VALID);
-#endif
+        cgtime(&h->when);
+        h->chain = chain;
+        h->result = result;
+        h->voltage = c->voltage;
+        h->freq_step = c->freq_step;
+        h->ghs = ghs;
+        h->pool_ghs = pool_ghs;
+        h->watts = watts;
+        h->jth = jth;
+        vf_history_num++;
+
+        sprintf(logstr,"Chain[J%d] V/F %c: %d.%02dV %+d steps, %.1f GH/s (pool %.1f), %.0f W, %.2f J/TH\n",chain+1,result,
+                c->voltage/100,c->voltage%100,c->freq_step,ghs,pool_ghs,watts,jth);
+        writeInitLogFile(logstr);
+    }
 
-        check_system_work_id = calloc(1,sizeof(struct thr_info));
-        if(thr_info_create(check_system_work_id, NULL, check_system_work, check_system_work_id))
+    // a move from the best point that keeps the chain's limits
+    static bool vf_move_valid(int chain, int move, int temp)
+    {
+        struct vf_chain *c = &vf_chains[chain];
+        int voltage = c->best_voltage + vf_moves[move].voltage;
+        int freq_step = c->best_freq_step + vf_moves[move].freq_step;
+        int j, idx;
+
+#ifdef T9_18
+        if(vf_moves[move].voltage)
+            return false;   // three hash boards share a PIC voltage
+#endif
+        if(voltage > c->base_voltage || voltage < c->base_voltage - VF_OPT_VOLT_DOWN)
+            return false;
+        if(freq_step > VF_OPT_FREQ_STEPS || freq_step < -VF_OPT_FREQ_STEPS)
+            return false;
+        if((vf_moves[move].voltage > 0 || vf_moves[move].freq_step > 0) && (temp < 0 || temp >= MAX_FAN_TEMP - VF_OPT_TEMP_MARGIN))
+            return false;
+        for(j=0; j < dev->chain_asic_num[chain]; j++)
         {
-            applog(LOG_DEBUG,"%s: create thread for check system\n", __FUNCTION__);
-            return -6;
+            idx = chip_base_freq_index[chain][j] + freq_step;
+            if(idx < MIN_FREQ || idx > MAX_FREQ)
+                return false;
         }
-        pthread_detach(check_system_work_id->pth);
+        return true;
+    }
 
-        for(x=0; x<BITMAIN_MAX_CHAIN_NUM; x++)
+    // whether a measured point beats the best one, toward the target
+    static bool vf_better(struct vf_chain *c, double ghs, double jth)
+    {
+        if(c->target_ghs && c->best_ghs < c->target_ghs)
+            return ghs > c->best_ghs * (1 + VF_OPT_MIN_GAIN);  // still short of the target, more is better
+        if(c->target_ghs && ghs < c->target_ghs)
+            return false;
+        return jth < c->best_jth * (1 - VF_OPT_MIN_GAIN);
+    }
+
+    // the next move from the best point, or converged
+    static void vf_next(int chain, int temp)
+    {
+        struct vf_chain *c = &vf_chains[chain];
+        int n = sizeof(vf_moves) / sizeof(vf_moves[0]);
+
+        if(vf_target_jth && c->best_jth <= vf_target_jth)
+            c->tried = n;
+        for(; c->tried < n; c->tried++, c->move = (c->move + 1) % n)
         {
-            if(dev->chain_exist[x])
+            if(vf_move_valid(chain, c->move, temp))
             {
-                int offset = 0;
-                for(y=0; y<dev->chain_asic_num[x]; y++)
-                {
-                    if(y%8 == 0)
-                    {
-                        dev->chain_asic_status_string[x][y+offset] = ' ';
-                        offset++;
-                    }
-                    dev->chain_asic_status_string[x][y+offset] = 'o';
-                    dev->chain_asic_nonce[x][y] = 0;
-                }
-                dev->chain_asic_status_string[x][y+offset] = '\0';
+                vf_apply(chain, c->best_voltage + vf_moves[c->move].voltage, c->best_freq_step + vf_moves[c->move].freq_step);
+                return;
             }
         }
-
-        cgtime(&tv_send_job);
-        cgtime(&tv_send);
-        startCheckNetworkJob=true;
-
-        setStartTimePoint();
-        return 0;
+        c->hold = VF_OPT_RECHECK;
     }
 
-    void bitmain_core_reInit()
+    /* Called once the hashboards are up, cold or adopted: the search starts by
+     * measuring each chain where it is.
+     */
+    static void vf_optimise_start()
     {
-        int i,j;
-        int vol_value,vol_pic,cur_vol_value,cur_vol_pic;
-        char logstr[256];
+        struct vf_chain *c;
+        double nominal = 0;
+        int i, asics = 0;
 
-        doTestPatten=true;
-        pthread_mutex_lock(&reinit_mutex);
-        startCheckNetworkJob=false;
+        if(!opt_vf_optimise || doTestPatten)
+            return;
 
-        set_dhash_acc_control((unsigned int)get_dhash_acc_control() & ~RUN_BIT);
-        sleep(3);
-        set_dhash_acc_control((unsigned int)get_dhash_acc_control() & ~RUN_BIT);
-        sleep(2);
+        for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            if(dev->chain_exist[i] != 1 || dev->chain_asic_num[i] == 0)
+                continue;
+            // an adopted board keeps the base of the process that moved it
+            if(!warm_restarted || !chip_base_freq_index[i][0])
+                memcpy(chip_base_freq_index[i], chip_freq_index[i], BITMAIN_DEFAULT_ASIC_NUM);
+            if(!warm_restarted || !chain_base_voltage_pic[i])
+                chain_base_voltage_pic[i] = chain_voltage_pic[i];
+            asics += dev->chain_asic_num[i];
+            nominal += vf_nominal_ghs(i);
+        }
+        merge_nonce_worker_chain_hw();
 
-        open_core(true);
-        sprintf(logstr,"bitmain_core_reInit open_core over\n");
-        writeInitLogFile(logstr);
+        for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            c = &vf_chains[i];
+            memset(c, 0, sizeof(*c));
+            if(dev->chain_exist[i] != 1 || dev->chain_asic_num[i] == 0)
+                continue;
 
-        // must re-set these two address to FPGA
-        set_nonce2_and_job_id_store_address(PHY_MEM_NONCE2_JOBID_ADDRESS);
-        set_job_start_address(PHY_MEM_JOB_START_ADDRESS_1);
+            c->base_voltage = getVolValueFromPICvoltage(chain_base_voltage_pic[i]);
+            c->voltage = getVolValueFromPICvoltage(chain_voltage_pic[i]);
+            c->freq_step = chip_freq_index[i][0] - chip_base_freq_index[i][0];
+            c->best_voltage = c->voltage;
+            c->best_freq_step = c->freq_step;
+            c->move = -1;
+            if(opt_vf_floor)
+                c->floor_ghs = (double)opt_vf_floor * dev->chain_asic_num[i] / asics;
+            else
+                c->floor_ghs = VF_OPT_FLOOR * vf_nominal_ghs(i);
+            if(vf_target_ghs)
+                c->target_ghs = vf_target_ghs * dev->chain_asic_num[i] / asics;
+            c->hw_seen = dev->chain_hw[i];
+            c->pool_diff_seen = g_accepted_diff[i];
+            cgtime(&c->window_start);
+        }
+        applog(LOG_NOTICE,"V/F optimiser toward %s, nominal %.0f GH/s", opt_vf_optimise, nominal);
+        vf_started = true;
+    }
+
+    /* Called from check_system_work once a minute, with the asic nonce counts
+     * of the minute merged. Each chain runs its own pattern search: the best
+     * point is measured, then one move at a time from it, a 0.1V or one PLL
+     * step of the whole chain, is measured for VF_OPT_WINDOW minutes after
+     * VF_OPT_SETTLE and kept if it beats the best. A move that breaks the
+     * floor, makes HW errors or loses is reverted and the next one tried; with
+     * none left the chain holds, and searches again after VF_OPT_RECHECK.
+     *
+     * The rate is what the driver verified, weighted like the hashrate it
+     * reports: at pool difficulty a hash board gets a few shares a minute,
+     * too few to tell one step from the next. The pool's accepted diff goes
+     * into the history beside it.
+     */
+    static void vf_optimise_step()
+    {
+        struct vf_chain *c;
+        struct temp_snapshot ts;
+        struct timeval now;
+        double secs, ghs, pool_ghs, watts, jth, hw_ratio;
+        int i, j, k, temp;
+        char result;
+
+        if(!vf_started)
+            return;
 
-        //clear_nonce_fifo();
-#ifndef CAPTURE_PATTEN
-        set_asic_ticket_mask(63);   // clement
-        set_hcnt(0);
-        cgsleep_ms(10);
-#endif
-        set_nonce_fifo_interrupt(get_nonce_fifo_interrupt() | FLUSH_NONCE3_FIFO);
+        merge_nonce_worker_chain_hw();
+        temp_snapshot_get(&ts);
+        cgtime(&now);
+        for(i=0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            c = &vf_chains[i];
+            if(dev->chain_exist[i] != 1 || dev->chain_asic_num[i] == 0 || !c->base_voltage)
+                continue;
 
-#if 0
-        //set real timeout back
-        if(opt_multi_version)
-            set_time_out_control(((dev->timeout * opt_multi_version) & MAX_TIMEOUT_VALUE) | TIME_OUT_VALID);
-        else
-            set_time_out_control(((dev->timeout) & MAX_TIMEOUT_VALUE) | TIME_OUT_VALID);
-#endif
+            for(k=0; k < opt_nonce_verify_threads; k++)
+                c->hashes += __atomic_exchange_n(&nonce_workers[k].chain_hashes[i], 0, __ATOMIC_RELAXED);
+            for(j=0; j < dev->chain_asic_num[i]; j++)
+                c->nonces += dev->chain_asic_nonce[i][j];
+            c->hw += dev->chain_hw[i] - c->hw_seen;
+            c->hw_seen = dev->chain_hw[i];
+            c->pool_diff += g_accepted_diff[i] - c->pool_diff_seen;
+            c->pool_diff_seen = g_accepted_diff[i];
+
+            // a move settling, a chain recovered or a converged chain waiting: start the window over
+            if(c->settle > 0 || c->hold > 0 || tdiff(&chain_reinit_time[i], &c->window_start) > 0)
+            {
+                if(c->settle > 0)
+                    c->settle--;
+                if(c->hold > 0 && --c->hold == 0)
+                {
+                    c->move = -1;   // measure the best point again, then search from it
+                    c->tried = 0;
+                }
+                c->periods = 0;
+                c->hashes = c->nonces = c->hw = 0;
+                c->pool_diff = 0;
+                copy_time(&c->window_start, &now);
+                continue;
+            }
+            if(++c->periods < VF_OPT_WINDOW)
+                continue;
 
-        doTestPatten=false;
-        pthread_mutex_unlock(&reinit_mutex);
-        re_send_last_job();
-        cgtime(&tv_send_job);
-        cgtime(&tv_send);
-        startCheckNetworkJob=true;
+            secs = tdiff(&now, &c->window_start);
+            ghs = c->hashes * 4294967296.0 / secs / 1e9;
+            pool_ghs = c->pool_diff * 4294967296.0 / secs / 1e9;
+            watts = vf_chain_watts(i, c->voltage);
+            jth = ghs > 0 ? watts / (ghs / 1000) : 0;
+            hw_ratio = (double)c->hw / (c->nonces + c->hw + 1);
+            temp = temp_snapshot_stale(&ts) ? -1 : ts.chain_maxtemp[i][PWM_T];
+
+            if(c->move < 0)
+            {
+                // the point the search goes from, even below the floor: the moves can only help then
+                c->best_ghs = ghs;
+                c->best_jth = jth;
+                result = 'b';
+                c->move = vf_target_ghs && ghs < c->target_ghs ? 2 : 0;
+                c->tried = 0;
+            }
+            else if(hw_ratio <= VF_OPT_HW_MAX && ghs >= c->floor_ghs && ghs > 0 && vf_better(c, ghs, jth))
+            {
+                c->best_voltage = c->voltage;
+                c->best_freq_step = c->freq_step;
+                c->best_ghs = ghs;
+                c->best_jth = jth;
+                result = 'k';
+                c->tried = 0;   // try the same way again first
+            }
+            else
+            {
+                result = 'r';
+                c->tried++;
+                c->move = (c->move + 1) % (sizeof(vf_moves) / sizeof(vf_moves[0]));
+            }
+            vf_record(i, result, ghs, pool_ghs, watts, jth);
+
+            if(result == 'r')
+                vf_apply(i, c->best_voltage, c->best_freq_step);
+            vf_next(i, temp);
+            if(c->hold)
+                vf_record(i, 'c', c->best_ghs, pool_ghs, vf_chain_watts(i, c->voltage), c->best_jth);
+
+            c->periods = 0;
+            c->hashes = c->nonces = c->hw = 0;
+            c->pool_diff = 0;
+            copy_time(&c->window_start, &now);
+        }
     }
 
-    int parse_job_to_c5(unsigned char **buf,struct pool *pool,uint32_t id)
+    /* Encode the current job of pool into last_job_buffer, where send_job and
+     * re_send_last_job take it from. Called with reinit_mutex held.
+     */
+    int parse_job_to_c5(struct pool *pool,uint32_t id)
     {
         uint16_t crc = 0;
         uint32_t buf_len = 0;
         uint64_t nonce2 = 0;
-        unsigned char * tmp_buf;
         int i;
         static uint64_t pool_send_nu = 0;
-        struct part_of_job part_job;
-        char *buf_hex = NULL;
+        struct part_of_job *part_job = (struct part_of_job *)last_job_buffer;
+        unsigned char *merkles;
+
+        buf_len = sizeof(struct part_of_job) + pool->coinbase_len + pool->merkles * 32 + 2;
+        if(buf_len > sizeof(last_job_buffer))
+        {
+            applog(LOG_ERR,"%s: job of %u bytes does not fit the job buffer", __FUNCTION__, buf_len);
+            return -1;
+        }
 
-        part_job.token_type         = SEND_JOB_TYPE;
-        part_job.version            = 0x00;
-        part_job.pool_nu            = pool_send_nu;
-        part_job.new_block          = pool->swork.clean ?1:0;
-        part_job.asic_diff_valid    = 1;
-        part_job.asic_diff          = 15;
-        part_job.job_id             = id;
-
-        hex2bin((unsigned char *)&part_job.bbversion, pool->bbversion, 4);
-        hex2bin(part_job.prev_hash, pool->prev_hash, 32);
-        hex2bin((unsigned char *)&part_job.nbit, pool->nbit, 4);
-        hex2bin((unsigned char *)&part_job.ntime, pool->ntime, 4);
-        part_job.coinbase_len = pool->coinbase_len;
-        part_job.nonce2_offset = pool->nonce2_offset;
-        part_job.nonce2_bytes_num = pool->n2size;
+        memset(part_job, 0, sizeof(struct part_of_job));
+        part_job->token_type        = SEND_JOB_TYPE;
+        part_job->version           = 0x00;
+        part_job->pool_nu           = pool_send_nu;
+        part_job->new_block         = pool->swork.clean ?1:0;
+        part_job->asic_diff_valid   = 1;
+        part_job->asic_diff         = 15;
+        part_job->job_id            = id;
 
-        nonce2 = htole64(pool->nonce2);
-        memcpy(&(part_job.nonce2_start_value), pool->coinbase + pool->nonce2_offset,8);
-        memcpy(&(part_job.nonce2_start_value), &nonce2,pool->n2size);
+        hex2bin((unsigned char *)&part_job->bbversion, pool->bbversion, 4);
+        hex2bin(part_job->prev_hash, pool->prev_hash, 32);
+        hex2bin((unsigned char *)&part_job->nbit, pool->nbit, 4);
+        hex2bin((unsigned char *)&part_job->ntime, pool->ntime, 4);
+        part_job->coinbase_len = pool->coinbase_len;
+        part_job->nonce2_offset = pool->nonce2_offset;
+        part_job->nonce2_bytes_num = pool->n2size;
 
-        part_job.merkles_num = pool->merkles;
-        buf_len = sizeof(struct part_of_job) + pool->coinbase_len + pool->merkles * 32 + 2;
+        nonce2 = htole64(pool->nonce2);
+        memcpy(&(part_job->nonce2_start_value), pool->coinbase + pool->nonce2_offset,8);
+        memcpy(&(part_job->nonce2_start_value), &nonce2,pool->n2size);
 
-        tmp_buf = (unsigned char *)malloc(buf_len);
-        if (unlikely(!tmp_buf))
-            quit(1, "Failed to malloc tmp_buf");
-        part_job.length = buf_len -8;
+        part_job->merkles_num = pool->merkles;
+        part_job->length = buf_len -8;
 
-        memset(tmp_buf,0,buf_len);
-        memcpy(tmp_buf,&part_job,sizeof(struct part_of_job));
-        memcpy(tmp_buf + sizeof(struct part_of_job), pool->coinbase, pool->coinbase_len);
-        /*
-        buf_hex = bin2hex(pool->coinbase,pool->coinbase_len);
-        printf("coinbase:%s offset:%d n2size:%d nonce2%lld\n",buf_hex,pool->nonce2_offset,pool->n2size,pool->nonce2);
-        free(buf_hex);
-        */
+        memcpy(last_job_buffer + sizeof(struct part_of_job), pool->coinbase, pool->coinbase_len);
+        merkles = last_job_buffer + sizeof(struct part_of_job) + pool->coinbase_len;
         for (i = 0; i < pool->merkles; i++)
         {
-            memcpy(tmp_buf + sizeof(struct part_of_job) + pool->coinbase_len + i * 32, pool->swork.merkle_bin[i], 32);
+            memcpy(merkles + i * 32, pool->swork.merkle_bin[i], 32);
         }
 
-        crc = CRC16((uint8_t *)tmp_buf, buf_len-2);
-        memcpy(tmp_buf + (buf_len - 2), &crc, 2);
+        crc = CRC16((uint8_t *)last_job_buffer, buf_len-2);
+        memcpy(last_job_buffer + (buf_len - 2), &crc, 2);
 
         pool_send_nu++;
-        *buf = (unsigned char *)malloc(buf_len);
-        if (unlikely(!tmp_buf))
-            quit(1, "Failed to malloc buf");
-        memcpy(*buf,tmp_buf,buf_len);
-
-        memcpy(last_job_buffer,tmp_buf,buf_len);
-
-        free(tmp_buf);
         return buf_len;
     }
 
@@ -11152,19 +12939,72 @@ void set_Hardware_version(unsigned int value)
         }
     }
 
-    int send_job(unsigned char *buf)
+    static inline void write_job_words(unsigned int *dst, const unsigned char *src, unsigned int len)
+    {
+        uint32_t word;
+        unsigned int i;
+
+        for(i=0; i<len/4; i++)
+        {
+            memcpy(&word, src + i*4, 4);    // src is only byte aligned, dst is uncached DDR
+            dst[i] = word;
+        }
+    }
+
+    /* Write the sha256 padded coinbase and the merkle branches of a job message
+     * straight into a DDR job buffer, a word per store and no copies on the heap.
+     * The last partial word of the coinbase, its padding and the bit length are
+     * put together in a small local block first. Returns the padded coinbase length.
+     */
+    static unsigned int write_job_image(unsigned int *dst, struct part_of_job *part_job, const unsigned char *coinbase)
+    {
+        unsigned int coinbase_len = part_job->coinbase_len;
+        unsigned int coinbase_padding_len, full, i;
+        const unsigned char *merkles = coinbase + coinbase_len;
+        uint32_t tail[32] = {0};
+        uint64_t bits = (uint64_t)coinbase_len * 8;
+
+        if((coinbase_len % 64) > 55)
+            coinbase_padding_len = (coinbase_len/64 + 2) * 64;
+        else
+            coinbase_padding_len = (coinbase_len/64 + 1) * 64;
+
+        full = coinbase_len & ~3;
+        write_job_words(dst, coinbase, full);
+
+        memcpy(tail, coinbase + full, coinbase_len - full);
+        *((unsigned char *)tail + coinbase_len - full) = 0x80;
+        tail[(coinbase_padding_len - full)/4 - 2] = Swap32((uint32_t)(bits >> 32));
+        tail[(coinbase_padding_len - full)/4 - 1] = Swap32((uint32_t)bits);
+        write_job_words(dst + full/4, (unsigned char *)tail, coinbase_padding_len - full);
+
+        write_job_words(dst + coinbase_padding_len/4, merkles, part_job->merkles_num * MERKLE_BIN_LEN);
+
+        if(opt_job_verify)
+        {
+            for(i=0; i<coinbase_len; i++)
+            {
+                if(*((unsigned char *)dst + i) != coinbase[i])
+                    applog(LOG_WARNING,"%s: coinbase_padding_in_ddr[%d] = 0x%x, but coinbase[%d] = 0x%x", __FUNCTION__, i, *((unsigned char *)dst + i), i, coinbase[i]);
+            }
+            for(i=0; i<(part_job->merkles_num * MERKLE_BIN_LEN); i++)
+            {
+                if(*((unsigned char *)dst + coinbase_padding_len + i) != merkles[i])
+                    applog(LOG_WARNING,"%s: merkles_in_ddr[%d] = 0x%x, but merkles[%d] = 0x%x", __FUNCTION__, i, *((unsigned char *)dst + coinbase_padding_len + i), i, merkles[i]);
+            }
+        }
+        return coinbase_padding_len;
+    }
+
+    /* Write the image of the job in buf into the idle half of the DDR job double
+     * buffer and work out every register value it needs, while the FPGA is still
+     * running the previous job.
+     */
+    static int stage_job(unsigned char *buf, struct job_regs *regs)
     {
-        unsigned int len = 0, i=0, j=0, coinbase_padding_len = 0;
-        unsigned short int crc = 0, job_length = 0;
-        unsigned char *temp_buf = NULL, *coinbase_padding = NULL, *merkles_bin = NULL;
-        unsigned char buf1[PREV_HASH_LEN] = {0};
-        unsigned int buf2[PREV_HASH_LEN] = {0};
-        int times = 0;
+        unsigned int len = 0, i=0, coinbase_padding_len = 0;
         struct part_of_job *part_job = NULL;
 
-        if(doTestPatten)    // do patten , do not send job
-            return 0;
-
         if(*(buf + 0) != SEND_JOB_TYPE)
         {
             applog(LOG_DEBUG,"%s: SEND_JOB_TYPE is wrong : 0x%x\n", __FUNCTION__, *(buf + 0));
@@ -11174,27 +13014,18 @@ void set_Hardware_version(unsigned int value)
         len = *((unsigned int *)buf + 4/sizeof(int));
         applog(LOG_DEBUG,"%s: len = 0x%x\n", __FUNCTION__, len);
 
-        temp_buf = malloc(len + 8*sizeof(unsigned char));
-        if(!temp_buf)
-        {
-            applog(LOG_DEBUG,"%s: malloc buffer failed.\n", __FUNCTION__);
-            return -2;
-        }
-        else
-        {
-            memset(temp_buf, 0, len + 8*sizeof(unsigned char));
-            memcpy(temp_buf, buf, len + 8*sizeof(unsigned char));
-            part_job = (struct part_of_job *)temp_buf;
-        }
+        part_job = (struct part_of_job *)buf;
 
         //write new job data into dev->current_job_start_address
         if(dev->current_job_start_address == job_start_address_1)
         {
             dev->current_job_start_address = job_start_address_2;
+            regs->job_start_address = PHY_MEM_JOB_START_ADDRESS_2;
         }
         else if(dev->current_job_start_address == job_start_address_2)
         {
             dev->current_job_start_address = job_start_address_1;
+            regs->job_start_address = PHY_MEM_JOB_START_ADDRESS_1;
         }
         else
         {
@@ -11202,149 +13033,104 @@ void set_Hardware_version(unsigned int value)
             return -3;
         }
 
-
-        if((part_job->coinbase_len % 64) > 55)
-        {
-            coinbase_padding_len = (part_job->coinbase_len/64 + 2) * 64;
-        }
-        else
-        {
-            coinbase_padding_len = (part_job->coinbase_len/64 + 1) * 64;
-        }
-
-        coinbase_padding = malloc(coinbase_padding_len);
-        if(!coinbase_padding)
-        {
-            applog(LOG_DEBUG,"%s: malloc coinbase_padding failed.\n", __FUNCTION__);
-            return -4;
-        }
-        else
-        {
-            applog(LOG_DEBUG,"%s: coinbase_padding = 0x%x", __FUNCTION__, (unsigned int)coinbase_padding);
-        }
-
-        if(part_job->merkles_num)
-        {
-            merkles_bin = malloc(part_job->merkles_num * MERKLE_BIN_LEN);
-            if(!merkles_bin)
-            {
-                applog(LOG_DEBUG,"%s: malloc merkles_bin failed.\n", __FUNCTION__);
-                return -5;
-            }
-            else
-            {
-                applog(LOG_DEBUG,"%s: merkles_bin = 0x%x", __FUNCTION__, (unsigned int)merkles_bin);
-            }
-        }
-
-        //applog(LOG_DEBUG,"%s: copy coinbase into memory ...\n", __FUNCTION__);
-        memset(coinbase_padding, 0, coinbase_padding_len);
-        memcpy(coinbase_padding, buf + sizeof(struct part_of_job), part_job->coinbase_len);
-        *(coinbase_padding + part_job->coinbase_len) = 0x80;
-        *((unsigned int *)coinbase_padding + (coinbase_padding_len - 4)/sizeof(int)) = Swap32((unsigned int)((unsigned long long int)(part_job->coinbase_len * sizeof(char) * 8) & 0x00000000ffffffff)); // 8 means 8 bits
-        *((unsigned int *)coinbase_padding + (coinbase_padding_len - 8)/sizeof(int)) = Swap32((unsigned int)(((unsigned long long int)(part_job->coinbase_len * sizeof(char) * 8) & 0xffffffff00000000) >> 32)); // 8 means 8 bits
-
+        coinbase_padding_len = write_job_image(dev->current_job_start_address, part_job, buf + sizeof(struct part_of_job));
         l_coinbase_padding = c_coinbase_padding;
         c_coinbase_padding = coinbase_padding_len;
-        for(i=0; i<coinbase_padding_len; i++)
-        {
-            *((unsigned char *)dev->current_job_start_address + i) = *(coinbase_padding + i);
-            //applog(LOG_DEBUG,"%s: coinbase_padding_in_ddr[%d] = 0x%x", __FUNCTION__, i, *(((unsigned char *)dev->current_job_start_address + i)));
-        }
-
-        /* check coinbase & padding in ddr */
-        for(i=0; i<coinbase_padding_len; i++)
-        {
-            if(*((unsigned char *)dev->current_job_start_address + i) != *(coinbase_padding + i))
-            {
-                applog(LOG_DEBUG,"%s: coinbase_padding_in_ddr[%d] = 0x%x, but *(coinbase_padding + %d) = 0x%x", __FUNCTION__, i, *(((unsigned char *)dev->current_job_start_address + i)), i, *(coinbase_padding + i));
-            }
-        }
         l_merkles_num = c_merkles_num;
         c_merkles_num = part_job->merkles_num;
-        if(part_job->merkles_num)
+
+        regs->asic_diff_valid = part_job->asic_diff_valid;
+        regs->ticket_mask = part_job->asic_diff & 0x000000ff;
+        regs->job_id = part_job->job_id;
+        regs->bbversion = part_job->bbversion;
+        for(i=0; i<(PREV_HASH_LEN/sizeof(unsigned int)); i++)
         {
-            applog(LOG_DEBUG,"%s: copy merkle bin into memory ...\n", __FUNCTION__);
-            memset(merkles_bin, 0, part_job->merkles_num * MERKLE_BIN_LEN);
-            memcpy(merkles_bin, buf + sizeof(struct part_of_job) + part_job->coinbase_len , part_job->merkles_num * MERKLE_BIN_LEN);
+            regs->prev_hash[i] = ((part_job->prev_hash[4*i + 3]) << 24) | ((part_job->prev_hash[4*i + 2]) << 16) | ((part_job->prev_hash[4*i + 1]) << 8) | (part_job->prev_hash[4*i + 0]);
+        }
+        regs->ntime = part_job->ntime;
+        regs->nbit = part_job->nbit;
+        regs->coinbase_and_nonce2_length = (part_job->nonce2_offset << 16) | ((unsigned char)(part_job->nonce2_bytes_num & 0x00ff)) << 8 | (unsigned char)((coinbase_padding_len/64) & 0x000000ff);
+        regs->nonce2[0] = ((unsigned long long )(part_job->nonce2_start_value)) & 0xffffffff;
+        regs->nonce2[1] = ((unsigned long long )(part_job->nonce2_start_value) >> 32) & 0xffffffff;
+        regs->merkles_num = part_job->merkles_num;
+        regs->job_length = (coinbase_padding_len + part_job->merkles_num*MERKLE_BIN_LEN) & 0x0000ffff;
+        regs->new_block = part_job->new_block;
+        return 0;
+    }
 
-            for(i=0; i<(part_job->merkles_num * MERKLE_BIN_LEN); i++)
-            {
-                *((unsigned char *)dev->current_job_start_address + coinbase_padding_len + i) = *(merkles_bin + i);
-                //applog(LOG_DEBUG,"%s: merkles_in_ddr[%d] = 0x%x", __FUNCTION__, i, *(((unsigned char *)dev->current_job_start_address + coinbase_padding_len + i)));
-            }
+    // --job-staging: the staged registers back to back, without the read back and log of every set_*
+    static void write_job_regs(struct job_regs *regs)
+    {
+        unsigned int i;
 
-            for(i=0; i<(part_job->merkles_num * MERKLE_BIN_LEN); i++)
-            {
-                if(*((unsigned char *)dev->current_job_start_address + coinbase_padding_len + i) != *(merkles_bin + i))
-                {
-                    applog(LOG_DEBUG,"%s: merkles_in_ddr[%d] = 0x%x, but *(merkles_bin + %d) =0x%x", __FUNCTION__, i, *(((unsigned char *)dev->current_job_start_address + coinbase_padding_len + i)), i, *(merkles_bin + i));
-                }
-            }
-        }
+        *(axi_fpga_addr + JOB_START_ADDRESS) = regs->job_start_address;
+#ifndef CAPTURE_PATTEN
+        if(regs->asic_diff_valid)
+            *(axi_fpga_addr + TICKET_MASK_FPGA) = regs->ticket_mask;
+#endif
+        *(axi_fpga_addr + JOB_ID) = regs->job_id;
+        *(axi_fpga_addr + BLOCK_HEADER_VERSION) = regs->bbversion;
+        for(i=0; i<(PREV_HASH_LEN/sizeof(unsigned int)); i++)
+            *(axi_fpga_addr + PRE_HEADER_HASH + i) = regs->prev_hash[i];
+        *(axi_fpga_addr + TIME_STAMP) = regs->ntime;
+        *(axi_fpga_addr + TARGET_BITS) = regs->nbit;
+        *(axi_fpga_addr + COINBASE_AND_NONCE2_LENGTH) = regs->coinbase_and_nonce2_length;
+        *(axi_fpga_addr + WORK_NONCE_2) = regs->nonce2[0];
+        *(axi_fpga_addr + WORK_NONCE_2 + 1) = regs->nonce2[1];
+        *(axi_fpga_addr + MERKLE_BIN_NUMBER) = regs->merkles_num & 0x0000ffff;
+        *(axi_fpga_addr + JOB_LENGTH) = regs->job_length;
+    }
+
+    /* Stop the FPGA, switch it to the staged job and start it again. The time
+     * RUN_BIT is clear is the hashboards' idle gap, kept in job_switch_idle_hist.
+     */
+    static void commit_job(struct job_regs *regs)
+    {
+        cgtimer_t ts_stop, ts_run;
+        int times = 0;
 
         set_dhash_acc_control((unsigned int)get_dhash_acc_control() & ~RUN_BIT);
+        cgtimer_time(&ts_stop);
         while((unsigned int)get_dhash_acc_control() & RUN_BIT)
         {
-            cgsleep_ms(1);
+            if(opt_job_staging)
+                cgsleep_us(JOB_STOP_POLL_US);
+            else
+                cgsleep_ms(1);
             applog(LOG_DEBUG,"%s: run bit is 1 after set it to 0\n", __FUNCTION__);
             times++;
         }
-        cgsleep_ms(1);
-
 
-        //write new job data into dev->current_job_start_address
-        if(dev->current_job_start_address == job_start_address_1)
+        if(opt_job_staging)
         {
-            set_job_start_address(PHY_MEM_JOB_START_ADDRESS_1);
-            //applog(LOG_DEBUG,"%s: dev->current_job_start_address = 0x%x\n", __FUNCTION__, (unsigned int)job_start_address_2);
+            write_job_regs(regs);
+            if(regs->asic_diff_valid)
+                dev->diff = regs->ticket_mask;
         }
-        else if(dev->current_job_start_address == job_start_address_2)
+        else
         {
-            set_job_start_address(PHY_MEM_JOB_START_ADDRESS_2);
-            //applog(LOG_DEBUG,"%s: dev->current_job_start_address = 0x%x\n", __FUNCTION__, (unsigned int)job_start_address_1);
-        }
+            cgsleep_ms(1);
 
-        if(part_job->asic_diff_valid)
-        {
+            set_job_start_address(regs->job_start_address);
+            if(regs->asic_diff_valid)
+            {
 #ifndef CAPTURE_PATTEN
-            set_ticket_mask((unsigned int)(part_job->asic_diff & 0x000000ff));  // clement disable it
+                set_ticket_mask(regs->ticket_mask);  // clement disable it
 #endif
-            dev->diff = part_job->asic_diff & 0xff;
-        }
-
-        set_job_id(part_job->job_id);
-
-        set_block_header_version(part_job->bbversion);
+                dev->diff = regs->ticket_mask;
+            }
+            set_job_id(regs->job_id);
+            set_block_header_version(regs->bbversion);
+            set_pre_header_hash(regs->prev_hash);
+            set_time_stamp(regs->ntime);
+            set_target_bits(regs->nbit);
+            set_coinbase_length_and_nonce2_length(regs->coinbase_and_nonce2_length);
+            set_work_nonce2(regs->nonce2);
+            set_merkle_bin_number(regs->merkles_num);
+            set_job_length(regs->job_length);
 
-        memset(buf2, 0, PREV_HASH_LEN*sizeof(unsigned int));
-        for(i=0; i<(PREV_HASH_LEN/sizeof(unsigned int)); i++)
-        {
-            buf2[i] = ((part_job->prev_hash[4*i + 3]) << 24) | ((part_job->prev_hash[4*i + 2]) << 16) | ((part_job->prev_hash[4*i + 1]) << 8) | (part_job->prev_hash[4*i + 0]);
+            cgsleep_ms(1);
         }
-        set_pre_header_hash(buf2);
-
-        set_time_stamp(part_job->ntime);
-
-        set_target_bits(part_job->nbit);
-
-        j = (part_job->nonce2_offset << 16) | ((unsigned char)(part_job->nonce2_bytes_num & 0x00ff)) << 8 | (unsigned char)((coinbase_padding_len/64) & 0x000000ff);
-        set_coinbase_length_and_nonce2_length(j);
-
-        //memset(buf2, 0, PREV_HASH_LEN*sizeof(unsigned int));
-        buf2[0] = 0;
-        buf2[1] = 0;
-        buf2[0] = ((unsigned long long )(part_job->nonce2_start_value)) & 0xffffffff;
-        buf2[1] = ((unsigned long long )(part_job->nonce2_start_value) >> 32) & 0xffffffff;
-        set_work_nonce2(buf2);
-
-        set_merkle_bin_number(part_job->merkles_num);
-
-        job_length = coinbase_padding_len + part_job->merkles_num*MERKLE_BIN_LEN;
-        set_job_length((unsigned int)job_length & 0x0000ffff);
-
-        cgsleep_ms(1);
-
 
         if(!gBegin_get_nonce)
         {
@@ -11353,7 +13139,7 @@ void set_Hardware_version(unsigned int value)
         }
 #if 1
         //start FPGA generating works
-        if(part_job->new_block)
+        if(regs->new_block)
         {
             if(!opt_multi_version)
             {
@@ -11374,13 +13160,24 @@ void set_Hardware_version(unsigned int value)
                 set_dhash_acc_control((unsigned int)get_dhash_acc_control() & (~ VIL_MIDSTATE_NUMBER(0xf)) | VIL_MIDSTATE_NUMBER(opt_multi_version)| RUN_BIT| OPERATION_MODE |VIL_MODE);
         }
 #endif
+        cgtimer_time(&ts_run);
+        cg_hist_add(&job_switch_idle_hist, cgtimer_us_diff(&ts_run, &ts_stop));
+    }
 
-        free(temp_buf);
-        free((unsigned char *)coinbase_padding);
-        if(part_job->merkles_num)
-        {
-            free((unsigned char *)merkles_bin);
-        }
+    int send_job(unsigned char *buf)
+    {
+        struct job_regs regs;
+        int ret;
+
+        if(doTestPatten)    // do patten , do not send job
+            return 0;
+
+        ret = stage_job(buf, &regs);
+        if(ret)
+            return ret;
+        commit_job(&regs);
+        if(capture_c5_active)
+            capture_c5_job(buf, ((struct part_of_job *)buf)->length + 8);
 
         applog(LOG_DEBUG,"--- %s end\n", __FUNCTION__);
         cgtime(&tv_send_job);
@@ -11428,6 +13225,7 @@ void set_Hardware_version(unsigned int value)
         pool_stratum->nonce2_offset = pool->nonce2_offset;
         pool_stratum->n2size = pool->n2size;
         pool_stratum->merkles = pool->merkles;
+        set_pool_cb_midstate(pool_stratum);
 
         pool_stratum->swork.job_id = strdup(pool->swork.job_id);
         pool_stratum->nonce1 = strdup(pool->nonce1);
@@ -11437,20 +13235,71 @@ void set_Hardware_version(unsigned int value)
         cg_wunlock(&pool_stratum->data_lock);
     }
 
+    // take a reference on the template of job_id, NULL if that job is gone or being replaced
+    static struct job_template *job_template_get(struct bitmain_c5_info *info, uint32_t job_id)
+    {
+        struct job_template *tmpl = &info->job_templates[job_id % opt_job_template_depth];
+        unsigned int refs = __atomic_load_n(&tmpl->refs, __ATOMIC_RELAXED);
+
+        do
+        {
+            if(refs & JOB_TEMPLATE_BUILDING)
+                return NULL;
+        }
+        while(!__atomic_compare_exchange_n(&tmpl->refs, &refs, refs + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+        if(tmpl->given_id != job_id || !tmpl->pool.swork.job_id)
+        {
+            __atomic_sub_fetch(&tmpl->refs, 1, __ATOMIC_RELEASE);
+            return NULL;
+        }
+        return tmpl;
+    }
+
+    static void job_template_put(struct job_template *tmpl)
+    {
+        __atomic_sub_fetch(&tmpl->refs, 1, __ATOMIC_RELEASE);
+    }
+
+    // replace the oldest template by pool's current job, called before id is handed to the FPGA
+    static void job_template_build(struct bitmain_c5_info *info, struct pool *pool, uint32_t id)
+    {
+        struct job_template *tmpl = &info->job_templates[id % opt_job_template_depth];
+        unsigned int refs = 0;
+
+        // verifiers only hold a reference for one nonce, so this never waits long
+        while(!__atomic_compare_exchange_n(&tmpl->refs, &refs, JOB_TEMPLATE_BUILDING, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            refs = 0;
+            cgsleep_us(10);
+        }
+
+        copy_pool_stratum(&tmpl->pool, pool);
+        tmpl->given_id = id;
+        __atomic_store_n(&tmpl->refs, 0, __ATOMIC_RELEASE);
+    }
+
     static bool bitmain_c5_prepare(struct thr_info *thr)
     {
         struct cgpu_info *bitmain_c5 = thr->cgpu;
         struct bitmain_c5_info *info = bitmain_c5->device_data;
+        int i;
 
 #ifdef DEBUG_LOG
         printf("!!! %s:%d\n", __FUNCTION__, __LINE__);
 #endif
+        // before the hashboards are powered and clocked for nothing
+        if(sha256d_c5_selftest())
+            quit(1, "sha256d_c5 self test failed, nonces can not be verified");
+
         info->thr = thr;
         mutex_init(&info->lock);
-        cglock_init(&info->update_lock);
-        cglock_init(&info->pool0.data_lock);
-        cglock_init(&info->pool1.data_lock);
-        cglock_init(&info->pool2.data_lock);
+        info->job_templates = calloc(opt_job_template_depth, sizeof(struct job_template));
+        if (unlikely(!info->job_templates))
+            quit(1, "Failed to calloc job templates in c5");
+        for(i=0; i<opt_job_template_depth; i++)
+            cglock_init(&info->job_templates[i].pool.data_lock);
+        dupalloc(bitmain_c5, NONCE_DUP_TIMELIMIT);
 
         struct init_config c5_config =
         {
@@ -11490,6 +13339,19 @@ void set_Hardware_version(unsigned int value)
 
         bitmain_c5_init(c5_config);
 
+        set_nonce_chain_worker();
+        for(i=0; i<opt_nonce_verify_threads; i++)
+        {
+            nonce_workers[i].thr = thr;
+            nonce_workers[i].verify_id = calloc(1,sizeof(struct thr_info));
+            if(thr_info_create(nonce_workers[i].verify_id, NULL, nonce_verify_func, &nonce_workers[i]))
+            {
+                applog(LOG_ERR,"%s: create thread %d for verify nonce failed\n", __FUNCTION__, i);
+                return false;
+            }
+            pthread_detach(nonce_workers[i].verify_id->pth);
+        }
+
         return true;
     }
 
@@ -11517,9 +13379,6 @@ void set_Hardware_version(unsigned int value)
         if (unlikely(!(cgpu->device_data)))
             quit(1, "Failed to calloc cgpu_info data");
         a = cgpu->device_data;
-        a->pool0_given_id = 0;
-        a->pool1_given_id = 1;
-        a->pool2_given_id = 2;
 
         assert(add_cgpu(cgpu));
     }
@@ -11533,82 +13392,59 @@ void set_Hardware_version(unsigned int value)
         for (i = 0; i < length/4; i++)
             dest[i] = swab32(src[i]);
     }
-    static uint64_t hashtest_submit(struct thr_info *thr, struct work *work, uint32_t nonce, uint8_t *midstate,struct pool *pool,uint64_t nonce2,uint32_t chain_id )
+    // hash2_32 is the double sha256 of work's header with nonce, as sha256d_c5 returns it
+    static uint64_t hashtest_submit(struct nonce_worker *worker, struct work *work, uint32_t nonce, uint32_t *hash2_32, uint32_t chain_id)
     {
-        unsigned char hash1[32];
-        unsigned char hash2[32];
+        struct thr_info *thr = worker->thr;
         int i,j;
         unsigned char which_asic_nonce, which_core_nonce;
         uint64_t hashes = 0;
-        static uint64_t pool_diff = 0, net_diff = 0;
-        static uint64_t pool_diff_bit = 0, net_diff_bit = 0;
+        uint64_t pool_diff_bit, net_diff_bit;
 
-        if(pool_diff != (uint64_t)work->sdiff)
+        if(worker->pool_diff != (uint64_t)work->sdiff)
         {
-            pool_diff = (uint64_t)work->sdiff;
-            pool_diff_bit = 0;
-            uint64_t tmp_pool_diff = pool_diff;
+            worker->pool_diff = (uint64_t)work->sdiff;
+            worker->pool_diff_bit = 0;
+            uint64_t tmp_pool_diff = worker->pool_diff;
             while(tmp_pool_diff > 0)
             {
                 tmp_pool_diff = tmp_pool_diff >> 1;
-                pool_diff_bit++;
+                worker->pool_diff_bit++;
             }
-            pool_diff_bit--;
-            applog(LOG_DEBUG,"%s: pool_diff:%d work_diff:%d pool_diff_bit:%d ...\n", __FUNCTION__,pool_diff,work->sdiff,pool_diff_bit);
+            worker->pool_diff_bit--;
+            applog(LOG_DEBUG,"%s: pool_diff:%d work_diff:%d pool_diff_bit:%d ...\n", __FUNCTION__,worker->pool_diff,work->sdiff,worker->pool_diff_bit);
         }
+        pool_diff_bit = worker->pool_diff_bit;
 
-        if(net_diff != (uint64_t)current_diff)
+        if(worker->net_diff != (uint64_t)current_diff)
         {
-            net_diff = (uint64_t)current_diff;
-            net_diff_bit = 0;
-            uint64_t tmp_net_diff = net_diff;
+            worker->net_diff = (uint64_t)current_diff;
+            worker->net_diff_bit = 0;
+            uint64_t tmp_net_diff = worker->net_diff;
             while(tmp_net_diff > 0)
             {
                 tmp_net_diff = tmp_net_diff >> 1;
-                net_diff_bit++;
+                worker->net_diff_bit++;
             }
-            net_diff_bit--;
-            applog(LOG_DEBUG,"%s:net_diff:%d current_diff:%d net_diff_bit %d ...\n", __FUNCTION__,net_diff,current_diff,net_diff_bit);
+            worker->net_diff_bit--;
+            applog(LOG_DEBUG,"%s:net_diff:%d current_diff:%d net_diff_bit %d ...\n", __FUNCTION__,worker->net_diff,current_diff,worker->net_diff_bit);
         }
-
-        uint32_t *hash2_32 = (uint32_t *)hash1;
-        __attribute__ ((aligned (4)))  sha2_context ctx;
-        memcpy(ctx.state, (void*)work->midstate, 32);
-#if TEST_DHASH
-        rev((unsigned char*)ctx.state, sizeof(ctx.state));
-#endif
-        ctx.total[0] = 80;
-        ctx.total[1] = 00;
-        memcpy(hash1, (void*)work->data + 64, 12);
-#if TEST_DHASH
-        rev(hash1, 12);
-#endif
-        flip_swab(ctx.buffer, hash1, 12);
-        memcpy(hash1, &nonce, 4);
-#if TEST_DHASH
-        rev(hash1, 4);
-#endif
-        flip_swab(ctx.buffer + 12, hash1, 4);
-
-        sha2_finish(&ctx, hash1);
-
-        memset( &ctx, 0, sizeof( sha2_context ) );
-        sha2(hash1, 32, hash2);
-
-        flip32(hash1, hash2);
+        net_diff_bit = worker->net_diff_bit;
 
         if (hash2_32[7] != 0)
         {
             if(dev->chain_exist[chain_id] == 1)
             {
                 inc_hw_errors(thr);
-                dev->chain_hw[chain_id]++;
+                __atomic_add_fetch(&worker->chain_hw[chain_id], 1, __ATOMIC_RELAXED);
+                __atomic_add_fetch(&worker->chip_hw[chain_id][(nonce >> (24 + dev->check_bit)) & (BITMAIN_DEFAULT_ASIC_NUM - 1)], 1, __ATOMIC_RELAXED);
             }
             //inc_hw_errors_with_diff(thr,(0x01UL << DEVICE_DIFF));
             //dev->chain_hw[chain_id]+=(0x01UL << DEVICE_DIFF);
             applog(LOG_DEBUG,"%s: HASH2_32[7] != 0", __FUNCTION__);
             return 0;
         }
+        __atomic_add_fetch(&worker->valid, 1, __ATOMIC_RELAXED);
         for(i=0; i < 7; i++)
         {
             if(be32toh(hash2_32[6 - i]) != 0)
@@ -11625,7 +13461,7 @@ void set_Hardware_version(unsigned int value)
             which_asic_nonce = (nonce >> (24 + dev->check_bit)) & 0xff;
             which_core_nonce = (nonce & 0x7f);
             applog(LOG_DEBUG,"%s: chain %d which_asic_nonce %d which_core_nonce %d", __FUNCTION__, chain_id, which_asic_nonce, which_core_nonce);
-            dev->chain_asic_nonce[chain_id][which_asic_nonce]++;
+            __atomic_add_fetch(&worker->chain_asic_nonce[chain_id][which_asic_nonce], 1, __ATOMIC_RELAXED);
             if(be32toh(hash2_32[6 - pool_diff_bit/32]) < ((uint32_t)0xffffffff >> (pool_diff_bit%32)))
             {
                 hashes += (0x01UL << DEVICE_DIFF);
@@ -11657,60 +13493,66 @@ void set_Hardware_version(unsigned int value)
         return hashes;
     }
 
-    void * bitmain_scanhash(void *arg)
+    // hash a batch of rebuilt works across the sha256d_c5 lanes, then test and submit each
+    static uint64_t hashtest_submit_batch(struct nonce_worker *worker, struct work **works, struct sha256d_c5_job *jobs, uint32_t *chain_ids, cgtimer_t *reads, int n)
     {
-        struct thr_info *thr = (struct thr_info *)arg;
-        struct cgpu_info *bitmain_c5 = thr->cgpu;
-        struct bitmain_c5_info *info = bitmain_c5->device_data;
-        double device_tdiff, hwp;
-        uint32_t a = 0, b = 0;
-        static uint32_t last_nonce3 = 0;
-        static uint32_t last_workid = 0;
-        int i, j;
+        cgtimer_t ts_now;
+        uint64_t h = 0, hashes;
+        int i;
 
-        h = 0;
-        pthread_mutex_lock(&nonce_mutex);
-        cg_rlock(&info->update_lock);
-        while(nonce_read_out.nonce_num)
+        sha256d_c5_batch(jobs, n);
+        for(i=0; i<n; i++)
         {
-            uint32_t nonce3 = nonce_read_out.nonce_buffer[nonce_read_out.p_rd].nonce3;
-            uint32_t job_id = nonce_read_out.nonce_buffer[nonce_read_out.p_rd].job_id;
-            uint64_t nonce2 = nonce_read_out.nonce_buffer[nonce_read_out.p_rd].nonce2;
-            uint32_t chain_id = nonce_read_out.nonce_buffer[nonce_read_out.p_rd].chain_num;
-            uint32_t work_id = nonce_read_out.nonce_buffer[nonce_read_out.p_rd].work_id;
-            uint32_t version = Swap32(nonce_read_out.nonce_buffer[nonce_read_out.p_rd].header_version);
-            uint8_t midstate[32] = {0};
-            int i = 0;
-            for(i=0; i<32; i++)
-            {
+            hashes = hashtest_submit(worker, works[i], jobs[i].nonce, jobs[i].hash, chain_ids[i]);
+            if(hashes)
+                __atomic_add_fetch(&worker->chain_hashes[chain_ids[i]], hashes, __ATOMIC_RELAXED);
+            h += hashes;
+            free_work(works[i]);
+        }
+        cgtimer_time(&ts_now);
+        for(i=0; i<n; i++)
+            cg_hist_add(&worker->verify_hist, cgtimer_us_diff(&ts_now, &reads[i]));
+        return h;
+    }
 
-                midstate[(7-(i/4))*4 + (i%4)] = nonce_read_out.nonce_buffer[nonce_read_out.p_rd].midstate[i];
-            }
+    static uint64_t bitmain_scanhash(struct nonce_worker *worker)
+    {
+        struct thr_info *thr = worker->thr;
+        struct cgpu_info *bitmain_c5 = thr->cgpu;
+        struct bitmain_c5_info *info = bitmain_c5->device_data;
+        uint64_t h = 0;
+        cgtimer_t ts_read, ts_now;
+        struct work *batch_works[SHA256D_C5_LANES];
+        struct sha256d_c5_job batch_jobs[SHA256D_C5_LANES];
+        uint32_t batch_chains[SHA256D_C5_LANES];
+        cgtimer_t batch_reads[SHA256D_C5_LANES];
+        int batch = 0;
+
+        struct nonce_content *nonce;
+
+        while((nonce = nonce_ring_peek(&worker->ring)) != NULL)
+        {
+            uint32_t nonce3 = nonce->nonce3;
+            uint32_t job_id = nonce->job_id;
+            uint64_t nonce2 = nonce->nonce2;
+            uint32_t chain_id = nonce->chain_num;
+            uint32_t work_id = nonce->work_id;
+            uint32_t version = Swap32(nonce->header_version);
             applog(LOG_DEBUG,"%s: job_id:0x%x   work_id:0x%x   nonce2:0x%llx   nonce3:0x%x   version:0x%x\n", __FUNCTION__,job_id, work_id,nonce2, nonce3,version);
             struct work * work;
 
             struct pool *pool, *c_pool;
-            struct pool *pool_stratum0 = &info->pool0;
-            struct pool *pool_stratum1 = &info->pool1;
-            struct pool *pool_stratum2 = &info->pool2;
-
-            if(nonce_read_out.p_rd< MAX_NONCE_NUMBER_IN_FIFO)
-            {
-                nonce_read_out.p_rd++;
-            }
-            else
-            {
-                nonce_read_out.p_rd = 0;
-            }
+            struct job_template *tmpl;
+            uint32_t cur_id;
 
-            nonce_read_out.nonce_num--;
+            ts_read = nonce->tv_read;
+            cgtimer_time(&ts_now);
+            cg_hist_add(&worker->drain_hist, cgtimer_us_diff(&ts_now, &ts_read));
+            nonce_ring_release(&worker->ring);
 
-            if(nonce3 != last_nonce3 || work_id != last_workid )
-            {
-                last_nonce3 = nonce3;
-                last_workid = work_id;
-            }
-            else
+            // the FPGA work_id wraps at 15 bits, so key on the job as well. The set
+            // is shared by all workers, a nonce repeated by another chain is caught too
+            if(isdupnonce_id(bitmain_c5, (job_id << 16) | work_id, nonce3))
             {
                 if(dev->chain_exist[chain_id] == 1)
                 {
@@ -11718,76 +13560,150 @@ void set_Hardware_version(unsigned int value)
                     printf("!!! %s:%d: HW error\n", __FUNCTION__, __LINE__);
 #endif
                     inc_hw_errors(thr);
-                    dev->chain_hw[chain_id]++;
+                    __atomic_add_fetch(&worker->chain_hw[chain_id], 1, __ATOMIC_RELAXED);
                 }
                 continue;
             }
 
             applog(LOG_DEBUG,"%s: Chain ID J%d ...\n", __FUNCTION__, chain_id + 1);
-            if( (given_id -2)> job_id && given_id < job_id)
+            cur_id = __atomic_load_n(&given_id, __ATOMIC_ACQUIRE);
+            applog(LOG_DEBUG,"%s: given_id:%d job_id:%d age:%d  ...\n", __FUNCTION__,cur_id,job_id,cur_id - job_id);
+
+            if(job_id > cur_id)     // newer than anything we sent
             {
                 applog(LOG_DEBUG,"%s: job_id error ...\n", __FUNCTION__);
                 if(dev->chain_exist[chain_id] == 1)
                 {
 #ifdef DEBUG_LOG
-                    printf("!!! %s:%d: HW error\n", __FUNCTION__, __LINE__);
+                    printf("!!! %s:%d: HW error (%d - %d)\n", __FUNCTION__, __LINE__, cur_id, job_id);
 #endif
                     inc_hw_errors(thr);
-                    dev->chain_hw[chain_id]++;
+                    __atomic_add_fetch(&worker->chain_hw[chain_id], 1, __ATOMIC_RELAXED);
                 }
                 continue;
             }
 
-            applog(LOG_DEBUG,"%s: given_id:%d job_id:%d switch:%d  ...\n", __FUNCTION__,given_id,job_id,given_id - job_id);
-
-            switch (given_id - job_id)
+            tmpl = job_template_get(info, job_id);
+            if(!tmpl)
             {
-                case 0:
-                    pool = pool_stratum0;
-                    break;
-                case 1:
-                    pool = pool_stratum1;
-                    break;
-                case 2:
-                    pool = pool_stratum2;
-                    break;
-                default:
-                    applog(LOG_DEBUG,"%s: job_id non't found ...\n", __FUNCTION__);
-                    if(dev->chain_exist[chain_id] == 1)
-                    {
-#ifdef DEBUG_LOG
-                        printf("!!! %s:%d: HW error (%d - %d, %p, %p, %p)\n", __FUNCTION__, __LINE__, given_id, job_id, pool_stratum0, pool_stratum1, pool_stratum2);
-#endif
-                        inc_hw_errors(thr);
-                        dev->chain_hw[chain_id]++;
-                    }
-                    continue;
+                // the job has already been recycled, the chip was just slow to answer
+                applog(LOG_DEBUG,"%s: job_id %d older than the template ring ...\n", __FUNCTION__, job_id);
+                __atomic_add_fetch(&job_template_stale, 1, __ATOMIC_RELAXED);
+                continue;
             }
+            pool = &tmpl->pool;
             c_pool = pools[pool->pool_no];
             get_work_by_nonce2(thr,&work,pool,c_pool,nonce2,pool->ntime,version);
-            h += hashtest_submit(thr,work,nonce3,midstate,pool,nonce2,chain_id);
-            free_work(work);
+            job_template_put(tmpl);
+
+            batch_works[batch] = work;
+            batch_chains[batch] = chain_id;
+            batch_reads[batch] = ts_read;
+            memcpy(batch_jobs[batch].midstate, work->midstate, sizeof(batch_jobs[batch].midstate));
+            memcpy(batch_jobs[batch].tail, work->data + 64, sizeof(batch_jobs[batch].tail));
+            batch_jobs[batch].nonce = nonce3;
+            if(++batch == SHA256D_C5_LANES)
+            {
+                h += hashtest_submit_batch(worker, batch_works, batch_jobs, batch_chains, batch_reads, batch);
+                batch = 0;
+            }
         }
-        cg_runlock(&info->update_lock);
-        pthread_mutex_unlock(&nonce_mutex);
-        cgsleep_ms(1);
-        if(h != 0)
+        if(batch)
+            h += hashtest_submit_batch(worker, batch_works, batch_jobs, batch_chains, batch_reads, batch);
+        return h;
+    }
+
+    /* Long lived consumer of one nonce_worker ring. The reader posts worker->ready
+     * after each batch, the timeout only bounds how late a missed post is seen.
+     */
+    void * nonce_verify_func(void *arg)
+    {
+        struct nonce_worker *worker = (struct nonce_worker *)arg;
+        uint64_t h;
+
+        while(1)
+        {
+            cgsem_mswait(&worker->ready, 100);
+            h = bitmain_scanhash(worker);
+            if(h != 0)
+            {
+                applog(LOG_DEBUG,"%s: hashes %llu ...\n", __FUNCTION__, h * 0xffffffffull);
+                __atomic_add_fetch(&worker->hashes, h, __ATOMIC_RELAXED);
+            }
+        }
+        return NULL;
+    }
+
+    // give the present chains to the verify threads round robin, chain numbers are sparse (S9 uses 5,6,7)
+    void set_nonce_chain_worker()
+    {
+        int i, n = 0;
+
+        for(i=0; i<BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            if(dev->chain_exist[i])
+                __atomic_store_n(&nonce_chain_worker[i], n++ % opt_nonce_verify_threads, __ATOMIC_RELAXED);
+        }
+    }
+
+    // HW errors only ever grow, so the per worker counters are summed on top of what a warm restart carried
+    static void merge_nonce_worker_chain_hw()
+    {
+        uint32_t hw;
+        int i, j;
+
+        for(i=0; i<BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            hw = chain_hw_carried[i];
+            for(j=0; j<opt_nonce_verify_threads; j++)
+                hw += __atomic_load_n(&nonce_workers[j].chain_hw[i], __ATOMIC_RELAXED) - nonce_workers[j].chain_hw_base[i];
+            dev->chain_hw[i] = hw;
+        }
+    }
+
+    // dev->chain_hw counts on from chain_hw, the workers only add what they count from now on
+    static void carry_nonce_worker_chain_hw(const uint32_t *chain_hw)
+    {
+        int i, j;
+
+        for(i=0; i<BITMAIN_MAX_CHAIN_NUM; i++)
         {
-            applog(LOG_DEBUG,"%s: hashes %u ...\n", __FUNCTION__,h * 0xffffffffull);
+            chain_hw_carried[i] = chain_hw[i];
+            for(j=0; j<MAX_NONCE_VERIFY_THREADS; j++)
+                nonce_workers[j].chain_hw_base[i] = __atomic_load_n(&nonce_workers[j].chain_hw[i], __ATOMIC_RELAXED);
+        }
+        merge_nonce_worker_chain_hw();
+    }
+
+    // nonce counts are per check period: move what the workers counted since the last call into dev
+    void merge_nonce_worker_asic_nonce()
+    {
+        int i, j, k;
+
+        for(k=0; k<opt_nonce_verify_threads; k++)
+        {
+            for(i=0; i<BITMAIN_MAX_CHAIN_NUM; i++)
+            {
+                if(!dev->chain_exist[i])
+                    continue;
+                for(j=0; j<BITMAIN_DEFAULT_ASIC_NUM; j++)
+                    dev->chain_asic_nonce[i][j] += __atomic_exchange_n(&nonce_workers[k].chain_asic_nonce[i][j], 0, __ATOMIC_RELAXED);
+            }
         }
-        h = h * 0xffffffffull;
     }
 
     static int64_t bitmain_c5_scanhash(struct thr_info *thr)
     {
+        uint64_t h = 0;
+        int i;
 #ifdef DEBUG_LOG
         // printf("!!! %s:%d\n", __FUNCTION__, __LINE__);
 #endif
-        h = 0;
-        pthread_t send_id;
-        pthread_create(&send_id, NULL, bitmain_scanhash, thr);
-        pthread_join(send_id, NULL);
-        return h;
+        cgsleep_ms(1);
+        scanhash_thread_saved++;
+        for(i=0; i<opt_nonce_verify_threads; i++)
+            h += __atomic_exchange_n(&nonce_workers[i].hashes, 0, __ATOMIC_RELAXED);
+        return h * 0xffffffffull;
     }
 
     static void bitmain_c5_update(struct cgpu_info *bitmain_c5)
@@ -11796,14 +13712,16 @@ void set_Hardware_version(unsigned int value)
         struct thr_info *thr = bitmain_c5->thr[0];
         struct work *work;
         struct pool *pool;
+        uint32_t id;
         int i, count = 0;
         mutex_lock(&info->lock);
         static char *last_job = NULL;
         bool same_job = true;
-        unsigned char *buf = NULL;
+        cgtimer_t ts_start, ts_sent;
 #ifdef DEBUG_LOG
         printf("!!! %s:%d\n", __FUNCTION__, __LINE__);
 #endif
+        cgtimer_time(&ts_start);
         thr->work_update = false;
         thr->work_restart = false;
         /* Step 1: Make sure pool is ready */
@@ -11815,28 +13733,25 @@ void set_Hardware_version(unsigned int value)
             quit(1, "Bitmain S9 has to use stratum pools");
 
         /* Step 3: Parse job to c5 formart */
-        cg_wlock(&info->update_lock);
         cg_rlock(&pool->data_lock);
+        notify_lat_stamp(pool, NOTIFY_UPDATE);
         info->pool_no = pool->pool_no;
-        copy_pool_stratum(&info->pool2, &info->pool1);
-        info->pool2_given_id = info->pool1_given_id;
-
-        copy_pool_stratum(&info->pool1, &info->pool0);
-        info->pool1_given_id = info->pool0_given_id;
-
-        copy_pool_stratum(&info->pool0, pool);
-        info->pool0_given_id = ++given_id;
-        parse_job_to_c5(&buf, pool, info->pool0_given_id);
-        /* Step 4: Send out buf */
-        if(!status_error)
+        id = given_id + 1;
+        job_template_build(info, pool, id);
+        /* Publish before the job can hash, so a nonce for it is never newer than given_id */
+        __atomic_store_n(&given_id, id, __ATOMIC_RELEASE);
+        pthread_mutex_lock(&reinit_mutex);
+        if(parse_job_to_c5(pool, id) > 0 && !status_error)
         {
-            pthread_mutex_lock(&reinit_mutex);
-            send_job(buf);
-            pthread_mutex_unlock(&reinit_mutex);
+            notify_lat_stamp(pool, NOTIFY_ENCODED);
+            /* Step 4: Send out buf */
+            send_job(last_job_buffer);
+            notify_lat_stamp(pool, NOTIFY_COMMIT);
+            cgtimer_time(&ts_sent);
+            cg_hist_add(&job_send_hist, cgtimer_us_diff(&ts_sent, &ts_start));
         }
+        pthread_mutex_unlock(&reinit_mutex);
         cg_runlock(&pool->data_lock);
-        cg_wunlock(&info->update_lock);
-        free(buf);
         mutex_unlock(&info->lock);
     }
 
@@ -11889,7 +13804,13 @@ void set_Hardware_version(unsigned int value)
         struct api_data *root = NULL;
         struct bitmain_c5_info *info = cgpu->device_data;
         char buf[64];
-        int i = 0;
+        char hist_buf[512];
+        struct nonce_path_stats nps;
+        unsigned int ring_overflow, reg_overflow = 0;
+        struct temp_snapshot ts;
+        uint64_t dup_checked, dup_dups;
+        double nonce_read_avg_ns;
+        int i = 0, j;
         uint64_t hash_rate_all = 0;
         char displayed_rate_all[16];
         bool copy_data = true;
@@ -12202,6 +14123,110 @@ void set_Hardware_version(unsigned int value)
                          (double)(hw_errors) / (double)(hw_errors + total_diff1) : 0;
         root = api_add_percent(root, "Device Hardware%", &(dev_hwp), true);
         root = api_add_int(root, "no_matching_work", &hw_errors, copy_data);
+        get_nonce_path_stats(&nps);
+        ring_overflow = nps.ring_overflow;
+        root = api_add_uint(root, "nonce_ring_overflow", &ring_overflow, copy_data);
+        for(i=0; i<BITMAIN_MAX_CHAIN_NUM; i++)
+            reg_overflow += reg_queue[i].overflow;
+        root = api_add_uint(root, "reg_queue_overflow", &reg_overflow, copy_data);
+        root = api_add_uint64(root, "scanhash_thread_saved", &scanhash_thread_saved, copy_data);
+        root = api_add_uint64(root, "job_template_stale", &job_template_stale, copy_data);
+        root = api_add_uint64(root, "nonce_read_count", &nonce_read_count, copy_data);
+        nonce_read_avg_ns = nonce_read_count ? (double)nonce_read_ns / nonce_read_count : 0;
+        root = api_add_double(root, "nonce_read_ns", &nonce_read_avg_ns, copy_data);
+        root = api_add_uint(root, "nonce_fifo_hwm", &nonce_fifo_hwm, copy_data);
+        root = api_add_uint64(root, "nonce_fifo_full", &nonce_fifo_full, copy_data);
+        root = api_add_uint64(root, "nonce_fifo_wakeups", &nonce_fifo_wakeups, copy_data);
+        root = api_add_uint(root, "nonce_poll_us", &nonce_poll_us, copy_data);
+        cg_hist_string(&job_send_hist, hist_buf, sizeof(hist_buf));
+        root = api_add_string(root, "job_send_us", hist_buf, copy_data);
+        cg_hist_string(&job_switch_idle_hist, hist_buf, sizeof(hist_buf));
+        root = api_add_string(root, "job_switch_idle_us", hist_buf, copy_data);
+        root = api_add_bool(root, "job_staging", &opt_job_staging, copy_data);
+        root = api_add_bool(root, "warm_restart", &warm_restarted, copy_data);
+        root = api_add_bool(root, "chain_reinit", &opt_chain_reinit, copy_data);
+        root = api_add_double(root, "chain_reinit_saved_gh", &chain_reinit_saved, copy_data);
+        root = api_add_bool(root, "chip_autotune", &opt_chip_autotune, copy_data);
+        if(opt_chip_autotune)
+        {
+            root = api_add_bool(root, "chip_autotune_dry_run", &opt_chip_autotune_dry_run, copy_data);
+            root = api_add_uint(root, "chip_autotune_raised", &autotune_raised, copy_data);
+            root = api_add_uint(root, "chip_autotune_lowered", &autotune_lowered, copy_data);
+        }
+        if(vf_started)
+        {
+            static const char *move_names[] = { "V-", "F-", "F+", "V+" };
+            char name[20];
+            char tmp[160];
+            unsigned int n;
+
+            root = api_add_string(root, "vf_optimise", opt_vf_optimise, copy_data);
+            for(i = 0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+            {
+                struct vf_chain *c = &vf_chains[i];
+
+                if(dev->chain_exist[i] != 1 || !c->base_voltage)
+                    continue;
+                // the best point, and what the search is doing from it
+                sprintf(name,"chain_vf%d",i+1);
+                sprintf(tmp,"%d.%02dV %+d steps %.1f GH/s %.2f J/TH floor %.1f GH/s, %s%s",c->best_voltage/100,c->best_voltage%100,
+                        c->best_freq_step,c->best_ghs,c->best_jth,c->floor_ghs,
+                        c->hold ? "converged" : c->move < 0 ? "measuring" : "trying ",
+                        c->hold || c->move < 0 ? "" : move_names[c->move]);
+                root = api_add_string(root, name, tmp, copy_data);
+            }
+            // oldest first: b measured as found, k kept, r reverted, c converged
+            for(n = vf_history_num > VF_OPT_HISTORY ? vf_history_num - VF_OPT_HISTORY : 0; n < vf_history_num; n++)
+            {
+                struct vf_history *h = &vf_history[n % VF_OPT_HISTORY];
+
+                sprintf(name,"vf_step%u",n);
+                sprintf(tmp,"%ld J%d %c %d.%02dV %+d steps %.1f GH/s pool %.1f GH/s %.0f W %.2f J/TH",(long)h->when.tv_sec,h->chain+1,h->result,
+                        h->voltage/100,h->voltage%100,h->freq_step,h->ghs,h->pool_ghs,h->watts,h->jth);
+                root = api_add_string(root, name, tmp, copy_data);
+            }
+        }
+        if(sim_c5_active)
+        {
+            struct sim_c5_stats sim;
+
+            sim_c5_get_stats(&sim);
+            root = api_add_uint64(root, "sim_nonces", &sim.nonces, true);
+            root = api_add_uint64(root, "sim_valid", &sim.valid, true);
+            root = api_add_uint64(root, "sim_hashes", &sim.hashes, true);
+            root = api_add_uint64(root, "sim_works", &sim.works, true);
+            root = api_add_uint64(root, "sim_jobs", &sim.jobs, true);
+            root = api_add_uint64(root, "sim_bc_cmds", &sim.bc_cmds, true);
+            root = api_add_uint64(root, "sim_iic_cmds", &sim.iic_cmds, true);
+            root = api_add_uint64(root, "sim_fifo_overflow", &sim.fifo_overflow, true);
+        }
+        if(capture_c5_active)
+        {
+            struct capture_c5_stats cap;
+
+            capture_c5_get_stats(&cap);
+            root = api_add_uint64(root, "capture_records", &cap.records, true);
+            root = api_add_uint64(root, "capture_bytes", &cap.bytes, true);
+            root = api_add_uint64(root, "capture_lines", &cap.lines, true);
+            root = api_add_uint64(root, "capture_jobs", &cap.jobs, true);
+            root = api_add_uint64(root, "capture_nonces", &cap.nonces, true);
+            root = api_add_uint64(root, "capture_regs", &cap.regs, true);
+            if(opt_fpga_replay)
+            {
+                root = api_add_uint64(root, "replay_job_diffs", &cap.job_diffs, true);
+                root = api_add_uint64(root, "replay_sync_timeouts", &cap.sync_timeouts, true);
+            }
+        }
+        temp_snapshot_get(&ts);
+        root = api_add_int(root, "temp_sweep_ms", &ts.sweep_ms, true);
+        dupcounters(cgpu, &dup_checked, &dup_dups);
+        root = api_add_uint64(root, "nonce_dup_checked", &dup_checked, copy_data);
+        root = api_add_uint64(root, "nonce_dups", &dup_dups, copy_data);
+        root = api_add_int(root, "nonce_verify_threads", &opt_nonce_verify_threads, copy_data);
+        cg_hist_string(&nps.drain_hist, hist_buf, sizeof(hist_buf));
+        root = api_add_string(root, "nonce_drain_us", hist_buf, copy_data);
+        cg_hist_string(&nps.verify_hist, hist_buf, sizeof(hist_buf));
+        root = api_add_string(root, "nonce_verify_us", hist_buf, copy_data);
 
         for(i = 0; i < BITMAIN_MAX_CHAIN_NUM; i++)
         {
@@ -12216,6 +14241,7 @@ void set_Hardware_version(unsigned int value)
             root = api_add_string(root, chain_asic_name, dev->chain_asic_status_string[i], copy_data);
         }
 
+        merge_nonce_worker_chain_hw();
         for(i = 0; i < BITMAIN_MAX_CHAIN_NUM; i++)
         {
             char chain_hw[16];
@@ -12231,6 +14257,45 @@ void set_Hardware_version(unsigned int value)
             root = api_add_string(root, chain_rate, displayed_rate[i], copy_data);
         }
 
+        for(i = 0; i < BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            if(dev->chain_exist[i] == 1)
+            {
+                char chain_reinit[20];
+                sprintf(chain_reinit,"chain_reinit%d",i+1);
+                root = api_add_uint(root, chain_reinit, &chain_reinit_num[i], copy_data);
+                sprintf(chain_reinit,"chain_reinit_fail%d",i+1);
+                root = api_add_uint(root, chain_reinit, &chain_reinit_failed[i], copy_data);
+            }
+        }
+
+        for(i = 0; opt_chip_autotune && i < BITMAIN_MAX_CHAIN_NUM; i++)
+        {
+            if(dev->chain_exist[i] == 1)
+            {
+                char chain_autotune[24];
+                char offsets[512] = "{";
+                char tmp[20];
+                int j;
+
+                // the last window: + up a step, - down a step, o kept
+                sprintf(chain_autotune,"chain_autotune%d",i+1);
+                root = api_add_string(root, chain_autotune, autotune_advice[i], copy_data);
+
+                // PLL steps from where each chip was brought up, only the moved ones
+                sprintf(chain_autotune,"chain_autotune_offset%d",i+1);
+                for(j = 0; j < dev->chain_asic_num[i]; j++)
+                {
+                    if(chip_base_freq_index[i][j] == 0 || chip_freq_index[i][j] == chip_base_freq_index[i][j])
+                        continue;
+                    sprintf(tmp,"%sC%d=%+d",offsets[1] ? "," : "",j,chip_freq_index[i][j] - chip_base_freq_index[i][j]);
+                    strcat(offsets,tmp);
+                }
+                strcat(offsets,"}");
+                root = api_add_string(root, chain_autotune, offsets, copy_data);
+            }
+        }
+
         for(i = 0; i < BITMAIN_MAX_CHAIN_NUM; i++)
         {
             if(dev->chain_exist[i] == 1)
@@ -12324,11 +14389,14 @@ void set_Hardware_version(unsigned int value)
     static void bitmain_c5_shutdown(struct thr_info *thr)
     {
         unsigned int ret;
+        int i;
 #ifdef DEBUG_LOG
         printf("!!! %s:%d\n", __FUNCTION__, __LINE__);
 #endif
         thr_info_cancel(check_system_work_id);
         thr_info_cancel(read_nonce_reg_id);
+        for(i=0; i<opt_nonce_verify_threads; i++)
+            thr_info_cancel(nonce_workers[i].verify_id);
         thr_info_cancel(read_temp_id);
         thr_info_cancel(pic_heart_beat);
         
@@ -12336,6 +14404,10 @@ void set_Hardware_version(unsigned int value)
         ret &= ~BC_COMMAND_EN_NULL_WORK;
         set_BC_write_command(ret);
         set_dhash_acc_control((unsigned int)get_dhash_acc_control() & ~RUN_BIT);
+
+        save_warm_restart();
+        save_autotune_file();
+        capture_c5_close();
     }
 
 
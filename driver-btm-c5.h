@@ -202,6 +202,11 @@
 #define NONCE2_AND_JOBID_ALIGN          64              // NONCE2_AND_JOBID_STORE_SPACE need 64 bytes aligned
 #define MAX_TIMEOUT_VALUE               0x1ffff         // defined in TIME_OUT_CONTROL
 #define MAX_NONCE_NUMBER_IN_FIFO        0x1ff           // 511 nonce
+#define NONCE_FIFO_TARGET               64              // the adaptive poll speeds up past this fill level
+#define NONCE_POLL_DEFAULT_US           1000
+#define NONCE_POLL_MIN_US               100
+#define NONCE_POLL_MAX_US               1000            // the old fixed poll, register replies come through the fifo too
+#define JOB_STOP_POLL_US                20              // --job-staging RUN_BIT poll while the FPGA stops
 #define NONCE_DATA_LENGTH               4               // 4 bytes
 #define REGISTER_DATA_LENGTH            4               // 4 bytes
 #define TW_WRITE_COMMAND_LEN            52
@@ -587,7 +592,6 @@ struct init_config
 
 struct bitmain_c5_info
 {
-    cglock_t update_lock;
 
     uint8_t     data_type;
     uint8_t     version;
@@ -616,12 +620,7 @@ struct bitmain_c5_info
 
     struct init_config c5_config;
     int pool_no;
-    struct pool pool0;
-    struct pool pool1;
-    struct pool pool2;
-    uint32_t pool0_given_id;
-    uint32_t pool1_given_id;
-    uint32_t pool2_given_id;
+    struct job_template *job_templates;     // opt_job_template_depth slots, indexed by given_id
 
     uint16_t    crc;
 } __attribute__((packed, aligned(4)));
@@ -653,6 +652,24 @@ struct part_of_job
 //uint8_t   merkle_bin[32] * merkles_num
 //uint16_t  crc
 
+// FPGA register values of a job, worked out by stage_job while the previous job still runs
+struct job_regs
+{
+    unsigned int    job_start_address;  // physical, JOB_START_ADDRESS
+    bool            asic_diff_valid;
+    unsigned int    ticket_mask;
+    unsigned int    job_id;
+    unsigned int    bbversion;
+    unsigned int    prev_hash[PREV_HASH_LEN/sizeof(unsigned int)];
+    unsigned int    ntime;
+    unsigned int    nbit;
+    unsigned int    coinbase_and_nonce2_length;
+    unsigned int    nonce2[2];
+    unsigned int    merkles_num;
+    unsigned int    job_length;
+    bool            new_block;
+};
+
 struct nonce_content
 {
     uint32_t    job_id;
@@ -662,8 +679,20 @@ struct nonce_content
     uint32_t    nonce3;
     uint32_t    chain_num;
     uint8_t     midstate[MIDSTATE_LEN];
+    cgtimer_t   tv_read;                // when get_nonce_and_register took it out of the FPGA fifo
 } __attribute__((packed, aligned(4)));
 
+// one NONCE2_AND_JOBID_ALIGN byte record of the nonce2/job_id table, indexed by work_id
+struct nonce_record
+{
+    uint32_t    job_id;                 // JOB_ID_OFFSET
+    uint32_t    header_version;         // HEADER_VERSION_OFFSET
+    uint32_t    nonce2_l;               // NONCE2_L_OFFSET
+    uint32_t    nonce2_h;               // NONCE2_H_OFFSET
+    uint32_t    reserved[4];
+    uint8_t     midstate[MIDSTATE_LEN]; // MIDSTATE_OFFSET
+} __attribute__((aligned(16)));
+
 struct nonce
 {
     uint8_t     token_type;
@@ -727,13 +756,247 @@ struct all_parameters
 
 
 
-struct nonce_buf
+#define CACHE_LINE_SIZE                 64
+#define NONCE_RING_SIZE                 512             // must be a power of 2 and larger than MAX_NONCE_NUMBER_IN_FIFO
+#define NONCE_RING_MASK                 (NONCE_RING_SIZE - 1)
+
+// single producer (get_nonce_and_register) / single consumer (bitmain_scanhash) nonce ring.
+// head and tail are free running counters, each written by one side only and kept on
+// their own cache line so the reader and the verifier never share a dirty line.
+struct nonce_ring
 {
-    unsigned int p_wr;
-    unsigned int p_rd;
-    unsigned int nonce_num;
-    struct nonce_content nonce_buffer[MAX_NONCE_NUMBER_IN_FIFO];
-} __attribute__((packed, aligned(4)));
+    unsigned int head __attribute__((aligned(CACHE_LINE_SIZE)));    // next slot to fill, producer only
+    unsigned int overflow;                                          // nonces dropped because the ring was full, producer only
+    unsigned int tail __attribute__((aligned(CACHE_LINE_SIZE)));    // next slot to drain, consumer only
+    unsigned int flush;                                             // set by clear_nonce_fifo, honoured by the consumer
+    unsigned int flushed;                                           // nonces dropped by those flushes, consumer only
+    struct nonce_content nonce_buffer[NONCE_RING_SIZE] __attribute__((aligned(CACHE_LINE_SIZE)));
+};
+
+#define BC_READY_POLL_US            10                                  // BC_COMMAND_BUFFER_READY poll interval
+#define BC_READY_TIMEOUT_US         3000000
+
+// one ASIC command for bc_queue_run
+struct bc_cmd
+{
+    unsigned int cmd[3];                                            // BC_COMMAND_BUFFER words
+    unsigned char chain;
+    unsigned int gap_us;                                            // before the next command to the same chain
+};
+
+struct bc_queue
+{
+    int num;
+    int size;
+    struct bc_cmd *cmds;
+};
+
+// bring-up phases of a chain, timed into the init log by chain_init_phase
+#define CHAIN_INIT_DONE             -1
+#define CHAIN_INIT_PIC              0
+#define CHAIN_INIT_VOLTAGE          1
+#define CHAIN_INIT_RESET            2
+#define CHAIN_INIT_ASIC             3
+#define CHAIN_INIT_ADDRESS          4
+#define CHAIN_INIT_FREQ             5
+#define CHAIN_INIT_BAUD             6
+#define CHAIN_INIT_OPENCORE         7
+#define CHAIN_INIT_PHASES           8
+
+#define PIC_RESET_WAIT_MS           500                                 // PIC bootloader start after reset_iic_pic
+#define ASIC_RETRY_NUM              6
+#define VOLTAGE_SETTLE_MS           1000
+#define OPENCORE_SETTLE_MS          1000                                // at open core voltage before the working one is set
+
+// one chain's state in chain_init_run. A step returns the ms until the chain's next
+// step may run, or -1 once the chain is through the phase.
+struct chain_init
+{
+    int phase;
+    int step;
+    int retries;
+    cgtimer_t phase_start;
+    cgtimer_t not_before;
+    int phase_ms[CHAIN_INIT_PHASES];
+};
+
+#define CALIBRATION_CACHE_FILE      "/etc/bmminer/calibration"
+#define CALIBRATION_CACHE_MAGIC     0x43414c42                          // "CALB"
+#define CALIBRATION_CACHE_VERSION   1
+#define HASH_BOARD_ID_LEN           12
+
+// what a hash board was brought up with, looked up by its board id on the next start
+struct calibration_chain
+{
+    unsigned char board_id[HASH_BOARD_ID_LEN];
+    unsigned char valid;
+    unsigned char asic_num;
+    unsigned char voltage_pic;
+    signed char temp_num;
+    unsigned char temp_chip_addr[MAX_TEMPCHIP_NUM];
+    unsigned char temp_chip_type[MAX_TEMPCHIP_NUM];
+    signed char middle_offset[MAX_TEMPCHIP_NUM];
+    unsigned char freq_index[BITMAIN_DEFAULT_ASIC_NUM];             // PLL index of each chip
+};
+
+struct calibration_cache
+{
+    uint32_t magic;
+    uint32_t version;
+    struct calibration_chain chain[BITMAIN_MAX_CHAIN_NUM];
+    uint16_t crc;                                                   // CRC16 of everything above
+};
+
+#define WARM_RESTART_FILE           "/tmp/bmminer-warm"                 // on tmpfs, so a reboot always starts cold
+#define WARM_RESTART_MAGIC          0x5741524d                          // "WARM"
+#define WARM_RESTART_VERSION        1
+#define WARM_RESTART_MAX_AGE        120                                 // seconds from shutdown to adoption
+
+// driver state handed from a shutting down bmminer to the next one, see save_warm_restart
+struct warm_restart_state
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;                                                  // a rebuilt binary may lay it out differently
+    cgtimer_t saved;                                                // CLOCK_MONOTONIC, shared by both processes
+    unsigned int hardware_version;
+    unsigned int phy_mem_nonce2_jobid_address;
+    int multi_version;                                              // options the hashboards were set up with
+    int freq;
+    int voltage;
+    bool fixed_freq;
+    bool is218_temp;
+    struct all_parameters dev;
+    uint8_t chain_voltage_pic[BITMAIN_MAX_CHAIN_NUM];
+    int chain_voltage_value[BITMAIN_MAX_CHAIN_NUM];
+    int lowest_testOK_temp[BITMAIN_MAX_CHAIN_NUM];
+    unsigned char chain_pic_buf[BITMAIN_MAX_CHAIN_NUM][128];
+    unsigned char last_freq[BITMAIN_MAX_CHAIN_NUM][256];
+    unsigned char badcore_num_buf[BITMAIN_MAX_CHAIN_NUM][64];
+    int chain_badcore_num[BITMAIN_MAX_CHAIN_NUM][256];
+    unsigned char show_last_freq[BITMAIN_MAX_CHAIN_NUM][256];
+    unsigned char chip_last_freq[BITMAIN_MAX_CHAIN_NUM][256];
+    unsigned char pic_temp_offset[BITMAIN_MAX_CHAIN_NUM];
+    unsigned char base_freq_index[BITMAIN_MAX_CHAIN_NUM];
+    int8_t middle_offset[BITMAIN_MAX_CHAIN_NUM][MAX_TEMPCHIP_NUM];
+    unsigned char chip_freq_index[BITMAIN_MAX_CHAIN_NUM][BITMAIN_DEFAULT_ASIC_NUM];
+    unsigned char chip_base_freq_index[BITMAIN_MAX_CHAIN_NUM][BITMAIN_DEFAULT_ASIC_NUM];
+    uint8_t chain_base_voltage_pic[BITMAIN_MAX_CHAIN_NUM];
+    unsigned char hash_board_id[BITMAIN_MAX_CHAIN_NUM][HASH_BOARD_ID_LEN];
+};
+
+#define CHAIN_REINIT_HOLDOFF        600                                 // seconds before the same chain is recovered again
+#define CHAIN_REINIT_RATE_ERRORS    3                                   // hashrate register reads in a row a chain did not answer
+
+#define AUTOTUNE_FILE               "/etc/bmminer/autotune"
+#define AUTOTUNE_MAGIC              0x4154554e                          // "ATUN"
+#define AUTOTUNE_VERSION            1
+#define AUTOTUNE_WINDOW             5                                   // check periods (minutes) of nonces behind a decision
+#define AUTOTUNE_MIN_NONCES         40                                  // a chip's nonces in a window to judge its yield
+#define AUTOTUNE_MAX_STEPS          8                                   // PLL steps a chip may go above where it was brought up
+#define AUTOTUNE_MAX_RAISES         4                                   // chips of a chain raised per window
+#define AUTOTUNE_HW_LOWER           0.005                               // HW errors per nonce that take a chip down a step
+#define AUTOTUNE_HW_RAISE           0.001                               // ... and below which it may go up
+#define AUTOTUNE_YIELD_LOWER        0.85                                // nonces per MHz against the chain median that take a chip down
+#define AUTOTUNE_YIELD_RAISE        0.95                                // ... and from which it may go up
+#define AUTOTUNE_TEMP_MARGIN        10                                  // no raises on a chain this close to MAX_FAN_TEMP
+#define AUTOTUNE_SAVE_INTERVAL      3600                                // seconds between writes of AUTOTUNE_FILE, it lives on flash
+
+// where the autotuner left a hash board, looked up by its board id on the next start
+struct autotune_chain
+{
+    unsigned char board_id[HASH_BOARD_ID_LEN];
+    unsigned char valid;
+    unsigned char asic_num;
+    signed char offset[BITMAIN_DEFAULT_ASIC_NUM];                   // PLL steps from the index the chip is brought up at
+    signed char limit[BITMAIN_DEFAULT_ASIC_NUM];                    // highest offset the chip held without stepping down
+};
+
+struct autotune_file
+{
+    uint32_t magic;
+    uint32_t version;
+    struct autotune_chain chain[BITMAIN_MAX_CHAIN_NUM];
+    uint16_t crc;                                                   // CRC16 of everything above
+};
+
+#define VF_OPT_WINDOW               15                                  // check periods (minutes) a voltage/frequency point is measured for
+#define VF_OPT_SETTLE               1                                   // periods after a move that are not measured
+#define VF_OPT_VOLT_STEP            10                                  // 0.1V, the resolution of the PIC voltage values
+#define VF_OPT_VOLT_DOWN            60                                  // lowest voltage tried under where init set the chain
+#define VF_OPT_FREQ_STEPS           8                                   // PLL steps the chain may move from where it was brought up
+#define VF_OPT_MIN_GAIN             0.01                                // what a move must win to be kept, a window measures the rate to about 2%
+#define VF_OPT_HW_MAX               0.01                                // HW errors per nonce that reject a point
+#define VF_OPT_FLOOR                0.9                                 // of the chains' nominal hashrate, without --vf-floor
+#define VF_OPT_TEMP_MARGIN          10                                  // no raises on a chain this close to MAX_FAN_TEMP
+#define VF_OPT_RECHECK              240                                 // periods a converged chain holds before it searches again
+#define VF_OPT_HISTORY              64                                  // search steps kept for the API
+#define VF_POWER_MODEL_DEFAULT      "idle=20,k=0.000126,psu=0.93"
+
+// one step of the voltage/frequency search, see vf_optimise_step
+struct vf_history
+{
+    struct timeval when;
+    unsigned char chain;
+    char result;                                                    // b measured as found, k kept, r reverted, c converged
+    short voltage;                                                  // 910 is 9.1V
+    signed char freq_step;                                          // PLL steps from where the chips were brought up
+    float ghs;                                                      // verified by the driver
+    float pool_ghs;                                                 // accepted by the pool
+    float watts;                                                    // power model, at the wall
+    float jth;
+};
+
+#define MAX_NONCE_VERIFY_THREADS    10
+#define NONCE_DUP_TIMELIMIT         10                                  // seconds a returned nonce is remembered for the duplicate check
+
+#define JOB_TEMPLATE_BUILDING       0x80000000
+
+// stratum job as sent to the FPGA, slot given_id % opt_job_template_depth of info->job_templates.
+// pool and given_id only change while refs holds JOB_TEMPLATE_BUILDING, which bitmain_c5_update
+// only sets once no verifier holds a reference, so a referenced template is immutable.
+struct job_template
+{
+    unsigned int refs;
+    uint32_t given_id;
+    struct pool pool;
+};
+
+// one nonce verify thread. The reader shards nonces by chain, so every chain is owned by
+// exactly one worker and the counters below have a single writer each.
+struct nonce_worker
+{
+    struct nonce_ring ring;
+    cgsem_t ready;                                                  // posted by the reader after a batch
+    struct thr_info *thr;                                           // the mining thread shares are submitted on
+    struct thr_info *verify_id;
+    uint64_t hashes;                                                // collected by bitmain_c5_scanhash
+    uint64_t pool_diff, pool_diff_bit;
+    uint64_t net_diff, net_diff_bit;
+    struct cg_hist drain_hist;                                      // fifo read to taken off the ring latency
+    struct cg_hist verify_hist;                                     // fifo read to tested and submitted latency
+    uint64_t valid;                                                 // nonces that passed the diff 1 test
+    uint32_t chain_hw[BITMAIN_MAX_CHAIN_NUM];                       // monotonic, summed into dev->chain_hw
+    uint32_t chain_hw_base[BITMAIN_MAX_CHAIN_NUM];                  // chain_hw when dev->chain_hw was carried over
+    uint64_t chain_asic_nonce[BITMAIN_MAX_CHAIN_NUM][BITMAIN_DEFAULT_ASIC_NUM]; // drained into dev->chain_asic_nonce
+    uint32_t chip_hw[BITMAIN_MAX_CHAIN_NUM][BITMAIN_DEFAULT_ASIC_NUM]; // drained by the autotuner
+    uint64_t chain_hashes[BITMAIN_MAX_CHAIN_NUM];                   // drained by the voltage/frequency optimiser
+};
+
+// the nonce path from the fifo reader to hashtest_submit, summed over the workers
+struct nonce_path_stats
+{
+    bool reading;                                                   // gBegin_get_nonce, the reader passes nonces on
+    uint64_t read;                                                  // nonce_read_count
+    uint64_t ring_overflow;
+    uint64_t flushed;
+    uint64_t queued;                                                // read, still on the rings
+    uint64_t hw;                                                    // failed the diff 1 test, duplicates and bad job ids
+    uint64_t valid;
+    uint64_t stale;                                                 // job_template_stale
+    struct cg_hist drain_hist;
+    struct cg_hist verify_hist;
+};
 
 struct reg_content
 {
@@ -742,13 +1005,37 @@ struct reg_content
     unsigned char chain_number;
 } __attribute__((packed, aligned(4)));
 
-struct reg_buf
+#define REG_QUEUE_SIZE              128     // must be a power of 2 and hold the replies of every asic of a chain
+#define REG_REPLY_TIMEOUT_MS        400     // a chain that sent no reply for this long has answered all it will
+#define REG_CHIP_REPLY_TIMEOUT_MS   80      // same, for a read from a single asic
+#define REG_RUNAWAY_REPLIES         600     // more replies than this to one read and the chain is looping
+
+// register replies of one chain, filled by get_nonce_and_register
+struct reg_queue
 {
-    unsigned int p_wr;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;                    // signalled on every reply, waits on CLOCK_MONOTONIC
+    unsigned int p_wr;                      // free running, the slot is p_wr % REG_QUEUE_SIZE
     unsigned int p_rd;
-    unsigned int reg_value_num;
-    struct reg_content reg_buffer[MAX_NONCE_NUMBER_IN_FIFO];
-} __attribute__((packed, aligned(4)));
+    unsigned int overflow;                  // replies dropped because nobody read the queue
+    unsigned int received;                  // replies since the last flush, dropped ones included
+    struct reg_content reg_buffer[REG_QUEUE_SIZE];
+};
+
+#define TEMP_IIC_POLL_NUM           10      // polls of an asic's I2C result before the temp read counts as failed
+#define TEMP_SNAPSHOT_STALE         10      // seconds without a new temp snapshot before the fans run full speed
+
+// the temps of one read_temp_func sweep, see temp_snapshot_get
+struct temp_snapshot
+{
+    uint32_t seq;                           // odd while read_temp_func writes it
+    struct timeval taken;
+    int sweep_ms;                           // how long reading every sensor took
+    int16_t chain_maxtemp[BITMAIN_MAX_CHAIN_NUM][TEMP_POS_NUM];
+    int16_t chain_mintemp[BITMAIN_MAX_CHAIN_NUM][TEMP_POS_NUM];
+    int temp_top[TEMP_POS_NUM];
+    int temp_low[TEMP_POS_NUM];
+};
 
 struct freq_pll
 {
@@ -908,6 +1195,24 @@ extern bool opt_pre_heat;
 extern int opt_bitmain_fan_pwm;
 extern int opt_bitmain_c5_freq;
 extern int opt_bitmain_c5_voltage;
+extern int opt_nonce_verify_threads;
+extern int opt_job_template_depth;
+extern char *opt_fpga_backend;
+extern char *opt_fpga_sim;
+extern char *opt_fpga_bench;
+extern char *opt_fpga_capture;
+extern char *opt_fpga_replay;
+extern bool opt_fpga_replay_fast;
+extern bool opt_job_verify;
+extern bool opt_job_staging;
+extern bool opt_calibration_cache;
+extern bool opt_warm_restart;
+extern bool opt_chain_reinit;
+extern bool opt_chip_autotune;
+extern bool opt_chip_autotune_dry_run;
+extern char *opt_vf_optimise;
+extern int opt_vf_floor;
+extern char *opt_power_model;
 extern int ADD_FREQ;
 extern int ADD_FREQ1;
 extern int fpga_version;
@@ -918,9 +1223,12 @@ extern unsigned char last_freq[BITMAIN_MAX_CHAIN_NUM][256];
 extern int chain_badcore_num[BITMAIN_MAX_CHAIN_NUM][256];
 
 int get_pll_index(int freq);
+void get_nonce_path_stats(struct nonce_path_stats *stats);
+bool vf_optimise_parse(const char *target, const char *power_model);
 
 extern uint32_t g_accepted[BITMAIN_MAX_CHAIN_NUM];
 extern uint32_t g_rejected[BITMAIN_MAX_CHAIN_NUM];
+extern double g_accepted_diff[BITMAIN_MAX_CHAIN_NUM];
 
 #endif
 
@@ -1185,6 +1185,20 @@ struct stratum_work
 #define RBUFSIZE 8192
 #define RECVSIZE (RBUFSIZE - 4)
 
+/* Points on the way from a mining.notify arriving to the hardware hashing it,
+ * stamped with notify_lat_stamp. NOTIFY_RECV also indexes the total in
+ * notify_lat_hist */
+enum notify_stage
+{
+    NOTIFY_RECV,        // recv_line read the line
+    NOTIFY_PARSED,      // parse_notify
+    NOTIFY_CURRENT,     // test_work_current
+    NOTIFY_UPDATE,      // driver update callback
+    NOTIFY_ENCODED,     // driver job encoded
+    NOTIFY_COMMIT,      // hardware running the job
+    NOTIFY_STAGES
+};
+
 struct pool
 {
     int pool_no;
@@ -1283,8 +1297,19 @@ struct pool
     bool support_vil;
     int version_num;
     int version[4];
+
+    /* sha256 state over the whole 64 byte blocks of coinbase in front of
+     * nonce2, see set_pool_cb_midstate */
+    uint32_t cb_midstate[8];
+    unsigned int cb_midstate_len;
 #endif
     struct stratum_work swork;
+
+    /* Monotonic stage times of the latest notify, zero when not reached */
+    cgtimer_t ts_recv;
+    cgtimer_t notify_ts[NOTIFY_STAGES];
+    bool notify_recorded;
+
     pthread_t stratum_sthread;
     pthread_t stratum_rthread;
     pthread_mutex_t stratum_lock;
@@ -1444,6 +1469,9 @@ extern bool submit_nonce_1(struct thr_info *thr, struct work *work, uint32_t non
 extern void submit_nonce_2(struct work *work);
 extern bool submit_nonce_direct(struct thr_info *thr, struct work *work, uint32_t nonce);
 extern bool submit_noffset_nonce(struct thr_info *thr, struct work *work, uint32_t nonce, int noffset);
+#ifdef USE_BITMAIN_C5
+extern void set_pool_cb_midstate(struct pool *pool);
+#endif
 extern struct work *get_work(struct thr_info *thr, const int thr_id);
 extern void __add_queued(struct cgpu_info *cgpu, struct work *work);
 extern struct work *get_queued(struct cgpu_info *cgpu);
@@ -1579,9 +1607,14 @@ extern struct api_data *api_add_volts(struct api_data *root, char *name, float *
 
 
 
+extern const char *notify_stage_names[NOTIFY_STAGES];
+extern void notify_lat_start(struct pool *pool);
+extern void notify_lat_stamp(struct pool *pool, enum notify_stage stage);
+extern void notify_lat_copy(struct cg_hist *hist);
 extern void dupalloc(struct cgpu_info *cgpu, int timelimit);
 extern void dupcounters(struct cgpu_info *cgpu, uint64_t *checked, uint64_t *dups);
 extern bool isdupnonce(struct cgpu_info *cgpu, struct work *work, uint32_t nonce);
+extern bool isdupnonce_id(struct cgpu_info *cgpu, uint32_t work_id, uint32_t nonce);
 
 extern void cg_logwork(struct work *work, unsigned char *nonce_bin, bool ok);
 extern void cg_logwork_uint32(struct work *work, uint32_t nonce, bool ok);
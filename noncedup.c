@@ -14,22 +14,40 @@
 typedef struct nitem {
 	uint32_t work_id;
 	uint32_t nonce;
-	struct timeval when;
+	struct k_item *hash_next;	// chain in the hash bucket
+	struct k_item **hash_pprev;
 } NITEM;
 
 #define DATAN(_item) ((NITEM *)(_item->data))
 
+/* The nonces seen in the last timelimit seconds are kept in a hash table
+ * keyed on (work_id, nonce), so a check is one bucket chain rather than a
+ * scan of everything in the window. Each nonce also sits in the time wheel
+ * slot for the second it arrived, and a whole slot is expired at once when
+ * the wheel comes back round to it */
+#define DUP_HASH_BITS 12
+#define DUP_HASH_SIZE (1 << DUP_HASH_BITS)
+
 struct dupdata {
 	int timelimit;
 	K_LIST *nfree_list;
-	K_STORE *nonce_list;
+	K_ITEM *hash[DUP_HASH_SIZE];
+	int wheel_slots;
+	K_STORE **wheel;
+	time_t wheel_sec;
 	uint64_t checked;
 	uint64_t dups;
 };
 
+static inline uint32_t duphash(uint32_t work_id, uint32_t nonce)
+{
+	return ((work_id * 0x9e3779b1) ^ nonce) * 0x85ebca6b >> (32 - DUP_HASH_BITS);
+}
+
 void dupalloc(struct cgpu_info *cgpu, int timelimit)
 {
 	struct dupdata *dup;
+	int i;
 
 	dup = calloc(1, sizeof(*dup));
 	if (unlikely(!dup))
@@ -37,7 +55,15 @@ void dupalloc(struct cgpu_info *cgpu, int timelimit)
 
 	dup->timelimit = timelimit;
 	dup->nfree_list = k_new_list("Nonces", sizeof(NITEM), 1024, 0, true);
-	dup->nonce_list = k_new_store(dup->nfree_list);
+
+	// A nonce is dropped when its slot comes round again,
+	// after between timelimit and timelimit+1 seconds
+	dup->wheel_slots = (timelimit > 0 ? timelimit : 0) + 1;
+	dup->wheel = calloc(dup->wheel_slots, sizeof(*(dup->wheel)));
+	if (unlikely(!dup->wheel))
+		quithere(1, "Failed to calloc dupdata wheel");
+	for (i = 0; i < dup->wheel_slots; i++)
+		dup->wheel[i] = k_new_store(dup->nfree_list);
 
 	cgpu->dup_data = dup;
 }
@@ -55,45 +81,74 @@ void dupcounters(struct cgpu_info *cgpu, uint64_t *checked, uint64_t *dups)
 	}
 }
 
-bool isdupnonce(struct cgpu_info *cgpu, struct work *work, uint32_t nonce)
+// Must be called with the nfree_list write lock held
+static void dupexpire(struct dupdata *dup, K_STORE *slot)
+{
+	K_ITEM *item;
+
+	for (item = slot->head; item; item = item->next) {
+		*(DATAN(item)->hash_pprev) = DATAN(item)->hash_next;
+		if (DATAN(item)->hash_next)
+			DATAN(DATAN(item)->hash_next)->hash_pprev = DATAN(item)->hash_pprev;
+	}
+	k_list_transfer_to_head(slot, dup->nfree_list);
+}
+
+bool isdupnonce_id(struct cgpu_info *cgpu, uint32_t work_id, uint32_t nonce)
 {
 	struct dupdata *dup = (struct dupdata *)(cgpu->dup_data);
-	struct timeval now;
+	K_ITEM *item, **bucket;
 	bool unique = true;
-	K_ITEM *item;
+	time_t now;
+	int i;
 
 	if (!dup)
 		return false;
 
-	cgtime(&now);
-	dup->checked++;
+	now = time(NULL);
 	K_WLOCK(dup->nfree_list);
-	item = dup->nonce_list->tail;
-	while (unique && item) {
-		if (DATAN(item)->work_id == work->id && DATAN(item)->nonce == nonce) {
+	dup->checked++;
+	if (unlikely(now != dup->wheel_sec)) {
+		if (now - dup->wheel_sec >= dup->wheel_slots || now < dup->wheel_sec) {
+			for (i = 0; i < dup->wheel_slots; i++)
+				dupexpire(dup, dup->wheel[i]);
+		} else {
+			while (dup->wheel_sec != now)
+				dupexpire(dup, dup->wheel[++(dup->wheel_sec) % dup->wheel_slots]);
+		}
+		dup->wheel_sec = now;
+	}
+
+	bucket = &(dup->hash[duphash(work_id, nonce)]);
+	for (item = *bucket; item; item = DATAN(item)->hash_next) {
+		if (DATAN(item)->work_id == work_id && DATAN(item)->nonce == nonce) {
 			unique = false;
-			applog(LOG_WARNING, "%s%d: Duplicate nonce %08x",
-					    cgpu->drv->name, cgpu->device_id, nonce);
-		} else
-			item = item->prev;
+			break;
+		}
 	}
 	if (unique) {
 		item = k_unlink_head(dup->nfree_list);
-		DATAN(item)->work_id = work->id;
+		DATAN(item)->work_id = work_id;
 		DATAN(item)->nonce = nonce;
-		memcpy(&(DATAN(item)->when), &now, sizeof(now));
-		k_add_head(dup->nonce_list, item);
-	}
-	item = dup->nonce_list->tail;
-	while (item && tdiff(&(DATAN(item)->when), &now) > dup->timelimit) {
-		item = k_unlink_tail(dup->nonce_list);
-		k_add_head(dup->nfree_list, item);
-		item = dup->nonce_list->tail;
-	}
+		DATAN(item)->hash_next = *bucket;
+		DATAN(item)->hash_pprev = bucket;
+		if (*bucket)
+			DATAN((*bucket))->hash_pprev = &(DATAN(item)->hash_next);
+		*bucket = item;
+		k_add_head(dup->wheel[now % dup->wheel_slots], item);
+	} else
+		dup->dups++;
 	K_WUNLOCK(dup->nfree_list);
 
-	if (!unique)
-		dup->dups++;
+	if (!unique) {
+		applog(LOG_WARNING, "%s%d: Duplicate nonce %08x",
+				    cgpu->drv->name, cgpu->device_id, nonce);
+	}
 
 	return !unique;
 }
+
+bool isdupnonce(struct cgpu_info *cgpu, struct work *work, uint32_t nonce)
+{
+	return isdupnonce_id(cgpu, work->id, nonce);
+}
@@ -0,0 +1,393 @@
+/*
+ * Double SHA-256 of the second half of an 80 byte block header, batched
+ * across SIMD lanes, for verifying the nonces the c5 FPGA returns.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "miner.h"
+#include "sha2.h"
+#include "sha2_c5.h"
+#include "sha256d_c5.h"
+
+typedef uint32_t sha256d_vec __attribute__ ((vector_size (4 * SHA256D_C5_LANES)));
+
+static const uint32_t sha256d_iv[8] =
+{
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint32_t sha256d_k[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/* K[i] + W[i] for the rounds whose message word is padding: rounds 4-15 of
+ * the second header block and rounds 8-15 of the hash of the digest */
+static const uint32_t sha256d_kw_hdr[16] =
+{
+    0, 0, 0, 0, 0xb956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf3f4
+};
+
+static const uint32_t sha256d_kw_dig[16] =
+{
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0x5807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf274
+};
+
+/* Written for both uint32_t and sha256d_vec operands */
+#define ROTR32(x, n)    (((x) >> (n)) | ((x) << (32 - (n))))
+#define BSIG0(x)        (ROTR32(x, 2) ^ ROTR32(x, 13) ^ ROTR32(x, 22))
+#define BSIG1(x)        (ROTR32(x, 6) ^ ROTR32(x, 11) ^ ROTR32(x, 25))
+#define SSIG0(x)        (ROTR32(x, 7) ^ ROTR32(x, 18) ^ ((x) >> 3))
+#define SSIG1(x)        (ROTR32(x, 17) ^ ROTR32(x, 19) ^ ((x) >> 10))
+#define CH32(x, y, z)   ((z) ^ ((x) & ((y) ^ (z))))
+#define MAJ32(x, y, z)  (((x) & (y)) | ((z) & ((x) | (y))))
+
+#define SHA256D_ROUND(kw) do { \
+    __typeof__(a) t1 = h + BSIG1(e) + CH32(e, f, g) + (kw); \
+    __typeof__(a) t2 = BSIG0(a) + MAJ32(a, b, c); \
+    h = g; g = f; f = e; e = d + t1; \
+    d = c; c = b; b = a; a = t1 + t2; \
+} while (0)
+
+#define SHA256D_EXPAND(i)   (w[(i) & 15] += SSIG1(w[((i) - 2) & 15]) + w[((i) - 7) & 15] + SSIG0(w[((i) - 15) & 15]))
+
+/* sha256d(header) for one lane type T. Everything that is not the nonce or
+ * the 3 tail words is a constant, so the padding words are folded into the
+ * round constants and the schedule words up to 31 skip their zero terms.
+ * hash[7] (H7 of the final hash) is known after round 60 of the second
+ * hash: the last three rounds only rotate it into h. When no lane has
+ * hash[7] == 0, i.e. every nonce is a HW error, stop there and return 0.
+ * Otherwise finish and return 1 with the full hash of every lane. */
+#define SHA256D_C5_KERNEL(name, T, C, ANY_ZERO) \
+static int name(const T ms[8], const T tail[3], T nonce, T hash[8]) \
+{ \
+    T a, b, c, d, e, f, g, h, w[16]; \
+    int i; \
+ \
+    a = ms[0]; b = ms[1]; c = ms[2]; d = ms[3]; \
+    e = ms[4]; f = ms[5]; g = ms[6]; h = ms[7]; \
+    w[0] = tail[0]; w[1] = tail[1]; w[2] = tail[2]; w[3] = nonce; \
+    for (i = 0; i < 4; i++) \
+        SHA256D_ROUND(C(sha256d_k[i]) + w[i]); \
+    for (i = 4; i < 16; i++) \
+        SHA256D_ROUND(C(sha256d_kw_hdr[i])); \
+ \
+    /* schedule with w[4] = 0x80000000, w[5..14] = 0, w[15] = 640 */ \
+    w[0] = SSIG0(w[1]) + w[0]; \
+    SHA256D_ROUND(C(sha256d_k[16]) + w[0]); \
+    w[1] = C(0x01100000) + SSIG0(w[2]) + w[1]; \
+    SHA256D_ROUND(C(sha256d_k[17]) + w[1]); \
+    w[2] = SSIG1(w[0]) + SSIG0(w[3]) + w[2]; \
+    SHA256D_ROUND(C(sha256d_k[18]) + w[2]); \
+    w[3] = SSIG1(w[1]) + C(0x11002000) + w[3]; \
+    SHA256D_ROUND(C(sha256d_k[19]) + w[3]); \
+    w[4] = SSIG1(w[2]) + C(0x80000000); \
+    SHA256D_ROUND(C(sha256d_k[20]) + w[4]); \
+    w[5] = SSIG1(w[3]); \
+    SHA256D_ROUND(C(sha256d_k[21]) + w[5]); \
+    w[6] = SSIG1(w[4]) + C(640); \
+    SHA256D_ROUND(C(sha256d_k[22]) + w[6]); \
+    for (i = 23; i < 30; i++) \
+    { \
+        w[i & 15] = SSIG1(w[(i - 2) & 15]) + w[(i - 7) & 15]; \
+        SHA256D_ROUND(C(sha256d_k[i]) + w[i & 15]); \
+    } \
+    w[14] = SSIG1(w[12]) + w[7] + C(0x00a00055); \
+    SHA256D_ROUND(C(sha256d_k[30]) + w[14]); \
+    w[15] = SSIG1(w[13]) + w[8] + SSIG0(w[0]) + C(640); \
+    SHA256D_ROUND(C(sha256d_k[31]) + w[15]); \
+    for (i = 32; i < 64; i++) \
+    { \
+        SHA256D_EXPAND(i); \
+        SHA256D_ROUND(C(sha256d_k[i]) + w[i & 15]); \
+    } \
+ \
+    /* hash of the 32 byte digest */ \
+    w[0] = ms[0] + a; w[1] = ms[1] + b; w[2] = ms[2] + c; w[3] = ms[3] + d; \
+    w[4] = ms[4] + e; w[5] = ms[5] + f; w[6] = ms[6] + g; w[7] = ms[7] + h; \
+    a = C(sha256d_iv[0]); b = C(sha256d_iv[1]); c = C(sha256d_iv[2]); d = C(sha256d_iv[3]); \
+    e = C(sha256d_iv[4]); f = C(sha256d_iv[5]); g = C(sha256d_iv[6]); h = C(sha256d_iv[7]); \
+    for (i = 0; i < 8; i++) \
+        SHA256D_ROUND(C(sha256d_k[i]) + w[i]); \
+    for (i = 8; i < 16; i++) \
+        SHA256D_ROUND(C(sha256d_kw_dig[i])); \
+ \
+    /* schedule with w[8] = 0x80000000, w[9..14] = 0, w[15] = 256 */ \
+    w[0] = SSIG0(w[1]) + w[0]; \
+    SHA256D_ROUND(C(sha256d_k[16]) + w[0]); \
+    w[1] = C(0x00a00000) + SSIG0(w[2]) + w[1]; \
+    SHA256D_ROUND(C(sha256d_k[17]) + w[1]); \
+    for (i = 18; i < 22; i++) \
+    { \
+        w[i & 15] = SSIG1(w[(i - 2) & 15]) + SSIG0(w[(i - 15) & 15]) + w[i & 15]; \
+        SHA256D_ROUND(C(sha256d_k[i]) + w[i & 15]); \
+    } \
+    w[6] = SSIG1(w[4]) + C(256) + SSIG0(w[7]) + w[6]; \
+    SHA256D_ROUND(C(sha256d_k[22]) + w[6]); \
+    w[7] = SSIG1(w[5]) + w[0] + C(0x11002000) + w[7]; \
+    SHA256D_ROUND(C(sha256d_k[23]) + w[7]); \
+    w[8] = SSIG1(w[6]) + w[1] + C(0x80000000); \
+    SHA256D_ROUND(C(sha256d_k[24]) + w[8]); \
+    for (i = 25; i < 30; i++) \
+    { \
+        w[i & 15] = SSIG1(w[(i - 2) & 15]) + w[(i - 7) & 15]; \
+        SHA256D_ROUND(C(sha256d_k[i]) + w[i & 15]); \
+    } \
+    w[14] = SSIG1(w[12]) + w[7] + C(0x00400022); \
+    SHA256D_ROUND(C(sha256d_k[30]) + w[14]); \
+    w[15] = SSIG1(w[13]) + w[8] + SSIG0(w[0]) + C(256); \
+    SHA256D_ROUND(C(sha256d_k[31]) + w[15]); \
+    for (i = 32; i < 61; i++) \
+    { \
+        SHA256D_EXPAND(i); \
+        SHA256D_ROUND(C(sha256d_k[i]) + w[i & 15]); \
+    } \
+ \
+    /* e after round 60 ends up in h */ \
+    hash[7] = e + C(sha256d_iv[7]); \
+    if (!(ANY_ZERO(hash[7]))) \
+        return 0; \
+ \
+    for (i = 61; i < 64; i++) \
+    { \
+        SHA256D_EXPAND(i); \
+        SHA256D_ROUND(C(sha256d_k[i]) + w[i & 15]); \
+    } \
+    hash[0] = a + C(sha256d_iv[0]); hash[1] = b + C(sha256d_iv[1]); \
+    hash[2] = c + C(sha256d_iv[2]); hash[3] = d + C(sha256d_iv[3]); \
+    hash[4] = e + C(sha256d_iv[4]); hash[5] = f + C(sha256d_iv[5]); \
+    hash[6] = g + C(sha256d_iv[6]); \
+    return 1; \
+}
+
+static inline sha256d_vec sha256d_splat(uint32_t x)
+{
+    sha256d_vec v;
+    int i;
+
+    for (i = 0; i < SHA256D_C5_LANES; i++)
+        v[i] = x;
+    return v;
+}
+
+static inline int sha256d_vec_any_zero(sha256d_vec v)
+{
+    int i;
+
+    for (i = 0; i < SHA256D_C5_LANES; i++)
+    {
+        if (!v[i])
+            return 1;
+    }
+    return 0;
+}
+
+#define SHA256D_SCALAR(x)       ((uint32_t)(x))
+#define SHA256D_SCALAR_ZERO(x)  ((x) == 0)
+
+SHA256D_C5_KERNEL(sha256d_c5_kernel, uint32_t, SHA256D_SCALAR, SHA256D_SCALAR_ZERO)
+SHA256D_C5_KERNEL(sha256d_c5_kernel_vec, sha256d_vec, sha256d_splat, sha256d_vec_any_zero)
+
+int sha256d_c5(struct sha256d_c5_job *job)
+{
+    return sha256d_c5_kernel(job->midstate, job->tail, job->nonce, job->hash);
+}
+
+/* Hash n jobs, SHA256D_C5_LANES at a time. Unused lanes of the last group
+ * are fed copies of its first job and thrown away. */
+void sha256d_c5_batch(struct sha256d_c5_job *jobs, int n)
+{
+    sha256d_vec ms[8], tail[3], nonce, hash[8];
+    int i, j, lanes;
+
+    while (n > 0)
+    {
+        lanes = n < SHA256D_C5_LANES ? n : SHA256D_C5_LANES;
+        if (lanes == 1)
+        {
+            sha256d_c5(jobs);
+            return;
+        }
+
+        for (j = 0; j < SHA256D_C5_LANES; j++)
+        {
+            struct sha256d_c5_job *job = &jobs[j < lanes ? j : 0];
+
+            for (i = 0; i < 8; i++)
+                ms[i][j] = job->midstate[i];
+            for (i = 0; i < 3; i++)
+                tail[i][j] = job->tail[i];
+            nonce[j] = job->nonce;
+        }
+
+        if (sha256d_c5_kernel_vec(ms, tail, nonce, hash))
+        {
+            for (j = 0; j < lanes; j++)
+            {
+                for (i = 0; i < 8; i++)
+                    jobs[j].hash[i] = hash[i][j];
+            }
+        }
+        else
+        {
+            for (j = 0; j < lanes; j++)
+                jobs[j].hash[7] = hash[7][j];
+        }
+
+        jobs += lanes;
+        n -= lanes;
+    }
+}
+
+extern const char bench_hidiffs[16][324];
+extern const char bench_lodiffs[16][324];
+
+/* Check both kernels against sha2.c's sha256() on the bench_block.h headers,
+ * which all meet diff 1, and on the same headers with the next nonce, which
+ * take the early reject. Returns the number of mismatches. */
+int sha256d_c5_selftest(void)
+{
+    struct sha256d_c5_job jobs[64], job;
+    unsigned char data[80], swap[80], hash1[32], hash2[32];
+    uint32_t ref[64][8];
+    sha256_ctx ctx;
+    int i, j, bad = 0;
+
+    for (i = 0; i < 64; i++)
+    {
+        hex2bin(data, (i % 32) < 16 ? bench_hidiffs[i % 16] : bench_lodiffs[i % 16], 80);
+        if (i >= 32)
+            *(uint32_t *)(data + 76) = htole32(le32toh(*(uint32_t *)(data + 76)) + 1);
+
+        /* reference: the way cgminer's regen_hash does it */
+        flip80(swap, data);
+        sha256(swap, 80, hash1);
+        sha256(hash1, 32, hash2);
+        flip32(ref[i], hash2);
+
+        /* the verifier's view: midstate as calc_midstate makes it */
+        sha256_init(&ctx);
+        sha256_update(&ctx, swap, 64);
+        memcpy(jobs[i].midstate, ctx.h, 32);
+        memcpy(jobs[i].tail, data + 64, 12);
+        jobs[i].nonce = le32toh(*(uint32_t *)(data + 76));
+
+        job = jobs[i];
+        if (sha256d_c5(&job) != !ref[i][7] || job.hash[7] != ref[i][7] ||
+            (!ref[i][7] && memcmp(job.hash, ref[i], 32)))
+            bad++;
+    }
+
+    sha256d_c5_batch(jobs, 64);
+    for (i = 0; i < 64; i++)
+    {
+        for (j = ref[i][7] ? 7 : 0; j < 8; j++)
+        {
+            if (jobs[i].hash[j] != ref[i][j])
+            {
+                bad++;
+                break;
+            }
+        }
+    }
+    return bad;
+}
+
+/* What hashtest_submit did per nonce before sha256d_c5 */
+static void sha256d_c5_bench_sha2(struct sha256d_c5_job *job)
+{
+    unsigned char hash1[32], hash2[32];
+    sha2_context ctx;
+    int i;
+
+    memcpy(ctx.state, job->midstate, 32);
+    ctx.total[0] = 80;
+    ctx.total[1] = 0;
+    for (i = 0; i < 3; i++)
+        ((uint32_t *)ctx.buffer)[i] = swab32(job->tail[i]);
+    ((uint32_t *)ctx.buffer)[3] = swab32(job->nonce);
+    sha2_finish(&ctx, hash1);
+    sha2(hash1, 32, hash2);
+    flip32(job->hash, hash2);
+}
+
+#define SHA256D_C5_BENCH_JOBS   (64 * SHA256D_C5_LANES)
+#define SHA256D_C5_BENCH_LOOPS  2000
+
+/* --bench-sha256d: nonces per second of the old and the new verify hashing */
+void sha256d_c5_bench(void)
+{
+    static struct sha256d_c5_job jobs[SHA256D_C5_BENCH_JOBS], ref[SHA256D_C5_BENCH_JOBS];
+    const char *names[3] = { "sha2_c5 (old)", "sha256d_c5", "sha256d_c5_batch" };
+    struct timeval tv_start, tv_end;
+    uint32_t seed = 0x12345678;
+    int i, j, loop, way, bad;
+    double secs;
+
+    for (i = 0; i < SHA256D_C5_BENCH_JOBS; i++)
+    {
+        for (j = 0; j < 8; j++)
+            jobs[i].midstate[j] = seed = seed * 1103515245 + 12345;
+        for (j = 0; j < 3; j++)
+            jobs[i].tail[j] = seed = seed * 1103515245 + 12345;
+        jobs[i].nonce = seed = seed * 1103515245 + 12345;
+    }
+    memcpy(ref, jobs, sizeof(ref));
+    for (i = 0; i < SHA256D_C5_BENCH_JOBS; i++)
+        sha256d_c5_bench_sha2(&ref[i]);
+
+    printf("SHA256d verify benchmark, %d lanes, %d nonces per way, self test %s\n",
+           SHA256D_C5_LANES, SHA256D_C5_BENCH_JOBS * SHA256D_C5_BENCH_LOOPS,
+           sha256d_c5_selftest() ? "FAILED" : "passed");
+    for (way = 0; way < 3; way++)
+    {
+        cgtime(&tv_start);
+        for (loop = 0; loop < SHA256D_C5_BENCH_LOOPS; loop++)
+        {
+            if (way == 0)
+            {
+                for (i = 0; i < SHA256D_C5_BENCH_JOBS; i++)
+                    sha256d_c5_bench_sha2(&jobs[i]);
+            }
+            else if (way == 1)
+            {
+                for (i = 0; i < SHA256D_C5_BENCH_JOBS; i++)
+                    sha256d_c5(&jobs[i]);
+            }
+            else
+                sha256d_c5_batch(jobs, SHA256D_C5_BENCH_JOBS);
+        }
+        cgtime(&tv_end);
+        secs = tdiff(&tv_end, &tv_start);
+
+        bad = 0;
+        for (i = 0; i < SHA256D_C5_BENCH_JOBS; i++)
+        {
+            if (ref[i].hash[7] ? jobs[i].hash[7] != ref[i].hash[7] :
+                memcmp(jobs[i].hash, ref[i].hash, sizeof(ref[i].hash)))
+                bad++;
+        }
+        printf("%-18s %12.0f nonces/s%s\n", names[way],
+               SHA256D_C5_BENCH_JOBS * (double)SHA256D_C5_BENCH_LOOPS / secs,
+               bad ? "  MISMATCH" : "");
+    }
+}
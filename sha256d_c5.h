@@ -0,0 +1,42 @@
+/*
+ * Double SHA-256 of the second half of an 80 byte block header, batched
+ * across SIMD lanes, for verifying the nonces the c5 FPGA returns.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef SHA256D_C5_H
+#define SHA256D_C5_H
+
+#include <stdint.h>
+
+/* Lanes hashed together by sha256d_c5_batch. The vector code is plain gcc
+ * vector extensions, so it becomes NEON with -mfpu=neon, SSE2/SSE4 on x86
+ * and AVX2 with -mavx2, and scalar code where there is no SIMD unit. */
+#if defined(__AVX2__)
+#define SHA256D_C5_LANES    8
+#else
+#define SHA256D_C5_LANES    4
+#endif
+
+struct sha256d_c5_job
+{
+    uint32_t midstate[8];   // work->midstate, sha256 state after the first 64 header bytes
+    uint32_t tail[3];       // work->data + 64, the header words ahead of the nonce
+    uint32_t nonce;
+    uint32_t hash[8];       // result, in the word order hashtest_submit tests: hash[7] == 0 for diff 1
+};
+
+/* hash[7] is always set. The other words are only computed when hash[7] is
+ * zero (for the batch: when it is zero in any lane of the group), a nonzero
+ * hash[7] is a HW error and needs nothing else. sha256d_c5 returns whether
+ * the full hash was computed. */
+extern int sha256d_c5(struct sha256d_c5_job *job);
+extern void sha256d_c5_batch(struct sha256d_c5_job *jobs, int n);
+extern int sha256d_c5_selftest(void);
+extern void sha256d_c5_bench(void);
+
+#endif /* SHA256D_C5_H */
@@ -0,0 +1,1220 @@
+/*
+ * Software model of the c5/S9 FPGA and its BM1387 hash chains, for running
+ * the driver without hash boards (--fpga-backend sim).
+ *
+ * The register block and the DDR window are plain memory. One thread polls
+ * the registers the driver writes and answers like the FPGA: BC commands go
+ * to virtual chips, PIC bytes go to a virtual PIC per chain, jobs are copied
+ * out of the job registers and the job image. One thread per chain then
+ * builds works from the job the way the FPGA does, hashes each chip's slice
+ * of the nonce range with sha256d_c5 and pushes what it finds into the
+ * nonce fifo, with the nonce2/job_id record the driver looks the work up by.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "miner.h"
+#include "util.h"
+#include "sha2.h"
+#include "driver-btm-c5.h"
+#include "sha256d_c5.h"
+#include "sim_c5.h"
+
+#define SIM_POLL_US         20      // register poll period of the FPGA thread
+#define SIM_MODEL_MS        100     // fan and temperature model step
+#define SIM_FIFO_SIZE       (MAX_NONCE_NUMBER_IN_FIFO + 1)
+#define SIM_CHIP_REGS       64      // asic registers, 4 bytes apart
+#define SIM_SLICE           ((uint32_t)CHIP_ADDR_INTERVAL << 24)    // nonces one chip owns
+#define SIM_CHUNK           4096    // nonces a chip hashes before the next chip's turn
+#define SIM_WORK_ID_MASK    0x7fff
+#define SIM_PACE_SLACK_S    0.01    // nonces a paced chain may burst to catch up, in seconds of its rate
+#define SIM_KNOWN_MS        500     // a chain swaps a nonce for a known one this often, see sim_c5_set_known
+#define SIM_PIC_FLASH_LEN   4096
+#define SIM_PIC_VOLTAGE     108     // about 8.8V
+#define SIM_FAN_MIN         20      // percent of MAX_FAN_SPEED a fan keeps at 0% PWM
+#define SIM_TEMP_DEVICE     0x98    // i2c address of the temp sensor, as read_temp sends it
+#define SIM_TEMP_TYPE       0x55    // sensor id in register 0xfe
+#define SIM_TEMP_CHIP       62      // chip the PIC temp offsets point at, 1 based
+#define SIM_TEMP_TAU        20.0    // seconds for the board temps to get 63% of the way
+#define SIM_AMBIENT         25.0
+
+struct sim_chip
+{
+    bool            addressed;      // got an address since the last CHAIN_INACTIVE
+    unsigned char   addr;
+    uint32_t        regs[SIM_CHIP_REGS];
+};
+
+struct sim_pic
+{
+    int             header;         // bytes of PIC_COMMAND_1, PIC_COMMAND_2 seen
+    unsigned char   cmd;
+    int             in_need;        // argument bytes cmd still waits for
+    int             in_len;
+    unsigned char   in[16];
+    unsigned char   out[16];        // bytes for the next IIC_READs
+    int             out_len;
+    int             out_pos;
+    unsigned int    pointer;        // flash pointer
+    unsigned char   cache[16];      // SEND_DATA_TO_IIC, written by WRITE_DATA_INTO_PIC
+    unsigned char   voltage;
+    unsigned char   voltage_time[PIC_VOLTAGE_TIME_LENGTH];
+    unsigned char   board_id[HASH_BOARD_ID_LEN];
+    unsigned char   temp_offset[8];
+    bool            dac;            // dc-dc on, the chain has power
+    unsigned char   flash[SIM_PIC_FLASH_LEN];
+};
+
+struct sim_sensor
+{
+    unsigned char   regs[256];
+    double          local;          // degrees C of the sensor itself
+    double          die;            // degrees C of the chip diode it reads
+};
+
+struct sim_job
+{
+    bool            valid;
+    uint32_t        job_id;
+    uint32_t        version;
+    uint32_t        prev_hash[8];
+    uint32_t        ntime;
+    uint32_t        nbit;
+    uint64_t        nonce2_start;
+    unsigned int    coinbase_len;
+    unsigned int    nonce2_offset;
+    unsigned int    nonce2_bytes;
+    unsigned int    merkle_offset;  // the padded coinbase length
+    unsigned int    merkles;
+    unsigned char   image[JOB_STORE_SPACE];
+};
+
+struct sim_chain
+{
+    int                 id;
+    pthread_t           pth;
+    bool                held;       // in reset through RESET_HASHBOARD_COMMAND
+    bool                cleared;    // the chips are in their reset state
+    struct sim_pic      pic;
+    struct sim_sensor   sensor;
+    struct sim_chip     chip[BITMAIN_DEFAULT_ASIC_NUM];
+    uint32_t            cursor[BITMAIN_DEFAULT_ASIC_NUM];   // where each chip is in its slice
+    struct sim_job      job;        // this chain's copy of sim_job
+    uint32_t            job_gen;
+    double              due;        // when the next nonce may go out, with a rate
+    double              known_due;  // when the next nonce is swapped for a known one
+    unsigned int        known_next;
+    unsigned int        seed;
+};
+
+bool sim_c5_active = false;
+
+static volatile unsigned int *sim_axi;
+static unsigned char *sim_mem;
+static struct sim_chain *sim_chain[BITMAIN_MAX_CHAIN_NUM];
+static pthread_t sim_fpga_pth;
+static bool sim_stop;
+static struct sim_c5_stats sim_stats;
+
+// --fpga-sim
+static unsigned int sim_chain_mask = (1 << 5) | (1 << 6) | (1 << 7);
+static int sim_chips = CHAIN_ASIC_NUM;
+static double sim_rate = 0;         // nonces/s per chain, 0 for as fast as they are found, see sim_c5_set_rate
+static int sim_bits = 32;           // leading zero bits of a returned hash, 0 for unhashed nonces
+static int sim_fans = MIN_FAN_NUM;
+
+static pthread_mutex_t sim_fifo_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t sim_fifo[SIM_FIFO_SIZE][2];
+static cgtimer_t sim_fifo_time[SIM_FIFO_SIZE];  // when each entry was pushed
+static unsigned int sim_fifo_head;
+static unsigned int sim_fifo_count;
+static struct cg_hist sim_fifo_hist;    // nonce push to pop latency, written by the popping reader
+static bool sim_hold;               // chains push nothing, see sim_c5_hold
+static const struct sim_c5_known *sim_known;
+static int sim_known_count;
+
+static pthread_mutex_t sim_job_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sim_job sim_job;
+static struct sim_job sim_job_next;
+static uint32_t sim_job_gen;        // bumped for every job the chains must switch to
+static uint32_t sim_job_seen;       // JOB_ID of sim_job
+static bool sim_running;            // RUN_BIT, as the chains see it
+static uint64_t sim_nonce2;
+static uint32_t sim_work_id;
+static uint32_t sim_fan_next;
+
+static double sim_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool sim_parse_int(const char *s, int min, int max, int *v)
+{
+    char *end;
+    long n = strtol(s, &end, 10);
+
+    if(end == s || *end || n < min || n > max)
+        return false;
+    *v = n;
+    return true;
+}
+
+// chains=5:6:7,chips=63,rate=0,bits=32,fans=2
+static bool sim_parse(const char *spec)
+{
+    char *buf, *tok, *val, *save, *save_chain, *end;
+    bool ok = true;
+    int n;
+
+    if(!spec)
+        return true;
+
+    buf = strdup(spec);
+    for(tok = strtok_r(buf, ",", &save); tok && ok; tok = strtok_r(NULL, ",", &save))
+    {
+        val = strchr(tok, '=');
+        if(!val)
+        {
+            ok = false;
+            break;
+        }
+        *val++ = '\0';
+
+        if(!strcmp(tok, "chains"))
+        {
+            sim_chain_mask = 0;
+            for(tok = strtok_r(val, ":", &save_chain); tok && ok; tok = strtok_r(NULL, ":", &save_chain))
+            {
+                ok = sim_parse_int(tok, 0, BITMAIN_MAX_CHAIN_NUM - 1, &n);
+                if(ok)
+                    sim_chain_mask |= 1 << n;
+            }
+        }
+        else if(!strcmp(tok, "chips"))
+            ok = sim_parse_int(val, 1, BITMAIN_DEFAULT_ASIC_NUM, &sim_chips);
+        else if(!strcmp(tok, "rate"))
+        {
+            sim_rate = strtod(val, &end);
+            ok = end != val && !*end && sim_rate >= 0;
+        }
+        else if(!strcmp(tok, "bits"))
+            ok = sim_parse_int(val, 0, 32, &sim_bits);
+        else if(!strcmp(tok, "fans"))
+            ok = sim_parse_int(val, 0, BITMAIN_MAX_FAN_NUM, &sim_fans);
+        else
+            ok = false;
+    }
+    free(buf);
+    return ok && sim_chain_mask;
+}
+
+/******************** nonce fifo ********************/
+
+// false, and counted as an overflow, when the fifo is full
+static bool sim_fifo_push(uint32_t word, uint32_t value)
+{
+    unsigned int tail;
+    bool pushed = false;
+
+    pthread_mutex_lock(&sim_fifo_lock);
+    if(sim_fifo_count >= MAX_NONCE_NUMBER_IN_FIFO)
+    {
+        sim_stats.fifo_overflow++;
+    }
+    else
+    {
+        tail = (sim_fifo_head + sim_fifo_count) % SIM_FIFO_SIZE;
+        sim_fifo[tail][0] = word;
+        sim_fifo[tail][1] = value;
+        cgtimer_time(&sim_fifo_time[tail]);
+        sim_fifo_count++;
+        sim_axi[NONCE_NUMBER_IN_FIFO] = sim_fifo_count;
+        pushed = true;
+    }
+    pthread_mutex_unlock(&sim_fifo_lock);
+    return pushed;
+}
+
+static void sim_fifo_flush(void)
+{
+    pthread_mutex_lock(&sim_fifo_lock);
+    sim_fifo_count = 0;
+    sim_axi[NONCE_NUMBER_IN_FIFO] = 0;
+    pthread_mutex_unlock(&sim_fifo_lock);
+}
+
+void sim_c5_return_nonce(unsigned int *buf)
+{
+    cgtimer_t now;
+
+    pthread_mutex_lock(&sim_fifo_lock);
+    if(sim_fifo_count)
+    {
+        buf[0] = sim_fifo[sim_fifo_head][0];
+        buf[1] = sim_fifo[sim_fifo_head][1];
+        if(buf[0] & NONCE_INDICATOR)
+        {
+            cgtimer_time(&now);
+            cg_hist_add(&sim_fifo_hist, cgtimer_us_diff(&now, &sim_fifo_time[sim_fifo_head]));
+        }
+        sim_fifo_head = (sim_fifo_head + 1) % SIM_FIFO_SIZE;
+        sim_fifo_count--;
+    }
+    else
+    {
+        // a nonce word without NONCE_INDICATOR, the reader drops it
+        buf[0] = WORK_ID_OR_CRC;
+        buf[1] = 0;
+    }
+    sim_axi[NONCE_NUMBER_IN_FIFO] = sim_fifo_count;
+    pthread_mutex_unlock(&sim_fifo_lock);
+}
+
+/******************** fans and temperatures ********************/
+
+static unsigned int sim_fan_percent(void)
+{
+    unsigned int ctl = sim_axi[FAN_CONTROL];
+    unsigned int high = ctl >> 16, low = ctl & 0xffff;
+
+    return high + low ? high * 100 / (high + low) : 100;
+}
+
+// the FPGA cycles through the fans on every read
+unsigned int sim_c5_fan_speed(void)
+{
+    unsigned int id, speed;
+
+    if(!sim_fans)
+        return 0;
+
+    id = __atomic_fetch_add(&sim_fan_next, 1, __ATOMIC_RELAXED) % sim_fans;
+    speed = MAX_FAN_SPEED * (SIM_FAN_MIN + (100 - SIM_FAN_MIN) * sim_fan_percent() / 100) / 100 / 120;
+    if(speed > 0xff)
+        speed = 0xff;
+    return (id << 8) | speed;
+}
+
+static bool sim_chain_alive(struct sim_chain *c)
+{
+    return __atomic_load_n(&c->pic.dac, __ATOMIC_RELAXED) && !__atomic_load_n(&c->held, __ATOMIC_RELAXED);
+}
+
+static bool sim_chain_hashing(struct sim_chain *c)
+{
+    return sim_chain_alive(c) && __atomic_load_n(&sim_running, __ATOMIC_ACQUIRE);
+}
+
+// boards settle exponentially towards a temp set by load and fan speed
+static void sim_model_temps(double dt)
+{
+    double k = 1 - exp(-dt / SIM_TEMP_TAU), cooling = 15.0 * sim_fan_percent() / 100;
+    double local, die;
+    struct sim_chain *c;
+    int i;
+
+    for(i=0; i<BITMAIN_MAX_CHAIN_NUM; i++)
+    {
+        c = sim_chain[i];
+        if(!c)
+            continue;
+
+        if(sim_chain_hashing(c))
+        {
+            local = SIM_AMBIENT + 35 - cooling;
+            die = local + 20;
+        }
+        else if(sim_chain_alive(c))
+        {
+            local = SIM_AMBIENT + 5;
+            die = local + 2;
+        }
+        else
+        {
+            local = SIM_AMBIENT;
+            die = SIM_AMBIENT;
+        }
+        c->sensor.local += (local - c->sensor.local) * k;
+        c->sensor.die += (die - c->sensor.die) * k;
+    }
+}
+
+static unsigned char sim_sensor_read(struct sim_sensor *s, unsigned char reg)
+{
+    int ext = (s->regs[0x09] & 0x04) ? 64 : 0;
+    int v;
+
+    switch(reg)
+    {
+        case 0x00:
+            v = lround(s->local) + ext;
+            break;
+        case 0x01:
+            // the inverse of get_remote: the sensor assumes a diode ideality of 1.008, the BM1387's is 1.11
+            v = lround((s->die * 1.11 + (1.11 - 1.008) * 273.15) / 1.008) + (int8_t)s->regs[0x11] + ext;
+            break;
+        default:
+            return s->regs[reg];
+    }
+    if(v < 0)
+        v = 0;
+    if(v > 0xff)
+        v = 0xff;
+    return v;
+}
+
+/******************** asics ********************/
+
+static void sim_chips_reset(struct sim_chain *c)
+{
+    memset(c->chip, 0, sizeof(c->chip));
+}
+
+static uint32_t sim_chip_read(struct sim_chip *chip, unsigned char reg)
+{
+    unsigned int pll = chip->regs[PLL_PARAMETER / 4];
+    double mhz = 0;
+    int i;
+
+    switch(reg)
+    {
+        case CHIP_ADDRESS:
+            return 0x13870000 | (chip->addr << 8);
+        case GOLDEN_NONCE_COUNTER:
+            // the rate the chip would have at its PLL setting, in units of 2^24 hashes/s
+            for(i=0; i<sizeof(freq_pll_1385)/sizeof(freq_pll_1385[0]); i++)
+            {
+                if(freq_pll_1385[i].vilpll == pll)
+                {
+                    mhz = atof(freq_pll_1385[i].freq);
+                    break;
+                }
+            }
+            return (uint32_t)(mhz * 1e6 * BM1387_CORE_NUM / (1 << 24));
+        default:
+            return chip->regs[(reg / 4) % SIM_CHIP_REGS];
+    }
+}
+
+// GENERAL_I2C_COMMAND: b0 0x01, b1 device | write, b2 register, b3 data
+static void sim_chip_i2c(struct sim_chain *c, struct sim_chip *chip, uint32_t data)
+{
+    unsigned char device = (data >> 16) & 0xfe, reg = (data >> 8) & 0xff, value = data & 0xff;
+
+    if(device != SIM_TEMP_DEVICE)
+    {
+        chip->regs[GENERAL_I2C_COMMAND / 4] = 0x40000000;  // no ack
+        return;
+    }
+    if(data & (1 << 16))
+        c->sensor.regs[reg] = value;
+    else
+        value = sim_sensor_read(&c->sensor, reg);
+    chip->regs[GENERAL_I2C_COMMAND / 4] = (reg << 8) | value;
+}
+
+// one VIL command; FIL commands and works through the BC buffer are not modelled
+static void sim_bc_command(struct sim_chain *c, const unsigned int *buf)
+{
+    unsigned char type = buf[0] >> 24, addr = (buf[0] >> 8) & 0xff, reg = buf[0] & 0xff;
+    bool all = type & VIL_ALL;
+    struct sim_chip *chip;
+    int i;
+
+    if((type & 0xe0) != VIL_COMMAND_TYPE || !sim_chain_alive(c))
+        return;
+
+    switch(type & 0x0f)
+    {
+        case CHAIN_INACTIVE:
+            for(i=0; i<sim_chips; i++)
+                c->chip[i].addressed = false;
+            break;
+
+        case SET_ADDRESS:
+            // the first chip down the chain without an address takes it
+            for(i=0; i<sim_chips; i++)
+            {
+                if(!c->chip[i].addressed)
+                {
+                    c->chip[i].addressed = true;
+                    c->chip[i].addr = addr;
+                    break;
+                }
+            }
+            break;
+
+        case GET_STATUS:
+            for(i=0; i<sim_chips; i++)
+            {
+                chip = &c->chip[i];
+                if(all || chip->addr == addr)
+                    sim_fifo_push(c->id, sim_chip_read(chip, reg));
+            }
+            break;
+
+        case SET_CONFIG:
+            for(i=0; i<sim_chips; i++)
+            {
+                chip = &c->chip[i];
+                if(!all && chip->addr != addr)
+                    continue;
+                if(reg == GENERAL_I2C_COMMAND)
+                    sim_chip_i2c(c, chip, buf[1]);
+                else
+                    chip->regs[(reg / 4) % SIM_CHIP_REGS] = buf[1];
+            }
+            break;
+    }
+}
+
+static void sim_poll_bc(void)
+{
+    unsigned int cmd = sim_axi[BC_WRITE_COMMAND], buf[3];
+    struct sim_chain *c;
+
+    if(!(cmd & BC_COMMAND_BUFFER_READY))
+        return;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    buf[0] = sim_axi[BC_COMMAND_BUFFER];
+    buf[1] = sim_axi[BC_COMMAND_BUFFER + 1];
+    buf[2] = sim_axi[BC_COMMAND_BUFFER + 2];
+
+    c = sim_chain[(cmd >> 16) & 0xf];
+    if(c)
+        sim_bc_command(c, buf);
+    sim_stats.bc_cmds++;
+
+    // the driver also writes this register to switch null works, keep its bits
+    __atomic_fetch_and(&sim_axi[BC_WRITE_COMMAND], ~BC_COMMAND_BUFFER_READY, __ATOMIC_RELEASE);
+}
+
+/******************** PIC ********************/
+
+static int sim_pic_args(unsigned char cmd)
+{
+    switch(cmd)
+    {
+        case SET_PIC_FLASH_POINTER:
+            return 2;
+        case SEND_DATA_TO_IIC:
+            return 16;
+        case SET_VOLTAGE:
+        case ENABLE_VOLTAGE:
+            return 1;
+        case SET_VOLTAGE_TIME:
+            return PIC_VOLTAGE_TIME_LENGTH;
+        case SET_HASH_BOARD_ID:
+        case SET_HOST_MAC_ADDRESS:
+            return HASH_BOARD_ID_LEN;
+        case WR_TEMP_OFFSET_VALUE:
+            return 8;
+        default:
+            return 0;
+    }
+}
+
+static void sim_pic_out(struct sim_pic *p, const unsigned char *buf, int len)
+{
+    memcpy(p->out, buf, len);
+    p->out_len = len;
+    p->out_pos = 0;
+}
+
+static void sim_pic_command(struct sim_pic *p)
+{
+    unsigned char buf[16];
+    int i;
+
+    switch(p->cmd)
+    {
+        case SET_PIC_FLASH_POINTER:
+            p->pointer = (p->in[0] << 8) | p->in[1];
+            break;
+        case GET_PIC_FLASH_POINTER:
+            buf[0] = p->pointer >> 8;
+            buf[1] = p->pointer & 0xff;
+            sim_pic_out(p, buf, 2);
+            break;
+        case SEND_DATA_TO_IIC:
+            memcpy(p->cache, p->in, sizeof(p->cache));
+            break;
+        case READ_DATA_FROM_IIC:
+            for(i=0; i<16; i++)
+                buf[i] = p->flash[(p->pointer + i) % SIM_PIC_FLASH_LEN];
+            sim_pic_out(p, buf, 16);
+            p->pointer += 16;
+            break;
+        case WRITE_DATA_INTO_PIC:
+            for(i=0; i<16; i++)
+                p->flash[(p->pointer + i) % SIM_PIC_FLASH_LEN] = p->cache[i];
+            p->pointer += 16;
+            break;
+        case ERASE_IIC_FLASH:
+            for(i=0; i<PIC_FLASH_SECTOR_LENGTH; i++)
+                p->flash[(p->pointer + i) % SIM_PIC_FLASH_LEN] = 0xff;
+            p->pointer += PIC_FLASH_SECTOR_LENGTH;
+            break;
+        case RESET_PIC:
+            __atomic_store_n(&p->dac, false, __ATOMIC_RELAXED);
+            break;
+        case GET_PIC_SOFTWARE_VERSION:
+            buf[0] = PIC_VERSION;
+            sim_pic_out(p, buf, 1);
+            break;
+        case SET_VOLTAGE:
+            p->voltage = p->in[0];
+            break;
+        case GET_VOLTAGE:
+            sim_pic_out(p, &p->voltage, 1);
+            break;
+        case SET_VOLTAGE_TIME:
+            memcpy(p->voltage_time, p->in, sizeof(p->voltage_time));
+            break;
+        case SET_HASH_BOARD_ID:
+            memcpy(p->board_id, p->in, sizeof(p->board_id));
+            break;
+        case GET_HASH_BOARD_ID:
+            sim_pic_out(p, p->board_id, sizeof(p->board_id));
+            break;
+        case ENABLE_VOLTAGE:
+            __atomic_store_n(&p->dac, p->in[0] != 0, __ATOMIC_RELAXED);
+            break;
+        case WR_TEMP_OFFSET_VALUE:
+            memcpy(p->temp_offset, p->in, sizeof(p->temp_offset));
+            break;
+        case RD_TEMP_OFFSET_VALUE:
+            sim_pic_out(p, p->temp_offset, sizeof(p->temp_offset));
+            break;
+    }
+}
+
+static void sim_pic_write(struct sim_pic *p, unsigned char byte)
+{
+    if(p->in_need)
+    {
+        p->in[p->in_len++] = byte;
+        if(--p->in_need == 0)
+            sim_pic_command(p);
+        return;
+    }
+
+    switch(p->header)
+    {
+        case 0:
+            p->header = byte == PIC_COMMAND_1;
+            break;
+        case 1:
+            p->header = byte == PIC_COMMAND_2 ? 2 : byte == PIC_COMMAND_1;
+            break;
+        default:
+            p->header = 0;
+            p->cmd = byte;
+            p->in_len = 0;
+            p->in_need = sim_pic_args(byte);
+            p->out_len = 0;
+            if(!p->in_need)
+                sim_pic_command(p);
+            break;
+    }
+}
+
+static unsigned char sim_pic_read(struct sim_pic *p)
+{
+    return p->out_pos < p->out_len ? p->out[p->out_pos++] : 0xff;
+}
+
+static void sim_poll_iic(void)
+{
+    unsigned int v = sim_axi[IIC_COMMAND];
+    unsigned char resp = 0;
+    struct sim_chain *c;
+
+    if(v & 0x80000000)
+        return;
+
+    c = sim_chain[(v >> 16) & 0xf];
+    if(c && (v & IIC_READ))
+        resp = sim_pic_read(&c->pic);
+    else if(c)
+        sim_pic_write(&c->pic, v & 0xff);
+    sim_stats.iic_cmds++;
+
+    sim_axi[IIC_COMMAND] = 0x80000000 | (v & 0x7fffff00) | resp;
+}
+
+/******************** resets ********************/
+
+static void sim_poll_reset(void)
+{
+    unsigned int qn = sim_axi[QN_WRITE_DATA_COMMAND], held = sim_axi[RESET_HASHBOARD_COMMAND];
+    struct sim_chain *c;
+    bool reset;
+    int i;
+
+    for(i=0; i<BITMAIN_MAX_CHAIN_NUM; i++)
+    {
+        c = sim_chain[i];
+        if(!c)
+            continue;
+
+        __atomic_store_n(&c->held, (held & (1 << i)) != 0, __ATOMIC_RELAXED);
+        reset = (qn & RESET_HASH_BOARD) && ((qn & RESET_ALL) || ((qn >> 16) & 0xf) == i);
+
+        // the chips lose their addresses and registers once, when reset or power goes away
+        if(!sim_chain_alive(c) || reset)
+        {
+            if(!c->cleared)
+                sim_chips_reset(c);
+            c->cleared = true;
+        }
+        else
+            c->cleared = false;
+    }
+
+    if(qn & RESET_HASH_BOARD)
+    {
+        if(qn & RESET_FPGA)
+            sim_fifo_flush();
+        __atomic_fetch_and(&sim_axi[QN_WRITE_DATA_COMMAND], ~RESET_HASH_BOARD, __ATOMIC_RELEASE);
+    }
+
+    if(sim_axi[NONCE_FIFO_INTERRUPT] & FLUSH_NONCE3_FIFO)
+    {
+        sim_fifo_flush();
+        __atomic_fetch_and(&sim_axi[NONCE_FIFO_INTERRUPT], ~FLUSH_NONCE3_FIFO, __ATOMIC_RELEASE);
+    }
+}
+
+/******************** jobs ********************/
+
+static bool sim_job_load(struct sim_job *job)
+{
+    unsigned int start = sim_axi[JOB_START_ADDRESS] - PHY_MEM_NONCE2_JOBID_ADDRESS;
+    unsigned int len = sim_axi[JOB_LENGTH] & 0xffff;
+    unsigned int lengths = sim_axi[COINBASE_AND_NONCE2_LENGTH];
+    uint64_t bits = 0;
+    int i;
+
+    job->valid = false;
+    job->job_id = sim_axi[JOB_ID];
+    job->version = sim_axi[BLOCK_HEADER_VERSION];
+    for(i=0; i<8; i++)
+        job->prev_hash[i] = sim_axi[PRE_HEADER_HASH + i];
+    job->ntime = sim_axi[TIME_STAMP];
+    job->nbit = sim_axi[TARGET_BITS];
+    job->nonce2_start = ((uint64_t)sim_axi[WORK_NONCE_2 + 1] << 32) | sim_axi[WORK_NONCE_2];
+    job->nonce2_offset = lengths >> 16;
+    job->nonce2_bytes = (lengths >> 8) & 0xff;
+    job->merkle_offset = (lengths & 0xff) * 64;
+    job->merkles = sim_axi[MERKLE_BIN_NUMBER] & 0xffff;
+
+    if(start > FPGA_MEM_TOTAL_LEN - JOB_STORE_SPACE || len > JOB_STORE_SPACE
+       || job->merkle_offset < 64 || job->merkle_offset + job->merkles * MERKLE_BIN_LEN > len)
+        return false;
+    memcpy(job->image, sim_mem + start, len);
+
+    // the coinbase is sha256 padded, its bit length ends the padding
+    for(i=0; i<8; i++)
+        bits = (bits << 8) | job->image[job->merkle_offset - 8 + i];
+    job->coinbase_len = bits / 8;
+    if(job->coinbase_len > job->merkle_offset - 9 || job->nonce2_bytes > 8
+       || job->nonce2_offset + job->nonce2_bytes > job->coinbase_len)
+        return false;
+
+    job->valid = true;
+    return true;
+}
+
+/* Take the job when RUN_BIT rises or JOB_ID changes under it. commit_job only
+ * writes the job registers while RUN_BIT is clear, so a job read between two
+ * looks that both see the same JOB_ID with RUN_BIT set is whole. */
+static void sim_poll_job(void)
+{
+    unsigned int job_id, ctrl;
+
+    job_id = sim_axi[JOB_ID];
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    ctrl = sim_axi[DHASH_ACC_CONTROL];
+
+    if(ctrl & NEW_BLOCK)
+        __atomic_fetch_and(&sim_axi[DHASH_ACC_CONTROL], ~NEW_BLOCK, __ATOMIC_RELAXED);
+
+    if(!(ctrl & RUN_BIT))
+    {
+        __atomic_store_n(&sim_running, false, __ATOMIC_RELEASE);
+        return;
+    }
+    if(__atomic_load_n(&sim_running, __ATOMIC_RELAXED) && job_id == sim_job_seen)
+        return;
+
+    if(!sim_job_load(&sim_job_next) && sim_job_next.job_id == job_id)
+        applog(LOG_WARNING, "%s: job %u doesn't fit the job buffer, the chains idle", __FUNCTION__, job_id);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(sim_axi[JOB_ID] != job_id || !(sim_axi[DHASH_ACC_CONTROL] & RUN_BIT))
+        return;
+
+    pthread_mutex_lock(&sim_job_lock);
+    memcpy(&sim_job, &sim_job_next, sizeof(sim_job));
+    __atomic_store_n(&sim_nonce2, sim_job.nonce2_start, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&sim_job_gen, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&sim_job_lock);
+
+    sim_job_seen = job_id;
+    sim_stats.jobs++;
+    __atomic_store_n(&sim_running, true, __ATOMIC_RELEASE);
+}
+
+static void *sim_fpga_thread(void *arg)
+{
+    double last = sim_now(), now;
+
+    while(!__atomic_load_n(&sim_stop, __ATOMIC_RELAXED))
+    {
+        sim_poll_reset();
+        sim_poll_bc();
+        sim_poll_iic();
+        sim_poll_job();
+
+        now = sim_now();
+        if(now - last >= SIM_MODEL_MS / 1000.0)
+        {
+            sim_model_temps(now - last);
+            last = now;
+        }
+        cgsleep_us(SIM_POLL_US);
+    }
+    return NULL;
+}
+
+/******************** chains ********************/
+
+static bool sim_chain_go(struct sim_chain *c)
+{
+    return !__atomic_load_n(&sim_stop, __ATOMIC_RELAXED) && !__atomic_load_n(&sim_hold, __ATOMIC_RELAXED)
+           && sim_chain_hashing(c) && c->job_gen == __atomic_load_n(&sim_job_gen, __ATOMIC_ACQUIRE);
+}
+
+// where the FPGA keeps the record of work_id, NULL while the driver hasn't set the table up
+static struct nonce_record *sim_record(uint32_t work_id)
+{
+    unsigned int records = sim_axi[NONCE2_AND_JOBID_STORE_ADDRESS] - PHY_MEM_NONCE2_JOBID_ADDRESS;
+
+    if(records > FPGA_MEM_TOTAL_LEN - (SIM_WORK_ID_MASK + 1) * NONCE2_AND_JOBID_ALIGN)
+        return NULL;
+    return (struct nonce_record *)(sim_mem + records + (work_id & SIM_WORK_ID_MASK) * NONCE2_AND_JOBID_ALIGN);
+}
+
+// build the header of nonce2 as the FPGA does, record it under a new work_id
+static uint32_t sim_start_work(struct sim_chain *c, struct sha256d_c5_job *work, uint64_t nonce2)
+{
+    struct sim_job *job = &c->job;
+    unsigned char hash1[32], root[64], data[80], swap[64];
+    struct nonce_record *rec;
+    uint64_t nonce2le;
+    uint32_t work_id;
+    sha256_ctx ctx;
+    int i;
+
+    if(job->nonce2_bytes < 8)
+        nonce2 &= (1ULL << (8 * job->nonce2_bytes)) - 1;
+    nonce2le = htole64(nonce2);
+    memcpy(job->image + job->nonce2_offset, &nonce2le, job->nonce2_bytes);
+
+    sha256(job->image, job->coinbase_len, hash1);
+    sha256(hash1, 32, root);
+    for(i=0; i<job->merkles; i++)
+    {
+        memcpy(root + 32, job->image + job->merkle_offset + i * MERKLE_BIN_LEN, 32);
+        sha256(root, 64, hash1);
+        sha256(hash1, 32, root);
+    }
+
+    memcpy(data, &job->version, 4);
+    memcpy(data + 4, job->prev_hash, 32);
+    flip32(data + 36, root);
+    memcpy(data + 68, &job->ntime, 4);
+    memcpy(data + 72, &job->nbit, 4);
+    memset(data + 76, 0, 4);
+
+    flip64(swap, data);
+    sha256_init(&ctx);
+    sha256_update(&ctx, swap, 64);
+    memcpy(work->midstate, ctx.h, sizeof(work->midstate));
+    memcpy(work->tail, data + 64, sizeof(work->tail));
+
+    work_id = __atomic_fetch_add(&sim_work_id, 1, __ATOMIC_RELAXED) & SIM_WORK_ID_MASK;
+    rec = sim_record(work_id);
+    if(rec)
+    {
+        rec->job_id = job->job_id;
+        rec->header_version = job->version;
+        rec->nonce2_l = nonce2 & 0xffffffff;
+        rec->nonce2_h = nonce2 >> 32;
+        memcpy(rec->midstate, ctx.h, MIDSTATE_LEN);
+    }
+    __atomic_add_fetch(&sim_stats.works, 1, __ATOMIC_RELAXED);
+    return work_id;
+}
+
+static bool sim_hit(uint32_t hash7)
+{
+    return (be32toh(hash7) >> (32 - sim_bits)) == 0;
+}
+
+// hash count nonces from start; true at the first hit, *done is how far it got
+static bool sim_search(struct sha256d_c5_job *work, uint32_t start, uint32_t count, uint32_t *nonce, uint32_t *done)
+{
+    struct sha256d_c5_job jobs[SHA256D_C5_LANES];
+    uint32_t n;
+    int i;
+
+    for(i=0; i<SHA256D_C5_LANES; i++)
+        jobs[i] = *work;
+
+    for(n=0; n<count; n+=SHA256D_C5_LANES)
+    {
+        for(i=0; i<SHA256D_C5_LANES; i++)
+            jobs[i].nonce = start + n + i;
+        sha256d_c5_batch(jobs, SHA256D_C5_LANES);
+        for(i=0; i<SHA256D_C5_LANES; i++)
+        {
+            if(sim_hit(jobs[i].hash[7]))
+            {
+                *nonce = jobs[i].nonce;
+                *done = n + i + 1;
+                __atomic_add_fetch(&sim_stats.hashes, n + SHA256D_C5_LANES, __ATOMIC_RELAXED);
+                return true;
+            }
+        }
+    }
+    *done = count;
+    __atomic_add_fetch(&sim_stats.hashes, count, __ATOMIC_RELAXED);
+    return false;
+}
+
+// whether a diff 1 test passes on the nonce, as the driver will find
+static bool sim_valid(const struct sha256d_c5_job *work, uint32_t nonce)
+{
+    struct sha256d_c5_job job = *work;
+
+    if(sim_bits == 32)
+        return true;
+    job.nonce = nonce;
+    sha256d_c5(&job);
+    return job.hash[7] == 0;
+}
+
+// the next known nonce and the work it is for, when one is due
+static bool sim_known_swap(struct sim_chain *c, struct sha256d_c5_job *work, uint32_t *work_id, uint32_t *nonce)
+{
+    const struct sim_c5_known *known;
+    int count = __atomic_load_n(&sim_known_count, __ATOMIC_ACQUIRE);
+    double now;
+
+    if(!count)
+        return false;
+    now = sim_now();
+    if(now < c->known_due)
+        return false;
+    c->known_due = now + SIM_KNOWN_MS / 1000.0;
+
+    known = &sim_known[c->known_next++ % count];
+    *work_id = sim_start_work(c, work, known->nonce2);
+    *nonce = known->nonce;
+    return true;
+}
+
+// hold a nonce back to the rate; a chain that fell behind catches up by at most SIM_PACE_SLACK_S
+static void sim_pace(struct sim_chain *c)
+{
+    double now, rate;
+
+    __atomic_load(&sim_rate, &rate, __ATOMIC_RELAXED);
+    if(rate <= 0)
+        return;
+
+    now = sim_now();
+    if(c->due < now - SIM_PACE_SLACK_S)
+        c->due = now - SIM_PACE_SLACK_S;
+    if(c->due > now)
+        cgsleep_us((c->due - now) * 1e6);
+    c->due += 1 / rate;
+}
+
+static void *sim_chain_thread(void *arg)
+{
+    struct sim_chain *c = arg;
+    struct sha256d_c5_job work, known_work, *push_work;
+    uint32_t work_id, push_id, start, count, nonce, done;
+    int i, left;
+    bool hit;
+
+    while(!__atomic_load_n(&sim_stop, __ATOMIC_RELAXED))
+    {
+        if(!sim_chain_hashing(c) || __atomic_load_n(&sim_hold, __ATOMIC_RELAXED))
+        {
+            cgsleep_ms(10);
+            continue;
+        }
+        if(c->job_gen != __atomic_load_n(&sim_job_gen, __ATOMIC_ACQUIRE))
+        {
+            pthread_mutex_lock(&sim_job_lock);
+            memcpy(&c->job, &sim_job, sizeof(c->job));
+            c->job_gen = sim_job_gen;
+            pthread_mutex_unlock(&sim_job_lock);
+        }
+        if(!c->job.valid)
+        {
+            cgsleep_ms(10);
+            continue;
+        }
+
+        work_id = sim_start_work(c, &work, __atomic_fetch_add(&sim_nonce2, 1, __ATOMIC_RELAXED));
+        memset(c->cursor, 0, sizeof(c->cursor));
+
+        // the chips take turns through their slices until all are done or the job changes
+        do
+        {
+            left = 0;
+            for(i=0; i<sim_chips && sim_chain_go(c); i++)
+            {
+                if(!c->chip[i].addressed || c->cursor[i] >= SIM_SLICE)
+                    continue;
+
+                start = ((uint32_t)c->chip[i].addr << 24) + c->cursor[i];
+                if(sim_bits == 0)
+                {
+                    nonce = start + rand_r(&c->seed) % SIM_SLICE;
+                    done = SIM_SLICE;
+                    hit = true;
+                }
+                else
+                {
+                    count = SIM_SLICE - c->cursor[i];
+                    if(count > SIM_CHUNK)
+                        count = SIM_CHUNK;
+                    hit = sim_search(&work, start, count, &nonce, &done);
+                }
+                c->cursor[i] += done;
+                if(c->cursor[i] < SIM_SLICE)
+                    left++;
+
+                if(hit)
+                {
+                    sim_pace(c);
+                    push_work = &work;
+                    push_id = work_id;
+                    if(sim_known_swap(c, &known_work, &push_id, &nonce))
+                        push_work = &known_work;
+                    if(sim_fifo_push(WORK_ID_OR_CRC | (push_id << 16) | NONCE_INDICATOR | c->id, nonce))
+                    {
+                        __atomic_add_fetch(&sim_stats.nonces, 1, __ATOMIC_RELAXED);
+                        if(sim_valid(push_work, nonce))
+                            __atomic_add_fetch(&sim_stats.valid, 1, __ATOMIC_RELAXED);
+                    }
+                }
+            }
+        }
+        while(left && sim_chain_go(c));
+    }
+    return NULL;
+}
+
+/******************** setup ********************/
+
+static void sim_chain_init(struct sim_chain *c, int id)
+{
+    char board_id[HASH_BOARD_ID_LEN + 1];
+
+    c->id = id;
+    c->seed = id;
+    c->pic.voltage = SIM_PIC_VOLTAGE;
+    memset(c->pic.flash, 0xff, sizeof(c->pic.flash));
+    snprintf(board_id, sizeof(board_id), "SIM%09d", id);
+    memcpy(c->pic.board_id, board_id, HASH_BOARD_ID_LEN);
+    c->pic.temp_offset[0] = sim_chips < SIM_TEMP_CHIP ? sim_chips : SIM_TEMP_CHIP;
+    c->sensor.regs[0xfe] = SIM_TEMP_TYPE;
+    c->sensor.local = SIM_AMBIENT;
+    c->sensor.die = SIM_AMBIENT;
+}
+
+int sim_c5_init(const char *spec, unsigned int **axi, unsigned int **mem)
+{
+    unsigned int mask;
+    void *p;
+    int i;
+
+    if(!sim_parse(spec))
+    {
+        applog(LOG_ERR, "%s: can't parse --fpga-sim %s, want chains=5:6:7,chips=%d,rate=0,bits=32,fans=%d", __FUNCTION__, spec, CHAIN_ASIC_NUM, MIN_FAN_NUM);
+        return -1;
+    }
+
+    sim_axi = calloc(TOTAL_LEN, 1);
+    if(posix_memalign(&p, 4096, FPGA_MEM_TOTAL_LEN) || !sim_axi)
+    {
+        applog(LOG_ERR, "%s: can't allocate the simulated FPGA", __FUNCTION__);
+        return -1;
+    }
+    sim_mem = p;
+    memset(sim_mem, 0, FPGA_MEM_TOTAL_LEN);
+
+    sim_axi[HARDWARE_VERSION] = (1 << 16) | HARDWARE_VERSION_VALUE;
+    sim_axi[HASH_ON_PLUG] = sim_chain_mask;
+    sim_axi[BUFFER_SPACE] = 0xffff;
+    sim_axi[IIC_COMMAND] = 0x80000000;
+
+    for(i=0, mask=sim_chain_mask; i<BITMAIN_MAX_CHAIN_NUM; i++)
+    {
+        if(!(mask & (1 << i)))
+            continue;
+        sim_chain[i] = calloc(1, sizeof(struct sim_chain));
+        if(!sim_chain[i])
+        {
+            applog(LOG_ERR, "%s: can't allocate chain %d", __FUNCTION__, i);
+            return -1;
+        }
+        sim_chain_init(sim_chain[i], i);
+    }
+
+    sim_stop = false;
+    if(pthread_create(&sim_fpga_pth, NULL, sim_fpga_thread, NULL))
+        return -1;
+    for(i=0; i<BITMAIN_MAX_CHAIN_NUM; i++)
+    {
+        if(sim_chain[i] && pthread_create(&sim_chain[i]->pth, NULL, sim_chain_thread, sim_chain[i]))
+            return -1;
+    }
+
+    applog(LOG_NOTICE, "FPGA simulator: chains 0x%04x of %d chips, %s nonces at %s, %d fans",
+           sim_chain_mask, sim_chips, sim_bits ? "hashed" : "unhashed", sim_rate > 0 ? "a set rate" : "full speed", sim_fans);
+    if(sim_bits)
+        applog(LOG_NOTICE, "FPGA simulator: a nonce takes about 2^%d hashes, only bits=32 passes the driver's check", sim_bits);
+
+    *axi = (unsigned int *)sim_axi;
+    *mem = (unsigned int *)sim_mem;
+    sim_c5_active = true;
+    return 0;
+}
+
+void sim_c5_close(void)
+{
+    int i;
+
+    if(!sim_c5_active)
+        return;
+
+    __atomic_store_n(&sim_stop, true, __ATOMIC_RELAXED);
+    pthread_join(sim_fpga_pth, NULL);
+    for(i=0; i<BITMAIN_MAX_CHAIN_NUM; i++)
+    {
+        if(!sim_chain[i])
+            continue;
+        pthread_join(sim_chain[i]->pth, NULL);
+        free(sim_chain[i]);
+        sim_chain[i] = NULL;
+    }
+    sim_c5_active = false;
+    free((void *)sim_axi);
+    free(sim_mem);
+    sim_axi = NULL;
+    sim_mem = NULL;
+}
+
+static uint64_t sim_thread_cpu_ns(pthread_t pth)
+{
+    struct timespec ts;
+    clockid_t cid;
+
+    if(pthread_getcpuclockid(pth, &cid) || clock_gettime(cid, &ts))
+        return 0;
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void sim_c5_get_stats(struct sim_c5_stats *stats)
+{
+    int i;
+
+    stats->nonces = __atomic_load_n(&sim_stats.nonces, __ATOMIC_RELAXED);
+    stats->fifo_overflow = __atomic_load_n(&sim_stats.fifo_overflow, __ATOMIC_RELAXED);
+    stats->hashes = __atomic_load_n(&sim_stats.hashes, __ATOMIC_RELAXED);
+    stats->works = __atomic_load_n(&sim_stats.works, __ATOMIC_RELAXED);
+    stats->jobs = __atomic_load_n(&sim_stats.jobs, __ATOMIC_RELAXED);
+    stats->bc_cmds = __atomic_load_n(&sim_stats.bc_cmds, __ATOMIC_RELAXED);
+    stats->iic_cmds = __atomic_load_n(&sim_stats.iic_cmds, __ATOMIC_RELAXED);
+    stats->valid = __atomic_load_n(&sim_stats.valid, __ATOMIC_RELAXED);
+    stats->cpu_ns = sim_thread_cpu_ns(sim_fpga_pth);
+    for(i=0; i<BITMAIN_MAX_CHAIN_NUM; i++)
+    {
+        if(sim_chain[i])
+            stats->cpu_ns += sim_thread_cpu_ns(sim_chain[i]->pth);
+    }
+}
+
+void sim_c5_fifo_hist(struct cg_hist *hist)
+{
+    pthread_mutex_lock(&sim_fifo_lock);
+    memcpy(hist, &sim_fifo_hist, sizeof(*hist));
+    pthread_mutex_unlock(&sim_fifo_lock);
+}
+
+// total over all chains, 0 for as fast as the chips find nonces
+void sim_c5_set_rate(double rate)
+{
+    int i, chains = 0;
+
+    for(i=0; i<BITMAIN_MAX_CHAIN_NUM; i++)
+        chains += sim_chain[i] != NULL;
+    rate = chains ? rate / chains : 0;
+    __atomic_store(&sim_rate, &rate, __ATOMIC_RELAXED);
+}
+
+void sim_c5_hold(bool hold)
+{
+    __atomic_store_n(&sim_hold, hold, __ATOMIC_RELAXED);
+}
+
+void sim_c5_set_known(const struct sim_c5_known *known, int count)
+{
+    sim_known = known;
+    __atomic_store_n(&sim_known_count, count, __ATOMIC_RELEASE);
+}
+
+// a full fifo is the caller's to wait out, it doesn't count as an overflow
+bool sim_c5_push_nonce(const unsigned int *buf, const struct nonce_record *rec)
+{
+    struct nonce_record *dst;
+    bool full;
+
+    pthread_mutex_lock(&sim_fifo_lock);
+    full = sim_fifo_count >= MAX_NONCE_NUMBER_IN_FIFO;
+    pthread_mutex_unlock(&sim_fifo_lock);
+    if(full)
+        return false;
+
+    dst = sim_record(WORK_ID_OR_CRC_VALUE(buf[0]));
+    if(dst)
+        memcpy(dst, rec, sizeof(*dst));
+    if(!sim_fifo_push(buf[0], buf[1]))
+        return false;
+    __atomic_add_fetch(&sim_stats.nonces, 1, __ATOMIC_RELAXED);
+    return true;
+}
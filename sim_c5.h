@@ -0,0 +1,69 @@
+/*
+ * Software model of the c5/S9 FPGA and its BM1387 hash chains, standing in
+ * for the register block and DDR window bitmain_axi_init maps from /dev/mem.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef SIM_C5_H
+#define SIM_C5_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct sim_c5_stats
+{
+    uint64_t    nonces;         // nonces pushed into the fifo
+    uint64_t    valid;          // of those, the ones that pass the driver's diff 1 test
+    uint64_t    fifo_overflow;  // nonces and register replies dropped on a full fifo
+    uint64_t    hashes;         // sha256d run by the simulated chips
+    uint64_t    works;          // nonce2 values the chains started
+    uint64_t    jobs;           // jobs taken from the job registers
+    uint64_t    bc_cmds;        // BC commands sent to the chains
+    uint64_t    iic_cmds;       // bytes through the PIC I2C register
+    uint64_t    cpu_ns;         // CPU time of the model's threads
+};
+
+// a nonce2 of the job and a nonce of it that passes the driver's diff 1 test
+struct sim_c5_known
+{
+    uint64_t    nonce2;
+    uint32_t    nonce;
+};
+
+struct cg_hist;
+struct nonce_record;
+
+extern bool sim_c5_active;
+
+/* Set *axi and *mem to the simulated register block (TOTAL_LEN bytes) and DDR
+ * window (FPGA_MEM_TOTAL_LEN bytes) and start the model. spec is the
+ * --fpga-sim string, NULL for the defaults. */
+extern int sim_c5_init(const char *spec, unsigned int **axi, unsigned int **mem);
+extern void sim_c5_close(void);
+
+/* The registers whose reads have side effects, which plain memory can't model */
+extern void sim_c5_return_nonce(unsigned int *buf);
+extern unsigned int sim_c5_fan_speed(void);
+
+extern void sim_c5_get_stats(struct sim_c5_stats *stats);
+extern void sim_c5_fifo_hist(struct cg_hist *hist);
+
+/* For benchmarks: the nonce rate over all chains (0 for unpaced) and a hold
+ * that stops the chains pushing nonces, so the driver can drain. */
+extern void sim_c5_set_rate(double rate);
+extern void sim_c5_hold(bool hold);
+
+/* For benchmarks that know their job: every chain swaps a nonce for the next
+ * of known now and then, so unhashed nonces still exercise the valid path.
+ * known must outlive the model. */
+extern void sim_c5_set_known(const struct sim_c5_known *known, int count);
+
+/* For replays: a nonce word pair from a capture and the record it points at,
+ * false while the fifo is full. */
+extern bool sim_c5_push_nonce(const unsigned int *buf, const struct nonce_record *rec);
+
+#endif /* SIM_C5_H */
@@ -44,6 +44,9 @@
 #include "elist.h"
 #include "compat.h"
 #include "util.h"
+#ifdef USE_BITMAIN_C5
+#include "capture_c5.h"
+#endif
 
 #define DEFAULT_SOCKWAIT 60
 
@@ -1405,6 +1408,89 @@ void cgtimer_sub(cgtimer_t *a, cgtimer_t *b, cgtimer_t *res)
 }
 
 
+/* Returns the microseconds elapsed from start to end. */
+int64_t cgtimer_us_diff(cgtimer_t *end, cgtimer_t *start)
+{
+    cgtimer_t res;
+
+    cgtimer_sub(end, start, &res);
+    return (int64_t)res.tv_sec * 1000000 + res.tv_nsec / 1000;
+}
+
+void cg_hist_add(struct cg_hist *hist, int64_t us)
+{
+    int i = 0;
+
+    if (us < 0)
+        us = 0;
+    while (i < CG_HIST_BUCKETS - 1 && us >= (1LL << i))
+        i++;
+    hist->bucket[i]++;
+    hist->count++;
+    hist->total_us += us;
+    if ((uint64_t)us > hist->max_us)
+        hist->max_us = us;
+}
+
+void cg_hist_merge(struct cg_hist *hist, const struct cg_hist *from)
+{
+    int i;
+
+    hist->count += from->count;
+    hist->total_us += from->total_us;
+    if (from->max_us > hist->max_us)
+        hist->max_us = from->max_us;
+    for (i = 0; i < CG_HIST_BUCKETS; i++)
+        hist->bucket[i] += from->bucket[i];
+}
+
+/* Returns the upper bound of the bucket holding the pct'th percentile, capped
+ * at the largest sample, or 0 for an empty histogram. */
+int64_t cg_hist_percentile(struct cg_hist *hist, double pct)
+{
+    double rank = hist->count * pct / 100;
+    uint64_t want = rank, seen = 0;
+    int i;
+
+    if (!hist->count)
+        return 0;
+    if (want < rank || !want)
+        want++;
+    for (i = 0; i < CG_HIST_BUCKETS - 1; i++)
+    {
+        seen += hist->bucket[i];
+        if (seen >= want)
+            break;
+    }
+    if (i == CG_HIST_BUCKETS - 1 || (uint64_t)(1LL << i) > hist->max_us)
+        return hist->max_us;
+    return 1LL << i;
+}
+
+/* Formats the non empty buckets as {upper_bound_us=count,...} */
+void cg_hist_string(struct cg_hist *hist, char *buf, size_t bufsiz)
+{
+    size_t len;
+    int i;
+
+    snprintf(buf, bufsiz, "{");
+    for (i = 0; i < CG_HIST_BUCKETS; i++)
+    {
+        if (!hist->bucket[i])
+            continue;
+        len = strlen(buf);
+        if (i == CG_HIST_BUCKETS - 1)
+            snprintf(buf + len, bufsiz - len, "%s>%lld=%llu", len > 1 ? "," : "",
+                     1LL << (i - 1), (unsigned long long)hist->bucket[i]);
+        else
+            snprintf(buf + len, bufsiz - len, "%s%lld=%llu", len > 1 ? "," : "",
+                     1LL << i, (unsigned long long)hist->bucket[i]);
+    }
+    len = strlen(buf);
+    snprintf(buf + len, bufsiz - len, "}");
+}
+
+
 #if defined(CLOCK_MONOTONIC) && !defined(__FreeBSD__) /* Essentially just linux */
 //#ifdef CLOCK_MONOTONIC /* Essentially just linux */
 void cgtimer_time(cgtimer_t *ts_start)
@@ -1851,6 +1937,7 @@ char *recv_line(struct pool *pool)
             }
             else
             {
+                cgtimer_time(&pool->ts_recv);
                 slen = strlen(s);
                 recalloc_sock(pool, slen);
                 strcat(pool->sockbuf, s);
@@ -1879,6 +1966,10 @@ char *recv_line(struct pool *pool)
     pool->cgminer_pool_stats.times_received++;
     pool->cgminer_pool_stats.bytes_received += len;
     pool->cgminer_pool_stats.net_bytes_received += len;
+#ifdef USE_BITMAIN_C5
+    if (capture_c5_active)
+        capture_c5_line(pool->pool_no, sret, len);
+#endif
 out:
     if (!sret)
         clear_sock(pool);
@@ -2050,6 +2141,7 @@ static bool parse_notify(struct pool *pool, json_t *val)
         applog(LOG_DEBUG, "Pool %d coinbase %s", pool->pool_no, cb);
         free(cb);
     }
+    notify_lat_start(pool);
 out_unlock:
     cg_wunlock(&pool->data_lock);
 
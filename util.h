@@ -142,6 +142,7 @@ void cgsleep_ms_r(cgtimer_t *ts_start, int ms);
 void cgsleep_us_r(cgtimer_t *ts_start, int64_t us);
 int cgtimer_to_ms(cgtimer_t *cgt);
 void cgtimer_sub(cgtimer_t *a, cgtimer_t *b, cgtimer_t *res);
+int64_t cgtimer_us_diff(cgtimer_t *end, cgtimer_t *start);
 double us_tdiff(struct timeval *end, struct timeval *start);
 int ms_tdiff(struct timeval *end, struct timeval *start);
 double tdiff(struct timeval *end, struct timeval *start);
@@ -177,6 +178,23 @@ void _cg_memcpy(void *dest, const void *src, unsigned int n, const char *file, c
 #define cgsem_mswait(_sem, _timeout) _cgsem_mswait(_sem, _timeout, __FILE__, __func__, __LINE__)
 #define cg_memcpy(dest, src, n) _cg_memcpy(dest, src, n, __FILE__, __func__, __LINE__)
 
+/* Log2 bucketed latency histogram: bucket i counts samples below 2^i
+ * microseconds and the last bucket takes everything larger. It is not locked,
+ * each histogram is expected to have a single writer. */
+#define CG_HIST_BUCKETS 24
+
+struct cg_hist {
+	uint64_t count;
+	uint64_t total_us;
+	uint64_t max_us;
+	uint64_t bucket[CG_HIST_BUCKETS];
+};
+
+void cg_hist_add(struct cg_hist *hist, int64_t us);
+void cg_hist_merge(struct cg_hist *hist, const struct cg_hist *from);
+int64_t cg_hist_percentile(struct cg_hist *hist, double pct);
+void cg_hist_string(struct cg_hist *hist, char *buf, size_t bufsiz);
+
 /* Align a size_t to 4 byte boundaries for fussy arches */
 static inline void align_len(size_t *len)
 {